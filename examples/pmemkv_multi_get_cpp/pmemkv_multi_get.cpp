@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+/*
+ * pmemkv_multi_get.cpp -- example which compares lookups done one by one
+ * (db::get) with batched lookups (db::multi_get). It inserts specified number
+ * of elements into the database, then reads all of them in random order,
+ * first with sequential get calls and then in batches of specified size.
+ * It prints time spent in both phases and the speedup of multi_get.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <libpmemkv.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+#define ASSERT(expr)                                                                     \
+	do {                                                                             \
+		if (!(expr))                                                             \
+			std::cout << pmemkv_errormsg() << std::endl;                     \
+		assert(expr);                                                            \
+	} while (0)
+#define LOG(msg) std::cout << msg << std::endl
+
+using namespace pmem::kv;
+using clock_type = std::chrono::steady_clock;
+
+static const size_t VALUE_SIZE = 64;
+
+double sequential_get(db *kv, const std::vector<std::string> &keys)
+{
+	size_t found = 0;
+
+	auto start = clock_type::now();
+	for (auto &key : keys) {
+		status s = kv->get(key,
+				   [&](string_view value) { found += value.size(); });
+		ASSERT(s == status::OK);
+	}
+	std::chrono::duration<double> elapsed = clock_type::now() - start;
+
+	ASSERT(found == keys.size() * VALUE_SIZE);
+
+	return elapsed.count();
+}
+
+double batched_get(db *kv, const std::vector<std::string> &keys, size_t batch_size)
+{
+	size_t found = 0;
+	std::vector<string_view> batch;
+	batch.reserve(batch_size);
+
+	auto start = clock_type::now();
+	for (size_t i = 0; i < keys.size(); i += batch_size) {
+		batch.clear();
+		for (size_t j = i; j < std::min(i + batch_size, keys.size()); j++)
+			batch.emplace_back(keys[j]);
+
+		status s = kv->multi_get(batch, [&](string_view, string_view value) {
+			found += value.size();
+			return 0;
+		});
+		ASSERT(s == status::OK);
+	}
+	std::chrono::duration<double> elapsed = clock_type::now() - start;
+
+	ASSERT(found == keys.size() * VALUE_SIZE);
+
+	return elapsed.count();
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 6) {
+		std::cerr << "Usage: " << argv[0]
+			  << " file size engine elements batch_size" << std::endl;
+		exit(1);
+	}
+
+	std::string path = argv[1];
+	size_t size = std::stoull(std::string(argv[2]));
+	std::string engine = argv[3];
+	size_t elements = std::stoull(std::string(argv[4]));
+	size_t batch_size = std::stoull(std::string(argv[5]));
+
+	if (batch_size == 0) {
+		std::cerr << "Batch size must be greater than 0" << std::endl;
+		exit(1);
+	}
+
+	/* See libpmemkv_config(3) for more detailed example of config creation */
+	config cfg;
+
+	status s = cfg.put_path(path);
+	ASSERT(s == status::OK);
+	s = cfg.put_size(size);
+	ASSERT(s == status::OK);
+	s = cfg.put_create_if_missing(true);
+	ASSERT(s == status::OK);
+
+	db *kv = new db();
+	ASSERT(kv != nullptr);
+	s = kv->open(engine, std::move(cfg));
+	ASSERT(s == status::OK);
+
+	LOG("Inserting " << elements << " elements");
+	std::vector<std::string> keys;
+	keys.reserve(elements);
+	std::string value(VALUE_SIZE, 'x');
+	for (size_t i = 0; i < elements; i++) {
+		keys.emplace_back(std::to_string(i));
+		s = kv->put(keys.back(), value);
+		ASSERT(s == status::OK);
+	}
+
+	/* random order defeats caches and hardware prefetchers */
+	std::shuffle(keys.begin(), keys.end(), std::mt19937_64(elements));
+
+	double seq = sequential_get(kv, keys);
+	LOG("get:       " << seq << " s");
+
+	double batched = batched_get(kv, keys, batch_size);
+	LOG("multi_get: " << batched << " s (batch size: " << batch_size << ")");
+
+	LOG("Speedup: " << seq / batched << "x");
+
+	LOG("Closing database");
+	delete kv;
+
+	return 0;
+}
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+/*
+ * pmemkv_read_scaling.cpp -- example which measures how reads scale with the number
+ * of threads. It inserts specified number of elements and then reads them from
+ * 1, 2, 4, ... up to max_threads threads. Keys are drawn from Zipfian distribution,
+ * so a few hot keys take most of the reads. Number of reads per second is printed
+ * for each thread count. Optional read_cache_slots parameter is passed to the
+ * engine config (cmap uses it to enable optimistic, lock-free reads).
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <libpmemkv.hpp>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define ASSERT(expr)                                                                     \
+	do {                                                                             \
+		if (!(expr))                                                             \
+			std::cout << pmemkv_errormsg() << std::endl;                     \
+		assert(expr);                                                            \
+	} while (0)
+#define LOG(msg) std::cout << msg << std::endl
+
+using namespace pmem::kv;
+
+static const size_t READS_PER_THREAD = 1000000;
+static const double ZIPF_EXPONENT = 0.99;
+
+/* Returns cumulative distribution function of Zipfian distribution over n keys */
+std::vector<double> zipf_cdf(size_t n)
+{
+	std::vector<double> cdf(n);
+	double sum = 0;
+	for (size_t i = 0; i < n; i++) {
+		sum += 1.0 / std::pow(static_cast<double>(i + 1), ZIPF_EXPONENT);
+		cdf[i] = sum;
+	}
+	for (auto &c : cdf)
+		c /= sum;
+
+	return cdf;
+}
+
+double reads_per_second(db *kv, const std::vector<std::string> &keys,
+			const std::vector<double> &cdf, size_t threads_number)
+{
+	std::vector<std::thread> threads;
+	std::atomic<size_t> ready(0);
+	std::atomic<bool> start(false);
+
+	for (size_t t = 0; t < threads_number; t++) {
+		threads.emplace_back([&, t]() {
+			std::mt19937_64 gen(t);
+			std::uniform_real_distribution<double> dist(0.0, 1.0);
+			std::vector<size_t> order(READS_PER_THREAD);
+			for (auto &o : order) {
+				auto it = std::lower_bound(cdf.begin(), cdf.end(),
+							   dist(gen));
+				o = std::min(static_cast<size_t>(it - cdf.begin()),
+					     keys.size() - 1);
+			}
+
+			ready++;
+			while (!start)
+				;
+
+			size_t sum = 0;
+			for (auto o : order) {
+				status s = kv->get(keys[o], [&](string_view value) {
+					sum += value.size();
+				});
+				ASSERT(s == status::OK);
+			}
+			ASSERT(sum > 0);
+		});
+	}
+
+	while (ready != threads_number)
+		;
+
+	auto begin = std::chrono::steady_clock::now();
+	start = true;
+	for (auto &th : threads)
+		th.join();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+	return static_cast<double>(READS_PER_THREAD * threads_number) / elapsed.count();
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 6) {
+		std::cerr << "Usage: " << argv[0]
+			  << " file size engine elements max_threads [read_cache_slots]"
+			  << std::endl;
+		exit(1);
+	}
+
+	std::string path = argv[1];
+	size_t size = std::stoull(std::string(argv[2]));
+	std::string engine = argv[3];
+	size_t elements = std::stoull(std::string(argv[4]));
+	size_t max_threads = std::stoull(std::string(argv[5]));
+
+	if (elements == 0) {
+		std::cerr << "Number of elements must be greater than 0" << std::endl;
+		exit(1);
+	}
+
+	/* See libpmemkv_config(3) for more detailed example of config creation */
+	config cfg;
+
+	status s = cfg.put_path(path);
+	ASSERT(s == status::OK);
+	s = cfg.put_size(size);
+	ASSERT(s == status::OK);
+	s = cfg.put_create_if_missing(true);
+	ASSERT(s == status::OK);
+	if (argc > 6) {
+		s = cfg.put_uint64("read_cache_slots", std::stoull(std::string(argv[6])));
+		ASSERT(s == status::OK);
+	}
+
+	db *kv = new db();
+	ASSERT(kv != nullptr);
+	s = kv->open(engine, std::move(cfg));
+	ASSERT(s == status::OK);
+
+	LOG("Inserting " << elements << " elements");
+	std::vector<std::string> keys;
+	keys.reserve(elements);
+	std::string value(64, 'x');
+	for (size_t i = 0; i < elements; i++) {
+		keys.emplace_back(std::to_string(i));
+		s = kv->put(keys.back(), value);
+		ASSERT(s == status::OK);
+	}
+
+	auto cdf = zipf_cdf(elements);
+	for (size_t threads = 1; threads <= max_threads; threads *= 2)
+		LOG("threads: " << threads << ", reads/sec: "
+				<< reads_per_second(kv, keys, cdf, threads));
+
+	LOG("Closing database");
+	delete kv;
+
+	return 0;
+}
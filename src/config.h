@@ -45,6 +45,13 @@ public:
 		put(key, value);
 	}
 
+	/* Like put_uint64(), but replaces an existing item with the same key. */
+	void assign_uint64(const char *key, uint64_t value)
+	{
+		umap.erase(key);
+		put(key, value);
+	}
+
 	void put_string(const char *key, const char *value)
 	{
 		put(key, value);
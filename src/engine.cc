@@ -3,6 +3,8 @@
 
 #include "engine.h"
 
+#include <cassert>
+
 namespace pmem
 {
 namespace kv
@@ -128,6 +130,80 @@ status engine_base::defrag(double start_percent, double amount_percent)
 	return status::NOT_SUPPORTED;
 }
 
+struct multi_get_context {
+	string_view key;
+	get_kv_callback *callback;
+	void *arg;
+	int ret;
+};
+
+static void multi_get_callback(const char *v, size_t vb, void *arg)
+{
+	auto c = static_cast<multi_get_context *>(arg);
+	c->ret = c->callback(c->key.data(), c->key.size(), v, vb, c->arg);
+}
+
+/*
+ * Default implementations of batch operations: call the single-key variant
+ * for every key. Engines which can share locks, transactions or tree
+ * traversals across the batch should override them.
+ */
+status engine_base::multi_get(const std::vector<string_view> &keys,
+			      get_kv_callback *callback, void *arg)
+{
+	status ret = status::OK;
+	for (auto &key : keys) {
+		multi_get_context ctx = {key, callback, arg, 0};
+		auto s = get(key, &multi_get_callback, &ctx);
+		if (s == status::NOT_FOUND)
+			ret = status::NOT_FOUND;
+		else if (s != status::OK)
+			return s;
+		else if (ctx.ret != 0)
+			return status::STOPPED_BY_CB;
+	}
+
+	return ret;
+}
+
+status engine_base::multi_put(const std::vector<string_view> &keys,
+			      const std::vector<string_view> &values)
+{
+	assert(keys.size() == values.size());
+
+	for (size_t i = 0; i < keys.size(); i++) {
+		auto s = put(keys[i], values[i]);
+		if (s != status::OK)
+			return s;
+	}
+
+	return status::OK;
+}
+
+status engine_base::multi_remove(const std::vector<string_view> &keys)
+{
+	status ret = status::OK;
+	for (auto &key : keys) {
+		auto s = remove(key);
+		if (s == status::NOT_FOUND)
+			ret = status::NOT_FOUND;
+		else if (s != status::OK)
+			return s;
+	}
+
+	return ret;
+}
+
+/*
+ * Engines which keep keys sorted may build the container directly from sorted
+ * input, others simply put all elements.
+ */
+status engine_base::bulk_load(const std::vector<string_view> &keys,
+			      const std::vector<string_view> &values)
+{
+	return multi_put(keys, values);
+}
+
 internal::transaction *engine_base::begin_tx()
 {
 	throw internal::not_supported("Transactions are not supported in this engine");
@@ -7,6 +7,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "config.h"
 #include "iterator.h"
@@ -63,6 +64,18 @@ public:
 	virtual status remove(string_view key) = 0;
 	virtual status defrag(double start_percent, double amount_percent);
 
+	virtual status multi_get(const std::vector<string_view> &keys,
+				 get_kv_callback *callback, void *arg);
+	/*
+	 * keys and values of multi_put and bulk_load have the same size, they are
+	 * built from arrays of one length passed to the C API
+	 */
+	virtual status multi_put(const std::vector<string_view> &keys,
+				 const std::vector<string_view> &values);
+	virtual status multi_remove(const std::vector<string_view> &keys);
+	virtual status bulk_load(const std::vector<string_view> &keys,
+				 const std::vector<string_view> &values);
+
 	virtual internal::transaction *begin_tx();
 
 	virtual iterator *new_iterator();
@@ -3,8 +3,17 @@
 
 #include "csmap.h"
 
+#include "../exceptions.h"
 #include "../iterator.h"
 #include "../out.h"
+#include "../parallel_for.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <thread>
 
 namespace pmem
 {
@@ -12,7 +21,7 @@ namespace kv
 {
 
 csmap::csmap(std::unique_ptr<internal::config> cfg)
-    : pmemobj_engine_base(cfg, "pmemkv_csmap"), config(std::move(cfg))
+    : pmemobj_engine_base(cfg, "pmemkv_csmap"), config(std::move(cfg)), removed_count(0)
 {
 	Recover();
 	LOG("Started ok");
@@ -32,7 +41,17 @@ status csmap::count_all(std::size_t &cnt)
 {
 	LOG("count_all");
 	check_outside_tx();
-	cnt = container->size();
+
+	/*
+	 * The global lock excludes reclaim(), but elements may be marked as
+	 * removed (and counted) concurrently: removed_count is incremented
+	 * before a removed element is inserted (see csmap_transaction), so it
+	 * can be momentarily greater than the number of such elements in the map.
+	 */
+	shared_global_lock_type lock(mtx);
+	auto size = container->size();
+	auto removed = removed_count.load();
+	cnt = size > removed ? size - removed : 0;
 
 	return status::OK;
 }
@@ -47,7 +66,7 @@ status csmap::count_above(string_view key, std::size_t &cnt)
 	auto first = container->upper_bound(key);
 	auto last = container->end();
 
-	cnt = internal::distance(first, last);
+	cnt = count(first, last);
 
 	return status::OK;
 }
@@ -62,7 +81,7 @@ status csmap::count_equal_above(string_view key, std::size_t &cnt)
 	auto first = container->lower_bound(key);
 	auto last = container->end();
 
-	cnt = internal::distance(first, last);
+	cnt = count(first, last);
 
 	return status::OK;
 }
@@ -77,7 +96,7 @@ status csmap::count_equal_below(string_view key, std::size_t &cnt)
 	auto first = container->begin();
 	auto last = container->upper_bound(key);
 
-	cnt = internal::distance(first, last);
+	cnt = count(first, last);
 
 	return status::OK;
 }
@@ -92,7 +111,7 @@ status csmap::count_below(string_view key, std::size_t &cnt)
 	auto first = container->begin();
 	auto last = container->lower_bound(key);
 
-	cnt = internal::distance(first, last);
+	cnt = count(first, last);
 
 	return status::OK;
 }
@@ -108,7 +127,7 @@ status csmap::count_between(string_view key1, string_view key2, std::size_t &cnt
 		auto first = container->upper_bound(key1);
 		auto last = container->lower_bound(key2);
 
-		cnt = internal::distance(first, last);
+		cnt = count(first, last);
 	} else {
 		cnt = 0;
 	}
@@ -116,17 +135,30 @@ status csmap::count_between(string_view key1, string_view key2, std::size_t &cnt
 	return status::OK;
 }
 
+std::size_t csmap::count(typename container_type::iterator first,
+			 typename container_type::iterator last)
+{
+	std::size_t cnt = 0;
+	for (auto it = first; it != last; ++it) {
+		if (!it->second.is_removed())
+			cnt++;
+	}
+
+	return cnt;
+}
+
 status csmap::iterate(typename container_type::iterator first,
 		      typename container_type::iterator last, get_kv_callback *callback,
 		      void *arg)
 {
 	for (auto it = first; it != last; ++it) {
-		shared_node_lock_type lock(it->second.mtx);
-
-		auto ret = callback(it->first.c_str(), it->first.size(),
-				    it->second.val.c_str(), it->second.val.size(), arg);
+		int ret = 0;
+		auto read = it->second.read([&](const char *value, size_t size) {
+			ret = callback(it->first.c_str(), it->first.size(), value, size,
+				       arg);
+		});
 
-		if (ret != 0)
+		if (read && ret != 0)
 			return status::STOPPED_BY_CB;
 	}
 
@@ -221,7 +253,11 @@ status csmap::exists(string_view key)
 	check_outside_tx();
 
 	shared_global_lock_type lock(mtx);
-	return container->contains(key) ? status::OK : status::NOT_FOUND;
+	auto it = container->find(key);
+	if (it == container->end())
+		return status::NOT_FOUND;
+
+	return it->second.is_removed() ? status::NOT_FOUND : status::OK;
 }
 
 status csmap::get(string_view key, get_v_callback *callback, void *arg)
@@ -231,11 +267,11 @@ status csmap::get(string_view key, get_v_callback *callback, void *arg)
 
 	shared_global_lock_type lock(mtx);
 	auto it = container->find(key);
-	if (it != container->end()) {
-		shared_node_lock_type lock(it->second.mtx);
-		callback(it->second.val.c_str(), it->second.val.size(), arg);
+	if (it != container->end() &&
+	    it->second.read([&](const char *value, size_t size) {
+		    callback(value, size, arg);
+	    }))
 		return status::OK;
-	}
 
 	LOG("  key not found");
 	return status::NOT_FOUND;
@@ -248,26 +284,377 @@ status csmap::put(string_view key, string_view value)
 	check_outside_tx();
 
 	shared_global_lock_type lock(mtx);
+	put_element(key, value);
+
+	return status::OK;
+}
+
+status csmap::remove(string_view key)
+{
+	LOG("remove key=" << std::string(key.data(), key.size()));
+	check_outside_tx();
 
+	status ret;
+	{
+		shared_global_lock_type lock(mtx);
+		ret = remove_element(key);
+	}
+
+	if (removed_count.load() >= reclaim_threshold)
+		reclaim();
+
+	return ret;
+}
+
+/* Inserts or updates an element, the caller must hold the global lock (shared). */
+void csmap::put_element(string_view key, string_view value)
+{
 	auto result = container->try_emplace(key, value);
+	if (result.second)
+		return;
+
+	auto &it = result.first;
+	unique_node_lock_type lock(it->second.mtx);
+	bool revived = it->second.removed;
+	pmem::obj::transaction::run(pmpool, [&] {
+		it->second.val.assign(value.data(), value.size());
+		if (revived)
+			it->second.removed = 0;
+	});
+
+	if (revived)
+		removed_count--;
+}
+
+/*
+ * Marks an element as removed and frees its value, the caller must hold the
+ * global lock (shared). The node itself stays in the map until reclaim(), so
+ * concurrent removes do not block each other nor readers of other keys.
+ */
+status csmap::remove_element(string_view key)
+{
+	auto it = container->find(key);
+	if (it == container->end())
+		return status::NOT_FOUND;
 
-	if (result.second == false) {
-		auto &it = result.first;
+	{
 		unique_node_lock_type lock(it->second.mtx);
+		if (it->second.removed)
+			return status::NOT_FOUND;
+
 		pmem::obj::transaction::run(pmpool, [&] {
-			it->second.val.assign(value.data(), value.size());
+			it->second.removed = 1;
+			it->second.val.clear();
+			it->second.val.shrink_to_fit();
 		});
 	}
+	removed_count++;
+	add_removed_key(&it->first);
 
 	return status::OK;
 }
 
-status csmap::remove(string_view key)
+/*
+ * Remembers key of a removed element for reclaim(). The element must be already
+ * counted in removed_count and the caller must hold the global lock (shared), so
+ * that the element is not erased before its key is added. The key is not copied,
+ * it points to the key of the element in the map.
+ */
+void csmap::add_removed_key(const internal::csmap::key_type *key)
+{
+	auto &shard = removed_keys[(reinterpret_cast<uintptr_t>(key) >> 4) %
+				   removed_keys_shards];
+	std::lock_guard<std::mutex> shard_lock(shard.mtx);
+	shard.keys.push_back(key);
+}
+
+/*
+ * Physically erases elements marked as removed. unsafe_erase() is not
+ * thread-safe, so it takes the global lock exclusively, once for each shard of
+ * removed keys, so that other threads wait only for a small batch. Keys are
+ * added only under the global lock (shared), so they all point to existing
+ * elements. An element which was put again and removed has its key added
+ * twice (to the same shard), elements which were put again are skipped.
+ */
+void csmap::reclaim()
+{
+	std::unique_lock<std::mutex> reclaim_lock(reclaim_mtx, std::try_to_lock);
+	if (!reclaim_lock.owns_lock())
+		return;
+
+	std::vector<const internal::csmap::key_type *> keys;
+	for (auto &shard : removed_keys) {
+		{
+			std::lock_guard<std::mutex> shard_lock(shard.mtx);
+			if (shard.keys.empty())
+				continue;
+		}
+
+		unique_global_lock_type lock(mtx);
+		keys.clear();
+		keys.swap(shard.keys);
+		std::sort(keys.begin(), keys.end());
+		keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+		for (auto key : keys) {
+			auto it = container->find(*key);
+			assert(it != container->end() && &it->first == key);
+			if (it->second.removed) {
+				container->unsafe_erase(it);
+				removed_count--;
+			}
+		}
+	}
+}
+
+/*
+ * Batch operations take the global lock only once for the whole batch and
+ * process keys in sorted order, so that consecutive lookups share the upper
+ * levels of the skip list in CPU caches.
+ */
+status csmap::multi_get(const std::vector<string_view> &keys, get_kv_callback *callback,
+			void *arg)
 {
-	LOG("remove key=" << std::string(key.data(), key.size()));
+	LOG("multi_get for " << keys.size() << " keys");
 	check_outside_tx();
-	unique_global_lock_type lock(mtx);
-	return container->unsafe_erase(key) > 0 ? status::OK : status::NOT_FOUND;
+
+	auto order = internal::sorted_positions(keys, container->key_comp());
+
+	status ret = status::OK;
+	shared_global_lock_type lock(mtx);
+	for (auto i : order) {
+		auto &key = keys[i];
+		auto it = container->find(key);
+		int cb_ret = 0;
+		if (it == container->end() ||
+		    !it->second.read([&](const char *value, size_t size) {
+			    cb_ret = callback(key.data(), key.size(), value, size, arg);
+		    })) {
+			ret = status::NOT_FOUND;
+			continue;
+		}
+
+		if (cb_ret != 0)
+			return status::STOPPED_BY_CB;
+	}
+
+	return ret;
+}
+
+status csmap::multi_put(const std::vector<string_view> &keys,
+			const std::vector<string_view> &values)
+{
+	LOG("multi_put for " << keys.size() << " keys");
+	check_outside_tx();
+
+	assert(keys.size() == values.size());
+
+	auto order = internal::sorted_positions(keys, container->key_comp());
+
+	shared_global_lock_type lock(mtx);
+	for (auto i : order)
+		put_element(keys[i], values[i]);
+
+	return status::OK;
+}
+
+status csmap::multi_remove(const std::vector<string_view> &keys)
+{
+	LOG("multi_remove for " << keys.size() << " keys");
+	check_outside_tx();
+
+	status ret = status::OK;
+	{
+		shared_global_lock_type lock(mtx);
+		for (auto &key : keys) {
+			if (remove_element(key) != status::OK)
+				ret = status::NOT_FOUND;
+		}
+	}
+
+	if (removed_count.load() >= reclaim_threshold)
+		reclaim();
+
+	return ret;
+}
+
+/*
+ * Sorted keys are split into contiguous ranges, which are put by separate threads.
+ * The threads insert into different parts of the skip list, so they rarely
+ * contend for the same nodes. Other batches are simply put.
+ */
+status csmap::bulk_load(const std::vector<string_view> &keys,
+			const std::vector<string_view> &values)
+{
+	LOG("bulk_load for " << keys.size() << " keys");
+	check_outside_tx();
+
+	assert(keys.size() == values.size());
+
+	if (!internal::strictly_sorted(keys, container->key_comp()))
+		return multi_put(keys, values);
+
+	size_t n = keys.size();
+	size_t threads_count = std::max<size_t>(
+		std::min<size_t>(std::thread::hardware_concurrency(),
+				 n / bulk_load_keys_per_thread),
+		1);
+
+	shared_global_lock_type lock(mtx);
+	internal::parallel_for(threads_count, [&](size_t t) {
+		size_t last = n * (t + 1) / threads_count;
+		for (size_t i = n * t / threads_count; i < last; i++)
+			put_element(keys[i], values[i]);
+	});
+
+	return status::OK;
+}
+
+internal::transaction *csmap::begin_tx()
+{
+	return new csmap_transaction(*this);
+}
+
+csmap::csmap_transaction::csmap_transaction(csmap &engine) : engine(engine)
+{
+}
+
+status csmap::csmap_transaction::put(string_view key, string_view value)
+{
+	log.insert(key, value);
+	return status::OK;
+}
+
+status csmap::csmap_transaction::remove(string_view key)
+{
+	log.remove(key);
+	return status::OK;
+}
+
+status csmap::csmap_transaction::get(string_view key, get_v_callback *callback,
+				     void *arg)
+{
+	string_view value;
+	auto pending = log.find(key, value);
+	if (pending == internal::dram_log::lookup_result::removed)
+		return status::NOT_FOUND;
+	if (pending == internal::dram_log::lookup_result::not_found)
+		return engine.get(key, callback, arg);
+
+	callback(value.data(), value.size(), arg);
+	return status::OK;
+}
+
+/*
+ * Only the latest operation of each key matters, they are applied in the order
+ * of keys. Elements which do not exist are inserted (outside of the pmemobj
+ * transaction, concurrent_map does not allow it) as removed, so they are not
+ * visible until the transaction commits. If it fails, they are erased like any
+ * other removed element.
+ */
+status csmap::csmap_transaction::commit()
+{
+	std::vector<string_view> keys;
+	std::vector<string_view> values;
+	std::vector<bool> removes;
+
+	auto insert_cb = [&](const internal::dram_log::element_type &e) {
+		keys.emplace_back(e.first);
+		values.emplace_back(e.second);
+		removes.push_back(false);
+	};
+
+	auto remove_cb = [&](const internal::dram_log::element_type &e) {
+		keys.emplace_back(e.first);
+		values.emplace_back();
+		removes.push_back(true);
+	};
+
+	log.foreach (insert_cb, remove_cb);
+
+	auto container = engine.container;
+	auto comp = container->key_comp();
+	auto order = internal::sorted_positions(keys, comp);
+
+	std::vector<const internal::csmap::key_type *> removed;
+	std::size_t revived = 0;
+	{
+		shared_global_lock_type lock(engine.mtx);
+
+		/* positions of operations to apply and their (locked) elements */
+		std::vector<std::pair<std::size_t, container_type::iterator>> ops;
+		std::vector<unique_node_lock_type> locks;
+		for (std::size_t j = 0; j < order.size(); j++) {
+			auto i = order[j];
+
+			/* equal keys are adjacent, sorted by their position in the log */
+			if (j + 1 < order.size() && !comp(keys[i], keys[order[j + 1]]))
+				continue;
+
+			auto it = container->find(keys[i]);
+			if (it == container->end()) {
+				if (removes[i])
+					continue;
+
+				/* counted before it is inserted, see count_all() */
+				engine.removed_count++;
+				auto result = container->try_emplace(
+					keys[i], internal::csmap::removed_tag{});
+				it = result.first;
+				if (result.second)
+					engine.add_removed_key(&it->first);
+				else
+					engine.removed_count--;
+			}
+
+			ops.emplace_back(i, it);
+			locks.emplace_back(it->second.mtx);
+		}
+
+		pmem::obj::transaction::run(engine.pmpool, [&] {
+			removed.clear();
+			revived = 0;
+
+			for (auto &op : ops) {
+				auto i = op.first;
+				auto &element = op.second->second;
+				if (removes[i]) {
+					if (element.removed)
+						continue;
+
+					element.removed = 1;
+					element.val.clear();
+					element.val.shrink_to_fit();
+					removed.push_back(&op.second->first);
+				} else {
+					element.val.assign(values[i].data(),
+							   values[i].size());
+					if (element.removed) {
+						element.removed = 0;
+						revived++;
+					}
+				}
+			}
+		});
+
+		engine.removed_count += removed.size();
+		for (auto key : removed)
+			engine.add_removed_key(key);
+	}
+
+	engine.removed_count -= revived;
+
+	log.clear();
+
+	if (engine.removed_count.load() >= reclaim_threshold)
+		engine.reclaim();
+
+	return status::OK;
+}
+
+void csmap::csmap_transaction::abort()
+{
+	log.clear();
 }
 
 void csmap::Recover()
@@ -276,10 +663,56 @@ void csmap::Recover()
 		auto pmem_ptr = static_cast<internal::csmap::pmem_type *>(
 			pmemobj_direct(*root_oid));
 
+		/* the legacy map stays attached until its elements are moved */
+		if (pmem_ptr->version == 0) {
+			/* throws before anything is changed if comparators differ */
+			auto legacy_ptr =
+				static_cast<internal::csmap::legacy_pmem_type *>(
+					pmemobj_direct(*root_oid));
+			legacy_ptr->map.runtime_initialize();
+			legacy_ptr->map.key_comp().runtime_initialize(
+				internal::extract_comparator(*config));
+
+			pmem::obj::transaction::run(pmpool, [&] {
+				auto legacy = *root_oid;
+				pmem::obj::transaction::snapshot(root_oid);
+				*root_oid = pmem::obj::make_persistent<
+						    internal::csmap::pmem_type>()
+						    .raw();
+				pmem_ptr = static_cast<internal::csmap::pmem_type *>(
+					pmemobj_direct(*root_oid));
+				pmem_ptr->map.runtime_initialize();
+				pmem_ptr->map.key_comp().initialize(
+					internal::extract_comparator(*config));
+				pmem_ptr->legacy = legacy;
+			});
+		}
+
+		if (pmem_ptr->version != internal::csmap::layout_version)
+			throw internal::not_supported(
+				"Unsupported csmap layout version: " +
+				std::to_string(pmem_ptr->version));
+
 		container = &pmem_ptr->map;
 		container->runtime_initialize();
 		container->key_comp().runtime_initialize(
 			internal::extract_comparator(*config));
+
+		/* finish (possibly interrupted) upgrade of the legacy map */
+		if (!OID_IS_NULL(pmem_ptr->legacy))
+			upgrade_legacy_map(pmem_ptr);
+
+		/*
+		 * Versions of elements are not persistent, and elements marked
+		 * as removed before the pool was closed are erased now.
+		 */
+		for (auto it = container->begin(); it != container->end();) {
+			it->second.mtx.runtime_initialize();
+			if (it->second.removed)
+				it = container->unsafe_erase(it);
+			else
+				++it;
+		}
 	} else {
 		pmem::obj::transaction::run(pmpool, [&] {
 			pmem::obj::transaction::snapshot(root_oid);
@@ -296,6 +729,35 @@ void csmap::Recover()
 	}
 }
 
+/*
+ * Moves all elements of a pool with layout version 0 into the container and frees
+ * the legacy map. Elements are copied outside of a transaction, the legacy map stays
+ * attached to the root until all of them are copied. If the process is interrupted,
+ * the copy is repeated on the next open - try_emplace makes it idempotent.
+ */
+void csmap::upgrade_legacy_map(internal::csmap::pmem_type *pmem_ptr)
+{
+	LOG("Upgrading layout of the legacy map");
+
+	auto legacy = static_cast<internal::csmap::legacy_pmem_type *>(
+		pmemobj_direct(pmem_ptr->legacy));
+	legacy->map.runtime_initialize();
+	legacy->map.key_comp().runtime_initialize(internal::extract_comparator(*config));
+
+	for (auto &e : legacy->map)
+		container->try_emplace(
+			e.first, string_view(e.second.val.c_str(), e.second.val.size()));
+
+	legacy->map.free_data();
+	pmem::obj::transaction::run(pmpool, [&] {
+		pmem::obj::delete_persistent<internal::csmap::legacy_pmem_type>(
+			pmem::obj::persistent_ptr<internal::csmap::legacy_pmem_type>(
+				pmem_ptr->legacy));
+		pmem::obj::transaction::snapshot(&pmem_ptr->legacy);
+		pmem_ptr->legacy = OID_NULL;
+	});
+}
+
 internal::iterator_base *csmap::new_iterator()
 {
 	return new csmap_iterator<false>{container, mtx};
@@ -321,11 +783,13 @@ status csmap::csmap_iterator<true>::seek(string_view key)
 	init_seek();
 
 	it_ = container->find(key);
-	if (it_ == container->end()) {
+	if (it_ == container->end())
 		return status::NOT_FOUND;
-	}
 
-	node_lock = csmap::unique_node_lock_type(it_->second.mtx);
+	if (!lock_current()) {
+		it_ = container->end();
+		return status::NOT_FOUND;
+	}
 
 	return status::OK;
 }
@@ -335,12 +799,10 @@ status csmap::csmap_iterator<true>::seek_lower(string_view key)
 	init_seek();
 
 	it_ = container->find_lower(key);
-	if (it_ == container->end())
-		return status::NOT_FOUND;
+	while (it_ != container->end() && !lock_current())
+		it_ = container->find_lower(it_->first);
 
-	node_lock = csmap::unique_node_lock_type(it_->second.mtx);
-
-	return status::OK;
+	return it_ == container->end() ? status::NOT_FOUND : status::OK;
 }
 
 status csmap::csmap_iterator<true>::seek_lower_eq(string_view key)
@@ -348,12 +810,10 @@ status csmap::csmap_iterator<true>::seek_lower_eq(string_view key)
 	init_seek();
 
 	it_ = container->find_lower_eq(key);
-	if (it_ == container->end())
-		return status::NOT_FOUND;
-
-	node_lock = csmap::unique_node_lock_type(it_->second.mtx);
+	while (it_ != container->end() && !lock_current())
+		it_ = container->find_lower(it_->first);
 
-	return status::OK;
+	return it_ == container->end() ? status::NOT_FOUND : status::OK;
 }
 
 status csmap::csmap_iterator<true>::seek_higher(string_view key)
@@ -361,12 +821,9 @@ status csmap::csmap_iterator<true>::seek_higher(string_view key)
 	init_seek();
 
 	it_ = container->find_higher(key);
-	if (it_ == container->end())
-		return status::NOT_FOUND;
-
-	node_lock = csmap::unique_node_lock_type(it_->second.mtx);
+	skip_removed();
 
-	return status::OK;
+	return it_ == container->end() ? status::NOT_FOUND : status::OK;
 }
 
 status csmap::csmap_iterator<true>::seek_higher_eq(string_view key)
@@ -374,47 +831,45 @@ status csmap::csmap_iterator<true>::seek_higher_eq(string_view key)
 	init_seek();
 
 	it_ = container->find_higher_eq(key);
-	if (it_ == container->end())
-		return status::NOT_FOUND;
-
-	node_lock = csmap::unique_node_lock_type(it_->second.mtx);
+	skip_removed();
 
-	return status::OK;
+	return it_ == container->end() ? status::NOT_FOUND : status::OK;
 }
 
 status csmap::csmap_iterator<true>::seek_to_first()
 {
 	init_seek();
 
-	if (container->empty())
-		return status::NOT_FOUND;
-
 	it_ = container->begin();
+	skip_removed();
 
-	node_lock = csmap::unique_node_lock_type(it_->second.mtx);
-
-	return status::OK;
+	return it_ == container->end() ? status::NOT_FOUND : status::OK;
 }
 
 status csmap::csmap_iterator<true>::is_next()
 {
-	auto tmp = it_;
-	if (tmp == container->end() || ++tmp == container->end())
+	if (it_ == container->end())
 		return status::NOT_FOUND;
 
-	return status::OK;
+	for (auto tmp = std::next(it_); tmp != container->end(); ++tmp) {
+		if (!tmp->second.is_removed())
+			return status::OK;
+	}
+
+	return status::NOT_FOUND;
 }
 
 status csmap::csmap_iterator<true>::next()
 {
 	init_seek();
 
-	if (it_ == container->end() || ++it_ == container->end())
+	if (it_ == container->end())
 		return status::NOT_FOUND;
 
-	node_lock = csmap::unique_node_lock_type(it_->second.mtx);
+	++it_;
+	skip_removed();
 
-	return status::OK;
+	return it_ == container->end() ? status::NOT_FOUND : status::OK;
 }
 
 result<string_view> csmap::csmap_iterator<true>::key()
@@ -473,6 +928,27 @@ void csmap::csmap_iterator<true>::init_seek()
 		node_lock.unlock();
 }
 
+/*
+ * Locks element pointed by it_, returns false (and leaves it unlocked) if the
+ * element is marked as removed.
+ */
+bool csmap::csmap_iterator<true>::lock_current()
+{
+	node_lock = csmap::unique_node_lock_type(it_->second.mtx);
+	if (!it_->second.removed)
+		return true;
+
+	node_lock.unlock();
+	return false;
+}
+
+/* Moves it_ forward to the first element which is not removed and locks it. */
+void csmap::csmap_iterator<true>::skip_removed()
+{
+	while (it_ != container->end() && !lock_current())
+		++it_;
+}
+
 void csmap::csmap_iterator<false>::init_seek()
 {
 	csmap::csmap_iterator<true>::init_seek();
@@ -6,14 +6,20 @@
 
 #include "../comparator/pmemobj_comparator.h"
 #include "../pmemobj_engine.h"
+#include "../valgrind/drd.h"
+#include "../version_lock.h"
 
 #include <libpmemobj++/container/string.hpp>
 #include <libpmemobj++/experimental/concurrent_map.hpp>
 #include <libpmemobj++/persistent_ptr.hpp>
 #include <libpmemobj++/shared_mutex.hpp>
 
+#include <atomic>
+#include <cstring>
 #include <mutex>
 #include <shared_mutex>
+#include <string>
+#include <vector>
 
 namespace pmem
 {
@@ -28,14 +34,19 @@ using key_type = pmem::obj::string;
 
 static_assert(sizeof(key_type) == 32, "");
 
+/* Selects constructor of an element which is marked as removed. */
+struct removed_tag {
+};
+
 struct mapped_type {
 	mapped_type() = default;
 
-	mapped_type(const mapped_type &other) : val(other.val)
+	mapped_type(const mapped_type &other) : val(other.val), removed(other.removed)
 	{
 	}
 
-	mapped_type(mapped_type &&other) : val(std::move(other.val))
+	mapped_type(mapped_type &&other)
+	    : val(std::move(other.val)), removed(other.removed)
 	{
 	}
 
@@ -47,33 +58,130 @@ struct mapped_type {
 	{
 	}
 
-	pmem::obj::shared_mutex mtx;
+	/* Element is not visible until it is put (see csmap_transaction). */
+	mapped_type(removed_tag) : removed(1)
+	{
+	}
+
+	/*
+	 * Returns true and calls f(data, size) if the element is not removed. The
+	 * value may be modified concurrently, so it is copied optimistically and f
+	 * gets a consistent copy: values of up to small_value_size bytes are copied
+	 * to the stack, larger ones to the heap. No lock is held while f runs.
+	 */
+	template <typename F>
+	bool read(F &&f)
+	{
+		char buf[small_value_size];
+		std::string large_buf;
+		for (;;) {
+			uint64_t v = mtx.read_begin();
+
+			/* reads below race with writers, they are validated */
+			ANNOTATE_IGNORE_READS_BEGIN();
+			bool was_removed = removed;
+			const char *data = val.c_str();
+			size_t size = val.size();
+			bool small = size <= small_value_size;
+			if (!was_removed && !mtx.read_retry(v)) {
+				if (small)
+					std::memcpy(buf, data, size);
+				else
+					large_buf.assign(data, size);
+			}
+			ANNOTATE_IGNORE_READS_END();
+
+			if (mtx.read_retry(v))
+				continue;
+			if (was_removed)
+				return false;
+
+			if (small)
+				f(static_cast<const char *>(buf), size);
+			else
+				f(large_buf.data(), size);
+			return true;
+		}
+	}
+
+	/* Returns true if the element is removed, can be called concurrently. */
+	bool is_removed() const
+	{
+		for (;;) {
+			uint64_t v = mtx.read_begin();
+			ANNOTATE_IGNORE_READS_BEGIN();
+			bool was_removed = removed;
+			ANNOTATE_IGNORE_READS_END();
+
+			if (!mtx.read_retry(v))
+				return was_removed;
+		}
+	}
+
+	/* values read() copies to the stack instead of the heap */
+	static constexpr size_t small_value_size = 256;
+
+	/* volatile, reset on open (see csmap::Recover) */
+	version_lock mtx;
 	pmem::obj::string val;
+	/* set by remove, element is physically erased later (see csmap::reclaim) */
+	pmem::obj::p<uint64_t> removed = 0;
 };
 
-static_assert(sizeof(mapped_type) == 96, "");
+static_assert(sizeof(mapped_type) == 48, "");
 
 using map_type = pmem::obj::experimental::concurrent_map<key_type, mapped_type,
 							 internal::pmemobj_compare>;
 
+/*
+ * Version 0 is used by pools created before elements had removed flag and
+ * volatile version (see legacy_pmem_type), they are upgraded on open.
+ */
+static constexpr uint64_t layout_version = 1;
+
 struct pmem_type {
-	pmem_type() : map()
+	pmem_type() : map(), version(layout_version), legacy(OID_NULL)
 	{
 		std::memset(reserved, 0, sizeof(reserved));
 	}
 
 	map_type map;
-	uint64_t reserved[8];
+	pmem::obj::p<uint64_t> version;
+	/* legacy_pmem_type, attached only while its elements are moved */
+	PMEMoid legacy;
+	uint64_t reserved[5];
 };
 
 static_assert(sizeof(pmem_type) == sizeof(map_type) + 64, "");
 
+/* Element of pools with layout version 0. */
+struct legacy_mapped_type {
+	pmem::obj::shared_mutex mtx;
+	pmem::obj::string val;
+};
+
+static_assert(sizeof(legacy_mapped_type) == 96, "");
+
+using legacy_map_type =
+	pmem::obj::experimental::concurrent_map<key_type, legacy_mapped_type,
+						internal::pmemobj_compare>;
+
+/* Root of pools with layout version 0, its reserved words are zeroed. */
+struct legacy_pmem_type {
+	legacy_map_type map;
+	uint64_t reserved[8];
+};
+
+/* version of pmem_type overlays reserved[0] of legacy_pmem_type */
+static_assert(sizeof(legacy_pmem_type) == sizeof(pmem_type), "");
+
 } /* namespace csmap */
 } /* namespace internal */
 
 class csmap : public pmemobj_engine_base<internal::csmap::pmem_type> {
 	template <bool IsConst>
 	class csmap_iterator;
+	class csmap_transaction;
 
 public:
 	csmap(std::unique_ptr<internal::config> cfg);
@@ -109,30 +217,85 @@ public:
 
 	status remove(string_view key) final;
 
+	status multi_get(const std::vector<string_view> &keys, get_kv_callback *callback,
+			 void *arg) final;
+	status multi_put(const std::vector<string_view> &keys,
+			 const std::vector<string_view> &values) final;
+	status multi_remove(const std::vector<string_view> &keys) final;
+	status bulk_load(const std::vector<string_view> &keys,
+			 const std::vector<string_view> &values) final;
+
+	internal::transaction *begin_tx() final;
+
 	internal::iterator_base *new_iterator() final;
 	internal::iterator_base *new_const_iterator() final;
 
 private:
-	using node_mutex_type = pmem::obj::shared_mutex;
+	using node_mutex_type = internal::version_lock;
 	using global_mutex_type = std::shared_timed_mutex;
 	using shared_global_lock_type = std::shared_lock<global_mutex_type>;
 	using unique_global_lock_type = std::unique_lock<global_mutex_type>;
-	using shared_node_lock_type = std::shared_lock<node_mutex_type>;
 	using unique_node_lock_type = std::unique_lock<node_mutex_type>;
 	using container_type = internal::csmap::map_type;
 
+	/* number of removed elements which triggers reclaim() */
+	static constexpr size_t reclaim_threshold = 1024;
+	static constexpr size_t removed_keys_shards = 64;
+	/* minimal number of elements put by each thread of bulk_load() */
+	static constexpr size_t bulk_load_keys_per_thread = 4096;
+
 	void Recover();
+	void upgrade_legacy_map(internal::csmap::pmem_type *pmem_ptr);
 	status iterate(typename container_type::iterator first,
 		       typename container_type::iterator last, get_kv_callback *callback,
 		       void *arg);
+	std::size_t count(typename container_type::iterator first,
+			  typename container_type::iterator last);
+	void put_element(string_view key, string_view value);
+	status remove_element(string_view key);
+	void add_removed_key(const internal::csmap::key_type *key);
+	void reclaim();
 
 	/*
-	 * We take read lock for thread-safe methods (like get/insert/get_all) to
-	 * synchronize with unsafe_erase() which is not thread-safe.
+	 * We take read lock for thread-safe methods (like get/insert/get_all/remove)
+	 * to synchronize with unsafe_erase() which is not thread-safe. Remove only
+	 * marks an element as removed; elements are physically erased in batches
+	 * by reclaim(), which is the only user of the write lock.
 	 */
 	global_mutex_type mtx;
 	container_type *container;
 	std::unique_ptr<internal::config> config;
+
+	/* number of elements marked as removed, but not erased yet */
+	std::atomic<std::size_t> removed_count;
+
+	/* keys of removed elements, sharded to not serialize concurrent removes */
+	struct removed_keys_shard {
+		std::mutex mtx;
+		std::vector<const internal::csmap::key_type *> keys;
+	};
+	removed_keys_shard removed_keys[removed_keys_shards];
+	std::mutex reclaim_mtx;
+};
+
+/*
+ * Transaction buffers puts and removes in DRAM. On commit, elements are locked
+ * (in the order of keys) and all operations are applied in a single pmemobj
+ * transaction, so they become visible (and persistent) at once.
+ */
+class csmap::csmap_transaction : public internal::transaction {
+public:
+	csmap_transaction(csmap &engine);
+
+	status put(string_view key, string_view value) final;
+	status remove(string_view key) final;
+	status get(string_view key, get_v_callback *callback, void *arg) final;
+	status commit() final;
+	void abort() final;
+
+private:
+	csmap &engine;
+	internal::dram_log log;
 };
 
 template <>
@@ -165,6 +328,8 @@ protected:
 	pmem::obj::pool_base pop;
 
 	void init_seek();
+	bool lock_current();
+	void skip_removed();
 };
 
 template <>
@@ -2,7 +2,12 @@
 /* Copyright 2020-2021, Intel Corporation */
 
 #include "radix.h"
+#include "../exceptions.h"
+#include "../fast_hash.h"
 #include "../out.h"
+#include "../parallel_for.h"
+
+#include <algorithm>
 
 namespace pmem
 {
@@ -29,6 +34,25 @@ status transaction::remove(string_view key)
 	return status::OK;
 }
 
+status transaction::get(string_view key, get_v_callback *callback, void *arg)
+{
+	string_view value;
+	auto pending = log.find(key, value);
+	if (pending == dram_log::lookup_result::removed)
+		return status::NOT_FOUND;
+
+	if (pending == dram_log::lookup_result::not_found) {
+		auto it = container->find(key);
+		if (it == container->end())
+			return status::NOT_FOUND;
+
+		value = string_view(it->value());
+	}
+
+	callback(value.data(), value.size(), arg);
+	return status::OK;
+}
+
 status transaction::commit()
 {
 	auto insert_cb = [&](const dram_log::element_type &e) {
@@ -53,6 +77,218 @@ void transaction::abort()
 {
 	log.clear();
 }
+
+cache_policy parse_cache_policy(const char *name)
+{
+	std::string policy(name);
+
+	if (policy == "lru")
+		return cache_policy::lru;
+	else if (policy == "clock")
+		return cache_policy::clock;
+	else if (policy == "tinylfu")
+		return cache_policy::tinylfu;
+
+	throw internal::invalid_argument("Unknown cache_policy: " + policy);
+}
+
+const char *cache_policy_name(cache_policy policy)
+{
+	switch (policy) {
+		case cache_policy::clock:
+			return "clock";
+		case cache_policy::tinylfu:
+			return "tinylfu";
+		default:
+			return "lru";
+	}
+}
+
+frequency_sketch::frequency_sketch(size_t capacity) : additions(0)
+{
+	/* few counters per element, to keep collisions rare */
+	size = 1;
+	while (size < capacity * depth && size < max_table_size)
+		size <<= 1;
+
+	table = std::unique_ptr<std::atomic<uint8_t>[]>(new std::atomic<uint8_t>[size]);
+	for (size_t i = 0; i < size; i++)
+		table[i].store(0, std::memory_order_relaxed);
+
+	mask = size - 1;
+	sample_size = 10 * std::max<size_t>(capacity, 1);
+}
+
+size_t frequency_sketch::index(uint64_t hash, size_t i) const
+{
+	static const uint64_t seeds[depth] = {
+		0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL,
+		0xcbf29ce484222325ULL};
+
+	uint64_t h = (hash + seeds[i]) * seeds[i];
+	return static_cast<size_t>(h ^ (h >> 32)) & mask;
+}
+
+void frequency_sketch::increment(uint64_t hash)
+{
+	for (size_t i = 0; i < depth; i++) {
+		auto &counter = table[index(hash, i)];
+		auto count = counter.load(std::memory_order_relaxed);
+		if (count < max_count)
+			counter.store(count + 1, std::memory_order_relaxed);
+	}
+
+	/* only the thread which reaches sample_size ages the counters */
+	if (additions.fetch_add(1, std::memory_order_relaxed) + 1 == sample_size)
+		age();
+}
+
+unsigned frequency_sketch::frequency(uint64_t hash) const
+{
+	unsigned ret = max_count;
+	for (size_t i = 0; i < depth; i++)
+		ret = std::min<unsigned>(
+			ret, table[index(hash, i)].load(std::memory_order_relaxed));
+
+	return ret;
+}
+
+/* Halves all counters, so old accesses weigh less than recent ones. */
+void frequency_sketch::age()
+{
+	for (size_t i = 0; i < size; i++)
+		table[i].store(table[i].load(std::memory_order_relaxed) >> 1,
+			       std::memory_order_relaxed);
+
+	additions.fetch_sub(sample_size / 2, std::memory_order_relaxed);
+}
+
+static std::atomic<size_t> cache_stats_next_shard(0);
+
+cache_stats::shard &cache_stats::local()
+{
+	thread_local size_t index = cache_stats_next_shard++;
+
+	return shards[index % shards_count];
+}
+
+uint64_t cache_stats::hits() const
+{
+	uint64_t ret = 0;
+	for (auto &s : shards)
+		ret += s.hits.load(std::memory_order_relaxed);
+
+	return ret;
+}
+
+uint64_t cache_stats::misses() const
+{
+	uint64_t ret = 0;
+	for (auto &s : shards)
+		ret += s.misses.load(std::memory_order_relaxed);
+
+	return ret;
+}
+
+double cache_stats::hit_ratio() const
+{
+	auto h = hits();
+	auto m = misses();
+
+	return h + m == 0 ? 0.0 : static_cast<double>(h) / (h + m);
+}
+
+static std::atomic<uint64_t> ebr_workers_next_id(0);
+
+/*
+ * Workers used by the current thread, one for each ebr_workers. When the thread
+ * exits, its workers are destroyed (unless their ebr_workers was destroyed
+ * before). Entries of destroyed ebr_workers are dropped when a new one is added.
+ */
+class ebr_workers::thread_cache {
+public:
+	~thread_cache()
+	{
+		for (auto &e : entries) {
+			auto state = e.second.state.lock();
+			if (!state)
+				continue;
+
+			std::unique_lock<std::mutex> guard(state->lock);
+			state->workers.erase(std::this_thread::get_id());
+		}
+	}
+
+	local_worker *find(uint64_t id)
+	{
+		auto it = entries.find(id);
+		return it != entries.end() ? it->second.worker : nullptr;
+	}
+
+	void insert(uint64_t id, const std::shared_ptr<shared_state> &state,
+		    local_worker *worker)
+	{
+		for (auto it = entries.begin(); it != entries.end();) {
+			if (it->second.state.expired())
+				it = entries.erase(it);
+			else
+				++it;
+		}
+
+		entries.emplace(id, entry{state, worker});
+	}
+
+private:
+	struct entry {
+		std::weak_ptr<shared_state> state;
+		local_worker *worker;
+	};
+
+	std::unordered_map<uint64_t, entry> entries;
+};
+
+ebr_workers::ebr_workers(map_mt_type *container)
+    : register_worker([container] { return container->register_worker(); }),
+      id(ebr_workers_next_id++),
+      state(std::make_shared<shared_state>())
+{
+}
+
+ebr_workers::ebr_workers(ebr_type *ebr)
+    : register_worker([ebr] { return ebr->register_worker(); }),
+      id(ebr_workers_next_id++),
+      state(std::make_shared<shared_state>())
+{
+}
+
+ebr_workers::~ebr_workers()
+{
+	/* workers of running threads, exiting threads will find none */
+	std::unique_lock<std::mutex> guard(state->lock);
+	state->workers.clear();
+}
+
+ebr_workers::local_worker &ebr_workers::local()
+{
+	thread_local thread_cache cache;
+
+	auto cached = cache.find(id);
+	if (cached)
+		return *cached;
+
+	std::unique_lock<std::mutex> guard(state->lock);
+	auto &w = state->workers[std::this_thread::get_id()];
+	if (!w) {
+		w = std::unique_ptr<local_worker>(new local_worker());
+		w->worker = std::unique_ptr<worker_type>(
+			new worker_type(register_worker()));
+	}
+	guard.unlock();
+
+	cache.insert(id, state, w.get());
+
+	return *w;
+}
 } /* namespace radix */
 } /* namespace internal */
 
@@ -361,11 +597,11 @@ heterogeneous_radix::merged_iterator &heterogeneous_radix::merged_iterator::oper
 	if (curr_it == current_it::dram) {
 		assert(dram_it != hetero_radix.cache->end());
 		assert(pmem_it == hetero_radix.container->end() ||
-		       dram_it->first.compare(pmem_it->key()) < 0);
+		       string_view(dram_it->key).compare(pmem_it->key()) < 0);
 	} else {
 		assert(pmem_it != hetero_radix.container->end());
 		assert(dram_it == hetero_radix.cache->end() ||
-		       dram_it->first.compare(pmem_it->key()) > 0);
+		       string_view(dram_it->key).compare(pmem_it->key()) > 0);
 	}
 
 	if (curr_it == current_it::dram)
@@ -384,7 +620,7 @@ string_view heterogeneous_radix::merged_iterator::key() const
 	assert(dereferenceable());
 
 	if (curr_it == current_it::dram)
-		return dram_it->first;
+		return dram_it->key;
 	else
 		return pmem_it->key();
 }
@@ -396,16 +632,12 @@ heterogeneous_radix::merged_iterator::value() const
 	assert(dereferenceable());
 
 	if (curr_it == current_it::dram) {
-		auto v = &dram_it->second->second;
-		auto value = v->load(std::memory_order_acquire);
-
-		assert(value != tombstone_persistent() && value != tombstone_volatile());
-
-		auto size = value->size();
 		unique_ptr_type ptr(nullptr, &no_delete);
+		size_t size = 0;
 
-		while (!ptr)
-			ptr = hetero_radix.try_read_value(v, value);
+		/* The element could be removed by a put which does not take
+		 * cache_lock, ptr is null then. */
+		hetero_radix.read_value(&dram_it->value, ptr, size);
 
 		return std::pair<unique_ptr_type, size_t>(std::move(ptr), size);
 	} else {
@@ -427,19 +659,19 @@ void heterogeneous_radix::merged_iterator::set_current_it()
 	while (dereferenceable()) {
 		if (pmem_it != hetero_radix.container->end() &&
 		    dram_it != hetero_radix.cache->end() &&
-		    dram_it->first == string_view(pmem_it->key())) {
+		    string_view(dram_it->key) == string_view(pmem_it->key())) {
 			/* If keys are the same, skip the one in pmem (the dram one is
 			 * more recent) */
 			++pmem_it;
 		} else if (dram_it == hetero_radix.cache->end() ||
 			   (pmem_it != hetero_radix.container->end() &&
-			    dram_it->first.compare(pmem_it->key()) > 0)) {
+			    string_view(dram_it->key).compare(pmem_it->key()) > 0)) {
 			/* If there are no more dram elements or pmem element is smaller
 			 */
 			curr_it = current_it::pmem;
 			return;
 		} else {
-			auto v = dram_it->second->second.load(std::memory_order_acquire);
+			auto v = dram_it->value.load(std::memory_order_acquire);
 
 			/* Skip removed entries */
 			if (v == heterogeneous_radix::tombstone_volatile() ||
@@ -513,6 +745,32 @@ heterogeneous_radix::heterogeneous_radix(std::unique_ptr<internal::config> cfg)
 {
 	config->get_uint64("log_size", &log_size);
 	config->get_uint64("cache_size", &cache_size);
+	config->get_uint64("cache_bytes", &cache_bytes);
+
+	const char *policy_name;
+	if (config->get_string("cache_policy", &policy_name))
+		cache_policy = internal::radix::parse_cache_policy(policy_name);
+	if (!config->get_uint64("producers", &producers_count))
+		producers_count = std::thread::hardware_concurrency();
+	producers_count = std::max<size_t>(producers_count, 1);
+	config->get_uint64("high_watermark", &high_watermark);
+	config->get_uint64("low_watermark", &low_watermark);
+	if (high_watermark != 0 && low_watermark > high_watermark)
+		throw internal::invalid_argument(
+			"low_watermark cannot be greater than high_watermark");
+	if (!config->get_uint64("replay_threads", &replay_threads) ||
+	    replay_threads == 0)
+		replay_threads = std::thread::hardware_concurrency();
+	replay_threads = std::max<size_t>(replay_threads, 1);
+
+	uint64_t background_replay_flag = 0;
+	config->get_uint64("background_replay", &background_replay_flag);
+	background_replay = background_replay_flag != 0;
+
+	/* the object is a pmemkv_config, which is internal::config */
+	void *stats_ptr;
+	if (config->get_object("stats", &stats_ptr))
+		stats_config = static_cast<internal::config *>(stats_ptr);
 
 	pmem_type *pmem_ptr;
 
@@ -533,23 +791,45 @@ heterogeneous_radix::heterogeneous_radix(std::unique_ptr<internal::config> cfg)
 
 	container = &pmem_ptr->map;
 	container->runtime_initialize_mt();
-	container_worker = std::unique_ptr<container_type::ebr::worker>(
-		new container_type::ebr::worker(container->register_worker()));
-
-	cache = std::unique_ptr<cache_type>(new cache_type(cache_size));
-	queue = std::unique_ptr<pmem_queue_type>(new pmem_queue_type(*pmem_ptr->log, 1));
-	queue_worker = std::unique_ptr<pmem_queue_type::worker>(
-		new pmem_queue_type::worker(queue->register_worker()));
-
-	queue->try_consume_batch([&](pmem_queue_type::batch_type batch) {
-		for (auto entry : batch)
-			consume_queue_entry(entry, false);
-	});
+	workers = std::unique_ptr<internal::radix::ebr_workers>(
+		new internal::radix::ebr_workers(container));
+
+	cache = std::unique_ptr<cache_type>(
+		new cache_type(cache_size, cache_bytes, cache_policy));
+	queue = std::unique_ptr<pmem_queue_type>(
+		new pmem_queue_type(*pmem_ptr->log, producers_count));
+	producers = std::unique_ptr<producer[]>(new producer[producers_count]);
+	for (size_t i = 0; i < producers_count; i++)
+		producers[i].worker = std::unique_ptr<pmem_queue_type::worker>(
+			new pmem_queue_type::worker(queue->register_worker()));
 
 	bg_exception_ptr = nullptr;
+	bg_progress = 0;
+	log_pending = 0;
+	stalls = 0;
+	stall_ns = 0;
+	max_stall_ns = 0;
 
 	stopped.store(false);
-	bg_thread = std::thread([&] { bg_work(); });
+	if (!background_replay) {
+		replay_log(nullptr);
+		bg_thread = std::thread([&] { bg_work(); });
+	} else {
+		bg_thread = std::thread([&] {
+			if (bg_replay())
+				bg_work();
+		});
+
+		/* Wait until the log is indexed in the cache (or replay fails). */
+		std::unique_lock<std::mutex> lock(bg_lock);
+		bg_cv.wait(lock, [&] { return log_indexed || replay_exception; });
+
+		if (!log_indexed) {
+			lock.unlock();
+			bg_thread.join();
+			std::rethrow_exception(replay_exception);
+		}
+	}
 
 	pop = pmem::obj::pool_by_vptr(&pmem_ptr->log);
 }
@@ -565,10 +845,30 @@ heterogeneous_radix::~heterogeneous_radix()
 
 	bg_thread.join();
 
-	container_worker.reset(nullptr);
-	queue_worker.reset(nullptr);
+	workers.reset(nullptr);
+	producers.reset(nullptr);
 
 	container->runtime_finalize_mt();
+
+	auto &stats = cache->statistics();
+	LOG("cache (" << internal::radix::cache_policy_name(cache_policy)
+		      << "): hits=" << stats.hits() << ", misses=" << stats.misses()
+		      << ", hit ratio=" << stats.hit_ratio()
+		      << ", evictions=" << stats.evictions
+		      << ", rejections=" << stats.rejections);
+	if (stats_config) {
+		stats_config->assign_uint64("cache_hits", stats.hits());
+		stats_config->assign_uint64("cache_misses", stats.misses());
+		stats_config->assign_uint64("cache_evictions", stats.evictions);
+		stats_config->assign_uint64("cache_rejections", stats.rejections);
+	}
+	LOG("put stalls=" << stalls << ", total stall time=" << stall_ns / 1000
+			  << "us, max stall time=" << max_stall_ns / 1000 << "us");
+	if (stats_config) {
+		stats_config->assign_uint64("put_stalls", stalls);
+		stats_config->assign_uint64("put_stall_ns", stall_ns);
+		stats_config->assign_uint64("put_max_stall_ns", max_stall_ns);
+	}
 }
 
 bool heterogeneous_radix::log_contains(const void *ptr) const
@@ -581,22 +881,27 @@ bool heterogeneous_radix::log_contains(const void *ptr) const
 }
 
 heterogeneous_radix::cache_type::value_type *
-heterogeneous_radix::cache_put_with_evict(string_view key, const uvalue_type *value)
+heterogeneous_radix::cache_put_with_evict(string_view key, const uvalue_type *value,
+					  bool optional)
 {
-	auto evict_cb = [&](typename cache_type::lru_list_type &list) {
-		for (auto rit = list.rbegin(); rit != list.rend(); rit++) {
-			auto t = rit->second.load(std::memory_order_relaxed);
-
-			/* Only element which has already been process by background
-			 * thread (is not in the log) can be evicted. */
-			if (!log_contains(t) && t != tombstone_volatile())
-				return std::next(rit).base();
-		}
+	auto can_evict = [&](const cache_type::value_type &v) {
+		auto t = v.load(std::memory_order_relaxed);
 
-		return list.end();
+		/* Only element which has already been process by background
+		 * thread (is not in the log) can be evicted. */
+		return !log_contains(t) && t != tombstone_volatile();
 	};
 
-	return cache->put(key, value, evict_cb);
+	return cache->put(key, value, can_evict, optional);
+}
+
+static std::atomic<size_t> next_thread_index(0);
+
+heterogeneous_radix::producer &heterogeneous_radix::local_producer()
+{
+	thread_local size_t index = next_thread_index++;
+
+	return producers[index % producers_count];
 }
 
 void heterogeneous_radix::handle_oom_from_bg()
@@ -607,21 +912,101 @@ void heterogeneous_radix::handle_oom_from_bg()
 	}
 }
 
+/*
+ * Blocks a put while the number of puts not yet applied to the radix tree is
+ * above high watermark, until it drops to low watermark (or bg thread fails).
+ */
+void heterogeneous_radix::throttle()
+{
+	auto high = cache_size * high_watermark / 100;
+	auto low = cache_size * low_watermark / 100;
+
+	if (high == 0 || log_pending.load(std::memory_order_relaxed) < high)
+		return;
+
+	auto start = std::chrono::steady_clock::now();
+	{
+		std::unique_lock<std::mutex> lock(eviction_lock);
+		eviction_cv.wait(lock, [&] {
+			return log_pending.load(std::memory_order_relaxed) <= low ||
+				bg_exception_ptr.load() != nullptr;
+		});
+	}
+	record_stall(start);
+
+	handle_oom_from_bg();
+}
+
+/*
+ * Blocks until background thread consumes a batch from the log after bg_progress
+ * was read (returns immediately if it already did) or fails.
+ */
+void heterogeneous_radix::wait_for_bg(uint64_t progress)
+{
+	auto start = std::chrono::steady_clock::now();
+	{
+		std::unique_lock<std::mutex> lock(eviction_lock);
+		eviction_cv.wait(lock, [&] {
+			return bg_progress.load(std::memory_order_relaxed) != progress ||
+				bg_exception_ptr.load() != nullptr;
+		});
+	}
+	record_stall(start);
+}
+
+void heterogeneous_radix::notify_bg_progress()
+{
+	{
+		std::unique_lock<std::mutex> lock(eviction_lock);
+		bg_progress.fetch_add(1, std::memory_order_release);
+	}
+
+	eviction_cv.notify_all();
+}
+
+void heterogeneous_radix::record_stall(std::chrono::steady_clock::time_point start)
+{
+	uint64_t ns = static_cast<uint64_t>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start)
+			.count());
+
+	stalls.fetch_add(1, std::memory_order_relaxed);
+	stall_ns.fetch_add(ns, std::memory_order_relaxed);
+
+	auto max = max_stall_ns.load(std::memory_order_relaxed);
+	while (ns > max &&
+	       !max_stall_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+		;
+}
+
 status heterogeneous_radix::put(string_view key, string_view value)
 {
 	check_outside_tx();
 
 	/*
 	 * This implementation consists of following steps:
-	 * 1. Insert element to the DRAM cache (with empty value for now)
+	 * 1. Insert element to the DRAM cache (with its current value for now)
+	 * and pin it, so it's not evicted while the log references it. If the
+	 * key is already cached, its element is pinned without taking cache_lock.
+	 * Once the entry is produced the pin belongs to it, bg thread unpins the
+	 * element after the entry is consumed.
 	 * 2. Allocate queue_entry on dram (it will hold key/value or
 	 * key/tombstone pair).
-	 * 3. Try to produce the queue_entry using queue. If this succeeds
-	 * set cache entry value to point to the value in queue.
+	 * 3. Try to produce the queue_entry using queue (through producer slot
+	 * of this thread). If this succeeds set cache entry value to point to
+	 * the value in queue.
 	 *
-	 * If inserting to cache or producing the queue_entry fails, check
-	 * if background thread did not encounter oom. If yes, propagate
-	 * oom to the user.
+	 * If inserting to cache (all elements are still in the log) or producing
+	 * the queue_entry (log is full) fails, check if background thread did
+	 * not encounter oom. If yes, propagate oom to the user, otherwise wait
+	 * until background thread consumes some entries from the log.
+	 *
+	 * Before all that, put waits if there are too many entries in the log
+	 * (see throttle()), so that other puts are not stalled on full cache.
+	 *
+	 * Puts of the same key are serialized, so the order of their entries
+	 * in the log is the same as the order of updates of the cache entry.
 	 */
 
 	auto uvalue_key_size =
@@ -638,17 +1023,62 @@ status heterogeneous_radix::put(string_view key, string_view value)
 
 	assert(reinterpret_cast<uintptr_t>(data.get()) % alignof(queue_entry) == 0);
 
-	/* XXX: implement blocking cache_put_with_evict */
+	throttle();
+
+	std::unique_lock<std::mutex> key_lock(
+		put_locks[fast_hash(key.size(), key.data()) % put_locks_count]);
+
 	cache_type::value_type *cache_val = nullptr;
+	cache->critical([&] {
+		auto v = cache->get(key, false);
+		if (v && cache->pin(v))
+			cache_val = v;
+	});
+
 	while (cache_val == nullptr) {
-		cache_val = cache_put_with_evict(key, nullptr);
+		auto progress = bg_progress.load(std::memory_order_acquire);
+		{
+			std::unique_lock<std::mutex> lock(cache_lock);
+			cache_val = cache->get(key, false);
+			if (cache_val == nullptr) {
+				/* Key is not cached, so the radix tree is up to date. */
+				workers->critical([&] {
+					auto it = container->find(key);
+					cache_val = cache_put_with_evict(
+						key,
+						it != container->end()
+							? &it->value()
+							: tombstone_persistent());
+				});
+			}
+
+			/* cannot fail, elements are evicted with the lock held */
+			if (cache_val) {
+				auto pinned = cache->pin(cache_val);
+				assert(pinned);
+				(void)pinned;
+			}
+		}
+
+		if (cache_val != nullptr)
+			break;
+
 		handle_oom_from_bg();
+		wait_for_bg(progress);
 	}
 
+	auto unpin = [&] { cache->unpin(cache_val); };
+
 	new (data.get()) queue_entry(cache_val, key, value);
 
+	auto &p = local_producer();
+	std::unique_lock<std::mutex> producer_lock(p.lock);
+
+	/* Counted before the entry is visible to bg thread, which decrements it. */
+	log_pending.fetch_add(1, std::memory_order_relaxed);
 	while (true) {
-		auto produced = queue_worker->try_produce(
+		auto progress = bg_progress.load(std::memory_order_acquire);
+		auto produced = p.worker->try_produce(
 			pmem::obj::string_view(reinterpret_cast<const char *>(data.get()),
 					       req_size),
 			[&](pmem::obj::string_view target) {
@@ -664,9 +1094,18 @@ status heterogeneous_radix::put(string_view key, string_view value)
 			});
 		if (produced)
 			break;
-		else
+
+		try {
 			handle_oom_from_bg();
+		} catch (...) {
+			log_pending.fetch_sub(1, std::memory_order_relaxed);
+			unpin();
+			throw;
+		}
+
+		wait_for_bg(progress);
 	}
+	producer_lock.unlock();
 
 	// XXX - if try_produce == false, we can just allocate new radix node to
 	// TLS and the publish pointer to this node
@@ -680,84 +1119,94 @@ status heterogeneous_radix::remove(string_view k)
 {
 	check_outside_tx();
 
-	/* Check if element exists. */
+	/* Check if element exists. Element is evicted from the cache only after
+	 * it was applied to the radix tree, so no lock is needed. */
 	bool found = false;
-	auto v = cache->get(k, false);
-	if (v) {
-		auto value = v->load(std::memory_order_acquire);
-		found = (value != tombstone_persistent() &&
-			 value != tombstone_volatile());
-	} else {
-		found = container->find(k) != container->end();
-	}
+	workers->critical([&] {
+		bool cached = false;
+		cache->critical([&] {
+			auto v = cache->get(k, false);
+			if (v) {
+				auto value = v->load(std::memory_order_acquire);
+				cached = true;
+				found = (value != tombstone_persistent() &&
+					 value != tombstone_volatile());
+			}
+		});
+
+		if (!cached)
+			found = container->find(k) != container->end();
+	});
 
 	if (!found)
 		return status::NOT_FOUND;
 
-	try {
-		/* Put tombstone. */
-		auto s = put(k, pmem::obj::string_view());
+	while (true) {
+		try {
+			/* Put tombstone. */
+			return put(k, pmem::obj::string_view());
+		} catch (pmem::transaction_out_of_memory &) {
+			std::unique_lock<std::mutex> lock(bg_lock);
 
-		if (s != status::OK)
-			return s;
-	} catch (pmem::transaction_out_of_memory &) {
-		/* Set element in cache to tombstone, does nothing if element
-		 * is not in the cache. */
-		cache->put(k, tombstone_persistent(),
-			   [&](typename cache_type::lru_list_type &list) {
-				   return list.end();
-			   });
+			/* Exception was already consumed by other thread, bg thread
+			 * is running again. */
+			if (bg_exception_ptr.load(std::memory_order_acquire) == nullptr)
+				continue;
+
+			/* Set element in cache to tombstone, does nothing if element
+			 * is not in the cache. */
+			{
+				std::unique_lock<std::mutex> cache_guard(cache_lock);
+				cache->put(k, tombstone_persistent(),
+					   [](const cache_type::value_type &) {
+						   return false;
+					   });
+			}
 
-		/* Try to free the element directly, bypassing the queue. No
-		 * synchronization is needed with bg thread since it is blocked by OOM. */
-		assert(bg_exception_ptr.load(std::memory_order_relaxed));
+			/* Try to free the element directly, bypassing the queue. No
+			 * synchronization is needed with bg thread since it is blocked
+			 * by OOM (and other threads are serialized by bg_lock). */
+			container->erase(k);
+			container->garbage_collect_force();
 
-		container->erase(k);
-		container->garbage_collect_force();
+			delete bg_exception_ptr.load(std::memory_order_relaxed);
+			bg_exception_ptr.store(nullptr, std::memory_order_release);
+			lock.unlock();
 
-		delete bg_exception_ptr.load(std::memory_order_relaxed);
+			/* Notify bg thread that the exception was consumed */
+			bg_cv.notify_one();
 
-		{
-			std::unique_lock<std::mutex> lock(bg_lock);
-			bg_exception_ptr.store(nullptr, std::memory_order_release);
+			return status::OK;
 		}
-
-		/* Notify bg thread that the exception was consumed */
-		bg_cv.notify_one();
 	}
-
-	return status::OK;
 }
 
 /* Tries to optimistically read from the log. Operation succeeds only
  * if v->load() points equals value after read completes. Otherwise nullptr
  * is returned and value is set to v->load() */
 heterogeneous_radix::unique_ptr_type
-heterogeneous_radix::try_read_value(cache_type::value_type *v,
-				    const uvalue_type *&value) const
+heterogeneous_radix::try_read_value(cache_type::value_type *v, const uvalue_type *&value,
+				    size_t &size) const
 {
-	auto size = value->size();
-	auto data = value->data();
-
-	if (log_contains(value) && log_contains(data + size)) {
-		return log_read_optimistically(v, value);
+	if (log_contains(value)) {
+		return log_read_optimistically(v, value, size);
 	} else {
 		/* Cache entry points to data in pmem container. It's safe
 		 * to just read from it as entries in containers are
-		 * protected by EBR. */
-		auto ptr = unique_ptr_type(value->data(), &no_delete);
-		assert(v->load(std::memory_order_acquire) == value);
-
-		return ptr;
+		 * protected by EBR (even if a concurrent put has already
+		 * changed the cache entry). */
+		size = value->size();
+		return unique_ptr_type(value->data(), &no_delete);
 	}
 }
 
 heterogeneous_radix::unique_ptr_type
 heterogeneous_radix::log_read_optimistically(cache_type::value_type *v,
-					     const uvalue_type *&value) const
+					     const uvalue_type *&value,
+					     size_t &size) const
 {
 	auto data = value->data();
-	auto size = value->size();
+	size = value->size();
 
 	/* Cache entry points to data in log. To read the data we
 	 * must protect against producers which could overwrite
@@ -769,14 +1218,19 @@ heterogeneous_radix::log_read_optimistically(cache_type::value_type *v,
 	 * conusmed by bg thread and producers might have
 	 * overwritten the data - in this case we start from the
 	 * beginning. Otherwise we just call user callback with
-	 * the temporary buffer. */
-	auto unsafe_buff = new char[size];
-	std::copy(data, data + size, unsafe_buff);
-
-	auto buffer = unique_ptr_type(unsafe_buff, [](const char *p) { delete[] p; });
+	 * the temporary buffer. The size is read only once, it is
+	 * garbage if the data was already overwritten. */
+	unique_ptr_type buffer(nullptr, &no_delete);
+	if (log_contains(data + size)) {
+		auto unsafe_buff = new char[size];
+		std::copy(data, data + size, unsafe_buff);
+
+		buffer = unique_ptr_type(unsafe_buff,
+					 [](const char *p) { delete[] p; });
+	}
 
 	auto current_value = v->load(std::memory_order_acquire);
-	if (current_value == value) {
+	if (current_value == value && buffer) {
 		return buffer;
 	} else {
 		value = current_value;
@@ -789,46 +1243,69 @@ status heterogeneous_radix::get(string_view key, get_v_callback *callback, void
 	check_outside_tx();
 	status s = status::OK;
 
-	auto v = cache->get(key, true);
+	workers->critical([&] {
+		unique_ptr_type ptr(nullptr, &no_delete);
+		size_t size = 0;
+		bool cached = false;
+
+		/* Hits do not take any locks, cache entries are freed only after
+		 * all threads leave critical sections of the cache. */
+		cache->critical([&] {
+			auto v = cache->get(key, true);
+			if (v) {
+				cached = true;
+				s = read_value(v, ptr, size);
+			}
+		});
 
-	container_worker->critical([&] {
-		if (!v) {
-			/* If element is not in the cache, search radix tree. */
-			auto it = container->find(key);
-			if (it != container->end()) {
-				auto value = string_view(it->value());
-				callback(value.data(), value.size(), arg);
+		if (!cached) {
+			/* Miss is handled with the lock held, so that a value
+			 * inserted to the cache by concurrent put is not
+			 * overwritten by an older one from radix tree. */
+			std::unique_lock<std::mutex> lock(cache_lock);
+			auto v = cache->get(key, false);
+			if (v) {
+				s = read_value(v, ptr, size);
+			} else {
+				/* If element is not in the cache, search radix tree. */
+				auto it = container->find(key);
+				if (it == container->end()) {
+					s = status::NOT_FOUND;
+					return;
+				}
 
-				cache_put_with_evict(key, &it->value());
+				/* Elements which are only read may be not admitted. */
+				cache_put_with_evict(key, &it->value(), true);
 
+				auto value = string_view(it->value());
+				ptr = unique_ptr_type(value.data(), &no_delete);
+				size = value.size();
 				s = status::OK;
-			} else
-				s = status::NOT_FOUND;
-
-			return;
-		}
-
-		unique_ptr_type ptr = unique_ptr_type(nullptr, &no_delete);
-		size_t size;
-		while (!ptr) {
-			auto value = v->load(std::memory_order_acquire);
-			if (value == tombstone_volatile() ||
-			    value == tombstone_persistent()) {
-				s = status::NOT_FOUND;
-				return;
 			}
-
-			size = value->size();
-			ptr = try_read_value(v, value);
 		}
 
-		callback(ptr.get(), size, arg);
-		s = status::OK;
+		if (s == status::OK)
+			callback(ptr.get(), size, arg);
 	});
 
 	return s;
 }
 
+/* Reads (or copies) value of the cache entry. */
+status heterogeneous_radix::read_value(cache_type::value_type *v, unique_ptr_type &ptr,
+				       size_t &size) const
+{
+	while (!ptr) {
+		auto value = v->load(std::memory_order_acquire);
+		if (value == tombstone_volatile() || value == tombstone_persistent())
+			return status::NOT_FOUND;
+
+		ptr = try_read_value(v, value, size);
+	}
+
+	return status::OK;
+}
+
 std::string heterogeneous_radix::name()
 {
 	return "radix";
@@ -850,7 +1327,7 @@ heterogeneous_radix::merged_lower_bound(string_view key)
 	auto dram_lo = cache->lower_bound(key);
 	auto pmem_lo = container->lower_bound(key);
 
-	assert(dram_lo == cache->end() || dram_lo->first.compare(key) >= 0);
+	assert(dram_lo == cache->end() || string_view(dram_lo->key).compare(key) >= 0);
 	assert(pmem_lo == container->end() || pmem_lo->key().compare(key) >= 0);
 
 	return merged_iterator(*this, dram_lo, pmem_lo);
@@ -862,19 +1339,49 @@ heterogeneous_radix::merged_upper_bound(string_view key)
 	auto dram_up = cache->upper_bound(key);
 	auto pmem_up = container->upper_bound(key);
 
-	assert(dram_up == cache->end() || dram_up->first.compare(key) > 0);
+	assert(dram_up == cache->end() || string_view(dram_up->key).compare(key) > 0);
 	assert(pmem_up == container->end() || pmem_up->key().compare(key) > 0);
 
 	return merged_iterator(*this, dram_up, pmem_up);
 }
 
+/*
+ * Runs f(lock) with the cache locked, inside critical sections of radix tree and
+ * of the cache (so elements of the cache evicted while the lock is released by
+ * iterate_callback stay valid).
+ */
+template <typename F>
+void heterogeneous_radix::iterate_critical(F &&f)
+{
+	workers->critical([&] {
+		cache->critical([&] {
+			std::unique_lock<std::mutex> lock(cache_lock);
+			f(lock);
+		});
+	});
+}
+
+/*
+ * Calls callback with the cache unlocked, so it does not block puts and it may
+ * access the engine. The iterator stays valid: iterator of the cache moves to
+ * the next key if the cache was modified in the meantime.
+ */
 int heterogeneous_radix::iterate_callback(const merged_iterator &it,
-					  get_kv_callback *callback, void *arg)
+					  get_kv_callback *callback, void *arg,
+					  std::unique_lock<std::mutex> &lock)
 {
 	const auto &key = it.key();
 	auto val = it.value();
 
-	return callback(key.data(), key.size(), val.first.get(), val.second, arg);
+	/* Skip the element if it was removed after the iterator moved to it. */
+	if (!val.first)
+		return 0;
+
+	lock.unlock();
+	auto ret = callback(key.data(), key.size(), val.first.get(), val.second, arg);
+	lock.lock();
+
+	return ret;
 }
 
 status heterogeneous_radix::get_all(get_kv_callback *callback, void *arg)
@@ -882,13 +1389,13 @@ status heterogeneous_radix::get_all(get_kv_callback *callback, void *arg)
 	check_outside_tx();
 
 	status s;
-	container_worker->critical([&] {
+	iterate_critical([&](std::unique_lock<std::mutex> &lock) {
 		auto first = merged_begin();
 
 		s = iterate_generic(
 			first,
 			[&](const merged_iterator &it) {
-				return iterate_callback(it, callback, arg);
+				return iterate_callback(it, callback, arg, lock);
 			},
 			[&](const merged_iterator &it) { return it.dereferenceable(); });
 	});
@@ -902,13 +1409,13 @@ status heterogeneous_radix::get_above(string_view key, get_kv_callback *callback
 	check_outside_tx();
 
 	status s;
-	container_worker->critical([&] {
+	iterate_critical([&](std::unique_lock<std::mutex> &lock) {
 		auto first = merged_upper_bound(key);
 
 		s = iterate_generic(
 			first,
 			[&](const merged_iterator &it) {
-				return iterate_callback(it, callback, arg);
+				return iterate_callback(it, callback, arg, lock);
 			},
 			[&](const merged_iterator &it) { return it.dereferenceable(); });
 	});
@@ -922,13 +1429,13 @@ status heterogeneous_radix::get_equal_above(string_view key, get_kv_callback *ca
 	check_outside_tx();
 
 	status s;
-	container_worker->critical([&] {
+	iterate_critical([&](std::unique_lock<std::mutex> &lock) {
 		auto first = merged_lower_bound(key);
 
 		s = iterate_generic(
 			first,
 			[&](const merged_iterator &it) {
-				return iterate_callback(it, callback, arg);
+				return iterate_callback(it, callback, arg, lock);
 			},
 			[&](const merged_iterator &it) { return it.dereferenceable(); });
 	});
@@ -942,7 +1449,7 @@ status heterogeneous_radix::get_equal_below(string_view key, get_kv_callback *ca
 	check_outside_tx();
 
 	status s;
-	container_worker->critical([&] {
+	iterate_critical([&](std::unique_lock<std::mutex> &lock) {
 		auto first = merged_begin();
 
 		/* We cannot rely on iterator comparisons because of concurrent
@@ -963,7 +1470,7 @@ status heterogeneous_radix::get_equal_below(string_view key, get_kv_callback *ca
 		s = iterate_generic(
 			first,
 			[&](const merged_iterator &it) {
-				return iterate_callback(it, callback, arg);
+				return iterate_callback(it, callback, arg, lock);
 			},
 			[&](const merged_iterator &it) {
 				return it.dereferenceable() && it.key().compare(key) <= 0;
@@ -979,13 +1486,13 @@ status heterogeneous_radix::get_below(string_view key, get_kv_callback *callback
 	check_outside_tx();
 
 	status s;
-	container_worker->critical([&] {
+	iterate_critical([&](std::unique_lock<std::mutex> &lock) {
 		auto first = merged_begin();
 
 		s = iterate_generic(
 			first,
 			[&](const merged_iterator &it) {
-				return iterate_callback(it, callback, arg);
+				return iterate_callback(it, callback, arg, lock);
 			},
 			[&](const merged_iterator &it) {
 				return it.dereferenceable() && it.key().compare(key) < 0;
@@ -1002,13 +1509,14 @@ status heterogeneous_radix::get_between(string_view key1, string_view key2,
 
 	if (key1.compare(key2) < 0) {
 		status s;
-		container_worker->critical([&] {
+		iterate_critical([&](std::unique_lock<std::mutex> &lock) {
 			auto first = merged_upper_bound(key1);
 
 			s = iterate_generic(
 				first,
 				[&](const merged_iterator &it) {
-					return iterate_callback(it, callback, arg);
+					return iterate_callback(it, callback, arg,
+								lock);
 				},
 				[&](const merged_iterator &it) {
 					return it.dereferenceable() &&
@@ -1087,8 +1595,9 @@ status heterogeneous_radix::exists(string_view key)
 		key, [](const char *, size_t, void *) {}, nullptr);
 }
 
-void heterogeneous_radix::consume_queue_entry(pmem::obj::string_view entry,
-					      bool dram_is_valid)
+heterogeneous_radix::cache_type::value_type *
+heterogeneous_radix::consume_queue_entry(pmem::obj::string_view entry,
+					 bool dram_is_valid)
 {
 	/*
 	 * This function consumes entries for the queue. It inserts/erases the
@@ -1101,15 +1610,32 @@ void heterogeneous_radix::consume_queue_entry(pmem::obj::string_view entry,
 	 *
 	 * This allows us to keep processed elements in cache without additional
 	 * value copies.
+	 *
+	 * Returns the dram_entry (if valid), which is pinned until the caller
+	 * unpins it.
 	 */
 	auto e = reinterpret_cast<const queue_entry *>(entry.data());
-	auto dram_entry = const_cast<queue_entry *>(e)->dram_entry;
+	auto dram_entry = dram_is_valid ? const_cast<queue_entry *>(e)->dram_entry
+					: nullptr;
+
+	apply_queue_entry(e, dram_entry);
+
+	return dram_entry;
+}
+
+/*
+ * Inserts/erases the element from the radix tree and, if dram_entry is not null,
+ * makes it point to the radix_tree node (or tombstone).
+ */
+void heterogeneous_radix::apply_queue_entry(const queue_entry *e,
+					    cache_type::value_type *dram_entry)
+{
 	const uvalue_type *expected = e->remove ? tombstone_volatile() : &e->value();
 	const uvalue_type *desired;
 
 	/* If the dram_entry points to different element than was passed through queue
 	 * it is already outdated - just skip it, it will be handled later. */
-	if (dram_is_valid && dram_entry->load(std::memory_order_acquire) != expected)
+	if (dram_entry && dram_entry->load(std::memory_order_acquire) != expected)
 		return;
 
 	if (e->remove) {
@@ -1120,10 +1646,199 @@ void heterogeneous_radix::consume_queue_entry(pmem::obj::string_view entry,
 		desired = &ret.first->value();
 	}
 
-	if (dram_is_valid)
+	if (dram_entry)
 		dram_entry->compare_exchange_strong(expected, desired);
 }
 
+/* Minimal number of log entries processed by each replay thread. */
+static const size_t replay_entries_per_thread = 4096;
+
+/*
+ * Returns the latest entry of each key in the batch, in log order. Keys are
+ * partitioned by their hash, so each thread finds the latest entries of its own
+ * subset of keys and the order of entries of a single key is preserved.
+ */
+std::vector<const heterogeneous_radix::queue_entry *>
+heterogeneous_radix::latest_entries(pmem_queue_type::batch_type batch)
+{
+	std::vector<const queue_entry *> entries;
+	for (auto entry : batch)
+		entries.push_back(reinterpret_cast<const queue_entry *>(entry.data()));
+
+	auto n = entries.size();
+	auto threads_count = std::max<size_t>(
+		std::min(replay_threads, n / replay_entries_per_thread), 1);
+
+	auto key = [&](size_t i) { return string_view(entries[i]->key()); };
+
+	std::vector<uint64_t> hashes(n);
+	internal::parallel_for(threads_count, [&](size_t t) {
+		for (size_t i = n * t / threads_count; i < n * (t + 1) / threads_count;
+		     i++)
+			hashes[i] = fast_hash(key(i).size(), key(i).data());
+	});
+
+	/* maps index of the first entry of a key to index of its latest entry */
+	auto hash = [&](size_t i) { return static_cast<size_t>(hashes[i]); };
+	auto equal = [&](size_t i, size_t j) { return key(i).compare(key(j)) == 0; };
+	using latest_map =
+		std::unordered_map<size_t, size_t, decltype(hash), decltype(equal)>;
+
+	std::vector<std::vector<size_t>> latest(threads_count);
+	internal::parallel_for(threads_count, [&](size_t t) {
+		latest_map map(0, hash, equal);
+		for (size_t i = 0; i < n; i++) {
+			if (hashes[i] % threads_count != t)
+				continue;
+
+			auto ret = map.emplace(i, i);
+			if (!ret.second)
+				ret.first->second = i;
+		}
+
+		for (auto &l : map)
+			latest[t].push_back(l.second);
+		std::sort(latest[t].begin(), latest[t].end());
+	});
+
+	std::vector<size_t> indexes;
+	for (auto &l : latest)
+		indexes.insert(indexes.end(), l.begin(), l.end());
+	std::sort(indexes.begin(), indexes.end());
+
+	std::vector<const queue_entry *> ret;
+	ret.reserve(indexes.size());
+	for (auto i : indexes)
+		ret.push_back(entries[i]);
+
+	LOG("replaying " << ret.size() << " of " << n << " log entries");
+
+	return ret;
+}
+
+/*
+ * Applies entries left in the log by previous run to the radix tree.
+ *
+ * If indexed is set, the entries are first inserted to the cache and pinned until
+ * they are applied, so that the engine can serve requests while they are
+ * applied, and indexed() is called. If they do not fit in the cache, indexed()
+ * is not called by this function.
+ */
+void heterogeneous_radix::replay_log(const std::function<void()> &indexed)
+{
+	queue->try_consume_batch([&](pmem_queue_type::batch_type batch) {
+		auto entries = latest_entries(batch);
+		std::vector<cache_type::value_type *> dram_entries(entries.size(),
+								   nullptr);
+
+		auto unpin = [&] {
+			for (auto v : dram_entries)
+				if (v)
+					cache->unpin(v);
+		};
+
+		try {
+			bool fits = static_cast<bool>(indexed);
+			if (fits) {
+				std::unique_lock<std::mutex> lock(cache_lock);
+				for (size_t i = 0; i < entries.size() && fits; i++) {
+					auto e = entries[i];
+					auto key = string_view(e->key());
+
+					/* Element might be already indexed by
+					 * previous (failed) replay, a put could
+					 * update it since. */
+					auto v = cache->get(key, false);
+					if (!v)
+						v = cache_put_with_evict(
+							key,
+							e->remove ? tombstone_volatile()
+								  : &e->value());
+
+					/* cannot fail, elements are evicted with
+					 * the lock held */
+					if (v) {
+						auto pinned = cache->pin(v);
+						assert(pinned);
+						(void)pinned;
+					}
+
+					dram_entries[i] = v;
+					fits = (v != nullptr);
+				}
+			}
+
+			if (fits)
+				indexed();
+
+			for (size_t i = 0; i < entries.size(); i++)
+				apply_queue_entry(entries[i], dram_entries[i]);
+		} catch (...) {
+			unpin();
+			throw;
+		}
+
+		unpin();
+	});
+}
+
+void heterogeneous_radix::replay_indexed()
+{
+	{
+		std::unique_lock<std::mutex> lock(bg_lock);
+		log_indexed = true;
+	}
+
+	bg_cv.notify_all();
+}
+
+/*
+ * Replays the log in background thread. If the replay fails before the engine is
+ * opened, the exception is passed to the constructor. Later failures are reported
+ * like failures of bg_work() and the replay is retried. Returns false if the
+ * replay failed or the engine was stopped.
+ */
+bool heterogeneous_radix::bg_replay()
+{
+	while (true) {
+		try {
+			replay_log([&] { replay_indexed(); });
+			replay_indexed();
+
+			/* Replayed elements can be evicted now. */
+			notify_bg_progress();
+
+			return true;
+		} catch (...) {
+			auto ex = std::current_exception();
+
+			std::unique_lock<std::mutex> lock(bg_lock);
+			if (!log_indexed) {
+				replay_exception = ex;
+				lock.unlock();
+				bg_cv.notify_all();
+
+				return false;
+			}
+
+			bg_exception_ptr.store(new std::exception_ptr(ex));
+			lock.unlock();
+
+			/* Wake up puts waiting for bg thread, they will report oom. */
+			notify_bg_progress();
+
+			lock.lock();
+			bg_cv.wait(lock, [&] {
+				return bg_exception_ptr.load() == nullptr ||
+					stopped.load();
+			});
+
+			if (stopped.load())
+				return false;
+		}
+	}
+}
+
 void heterogeneous_radix::bg_work()
 {
 	bool should_report_oom = false;
@@ -1133,14 +1848,27 @@ void heterogeneous_radix::bg_work()
 			return;
 
 		try {
+			size_t count = 0;
+			std::vector<cache_type::value_type *> applied;
 			auto consumed = queue->try_consume_batch(
 				[&](pmem_queue_type::batch_type batch) {
-					for (auto entry : batch)
-						consume_queue_entry(entry, true);
+					for (auto entry : batch) {
+						applied.push_back(
+							consume_queue_entry(entry, true));
+						count++;
+					}
 				});
 
 			if (consumed) {
+				/* Consumed entries no longer reference their cache
+				 * elements, unpin them only now since a failed batch
+				 * is consumed again. */
+				for (auto v : applied)
+					cache->unpin(v);
+
 				should_report_oom = false;
+				log_pending.fetch_sub(count, std::memory_order_relaxed);
+				notify_bg_progress();
 			} else {
 				/* Nothing else to do, try to collect some
 				 * garbage. */
@@ -1161,6 +1889,9 @@ void heterogeneous_radix::bg_work()
 			auto ex = new std::exception_ptr(std::current_exception());
 			bg_exception_ptr.store(ex);
 
+			/* Wake up puts waiting for bg thread, they will report oom. */
+			notify_bg_progress();
+
 			std::unique_lock<std::mutex> lock(bg_lock);
 
 			/* Wait until exception is handled or
@@ -1179,6 +1910,299 @@ void heterogeneous_radix::bg_work()
 	}
 }
 
+/* CONCURRENT_RADIX */
+
+concurrent_radix::concurrent_radix(std::unique_ptr<internal::config> cfg)
+    : pmemobj_engine_base(cfg, "pmemkv_radix"), config(std::move(cfg))
+{
+	pmem_type *pmem_ptr;
+
+	if (!OID_IS_NULL(*root_oid)) {
+		pmem_ptr = static_cast<pmem_type *>(pmemobj_direct(*root_oid));
+	} else {
+		pmem::obj::transaction::run(pmpool, [&] {
+			pmem::obj::transaction::snapshot(root_oid);
+			*root_oid = pmem::obj::make_persistent<pmem_type>().raw();
+			pmem_ptr = static_cast<pmem_type *>(pmemobj_direct(*root_oid));
+		});
+	}
+
+	container = &pmem_ptr->map;
+	container->runtime_initialize_mt();
+	workers = std::unique_ptr<internal::radix::ebr_workers>(
+		new internal::radix::ebr_workers(container));
+
+	LOG("Started ok");
+}
+
+concurrent_radix::~concurrent_radix()
+{
+	workers.reset(nullptr);
+
+	container->runtime_finalize_mt();
+
+	LOG("Stopped ok");
+}
+
+std::string concurrent_radix::name()
+{
+	return "radix";
+}
+
+/* Must be called with write_lock held. */
+void concurrent_radix::collect_garbage()
+{
+	if (++writes_since_gc < gc_interval)
+		return;
+
+	writes_since_gc = 0;
+	container->garbage_collect();
+}
+
+/*
+ * Must be called inside EBR critical section. Range is defined by a predicate
+ * on keys instead of the last iterator, because elements can be concurrently
+ * erased (see heterogeneous_radix::get_equal_below).
+ */
+template <typename Predicate>
+status concurrent_radix::iterate(container_type::iterator first, Predicate &&p,
+				 get_kv_callback *callback, void *arg)
+{
+	return iterate_generic(
+		first,
+		[&](const container_type::iterator &it) {
+			const auto &key = it->key();
+			const auto &value = it->value();
+
+			return callback(key.data(), key.size(), value.data(),
+					value.size(), arg);
+		},
+		[&](const container_type::iterator &it) {
+			return it != container->end() && p(string_view(it->key()));
+		});
+}
+
+status concurrent_radix::get_all(get_kv_callback *callback, void *arg)
+{
+	LOG("get_all");
+	check_outside_tx();
+
+	status s;
+	workers->critical([&] {
+		s = iterate(
+			container->begin(), [](string_view) { return true; }, callback,
+			arg);
+	});
+
+	return s;
+}
+
+status concurrent_radix::get_above(string_view key, get_kv_callback *callback, void *arg)
+{
+	LOG("get_above for key=" << std::string(key.data(), key.size()));
+	check_outside_tx();
+
+	status s;
+	workers->critical([&] {
+		s = iterate(
+			container->upper_bound(key), [](string_view) { return true; },
+			callback, arg);
+	});
+
+	return s;
+}
+
+status concurrent_radix::get_equal_above(string_view key, get_kv_callback *callback,
+					 void *arg)
+{
+	LOG("get_equal_above for key=" << std::string(key.data(), key.size()));
+	check_outside_tx();
+
+	status s;
+	workers->critical([&] {
+		s = iterate(
+			container->lower_bound(key), [](string_view) { return true; },
+			callback, arg);
+	});
+
+	return s;
+}
+
+status concurrent_radix::get_equal_below(string_view key, get_kv_callback *callback,
+					 void *arg)
+{
+	LOG("get_equal_below for key=" << std::string(key.data(), key.size()));
+	check_outside_tx();
+
+	status s;
+	workers->critical([&] {
+		s = iterate(
+			container->begin(),
+			[&](string_view k) { return k.compare(key) <= 0; }, callback,
+			arg);
+	});
+
+	return s;
+}
+
+status concurrent_radix::get_below(string_view key, get_kv_callback *callback, void *arg)
+{
+	LOG("get_below for key=" << std::string(key.data(), key.size()));
+	check_outside_tx();
+
+	status s;
+	workers->critical([&] {
+		s = iterate(
+			container->begin(),
+			[&](string_view k) { return k.compare(key) < 0; }, callback,
+			arg);
+	});
+
+	return s;
+}
+
+status concurrent_radix::get_between(string_view key1, string_view key2,
+				     get_kv_callback *callback, void *arg)
+{
+	LOG("get_between for key1=" << key1.data() << ", key2=" << key2.data());
+	check_outside_tx();
+
+	if (key1.compare(key2) < 0) {
+		status s;
+		workers->critical([&] {
+			s = iterate(
+				container->upper_bound(key1),
+				[&](string_view k) { return k.compare(key2) < 0; },
+				callback, arg);
+		});
+
+		return s;
+	}
+
+	return status::OK;
+}
+
+status concurrent_radix::count_all(std::size_t &cnt)
+{
+	check_outside_tx();
+
+	cnt = 0;
+	return get_all(count_elements, (void *)&cnt);
+}
+
+status concurrent_radix::count_above(string_view key, std::size_t &cnt)
+{
+	check_outside_tx();
+
+	cnt = 0;
+	return get_above(key, count_elements, (void *)&cnt);
+}
+
+status concurrent_radix::count_equal_above(string_view key, std::size_t &cnt)
+{
+	check_outside_tx();
+
+	cnt = 0;
+	return get_equal_above(key, count_elements, (void *)&cnt);
+}
+
+status concurrent_radix::count_equal_below(string_view key, std::size_t &cnt)
+{
+	check_outside_tx();
+
+	cnt = 0;
+	return get_equal_below(key, count_elements, (void *)&cnt);
+}
+
+status concurrent_radix::count_below(string_view key, std::size_t &cnt)
+{
+	check_outside_tx();
+
+	cnt = 0;
+	return get_below(key, count_elements, (void *)&cnt);
+}
+
+status concurrent_radix::count_between(string_view key1, string_view key2,
+				       std::size_t &cnt)
+{
+	check_outside_tx();
+
+	cnt = 0;
+	return get_between(key1, key2, count_elements, (void *)&cnt);
+}
+
+status concurrent_radix::exists(string_view key)
+{
+	LOG("exists for key=" << std::string(key.data(), key.size()));
+	check_outside_tx();
+
+	status s;
+	workers->critical([&] {
+		s = container->find(key) != container->end() ? status::OK
+							     : status::NOT_FOUND;
+	});
+
+	return s;
+}
+
+status concurrent_radix::get(string_view key, get_v_callback *callback, void *arg)
+{
+	LOG("get key=" << std::string(key.data(), key.size()));
+	check_outside_tx();
+
+	status s = status::NOT_FOUND;
+	workers->critical([&] {
+		auto it = container->find(key);
+		if (it != container->end()) {
+			auto value = string_view(it->value());
+			callback(value.data(), value.size(), arg);
+			s = status::OK;
+		}
+	});
+
+	return s;
+}
+
+status concurrent_radix::put(string_view key, string_view value)
+{
+	LOG("put key=" << std::string(key.data(), key.size())
+		       << ", value.size=" << std::to_string(value.size()));
+	check_outside_tx();
+
+	std::unique_lock<std::mutex> lock(write_lock);
+
+	auto result = container->try_emplace(key, value);
+
+	/* In MT mode assign_val replaces the leaf, readers still see the old one. */
+	if (result.second == false) {
+		pmem::obj::transaction::run(pmpool,
+					    [&] { result.first.assign_val(value); });
+	}
+
+	collect_garbage();
+
+	return status::OK;
+}
+
+status concurrent_radix::remove(string_view key)
+{
+	LOG("remove key=" << std::string(key.data(), key.size()));
+	check_outside_tx();
+
+	std::unique_lock<std::mutex> lock(write_lock);
+
+	auto it = container->find(key);
+
+	if (it == container->end())
+		return status::NOT_FOUND;
+
+	container->erase(it);
+
+	collect_garbage();
+
+	return status::OK;
+}
+
 internal::iterator_base *radix::new_iterator()
 {
 	return new radix_iterator<false>{container};
@@ -5,8 +5,10 @@
 #define LIBPMEMKV_RADIX_H
 
 #include "../comparator/pmemobj_comparator.h"
+#include "../fast_hash.h"
 #include "../iterator.h"
 #include "../pmemobj_engine.h"
+#include "radix/dram_index.h"
 
 #include <libpmemobj++/experimental/inline_string.hpp>
 #include <libpmemobj++/experimental/mpsc_queue.hpp>
@@ -14,10 +16,15 @@
 #include <libpmemobj++/persistent_ptr.hpp>
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <list>
+#include <functional>
+#include <limits>
 #include <mutex>
 #include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace pmem
 {
@@ -40,6 +47,72 @@ using map_mt_type = map_type_generic<true>;
 
 using log_type = pmem::obj::experimental::mpsc_queue::pmem_log_type;
 
+/*
+ * EBR workers of a concurrent radix tree (or of a standalone ebr), one for each
+ * thread which uses it. Workers are registered on the first use, threads cache
+ * pointers to them. A worker is destroyed when its thread exits or together
+ * with this object, whichever happens first.
+ */
+class ebr_workers {
+public:
+	using ebr_type = map_mt_type::ebr;
+	using worker_type = ebr_type::worker;
+
+	ebr_workers(map_mt_type *container);
+	ebr_workers(ebr_type *ebr);
+	~ebr_workers();
+
+	ebr_workers(const ebr_workers &) = delete;
+	ebr_workers &operator=(const ebr_workers &) = delete;
+
+	/*
+	 * Runs f inside critical section of this thread's worker. Critical
+	 * sections can be nested (e.g. when a callback of get_all calls get).
+	 */
+	template <typename F>
+	void critical(F &&f)
+	{
+		auto &w = local();
+		if (w.depth > 0) {
+			f();
+			return;
+		}
+
+		w.depth++;
+		try {
+			w.worker->critical(f);
+		} catch (...) {
+			w.depth--;
+			throw;
+		}
+		w.depth--;
+	}
+
+private:
+	struct local_worker {
+		std::unique_ptr<worker_type> worker;
+		size_t depth = 0;
+	};
+
+	/* workers, shared with caches of threads (which may outlive this object) */
+	struct shared_state {
+		std::mutex lock;
+		std::unordered_map<std::thread::id, std::unique_ptr<local_worker>>
+			workers;
+	};
+
+	class thread_cache;
+
+	local_worker &local();
+
+	std::function<worker_type()> register_worker;
+
+	/* identifies this object in threads' caches, never reused */
+	const uint64_t id;
+
+	std::shared_ptr<shared_state> state;
+};
+
 template <typename MapType = map_type>
 struct pmem_type {
 	pmem_type() : map()
@@ -59,6 +132,7 @@ public:
 	transaction(pmem::obj::pool_base &pop, map_type *container);
 	status put(string_view key, string_view value) final;
 	status remove(string_view key) final;
+	status get(string_view key, get_v_callback *callback, void *arg) final;
 	status commit() final;
 	void abort() final;
 
@@ -68,21 +142,185 @@ private:
 	map_type *container;
 };
 
+/* Eviction (and admission) policy of ordered_cache. */
+enum class cache_policy {
+	/*
+	 * evicts the least recently used of a few elements (sampled in the order
+	 * of insertion), an approximation of LRU which does not need any
+	 * bookkeeping on hits
+	 */
+	lru,
+	/* approximation of LRU, hits only set a reference bit (second chance) */
+	clock,
+	/*
+	 * LRU eviction, but elements which are only read (not written) are
+	 * admitted to the cache only if they are accessed more frequently than
+	 * the element which would be evicted (TinyLFU), so scans do not flush
+	 * frequently used elements
+	 */
+	tinylfu
+};
+
+cache_policy parse_cache_policy(const char *name);
+const char *cache_policy_name(cache_policy policy);
+
+/*
+ * Count-min sketch with 4-bit saturating counters (stored in bytes), which
+ * estimates how often keys are accessed. Counters are halved periodically,
+ * so the estimate reflects recent history.
+ *
+ * It can be updated concurrently, without locks: concurrent increments of the
+ * same counter may be lost, which only makes the estimate less accurate.
+ */
+class frequency_sketch {
+public:
+	frequency_sketch(size_t capacity);
+
+	void increment(uint64_t hash);
+	unsigned frequency(uint64_t hash) const;
+
+private:
+	static constexpr size_t depth = 4;
+	static constexpr size_t max_table_size = 1 << 24;
+	static constexpr uint8_t max_count = 15;
+
+	size_t index(uint64_t hash, size_t i) const;
+	void age();
+
+	std::unique_ptr<std::atomic<uint8_t>[]> table;
+	size_t size;
+	size_t mask;
+	size_t sample_size;
+	std::atomic<size_t> additions;
+};
+
+/*
+ * Counters of ordered_cache. Hits and misses are counted per shard (threads
+ * are assigned to shards round-robin), so lookups from different threads do
+ * not write to the same cache line.
+ */
+class cache_stats {
+public:
+	void hit()
+	{
+		local().hits.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void miss()
+	{
+		local().misses.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	uint64_t hits() const;
+	uint64_t misses() const;
+	double hit_ratio() const;
+
+	std::atomic<uint64_t> evictions{0};
+	/* elements which were not admitted to the cache by the policy */
+	std::atomic<uint64_t> rejections{0};
+
+private:
+	static constexpr size_t shards_count = 16;
+
+	struct shard {
+		std::atomic<uint64_t> hits{0};
+		std::atomic<uint64_t> misses{0};
+		char padding[48];
+	};
+
+	shard &local();
+
+	shard shards[shards_count];
+};
+
+/*
+ * Ordered DRAM cache of pointers to values, with pluggable eviction policy.
+ * Its capacity is limited by number of elements and (optionally) by bytes.
+ * Values are not held in DRAM (the cache only points to them), so the byte
+ * budget accounts for keys and per-element overhead.
+ *
+ * Elements are kept in a dram_index (B+-tree) and allocated from a pool.
+ * Modifications (put) and iteration must be serialized by the caller, but get
+ * does not take any locks: it can be called concurrently with other gets and
+ * with a modification, inside critical(). Evicted elements are freed only
+ * after all threads leave critical sections in which they could access them.
+ * Hits only update per-element atomics (reference bit or time of the last
+ * access), so concurrent gets of different keys do not write to shared memory.
+ * Elements can be pinned (also without serialization), pinned elements are
+ * never evicted.
+ */
 template <typename Value>
 class ordered_cache {
+public:
+	using value_type = std::atomic<const Value *>;
+
 private:
-	using key_type = std::string;
-	using dram_value_type = std::pair<key_type, std::atomic<const Value *>>;
-	using dram_map_type =
-		std::map<string_view, typename std::list<dram_value_type>::iterator>;
+	/* value of the element and number of its pins (or evicted) */
+	struct slot : value_type {
+		slot(const Value *v) : value_type(v), pins(0)
+		{
+		}
+
+		std::atomic<uint32_t> pins;
+	};
+
+	static constexpr uint32_t evicted = std::numeric_limits<uint32_t>::max();
+
+	struct entry {
+		entry(string_view key, const Value *v, uint64_t stamp)
+		    : key(key.data(), key.size()),
+		      value(v),
+		      stamp(stamp),
+		      referenced(false)
+		{
+		}
+
+		const std::string key;
+		slot value;
+		/* time of the last access, used by lru and tinylfu policies */
+		std::atomic<uint64_t> stamp;
+		/* used by clock policy */
+		std::atomic<bool> referenced;
+
+		/* neighbours in the (cyclic) order of insertion */
+		entry *prev = nullptr;
+		entry *next = nullptr;
+	};
+
+	/* approximate DRAM usage of an element, besides its key */
+	static constexpr size_t entry_overhead = sizeof(entry) + 64;
+
+	/* number of evictable elements examined by lru and tinylfu to find a victim */
+	static constexpr size_t eviction_samples = 8;
 
 public:
-	using lru_list_type = std::list<dram_value_type>;
-	using iterator = typename dram_map_type::iterator;
-	using value_type = std::atomic<const Value *>;
+	using iterator = typename dram_index<entry>::iterator;
+
+	ordered_cache(size_t max_size, size_t max_bytes, cache_policy policy)
+	    : max_size(max_size),
+	      max_bytes(max_bytes),
+	      policy(policy),
+	      sketch(policy == cache_policy::tinylfu ? max_size : 0),
+	      workers(&ebr),
+	      garbage(ebr),
+	      index(garbage)
+	{
+	}
 
-	ordered_cache(size_t max_size) : max_size(max_size)
+	/* Must not be called concurrently with any other method. */
+	~ordered_cache()
 	{
+		garbage.clear();
+
+		if (!hand)
+			return;
+
+		auto e = hand;
+		do {
+			auto next = e->next;
+			entries.destroy(e);
+			e = next;
+		} while (e != hand);
 	}
 
 	ordered_cache(const ordered_cache &) = delete;
@@ -91,102 +329,280 @@ public:
 	ordered_cache &operator=(const ordered_cache &) = delete;
 	ordered_cache &operator=(ordered_cache &&) = delete;
 
+	/* Runs f inside critical section, which protects elements from being freed. */
 	template <typename F>
-	value_type *put(string_view key, const Value *v, F &&evict)
+	void critical(F &&f)
 	{
-		assert(map.size() == lru_list.size());
-
-		auto it = map.find(key);
-		if (it == map.end()) {
-			if (lru_list.size() < max_size) {
-				lru_list.emplace_front(
-					std::piecewise_construct,
-					std::forward_as_tuple(key.data(), key.size()),
-					std::forward_as_tuple(v));
-				auto lit = lru_list.begin();
+		workers.critical(std::forward<F>(f));
+	}
 
-				auto ret = map_put(lit->first, lit);
+	/*
+	 * Inserts or updates an element. If the cache is full, elements chosen by
+	 * the policy are evicted, but only those for which can_evict(value_type &)
+	 * returns true. Returns nullptr if there is not enough space or (only if
+	 * optional is set) the policy did not admit the element.
+	 */
+	template <typename F>
+	value_type *put(string_view key, const Value *v, F &&can_evict,
+			bool optional = false)
+	{
+		auto e = index.find(key);
+		if (e) {
+			touch(e);
+			e->value.store(v, std::memory_order_release);
 
-				assert(ret.second);
+			return &e->value;
+		}
 
-				it = ret.first;
-			} else {
-				auto lit = evict(lru_list);
+		/* optional puts follow a get, which already recorded the access */
+		uint64_t hash = 0;
+		if (policy == cache_policy::tinylfu) {
+			hash = fast_hash(key.size(), key.data());
+			if (!optional)
+				sketch.increment(hash);
+		}
 
-				if (lit == lru_list.end())
-					return nullptr;
+		auto bytes = key.size() + entry_overhead;
+		while (size >= max_size ||
+		       (max_bytes != 0 && used_bytes + bytes > max_bytes)) {
+			auto victim = find_victim(can_evict);
+			if (!victim)
+				return nullptr;
+
+			if (optional && policy == cache_policy::tinylfu &&
+			    sketch.frequency(hash) <=
+				    sketch.frequency(fast_hash(victim->key.size(),
+							       victim->key.data()))) {
+				stats.rejections.fetch_add(1, std::memory_order_relaxed);
+				return nullptr;
+			}
 
-				map.erase(lit->first);
+			/* concurrent pin() fails once the element is marked */
+			uint32_t unpinned = 0;
+			if (!victim->value.pins.compare_exchange_strong(
+				    unpinned, evicted, std::memory_order_acquire))
+				continue;
 
-				lru_list.splice(lru_list.begin(), lru_list, lit);
-				lru_list.begin()->first.assign(key.data(), key.size());
-				lru_list.begin()->second.store(v,
-							       std::memory_order_release);
-				lit = lru_list.begin();
+			erase(victim);
+			stats.evictions.fetch_add(1, std::memory_order_relaxed);
+		}
 
-				auto ret = map_put(lit->first, lit);
-				assert(ret.second);
+		/* time advances with insertions, hits only read it */
+		auto now = insertions.fetch_add(1, std::memory_order_relaxed) + 1;
 
-				it = ret.first;
-			}
-		} else {
-			lru_list.splice(lru_list.begin(), lru_list, it->second);
-			lru_list.begin()->second.store(v, std::memory_order_release);
+		e = entries.create(key, v, now);
+		try {
+			index.insert(e);
+		} catch (...) {
+			entries.destroy(e);
+			throw;
 		}
 
-		return &it->second->second;
+		link(e);
+		size++;
+		used_bytes += bytes;
+
+		return &e->value;
+	}
+
+	/*
+	 * Pins element returned by get() or put(), so it is not evicted until
+	 * unpin() is called. Must be called inside critical() (or by a thread which
+	 * serializes modifications). Returns false if the element was already
+	 * evicted (only possible if it's called concurrently with a put).
+	 */
+	bool pin(value_type *v)
+	{
+		auto &pins = static_cast<slot *>(v)->pins;
+		auto p = pins.load(std::memory_order_relaxed);
+		do {
+			if (p == evicted)
+				return false;
+		} while (!pins.compare_exchange_weak(p, p + 1, std::memory_order_acquire,
+						     std::memory_order_relaxed));
+
+		return true;
 	}
 
+	/* Can be called concurrently with any method. */
+	void unpin(value_type *v)
+	{
+		static_cast<slot *>(v)->pins.fetch_sub(1, std::memory_order_release);
+	}
+
+	/*
+	 * Returns element or nullptr. Must be called inside critical() (or by a
+	 * thread which serializes modifications). If promote is set, the access
+	 * is recorded (in stats and by the policy).
+	 */
 	value_type *get(string_view key, bool promote)
 	{
-		assert(map.size() == lru_list.size());
+		if (promote && policy == cache_policy::tinylfu)
+			sketch.increment(fast_hash(key.size(), key.data()));
 
-		auto it = map.find(key);
-		if (it == map.end()) {
-			return nullptr;
-		} else {
+		auto e = index.find(key);
+		if (!e) {
 			if (promote)
-				lru_list.splice(lru_list.begin(), lru_list, it->second);
+				stats.miss();
 
-			return &it->second->second;
+			return nullptr;
 		}
+
+		if (promote) {
+			stats.hit();
+			touch(e);
+		}
+
+		return &e->value;
 	}
 
 	iterator begin()
 	{
-		return map.begin();
+		return index.begin();
 	}
 
 	iterator end()
 	{
-		return map.end();
+		return index.end();
 	}
 
 	iterator lower_bound(string_view key)
 	{
-		return map.lower_bound(key);
+		return index.lower_bound(key);
 	}
 
 	iterator upper_bound(string_view key)
 	{
-		return map.upper_bound(key);
+		return index.upper_bound(key);
+	}
+
+	const cache_stats &statistics() const
+	{
+		return stats;
 	}
 
 private:
-	std::pair<typename dram_map_type::iterator, bool>
-	map_put(const typename dram_map_type::key_type &k,
-		const typename dram_map_type::mapped_type &v)
+	/* Can be called concurrently, stores only if the value changes. */
+	void touch(entry *e)
+	{
+		if (policy == cache_policy::clock) {
+			if (!e->referenced.load(std::memory_order_relaxed))
+				e->referenced.store(true, std::memory_order_relaxed);
+		} else {
+			auto now = insertions.load(std::memory_order_relaxed);
+			if (e->stamp.load(std::memory_order_relaxed) != now)
+				e->stamp.store(now, std::memory_order_relaxed);
+		}
+	}
+
+	template <typename F>
+	static bool evictable(entry *e, F &&can_evict)
+	{
+		return e->value.pins.load(std::memory_order_relaxed) == 0 &&
+			can_evict(static_cast<const value_type &>(e->value));
+	}
+
+	/* Returns element to evict or nullptr if no element can be evicted. */
+	template <typename F>
+	entry *find_victim(F &&can_evict)
 	{
-#if __cpp_lib_map_try_emplace
-		return map.try_emplace(k, v);
-#else
-		return map.emplace(k, v);
-#endif
+		if (!hand)
+			return nullptr;
+
+		if (policy == cache_policy::clock) {
+			/*
+			 * Every element is visited at most twice: the first
+			 * visit may only clear its reference bit.
+			 */
+			for (size_t i = 0; i < 2 * size; i++, hand = hand->next) {
+				if (!evictable(hand, can_evict))
+					continue;
+
+				if (hand->referenced.load(std::memory_order_relaxed))
+					hand->referenced.store(false,
+							       std::memory_order_relaxed);
+				else
+					return hand;
+			}
+
+			return nullptr;
+		}
+
+		/*
+		 * The least recently used of eviction_samples evictable elements
+		 * following the hand, the next search starts after them.
+		 */
+		entry *victim = nullptr;
+		size_t samples = 0;
+		for (size_t i = 0; i < size && samples < eviction_samples;
+		     i++, hand = hand->next) {
+			if (!evictable(hand, can_evict))
+				continue;
+
+			samples++;
+			if (!victim ||
+			    hand->stamp.load(std::memory_order_relaxed) <
+				    victim->stamp.load(std::memory_order_relaxed))
+				victim = hand;
+		}
+
+		return victim;
+	}
+
+	/* Inserts e before the hand, so it is examined after all other elements. */
+	void link(entry *e)
+	{
+		if (!hand) {
+			e->prev = e->next = e;
+			hand = e;
+		} else {
+			e->next = hand;
+			e->prev = hand->prev;
+			hand->prev->next = e;
+			hand->prev = e;
+		}
+	}
+
+	void erase(entry *e)
+	{
+		auto removed = index.erase(e->key);
+		assert(removed == e);
+		(void)removed;
+
+		if (e->next == e) {
+			hand = nullptr;
+		} else {
+			e->prev->next = e->next;
+			e->next->prev = e->prev;
+			if (hand == e)
+				hand = e->next;
+		}
+
+		size--;
+		used_bytes -= e->key.size() + entry_overhead;
+
+		garbage.retire([this, e] { entries.destroy(e); });
 	}
 
-	lru_list_type lru_list;
-	dram_map_type map;
 	const size_t max_size;
+	const size_t max_bytes;
+	size_t size = 0;
+	size_t used_bytes = 0;
+
+	const cache_policy policy;
+	/* next element to examine by the policy, elements form a cycle */
+	entry *hand = nullptr;
+	/* number of insertions, used as time of accesses */
+	std::atomic<uint64_t> insertions{0};
+	frequency_sketch sketch;
+
+	cache_stats stats;
+
+	map_mt_type::ebr ebr;
+	ebr_workers workers;
+	object_pool<entry> entries;
+	ebr_garbage garbage;
+	dram_index<entry> index;
 };
 
 } /* namespace radix */
@@ -196,8 +612,9 @@ private:
  * Radix tree engine backed by:
  * https://github.com/pmem/libpmemobj-cpp/blob/master/include/libpmemobj%2B%2B/experimental/radix_tree.hpp
  *
- * It is a sorted, singlethreaded engine. Unlike other sorted engines it does not support
- * custom comparator (the order is defined by the keys' representation).
+ * It is a sorted, singlethreaded engine (see concurrent_radix for thread-safe variant).
+ * Unlike other sorted engines it does not support custom comparator (the order is
+ * defined by the keys' representation).
  *
  * The implementation is a variation of a PATRICIA trie - the internal
  * nodes do not store the path explicitly, but only a position at which
@@ -267,12 +684,25 @@ private:
  * Heterogenous engine which implements DRAM cache on top of radix tree container.
  *
  * On put, data is first inserted to DRAM cache and appended to pmem log (mpsc_queue).
- * There is one background thread which consumes data from the log and erases/inserts
- * consumed elements to the radix tree.
+ * Threads append to the log concurrently, through a pool of producer slots (see
+ * "producers" config parameter). There is one background thread which consumes
+ * data from the log and erases/inserts consumed elements to the radix tree. It is
+ * not partitioned by keys: radix tree allows only one writer, so several consumers
+ * would be serialized on it anyway.
+ *
+ * Puts of cached keys pin their cache elements without taking cache_lock. The pin
+ * is kept until the log entry is consumed, so elements referenced from the log are
+ * never evicted. Scans do not hold cache_lock while their callbacks run.
  *
  * On get, dram cache is first checked. If looked-for element is found there, it is
  * returned to the user. On cache-miss, we search the radix_tree. Read operations on
  * radix_tree are protected by Epoch Based Reclamation mechanism.
+ *
+ * On open, entries left in the log are replayed: only the latest entry of each key
+ * is applied to the radix_tree (they are found by several threads, each handling
+ * a subset of keys). With "background_replay" set, those entries are first
+ * inserted to the dram cache (pointing to the log, like entries of regular puts)
+ * and applied by the background thread, while the engine already serves requests.
  */
 class heterogeneous_radix
     : public pmemobj_engine_base<
@@ -339,6 +769,15 @@ private:
 
 	using pmem_queue_type = pmem::obj::experimental::mpsc_queue;
 
+	/* Producer slot of the queue, slots are assigned to threads round-robin. */
+	struct producer {
+		std::mutex lock;
+		std::unique_ptr<pmem_queue_type::worker> worker;
+	};
+
+	/* puts of the same key are serialized, so they reach the log in order */
+	static constexpr size_t put_locks_count = 64;
+
 	struct merged_iterator {
 		merged_iterator(heterogeneous_radix &hetero_radix, dram_iterator dram_it,
 				pmem_iterator pmem_it);
@@ -370,18 +809,34 @@ private:
 	merged_iterator merged_upper_bound(string_view key);
 
 	int iterate_callback(const merged_iterator &it, get_kv_callback *callback,
-			     void *arg);
+			     void *arg, std::unique_lock<std::mutex> &lock);
+	template <typename F>
+	void iterate_critical(F &&f);
 
 	void bg_work();
+	bool bg_replay();
+	void replay_log(const std::function<void()> &indexed);
+	void replay_indexed();
+	std::vector<const queue_entry *>
+	latest_entries(pmem_queue_type::batch_type batch);
+	producer &local_producer();
 	cache_type::value_type *cache_put_with_evict(string_view key,
-						     const uvalue_type *value);
+						     const uvalue_type *value,
+						     bool optional = false);
 	bool log_contains(const void *entry) const;
 	void handle_oom_from_bg();
-	void consume_queue_entry(pmem::obj::string_view item, bool);
+	void throttle();
+	void wait_for_bg(uint64_t progress);
+	void notify_bg_progress();
+	void record_stall(std::chrono::steady_clock::time_point start);
+	cache_type::value_type *consume_queue_entry(pmem::obj::string_view item, bool);
+	void apply_queue_entry(const queue_entry *e, cache_type::value_type *dram_entry);
 	unique_ptr_type log_read_optimistically(cache_type::value_type *ptr,
-						const uvalue_type *&) const;
+						const uvalue_type *&, size_t &size) const;
 	unique_ptr_type try_read_value(cache_type::value_type *ptr,
-				       const uvalue_type *&value) const;
+				       const uvalue_type *&value, size_t &size) const;
+	status read_value(cache_type::value_type *v, unique_ptr_type &ptr,
+			  size_t &size) const;
 
 	/* Element was logically removed but there might be an older version on pmem. */
 	static const uvalue_type *tombstone_volatile();
@@ -391,7 +846,16 @@ private:
 
 	std::unique_ptr<cache_type> cache;
 	size_t cache_size = 64000000;
+	size_t cache_bytes = 0;
+	internal::radix::cache_policy cache_policy = internal::radix::cache_policy::lru;
 	size_t log_size = 1000000;
+	size_t producers_count = 0;
+	/* in percent of cache_size, 0 disables throttling */
+	size_t high_watermark = 90;
+	size_t low_watermark = 70;
+	/* 0 means number of hardware threads */
+	size_t replay_threads = 0;
+	bool background_replay = false;
 
 	std::atomic<bool> stopped;
 	std::thread bg_thread;
@@ -399,20 +863,113 @@ private:
 	pmem::obj::pool_base pop;
 
 	container_type *container;
-	std::unique_ptr<container_type::ebr::worker> container_worker;
+	std::unique_ptr<internal::radix::ebr_workers> workers;
 
 	pmem_log_type *log;
 	std::unique_ptr<internal::config> config;
-
+	/* filled with counters of the engine on close, owned by the user */
+	internal::config *stats_config = nullptr;
+
+	/*
+	 * Puts which cannot proceed (cache is full of elements which are still in
+	 * the log, the log is full or too many puts are not yet applied) wait on
+	 * eviction_cv. bg_progress is incremented (under eviction_lock) each time
+	 * background thread consumes a batch from the log.
+	 */
 	std::mutex eviction_lock;
 	std::condition_variable eviction_cv;
+	std::atomic<uint64_t> bg_progress;
+	/* number of puts in the log, not yet applied to the radix tree */
+	std::atomic<size_t> log_pending;
+	std::atomic<uint64_t> stalls;
+	std::atomic<uint64_t> stall_ns;
+	std::atomic<uint64_t> max_stall_ns;
+
+	/*
+	 * Serializes modifications of the cache structure (and its iteration).
+	 * Puts of cached keys and cache hits do not take it, it is released
+	 * while callbacks of get_* methods run.
+	 */
+	std::mutex cache_lock;
+	std::mutex put_locks[put_locks_count];
 
 	std::mutex bg_lock;
 	std::condition_variable bg_cv;
 	std::atomic<std::exception_ptr *> bg_exception_ptr;
+	/* state of background replay, protected by bg_lock */
+	bool log_indexed = false;
+	std::exception_ptr replay_exception;
 
 	std::unique_ptr<pmem_queue_type> queue;
-	std::unique_ptr<pmem_queue_type::worker> queue_worker;
+	std::unique_ptr<producer[]> producers;
+};
+
+/**
+ * Concurrent variant of the radix engine, without DRAM cache (enabled with
+ * "concurrent" config parameter).
+ *
+ * Read operations do not take any locks, they are protected by Epoch Based
+ * Reclamation mechanism - each thread which uses the engine gets its own EBR
+ * worker. Writers are serialized by a mutex; a node which is replaced or erased
+ * is freed only after all readers which could have seen it leave their
+ * critical sections (see garbage_collect()).
+ */
+class concurrent_radix
+    : public pmemobj_engine_base<
+	      internal::radix::pmem_type<internal::radix::map_mt_type>> {
+public:
+	concurrent_radix(std::unique_ptr<internal::config> cfg);
+	~concurrent_radix();
+
+	concurrent_radix(const concurrent_radix &) = delete;
+	concurrent_radix &operator=(const concurrent_radix &) = delete;
+
+	std::string name() final;
+
+	status count_all(std::size_t &cnt) final;
+	status count_above(string_view key, std::size_t &cnt) final;
+	status count_equal_above(string_view key, std::size_t &cnt) final;
+	status count_equal_below(string_view key, std::size_t &cnt) final;
+	status count_below(string_view key, std::size_t &cnt) final;
+	status count_between(string_view key1, string_view key2, std::size_t &cnt) final;
+
+	status get_all(get_kv_callback *callback, void *arg) final;
+	status get_above(string_view key, get_kv_callback *callback, void *arg) final;
+	status get_equal_above(string_view key, get_kv_callback *callback,
+			       void *arg) final;
+	status get_equal_below(string_view key, get_kv_callback *callback,
+			       void *arg) final;
+	status get_below(string_view key, get_kv_callback *callback, void *arg) final;
+	status get_between(string_view key1, string_view key2, get_kv_callback *callback,
+			   void *arg) final;
+
+	status exists(string_view key) final;
+
+	status get(string_view key, get_v_callback *callback, void *arg) final;
+
+	status put(string_view key, string_view value) final;
+
+	status remove(string_view key) final;
+
+private:
+	using container_type = internal::radix::map_mt_type;
+	using pmem_type = internal::radix::pmem_type<container_type>;
+
+	/* number of writes after which garbage is collected */
+	static constexpr size_t gc_interval = 1024;
+
+	void collect_garbage();
+
+	template <typename Predicate>
+	status iterate(container_type::iterator first, Predicate &&p,
+		       get_kv_callback *callback, void *arg);
+
+	container_type *container;
+	std::unique_ptr<internal::config> config;
+	std::unique_ptr<internal::radix::ebr_workers> workers;
+
+	std::mutex write_lock;
+	size_t writes_since_gc = 0;
 };
 
 template <>
@@ -469,9 +1026,13 @@ public:
 		check_config_null(get_name(), cfg);
 
 		uint64_t dram_caching;
+		uint64_t concurrent;
 		if (cfg->get_uint64("dram_caching", &dram_caching) && dram_caching) {
 			return std::unique_ptr<engine_base>(
 				new heterogeneous_radix(std::move(cfg)));
+		} else if (cfg->get_uint64("concurrent", &concurrent) && concurrent) {
+			return std::unique_ptr<engine_base>(
+				new concurrent_radix(std::move(cfg)));
 		} else {
 			return std::unique_ptr<engine_base>(new radix(std::move(cfg)));
 		}
@@ -0,0 +1,910 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#ifndef LIBPMEMKV_RADIX_DRAM_INDEX_H
+#define LIBPMEMKV_RADIX_DRAM_INDEX_H
+
+#include "../../libpmemkv.hpp"
+
+#include <libpmemobj++/detail/ebr.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace pmem
+{
+namespace kv
+{
+namespace internal
+{
+namespace radix
+{
+
+/*
+ * Pool of objects of type T. Memory is allocated in chunks of cache line
+ * aligned slots and returned to the system only when the pool is destroyed,
+ * so objects are created without calls to the global allocator and objects
+ * allocated one after another are close to each other.
+ */
+template <typename T>
+class object_pool {
+public:
+	object_pool() = default;
+
+	object_pool(const object_pool &) = delete;
+	object_pool &operator=(const object_pool &) = delete;
+
+	template <typename... Args>
+	T *create(Args &&... args)
+	{
+		if (free_slots.empty())
+			grow();
+
+		auto ptr = new (free_slots.back()) T(std::forward<Args>(args)...);
+		free_slots.pop_back();
+
+		return ptr;
+	}
+
+	void destroy(T *ptr)
+	{
+		ptr->~T();
+		free_slots.push_back(ptr);
+	}
+
+private:
+	static constexpr size_t cacheline_size = 64;
+	static constexpr size_t slot_size =
+		(sizeof(T) + cacheline_size - 1) / cacheline_size * cacheline_size;
+	static constexpr size_t slots_per_chunk = 64;
+
+	void grow()
+	{
+		free_slots.reserve(free_slots.size() + slots_per_chunk);
+		chunks.emplace_back(
+			new char[slots_per_chunk * slot_size + cacheline_size]);
+
+		/* operator new does not respect alignment of T before C++17 */
+		auto addr = reinterpret_cast<uintptr_t>(chunks.back().get());
+		addr = (addr + cacheline_size - 1) & ~(uintptr_t)(cacheline_size - 1);
+
+		/* slots are handed out in the order of their addresses */
+		for (size_t i = slots_per_chunk; i > 0; i--)
+			free_slots.push_back(
+				reinterpret_cast<void *>(addr + (i - 1) * slot_size));
+	}
+
+	std::vector<std::unique_ptr<char[]>> chunks;
+	std::vector<void *> free_slots;
+};
+
+/*
+ * Objects unlinked from volatile structures which are read without locks
+ * (inside critical sections of ebr). They are freed once all readers which
+ * could still access them leave their critical sections. Methods must not be
+ * called concurrently.
+ */
+class ebr_garbage {
+public:
+	using ebr_type = pmem::detail::ebr;
+
+	ebr_garbage(ebr_type &ebr) : ebr(ebr)
+	{
+	}
+
+	~ebr_garbage()
+	{
+		clear();
+	}
+
+	ebr_garbage(const ebr_garbage &) = delete;
+	ebr_garbage &operator=(const ebr_garbage &) = delete;
+
+	/* Schedules call of deleter, it must free the retired object. */
+	void retire(std::function<void()> deleter)
+	{
+		garbage[ebr.staging_epoch()].emplace_back(std::move(deleter));
+
+		if (++retired % collect_interval == 0)
+			collect();
+	}
+
+	/* Frees objects which were retired at least two epochs ago. */
+	void collect()
+	{
+		ebr.sync();
+		free(garbage[ebr.gc_epoch()]);
+	}
+
+	/* Frees all retired objects, must be called when there are no readers. */
+	void clear()
+	{
+		for (auto &objects : garbage)
+			free(objects);
+	}
+
+private:
+	static constexpr size_t epochs_number = 3;
+	static constexpr size_t collect_interval = 64;
+
+	static void free(std::vector<std::function<void()>> &objects)
+	{
+		for (auto &deleter : objects)
+			deleter();
+
+		objects.clear();
+	}
+
+	ebr_type &ebr;
+	std::vector<std::function<void()>> garbage[epochs_number];
+	size_t retired = 0;
+};
+
+/*
+ * Volatile B+-tree which maps keys to entries. Entry must have a `key` member
+ * (std::string) which is not modified while the entry is in the index. The
+ * index only points to entries, it does not own them.
+ *
+ * Nodes are allocated from pools and keep 8-byte prefixes of keys next to the
+ * pointers, so searching a node usually touches only its prefix array and
+ * not the keys themselves.
+ *
+ * Modifications (insert/erase) and iteration must be serialized by the caller.
+ * Lookups (find) do not take any locks and can run concurrently with a
+ * modification: each node has a version which is odd while the node is
+ * modified, readers validate the version after reading a node (and before
+ * descending to its child) and restart if it changed (optimistic lock
+ * coupling). Removed nodes and separators are reclaimed through ebr_garbage,
+ * so lock-free readers must be inside critical section of its ebr.
+ *
+ * Empty nodes are removed from the tree, but nodes are not merged.
+ */
+template <typename Entry>
+class dram_index {
+private:
+	static constexpr size_t capacity = 16;
+
+	struct node {
+		node(bool leaf) : leaf(leaf)
+		{
+			for (auto &p : prefixes)
+				p.store(0, std::memory_order_relaxed);
+		}
+
+		std::atomic<uint64_t> version{0};
+		/* number of entries (in leaf) or separators (in inner node) */
+		std::atomic<uint32_t> count{0};
+		const bool leaf;
+		std::atomic<uint64_t> prefixes[capacity];
+	};
+
+	struct leaf_node : node {
+		leaf_node() : node(true)
+		{
+			for (auto &e : entries)
+				e.store(nullptr, std::memory_order_relaxed);
+		}
+
+		std::atomic<Entry *> entries[capacity];
+
+		/* neighbours, used only for iteration */
+		leaf_node *prev = nullptr;
+		leaf_node *next = nullptr;
+	};
+
+	struct inner_node : node {
+		inner_node() : node(false)
+		{
+			for (auto &s : separators)
+				s.store(nullptr, std::memory_order_relaxed);
+			for (auto &c : children)
+				c.store(nullptr, std::memory_order_relaxed);
+		}
+
+		/* keys in children[i] < separators[i] <= keys in children[i + 1] */
+		std::atomic<const std::string *> separators[capacity];
+		std::atomic<node *> children[capacity + 1];
+	};
+
+	/* prefix of the key and the entry */
+	using entry_slot = std::pair<uint64_t, Entry *>;
+
+	/* inner node and index of its child on the path from root to a leaf */
+	using path_type = std::vector<std::pair<inner_node *, size_t>>;
+
+public:
+	class iterator {
+	public:
+		iterator() = default;
+
+		Entry &operator*() const
+		{
+			return *current;
+		}
+
+		Entry *operator->() const
+		{
+			return current;
+		}
+
+		/* Stays valid (moves to the next key) if the index is modified. */
+		iterator &operator++()
+		{
+			assert(current != nullptr);
+
+			if (index->modifications != modifications)
+				*this = index->upper_bound(key_of(current));
+			else
+				*this = iterator(index, leaf, pos + 1);
+
+			return *this;
+		}
+
+		bool operator==(const iterator &other) const
+		{
+			return current == other.current;
+		}
+
+		bool operator!=(const iterator &other) const
+		{
+			return !(*this == other);
+		}
+
+	private:
+		friend class dram_index;
+
+		iterator(const dram_index *index, leaf_node *leaf, size_t pos)
+		    : index(index),
+		      leaf(leaf),
+		      pos(pos),
+		      modifications(index->modifications)
+		{
+			while (this->leaf && this->pos >= count_of(this->leaf)) {
+				this->leaf = this->leaf->next;
+				this->pos = 0;
+			}
+
+			if (this->leaf)
+				current = this->leaf->entries[this->pos].load(
+					std::memory_order_relaxed);
+		}
+
+		const dram_index *index = nullptr;
+		leaf_node *leaf = nullptr;
+		size_t pos = 0;
+		Entry *current = nullptr;
+		uint64_t modifications = 0;
+	};
+
+	dram_index(ebr_garbage &garbage) : garbage(garbage)
+	{
+		auto leaf = leaves.create();
+		root.store(leaf, std::memory_order_relaxed);
+		first_leaf = leaf;
+	}
+
+	/* Objects retired to garbage must be freed before the index is destroyed. */
+	~dram_index()
+	{
+		destroy(root.load(std::memory_order_relaxed));
+	}
+
+	dram_index(const dram_index &) = delete;
+	dram_index &operator=(const dram_index &) = delete;
+
+	/*
+	 * Returns entry with the key or nullptr. Can be called concurrently with
+	 * modifications, but then it must be called inside critical section.
+	 */
+	Entry *find(string_view key) const
+	{
+		auto p = prefix(key);
+
+		while (true) {
+			Entry *ret;
+			if (try_find(p, key, ret))
+				return ret;
+
+			std::this_thread::yield();
+		}
+	}
+
+	/* Inserts the entry, returns false if its key is already in the index. */
+	bool insert(Entry *e)
+	{
+		auto key = key_of(e);
+		auto p = prefix(key);
+		auto leaf = find_leaf(p, key);
+
+		bool found;
+		auto pos = leaf_lower_bound(leaf, p, key, found);
+		if (found)
+			return false;
+
+		if (count_of(leaf) < capacity) {
+			lock(leaf);
+			insert_at(leaf, pos, p, e);
+			unlock(leaf);
+		} else {
+			split_and_insert(leaf, pos, p, e);
+		}
+
+		modifications++;
+
+		return true;
+	}
+
+	/* Removes the key from the index, returns the removed entry or nullptr. */
+	Entry *erase(string_view key)
+	{
+		auto p = prefix(key);
+		auto leaf = find_leaf(p, key);
+
+		bool found;
+		auto pos = leaf_lower_bound(leaf, p, key, found);
+		if (!found)
+			return nullptr;
+
+		auto e = leaf->entries[pos].load(std::memory_order_relaxed);
+
+		lock(leaf);
+		erase_at(leaf, pos);
+
+		if (count_of(leaf) > 0 || leaf == root.load(std::memory_order_relaxed))
+			unlock(leaf);
+		else
+			remove_empty_leaf(leaf);
+
+		modifications++;
+
+		return e;
+	}
+
+	iterator begin() const
+	{
+		return iterator(this, first_leaf, 0);
+	}
+
+	iterator end() const
+	{
+		return iterator();
+	}
+
+	iterator lower_bound(string_view key) const
+	{
+		auto p = prefix(key);
+		auto leaf = find_leaf(p, key);
+
+		bool found;
+		auto pos = leaf_lower_bound(leaf, p, key, found);
+
+		return iterator(this, leaf, pos);
+	}
+
+	iterator upper_bound(string_view key) const
+	{
+		auto p = prefix(key);
+		auto leaf = find_leaf(p, key);
+
+		bool found;
+		auto pos = leaf_lower_bound(leaf, p, key, found);
+
+		return iterator(this, leaf, found ? pos + 1 : pos);
+	}
+
+private:
+	static string_view key_of(const Entry *e)
+	{
+		return string_view(e->key.data(), e->key.size());
+	}
+
+	static size_t count_of(const node *n)
+	{
+		size_t count = n->count.load(std::memory_order_relaxed);
+
+		/* readers may see a torn count */
+		return count < capacity ? count : capacity;
+	}
+
+	/* First 8 bytes of the key (padded with zeros), in big-endian order. */
+	static uint64_t prefix(string_view key)
+	{
+		unsigned char bytes[sizeof(uint64_t)] = {0};
+		std::memcpy(bytes, key.data(), std::min(key.size(), sizeof(bytes)));
+
+		uint64_t ret = 0;
+		for (auto b : bytes)
+			ret = (ret << 8) | b;
+
+		return ret;
+	}
+
+	/*
+	 * Index of the first entry of the leaf with key not less than key (sets
+	 * found if the keys are equal). Readers may see inconsistent state of
+	 * the node, the result is then discarded after validation.
+	 */
+	static size_t leaf_lower_bound(const leaf_node *n, uint64_t p, string_view key,
+				  bool &found)
+	{
+		found = false;
+
+		auto count = count_of(n);
+		for (size_t i = 0; i < count; i++) {
+			auto slot_prefix = n->prefixes[i].load(std::memory_order_relaxed);
+			if (slot_prefix < p)
+				continue;
+			if (slot_prefix > p)
+				return i;
+
+			auto e = n->entries[i].load(std::memory_order_acquire);
+			if (!e)
+				return i;
+
+			auto cmp = key_of(e).compare(key);
+			if (cmp >= 0) {
+				found = (cmp == 0);
+				return i;
+			}
+		}
+
+		return count;
+	}
+
+	/* Index of the child of an inner node, which may contain key. */
+	static size_t child_index(const inner_node *n, uint64_t p, string_view key)
+	{
+		auto count = count_of(n);
+		for (size_t i = 0; i < count; i++) {
+			auto slot_prefix = n->prefixes[i].load(std::memory_order_relaxed);
+			if (slot_prefix < p)
+				continue;
+			if (slot_prefix > p)
+				return i;
+
+			auto s = n->separators[i].load(std::memory_order_acquire);
+			if (!s || string_view(s->data(), s->size()).compare(key) > 0)
+				return i;
+		}
+
+		return count;
+	}
+
+	static bool validate(const node *n, uint64_t version)
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return n->version.load(std::memory_order_relaxed) == version;
+	}
+
+	/* Returns false if the lookup must be restarted. */
+	bool try_find(uint64_t p, string_view key, Entry *&ret) const
+	{
+		auto rv = root_version.load(std::memory_order_acquire);
+		if (rv & 1)
+			return false;
+
+		const node *n = root.load(std::memory_order_acquire);
+		auto v = n->version.load(std::memory_order_acquire);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (root_version.load(std::memory_order_relaxed) != rv)
+			return false;
+
+		while (!n->leaf) {
+			if (v & 1)
+				return false;
+
+			auto in = static_cast<const inner_node *>(n);
+			const node *child = in->children[child_index(in, p, key)].load(
+				std::memory_order_acquire);
+			if (!child)
+				return false;
+
+			auto child_v = child->version.load(std::memory_order_acquire);
+			if (!validate(n, v))
+				return false;
+
+			n = child;
+			v = child_v;
+		}
+
+		if (v & 1)
+			return false;
+
+		auto leaf = static_cast<const leaf_node *>(n);
+
+		bool found;
+		auto pos = leaf_lower_bound(leaf, p, key, found);
+		ret = nullptr;
+		if (found)
+			ret = leaf->entries[pos].load(std::memory_order_acquire);
+
+		return validate(n, v);
+	}
+
+	/* Used by writers, fills path with inner nodes on the way to the leaf. */
+	leaf_node *find_leaf(uint64_t p, string_view key) const
+	{
+		path.clear();
+
+		auto n = root.load(std::memory_order_relaxed);
+		while (!n->leaf) {
+			auto in = static_cast<inner_node *>(n);
+			auto i = child_index(in, p, key);
+
+			path.emplace_back(in, i);
+			n = in->children[i].load(std::memory_order_relaxed);
+		}
+
+		return static_cast<leaf_node *>(n);
+	}
+
+	static void lock(node *n)
+	{
+		auto v = n->version.load(std::memory_order_relaxed);
+		assert((v & 1) == 0);
+
+		n->version.store(v + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	static void unlock(node *n)
+	{
+		auto v = n->version.load(std::memory_order_relaxed);
+		assert((v & 1) == 1);
+
+		n->version.store(v + 1, std::memory_order_release);
+	}
+
+	/* Copies slot src of the array to slot dst. */
+	template <typename T>
+	static void move_slot(std::atomic<T> *slots, size_t dst, size_t src)
+	{
+		slots[dst].store(slots[src].load(std::memory_order_relaxed),
+				 std::memory_order_release);
+	}
+
+	static void insert_at(leaf_node *n, size_t pos, uint64_t p, Entry *e)
+	{
+		auto count = count_of(n);
+		for (size_t i = count; i > pos; i--) {
+			move_slot(n->prefixes, i, i - 1);
+			move_slot(n->entries, i, i - 1);
+		}
+
+		n->prefixes[pos].store(p, std::memory_order_relaxed);
+		n->entries[pos].store(e, std::memory_order_release);
+		n->count.store(count + 1, std::memory_order_relaxed);
+	}
+
+	static void erase_at(leaf_node *n, size_t pos)
+	{
+		auto count = count_of(n);
+		for (size_t i = pos; i + 1 < count; i++) {
+			move_slot(n->prefixes, i, i + 1);
+			move_slot(n->entries, i, i + 1);
+		}
+
+		n->prefixes[count - 1].store(0, std::memory_order_relaxed);
+		n->entries[count - 1].store(nullptr, std::memory_order_release);
+		n->count.store(count - 1, std::memory_order_relaxed);
+	}
+
+	/* Inserts separator s and child c (on its right side) at pos. */
+	static void insert_at(inner_node *n, size_t pos, const std::string *s, node *c)
+	{
+		auto count = count_of(n);
+		for (size_t i = count; i > pos; i--) {
+			move_slot(n->prefixes, i, i - 1);
+			move_slot(n->separators, i, i - 1);
+			move_slot(n->children, i + 1, i);
+		}
+
+		n->prefixes[pos].store(prefix(*s), std::memory_order_relaxed);
+		n->separators[pos].store(s, std::memory_order_release);
+		n->children[pos + 1].store(c, std::memory_order_release);
+		n->count.store(count + 1, std::memory_order_relaxed);
+	}
+
+	/*
+	 * Removes child at pos and one of the separators next to it. Returns the
+	 * removed separator.
+	 */
+	static const std::string *erase_at(inner_node *n, size_t pos)
+	{
+		auto count = count_of(n);
+		assert(count > 0);
+
+		auto sep = pos > 0 ? pos - 1 : 0;
+		auto ret = n->separators[sep].load(std::memory_order_relaxed);
+
+		for (size_t i = sep; i + 1 < count; i++) {
+			move_slot(n->prefixes, i, i + 1);
+			move_slot(n->separators, i, i + 1);
+		}
+		for (size_t i = pos; i < count; i++)
+			move_slot(n->children, i, i + 1);
+
+		n->prefixes[count - 1].store(0, std::memory_order_relaxed);
+		n->separators[count - 1].store(nullptr, std::memory_order_release);
+		n->children[count].store(nullptr, std::memory_order_release);
+		n->count.store(count - 1, std::memory_order_relaxed);
+
+		return ret;
+	}
+
+	/*
+	 * Splits the full leaf (and its full ancestors). All nodes are allocated
+	 * before any node is modified, so an exception leaves the tree intact.
+	 */
+	void split_and_insert(leaf_node *leaf, size_t pos, uint64_t p, Entry *e)
+	{
+		/* number of inner nodes to split, counting from the bottom of path */
+		size_t inner_splits = 0;
+		while (inner_splits < path.size() &&
+		       count_of(parent_at(inner_splits).first) == capacity)
+			inner_splits++;
+
+		bool new_root = (inner_splits == path.size());
+
+		/* entries of the leaf with the new one, split between two leaves */
+		const size_t left_count = (capacity + 1) / 2;
+		entry_slot items[capacity + 1];
+		for (size_t i = 0, j = 0; i <= capacity; i++) {
+			if (i == pos) {
+				items[i] = {p, e};
+			} else {
+				items[i] = {
+					leaf->prefixes[j].load(std::memory_order_relaxed),
+					leaf->entries[j].load(std::memory_order_relaxed)};
+				j++;
+			}
+		}
+
+		std::unique_ptr<std::string> separator;
+		leaf_node *right_leaf = nullptr;
+		std::vector<inner_node *> new_inners;
+
+		try {
+			separator.reset(new std::string(items[left_count].second->key));
+			right_leaf = leaves.create();
+			new_inners.reserve(inner_splits + 1);
+			for (size_t i = 0; i < inner_splits + (new_root ? 1 : 0); i++)
+				new_inners.push_back(inners.create());
+		} catch (...) {
+			if (right_leaf)
+				leaves.destroy(right_leaf);
+			for (auto n : new_inners)
+				inners.destroy(n);
+			throw;
+		}
+
+		/* nodes which are modified are locked until the whole split is done */
+		lock(leaf);
+		for (size_t i = 0; i < inner_splits; i++)
+			lock(parent_at(i).first);
+		if (new_root)
+			root_version.fetch_add(1, std::memory_order_relaxed);
+		else
+			lock(parent_at(inner_splits).first);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		assign(leaf, items, left_count);
+		assign(right_leaf, items + left_count, capacity + 1 - left_count);
+
+		right_leaf->prev = leaf;
+		right_leaf->next = leaf->next;
+		if (leaf->next)
+			leaf->next->prev = right_leaf;
+		leaf->next = right_leaf;
+
+		/* separator and node to insert into the parent */
+		const std::string *up_separator = separator.release();
+		node *up_node = right_leaf;
+		node *left_node = leaf;
+
+		for (size_t level = 0; level < inner_splits; level++) {
+			auto parent = parent_at(level);
+			split_inner(parent.first, parent.second, up_separator, up_node,
+				    new_inners[level]);
+
+			up_node = new_inners[level];
+			left_node = parent.first;
+		}
+
+		if (new_root) {
+			const std::string *separators[] = {up_separator};
+			node *children[] = {left_node, up_node};
+
+			auto r = new_inners[inner_splits];
+			assign(r, separators, children, 1);
+			root.store(r, std::memory_order_release);
+		} else {
+			auto parent = parent_at(inner_splits);
+			insert_at(parent.first, parent.second, up_separator, up_node);
+			unlock(parent.first);
+		}
+
+		for (size_t i = 0; i < inner_splits; i++)
+			unlock(parent_at(i).first);
+		unlock(leaf);
+		if (new_root)
+			root_version.fetch_add(1, std::memory_order_release);
+	}
+
+	/*
+	 * Inserts separator and child at pos into the full node n, and moves
+	 * upper half of n to right (new node). On return, separator is set to
+	 * the middle separator, which must be inserted into the parent (with
+	 * right as its child).
+	 */
+	void split_inner(inner_node *n, size_t pos, const std::string *&separator,
+			 node *child, inner_node *right)
+	{
+		const std::string *separators[capacity + 1];
+		node *children[capacity + 2];
+
+		for (size_t i = 0, j = 0; i <= capacity; i++) {
+			if (i == pos)
+				separators[i] = separator;
+			else
+				separators[i] = n->separators[j++].load(
+					std::memory_order_relaxed);
+		}
+		for (size_t i = 0, j = 0; i <= capacity + 1; i++) {
+			if (i == pos + 1)
+				children[i] = child;
+			else
+				children[i] =
+					n->children[j++].load(std::memory_order_relaxed);
+		}
+
+		const size_t left_count = capacity / 2;
+
+		assign(n, separators, children, left_count);
+		assign(right, separators + left_count + 1, children + left_count + 1,
+		       capacity - left_count);
+
+		separator = separators[left_count];
+	}
+
+	/* Sets content of the leaf, remaining slots are cleared. */
+	static void assign(leaf_node *n, const entry_slot *items, size_t count)
+	{
+		for (size_t i = 0; i < capacity; i++) {
+			auto item = i < count ? items[i] : entry_slot(0, nullptr);
+			n->prefixes[i].store(item.first, std::memory_order_relaxed);
+			n->entries[i].store(item.second, std::memory_order_release);
+		}
+
+		n->count.store(count, std::memory_order_relaxed);
+	}
+
+	/* Sets content of the inner node, remaining slots are cleared. */
+	static void assign(inner_node *n, const std::string *const *separators,
+			   node *const *children, size_t count)
+	{
+		for (size_t i = 0; i < capacity; i++) {
+			auto s = i < count ? separators[i] : nullptr;
+			n->prefixes[i].store(s ? prefix(*s) : 0,
+					     std::memory_order_relaxed);
+			n->separators[i].store(s, std::memory_order_release);
+		}
+		for (size_t i = 0; i <= capacity; i++)
+			n->children[i].store(i <= count ? children[i] : nullptr,
+					     std::memory_order_release);
+
+		n->count.store(count, std::memory_order_relaxed);
+	}
+
+	/* Parent of the leaf found by find_leaf (level 0) or of its ancestor. */
+	std::pair<inner_node *, size_t> parent_at(size_t level) const
+	{
+		return path[path.size() - 1 - level];
+	}
+
+	/* Removes the (empty and locked) leaf and ancestors which become empty. */
+	void remove_empty_leaf(leaf_node *leaf)
+	{
+		if (leaf->prev)
+			leaf->prev->next = leaf->next;
+		else
+			first_leaf = leaf->next;
+		if (leaf->next)
+			leaf->next->prev = leaf->prev;
+
+		/* removed nodes stay locked, so readers which reach them restart */
+		retire(leaf);
+
+		for (size_t level = path.size(); level > 0; level--) {
+			auto parent = path[level - 1];
+			lock(parent.first);
+
+			if (count_of(parent.first) == 0) {
+				/* leaf was the only child */
+				retire(parent.first);
+				continue;
+			}
+
+			auto separator = erase_at(parent.first, parent.second);
+			garbage.retire([separator] { delete separator; });
+			unlock(parent.first);
+
+			break;
+		}
+
+		/* root has at least two children, so only root can have just one */
+		auto r = root.load(std::memory_order_relaxed);
+		while (!r->leaf && count_of(r) == 0) {
+			auto in = static_cast<inner_node *>(r);
+
+			root_version.fetch_add(1, std::memory_order_relaxed);
+			lock(in);
+			std::atomic_thread_fence(std::memory_order_release);
+
+			r = in->children[0].load(std::memory_order_relaxed);
+			root.store(r, std::memory_order_release);
+			retire(in);
+
+			root_version.fetch_add(1, std::memory_order_release);
+		}
+	}
+
+	void retire(leaf_node *n)
+	{
+		garbage.retire([this, n] { leaves.destroy(n); });
+	}
+
+	void retire(inner_node *n)
+	{
+		garbage.retire([this, n] { inners.destroy(n); });
+	}
+
+	void destroy(node *n)
+	{
+		if (n->leaf) {
+			leaves.destroy(static_cast<leaf_node *>(n));
+			return;
+		}
+
+		auto in = static_cast<inner_node *>(n);
+		for (size_t i = 0; i <= count_of(in); i++)
+			destroy(in->children[i].load(std::memory_order_relaxed));
+		for (size_t i = 0; i < count_of(in); i++)
+			delete in->separators[i].load(std::memory_order_relaxed);
+
+		inners.destroy(in);
+	}
+
+	ebr_garbage &garbage;
+
+	object_pool<leaf_node> leaves;
+	object_pool<inner_node> inners;
+
+	std::atomic<node *> root;
+	/* odd while root is replaced */
+	std::atomic<uint64_t> root_version{0};
+
+	leaf_node *first_leaf;
+	/* incremented on every modification, used to revalidate iterators */
+	uint64_t modifications = 0;
+	/* reused by writers */
+	mutable path_type path;
+};
+
+} /* namespace radix */
+} /* namespace internal */
+} /* namespace kv */
+} /* namespace pmem */
+
+#endif /* LIBPMEMKV_RADIX_DRAM_INDEX_H */
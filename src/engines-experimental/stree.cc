@@ -7,9 +7,14 @@
 #include <libpmemobj++/make_persistent_atomic.hpp>
 #include <libpmemobj++/transaction.hpp>
 
+#include "../exceptions.h"
 #include "../out.h"
+#include "../valgrind/drd.h"
 #include "stree.h"
 
+#include <algorithm>
+#include <thread>
+
 using pmem::detail::conditional_add_to_tx;
 using pmem::obj::make_persistent_atomic;
 using pmem::obj::transaction;
@@ -18,6 +23,133 @@ namespace pmem
 {
 namespace kv
 {
+namespace internal
+{
+namespace stree
+{
+
+static std::atomic<size_t> global_mutex_next_shard(0);
+
+global_mutex::shard &global_mutex::local()
+{
+	thread_local size_t index = global_mutex_next_shard++;
+
+	return shards[index % shards_count];
+}
+
+/*
+ * A reader announces itself first and checks for a writer afterwards, while a
+ * writer announces itself first and waits for readers afterwards (both with
+ * sequentially consistent operations), so at least one of them always sees
+ * the other.
+ */
+void global_mutex::lock_shared()
+{
+	shard &s = local();
+	while (true) {
+		s.readers.fetch_add(1);
+		if (!writer.load())
+			break;
+
+		s.readers.fetch_sub(1);
+		while (writer.load(std::memory_order_relaxed))
+			std::this_thread::yield();
+	}
+	ANNOTATE_HAPPENS_AFTER(&writer);
+}
+
+void global_mutex::unlock_shared()
+{
+	shard &s = local();
+	ANNOTATE_HAPPENS_BEFORE(&s.readers);
+	s.readers.fetch_sub(1, std::memory_order_release);
+}
+
+void global_mutex::lock()
+{
+	writer_mtx.lock();
+	writer.store(true);
+	for (auto &s : shards) {
+		while (s.readers.load() != 0)
+			std::this_thread::yield();
+		ANNOTATE_HAPPENS_AFTER(&s.readers);
+	}
+}
+
+void global_mutex::unlock()
+{
+	ANNOTATE_HAPPENS_BEFORE(&writer);
+	writer.store(false);
+	writer_mtx.unlock();
+}
+
+transaction::transaction(pmem::obj::pool_base &pop, btree_type *tree, global_mutex &mtx)
+    : pop(pop), tree(tree), mtx(mtx)
+{
+}
+
+status transaction::put(string_view key, string_view value)
+{
+	log.insert(key, value);
+	return status::OK;
+}
+
+status transaction::remove(string_view key)
+{
+	log.remove(key);
+	return status::OK;
+}
+
+status transaction::get(string_view key, get_v_callback *callback, void *arg)
+{
+	string_view value;
+	auto pending = log.find(key, value);
+	if (pending == dram_log::lookup_result::removed)
+		return status::NOT_FOUND;
+
+	if (pending == dram_log::lookup_result::not_found) {
+		shared_global_lock lock(mtx);
+		if (!tree->concurrent_get(key, [&](string_view v) {
+			    callback(v.data(), v.size(), arg);
+		    }))
+			return status::NOT_FOUND;
+
+		return status::OK;
+	}
+
+	callback(value.data(), value.size(), arg);
+	return status::OK;
+}
+
+/* All operations are applied in a single pmemobj transaction. */
+status transaction::commit()
+{
+	auto insert_cb = [&](const dram_log::element_type &e) {
+		auto value = string_view(e.second);
+		auto result = tree->try_emplace(string_view(e.first), value);
+		if (!result.second)
+			result.first->second = value;
+	};
+
+	auto remove_cb = [&](const dram_log::element_type &e) {
+		tree->erase(string_view(e.first));
+	};
+
+	std::unique_lock<global_mutex> lock(mtx);
+	pmem::obj::transaction::run(pop, [&] { log.foreach (insert_cb, remove_cb); });
+
+	log.clear();
+
+	return status::OK;
+}
+
+void transaction::abort()
+{
+	log.clear();
+}
+
+} /* namespace stree */
+} /* namespace internal */
 
 stree::stree(std::unique_ptr<internal::config> cfg)
     : pmemobj_engine_base(cfg, "pmemkv_stree"), config(std::move(cfg))
@@ -28,6 +160,7 @@ stree::stree(std::unique_ptr<internal::config> cfg)
 
 stree::~stree()
 {
+	my_btree.reset();
 	LOG("Stopped ok");
 }
 
@@ -46,25 +179,14 @@ status stree::count_all(std::size_t &cnt)
 	return status::OK;
 }
 
-template <typename It>
-static std::size_t size(It first, It last)
-{
-	auto dist = std::distance(first, last);
-	assert(dist >= 0);
-
-	return static_cast<std::size_t>(dist);
-}
-
 /* above key, key exclusive */
 status stree::count_above(string_view key, std::size_t &cnt)
 {
 	LOG("count_above key>=" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
-	auto first = my_btree->upper_bound(key);
-	auto last = my_btree->end();
-
-	cnt = size(first, last);
+	internal::stree::shared_global_lock lock(mtx);
+	cnt = my_btree->concurrent_count<string_view>(&key, false, nullptr, false);
 
 	return status::OK;
 }
@@ -75,10 +197,8 @@ status stree::count_equal_above(string_view key, std::size_t &cnt)
 	LOG("count_equal_above key>=" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
-	auto first = my_btree->lower_bound(key);
-	auto last = my_btree->end();
-
-	cnt = size(first, last);
+	internal::stree::shared_global_lock lock(mtx);
+	cnt = my_btree->concurrent_count<string_view>(&key, true, nullptr, false);
 
 	return status::OK;
 }
@@ -89,10 +209,8 @@ status stree::count_below(string_view key, std::size_t &cnt)
 	LOG("count_below key<" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
-	auto first = my_btree->begin();
-	auto last = my_btree->lower_bound(key);
-
-	cnt = size(first, last);
+	internal::stree::shared_global_lock lock(mtx);
+	cnt = my_btree->concurrent_count<string_view>(nullptr, false, &key, false);
 
 	return status::OK;
 }
@@ -103,10 +221,8 @@ status stree::count_equal_below(string_view key, std::size_t &cnt)
 	LOG("count_equal_below key>=" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
-	auto first = my_btree->begin();
-	auto last = my_btree->upper_bound(key);
-
-	cnt = size(first, last);
+	internal::stree::shared_global_lock lock(mtx);
+	cnt = my_btree->concurrent_count<string_view>(nullptr, false, &key, true);
 
 	return status::OK;
 }
@@ -118,10 +234,8 @@ status stree::count_between(string_view key1, string_view key2, std::size_t &cnt
 	check_outside_tx();
 
 	if (my_btree->key_comp()(key1, key2)) {
-		auto first = my_btree->upper_bound(key1);
-		auto last = my_btree->lower_bound(key2);
-
-		cnt = size(first, last);
+		internal::stree::shared_global_lock lock(mtx);
+		cnt = my_btree->concurrent_count(&key1, false, &key2, false);
 	} else {
 		cnt = 0;
 	}
@@ -129,15 +243,31 @@ status stree::count_between(string_view key1, string_view key2, std::size_t &cnt
 	return status::OK;
 }
 
+/*
+ * Calls callback for every element between first and last (nullptr means no
+ * bound, see b_tree::concurrent_scan).
+ */
+static status scan(internal::stree::btree_type *tree, const string_view *first,
+		   bool first_inclusive, const string_view *last, bool last_inclusive,
+		   get_kv_callback *callback, void *arg)
+{
+	auto completed = tree->concurrent_scan(
+		first, first_inclusive, last, last_inclusive,
+		[&](string_view key, string_view value) {
+			return callback(key.data(), key.size(), value.data(),
+					value.size(), arg) == 0;
+		});
+
+	return completed ? status::OK : status::STOPPED_BY_CB;
+}
+
 status stree::get_all(get_kv_callback *callback, void *arg)
 {
 	LOG("get_all");
 	check_outside_tx();
 
-	auto first = my_btree->begin();
-	auto last = my_btree->end();
-
-	return internal::iterate_through_pairs(first, last, callback, arg);
+	internal::stree::shared_global_lock lock(mtx);
+	return scan(my_btree.get(), nullptr, false, nullptr, false, callback, arg);
 }
 
 /* (key, end), above key */
@@ -146,10 +276,8 @@ status stree::get_above(string_view key, get_kv_callback *callback, void *arg)
 	LOG("get_above start key>=" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
-	auto first = my_btree->upper_bound(key);
-	auto last = my_btree->end();
-
-	return internal::iterate_through_pairs(first, last, callback, arg);
+	internal::stree::shared_global_lock lock(mtx);
+	return scan(my_btree.get(), &key, false, nullptr, false, callback, arg);
 }
 
 /* [key, end), above or equal to key */
@@ -158,10 +286,8 @@ status stree::get_equal_above(string_view key, get_kv_callback *callback, void *
 	LOG("get_equal_above start key>=" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
-	auto first = my_btree->lower_bound(key);
-	auto last = my_btree->end();
-
-	return internal::iterate_through_pairs(first, last, callback, arg);
+	internal::stree::shared_global_lock lock(mtx);
+	return scan(my_btree.get(), &key, true, nullptr, false, callback, arg);
 }
 
 /* [start, key], below or equal to key */
@@ -170,10 +296,8 @@ status stree::get_equal_below(string_view key, get_kv_callback *callback, void *
 	LOG("get_equal_below start key>=" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
-	auto first = my_btree->begin();
-	auto last = my_btree->upper_bound(key);
-
-	return internal::iterate_through_pairs(first, last, callback, arg);
+	internal::stree::shared_global_lock lock(mtx);
+	return scan(my_btree.get(), nullptr, false, &key, true, callback, arg);
 }
 
 /* [start, key), less than key, key exclusive */
@@ -182,10 +306,8 @@ status stree::get_below(string_view key, get_kv_callback *callback, void *arg)
 	LOG("get_below key<" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
-	auto first = my_btree->begin();
-	auto last = my_btree->lower_bound(key);
-
-	return internal::iterate_through_pairs(first, last, callback, arg);
+	internal::stree::shared_global_lock lock(mtx);
+	return scan(my_btree.get(), nullptr, false, &key, false, callback, arg);
 }
 
 /* get between (key1, key2), key1 exclusive, key2 exclusive */
@@ -197,10 +319,8 @@ status stree::get_between(string_view key1, string_view key2, get_kv_callback *c
 	check_outside_tx();
 
 	if (my_btree->key_comp()(key1, key2)) {
-		auto first = my_btree->upper_bound(key1);
-		auto last = my_btree->lower_bound(key2);
-
-		return internal::iterate_through_pairs(first, last, callback, arg);
+		internal::stree::shared_global_lock lock(mtx);
+		return scan(my_btree.get(), &key1, false, &key2, false, callback, arg);
 	}
 
 	return status::OK;
@@ -211,8 +331,8 @@ status stree::exists(string_view key)
 	LOG("exists for key=" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
-	internal::stree::btree_type::iterator it = my_btree->find(key);
-	if (it == my_btree->end()) {
+	internal::stree::shared_global_lock lock(mtx);
+	if (!my_btree->concurrent_find(key, nullptr)) {
 		LOG("  key not found");
 		return status::NOT_FOUND;
 	}
@@ -224,13 +344,14 @@ status stree::get(string_view key, get_v_callback *callback, void *arg)
 	LOG("get using callback for key=" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
-	internal::stree::btree_type::iterator it = my_btree->find(key);
-	if (it == my_btree->end()) {
+	internal::stree::shared_global_lock lock(mtx);
+	if (!my_btree->concurrent_get(key, [&](string_view value) {
+		    callback(value.data(), value.size(), arg);
+	    })) {
 		LOG("  key not found");
 		return status::NOT_FOUND;
 	}
 
-	callback(it->second.c_str(), it->second.size(), arg);
 	return status::OK;
 }
 
@@ -240,13 +361,9 @@ status stree::put(string_view key, string_view value)
 		       << ", value.size=" << std::to_string(value.size()));
 	check_outside_tx();
 
-	auto result = my_btree->try_emplace(key, value);
-	if (!result.second) { // key already exists, so update
-		typename internal::stree::btree_type::value_type &entry = *result.first;
-		transaction::manual tx(pmpool);
-		entry.second = value;
-		transaction::commit();
-	}
+	internal::stree::shared_global_lock lock(mtx);
+	my_btree->concurrent_insert_or_assign(key, value);
+
 	return status::OK;
 }
 
@@ -255,38 +372,314 @@ status stree::remove(string_view key)
 	LOG("remove key=" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
+	using erase_result = internal::stree::btree_type::erase_result;
+	{
+		internal::stree::shared_global_lock lock(mtx);
+		auto result = my_btree->concurrent_erase(key);
+		if (result != erase_result::exclusive_required)
+			return (result == erase_result::erased) ? status::OK
+								 : status::NOT_FOUND;
+	}
+
+	/* erase may rebalance the tree and free nodes */
+	std::unique_lock<internal::stree::global_mutex> lock(mtx);
 	auto result = my_btree->erase(key);
 	return (result == 1) ? status::OK : status::NOT_FOUND;
 }
 
+/*
+ * Batch operations process keys in sorted order, so that consecutive keys
+ * mostly land in the same (already cached) leaf. multi_get additionally
+ * interleaves the lookups (see b_tree::multi_find), so that cache misses of
+ * different keys overlap. Writes of the whole batch are done in a single
+ * pmemobj transaction, which makes them atomic (and exclusive: other operations
+ * must not see a partially applied batch).
+ */
+status stree::multi_get(const std::vector<string_view> &keys, get_kv_callback *callback,
+			void *arg)
+{
+	LOG("multi_get for " << keys.size() << " keys");
+	check_outside_tx();
+
+	std::vector<string_view> sorted_keys;
+	sorted_keys.reserve(keys.size());
+	for (auto i : internal::sorted_positions(keys, my_btree->key_comp()))
+		sorted_keys.push_back(keys[i]);
+
+	status ret = status::OK;
+	internal::stree::shared_global_lock lock(mtx);
+	auto completed = my_btree->multi_find(
+		sorted_keys.begin(), sorted_keys.end(),
+		[&](string_view key, const std::string *value) {
+			if (value == nullptr) {
+				ret = status::NOT_FOUND;
+				return true;
+			}
+
+			return callback(key.data(), key.size(), value->data(),
+					value->size(), arg) == 0;
+		});
+
+	return completed ? ret : status::STOPPED_BY_CB;
+}
+
+status stree::multi_put(const std::vector<string_view> &keys,
+			const std::vector<string_view> &values)
+{
+	LOG("multi_put for " << keys.size() << " keys");
+	check_outside_tx();
+
+	assert(keys.size() == values.size());
+
+	auto order = internal::sorted_positions(keys, my_btree->key_comp());
+
+	std::unique_lock<internal::stree::global_mutex> lock(mtx);
+	transaction::run(pmpool, [&] {
+		for (auto i : order) {
+			auto result = my_btree->try_emplace(keys[i], values[i]);
+			if (!result.second)
+				result.first->second = values[i];
+		}
+	});
+
+	return status::OK;
+}
+
+status stree::multi_remove(const std::vector<string_view> &keys)
+{
+	LOG("multi_remove for " << keys.size() << " keys");
+	check_outside_tx();
+
+	auto order = internal::sorted_positions(keys, my_btree->key_comp());
+
+	status ret = status::OK;
+	std::unique_lock<internal::stree::global_mutex> lock(mtx);
+	transaction::run(pmpool, [&] {
+		for (auto i : order) {
+			if (my_btree->erase(keys[i]) == 0)
+				ret = status::NOT_FOUND;
+		}
+	});
+
+	return ret;
+}
+
+/*
+ * Sorted keys which are greater than all keys in the tree are appended to its
+ * leafs directly (see b_tree_base::append), other batches are simply put.
+ */
+status stree::bulk_load(const std::vector<string_view> &keys,
+			const std::vector<string_view> &values)
+{
+	LOG("bulk_load for " << keys.size() << " keys");
+	check_outside_tx();
+
+	assert(keys.size() == values.size());
+
+	if (internal::strictly_sorted(keys, my_btree->key_comp())) {
+		std::vector<std::pair<string_view, string_view>> elements;
+		elements.reserve(keys.size());
+		for (size_t i = 0; i < keys.size(); i++)
+			elements.emplace_back(keys[i], values[i]);
+
+		std::unique_lock<internal::stree::global_mutex> lock(mtx);
+		if (my_btree->append(elements.begin(), elements.end(),
+				     bulk_load_leaf_size))
+			return status::OK;
+	}
+
+	return multi_put(keys, values);
+}
+
+internal::transaction *stree::begin_tx()
+{
+	return new internal::stree::transaction(pmpool, my_btree.get(), mtx);
+}
+
 void stree::Recover()
 {
+	std::size_t compression;
+	bool prefix_compression =
+		config->get_uint64("prefix_compression", &compression) &&
+		compression != 0;
+
+	/* suffixes of keys with a common prefix compare as the whole keys */
+	if (prefix_compression &&
+	    internal::extract_comparator(*config) != &internal::binary_comparator())
+		throw internal::invalid_argument(
+			"prefix_compression requires the default comparator");
+
+	internal::stree::pmem_type *pmem_ptr;
 	if (!OID_IS_NULL(*root_oid)) {
-		my_btree = (internal::stree::btree_type *)pmemobj_direct(*root_oid);
-		my_btree->key_comp().runtime_initialize(
+		pmem_ptr = static_cast<internal::stree::pmem_type *>(
+			pmemobj_direct(*root_oid));
+
+		/* the legacy tree stays attached until its elements are moved */
+		if (pmem_ptr->version == 0) {
+			/* throws before anything is changed if comparators differ */
+			auto legacy_ptr =
+				static_cast<internal::stree::legacy::pmem_type *>(
+					pmemobj_direct(*root_oid));
+			legacy_ptr->compare.runtime_initialize(
+				internal::extract_comparator(*config));
+
+			pmem::obj::transaction::run(pmpool, [&] {
+				auto legacy = *root_oid;
+				pmem::obj::transaction::snapshot(root_oid);
+				*root_oid = pmem::obj::make_persistent<
+						    internal::stree::pmem_type>(
+						    prefix_compression)
+						    .raw();
+				pmem_ptr = static_cast<internal::stree::pmem_type *>(
+					pmemobj_direct(*root_oid));
+				pmem_ptr->compare.initialize(
+					internal::extract_comparator(*config));
+				pmem_ptr->legacy = legacy;
+			});
+		}
+
+		if (pmem_ptr->version != internal::stree::btree_type::layout_version)
+			throw internal::not_supported(
+				"Unsupported stree layout version: " +
+				std::to_string(pmem_ptr->version));
+
+		pmem_ptr->compare.runtime_initialize(
 			internal::extract_comparator(*config));
 	} else {
 		pmem::obj::transaction::run(pmpool, [&] {
 			pmem::obj::transaction::snapshot(root_oid);
 			*root_oid =
-				pmem::obj::make_persistent<internal::stree::btree_type>()
+				pmem::obj::make_persistent<internal::stree::pmem_type>(
+					prefix_compression)
 					.raw();
-			my_btree =
-				(internal::stree::btree_type *)pmemobj_direct(*root_oid);
-			my_btree->key_comp().initialize(
+			pmem_ptr = static_cast<internal::stree::pmem_type *>(
+				pmemobj_direct(*root_oid));
+			pmem_ptr->compare.initialize(
 				internal::extract_comparator(*config));
 		});
 	}
+
+	std::size_t rebuild_threads;
+	if (!config->get_uint64("rebuild_threads", &rebuild_threads) ||
+	    rebuild_threads == 0)
+		rebuild_threads = std::thread::hardware_concurrency();
+
+	std::size_t bulk_load_fill;
+	if (!config->get_uint64("bulk_load_fill", &bulk_load_fill) || bulk_load_fill == 0)
+		bulk_load_fill = 100;
+	if (bulk_load_fill > 100)
+		throw internal::invalid_argument(
+			"bulk_load_fill must be a percentage, between 1 and 100");
+	bulk_load_leaf_size = std::max<std::size_t>(
+		(internal::stree::DEGREE - 1) * bulk_load_fill / 100, 1);
+
+	/* fingerprints of keys can be used only if equal keys have equal bytes */
+	my_btree.reset(new internal::stree::btree_type(
+		pmem_ptr,
+		internal::extract_comparator(*config) == &internal::binary_comparator(),
+		rebuild_threads));
+
+	/* finish (possibly interrupted) upgrade of the legacy tree */
+	if (!OID_IS_NULL(pmem_ptr->legacy))
+		upgrade_legacy_tree(pmem_ptr);
+}
+
+/*
+ * Moves all elements of a tree of layout version 0 into my_btree and frees the
+ * legacy tree. Elements are put one by one, outside of a transaction, while the
+ * legacy tree stays attached to the root. If the process is interrupted, the copy
+ * is simply repeated on the next open. Then, in a single transaction, inner nodes
+ * of the legacy tree are freed and its leftmost leaf is attached instead. Leafs
+ * are freed in batches, each transaction attaches the first leaf which is left.
+ */
+void stree::upgrade_legacy_tree(internal::stree::pmem_type *pmem_ptr)
+{
+	namespace legacy = internal::stree::legacy;
+	using internal::stree::key_type;
+	using internal::stree::value_type;
+
+	if (!pmem_ptr->legacy_leafs) {
+		LOG("Upgrading layout of the legacy tree");
+
+		auto legacy_ptr = static_cast<legacy::pmem_type *>(
+			pmemobj_direct(pmem_ptr->legacy));
+
+		/* inner nodes are collected top down, the leftmost leaf is found */
+		std::vector<legacy::inner_type *> inner_nodes;
+		legacy::node_t *node = legacy_ptr->root.get();
+		while (node->level != 0) {
+			inner_nodes.push_back(static_cast<legacy::inner_type *>(node));
+			node = inner_nodes.back()->children[0].get();
+		}
+		auto leftmost = static_cast<legacy::leaf_type *>(node);
+		for (std::size_t i = 0; i < inner_nodes.size(); ++i) {
+			auto inner = inner_nodes[i];
+			if (inner->level == 1)
+				continue;
+			for (std::size_t j = 1; j <= inner->size; ++j)
+				inner_nodes.push_back(static_cast<legacy::inner_type *>(
+					inner->children[j].get()));
+		}
+
+		for (auto leaf = leftmost; leaf; leaf = leaf->next.get()) {
+			for (std::size_t i = 0; i < leaf->size; ++i) {
+				auto &e = leaf->entries[leaf->idxs[i]];
+				my_btree->concurrent_insert_or_assign(
+					string_view(e.first.c_str(), e.first.size()),
+					string_view(e.second.c_str(), e.second.size()));
+			}
+		}
+
+		pmem::obj::transaction::run(pmpool, [&] {
+			for (auto inner : inner_nodes) {
+				for (std::size_t i = 0; i < inner->size; ++i)
+					pmem::obj::delete_persistent<key_type>(
+						inner->entries[i]);
+				pmem::obj::delete_persistent<legacy::inner_type>(
+					pmemobj_oid(inner));
+			}
+			pmem::obj::delete_persistent<legacy::pmem_type>(pmem_ptr->legacy);
+
+			pmem::obj::transaction::snapshot(&pmem_ptr->legacy);
+			pmem_ptr->legacy = pmemobj_oid(leftmost);
+			pmem_ptr->legacy_leafs = 1;
+		});
+	}
+
+	while (!OID_IS_NULL(pmem_ptr->legacy)) {
+		pmem::obj::transaction::run(pmpool, [&] {
+			pmem::obj::transaction::snapshot(&pmem_ptr->legacy);
+			for (std::size_t n = 0; n < upgrade_leafs_per_tx &&
+			     !OID_IS_NULL(pmem_ptr->legacy);
+			     ++n) {
+				auto leaf = static_cast<legacy::leaf_type *>(
+					pmemobj_direct(pmem_ptr->legacy));
+				for (std::size_t i = 0; i < leaf->size; ++i) {
+					auto &e = leaf->entries[leaf->idxs[i]];
+					e.first.~key_type();
+					e.second.~value_type();
+				}
+
+				auto next = leaf->next.raw();
+				pmem::obj::delete_persistent<legacy::leaf_type>(
+					pmem_ptr->legacy);
+				pmem_ptr->legacy = next;
+			}
+
+			if (OID_IS_NULL(pmem_ptr->legacy))
+				pmem_ptr->legacy_leafs = 0;
+		});
+	}
 }
 
 internal::iterator_base *stree::new_iterator()
 {
-	return new stree_iterator<false>{my_btree};
+	return new stree_iterator<false>{my_btree.get()};
 }
 
 internal::iterator_base *stree::new_const_iterator()
 {
-	return new stree_iterator<true>{my_btree};
+	return new stree_iterator<true>{my_btree.get()};
 }
 
 stree::stree_iterator<true>::stree_iterator(container_type *c)
@@ -422,7 +815,7 @@ result<string_view> stree::stree_iterator<true>::key()
 {
 	assert(it_ != container->end());
 
-	return string_view(it_->first.cdata(), it_->first.length());
+	return it_.key(key_buffer);
 }
 
 result<pmem::obj::slice<const char *>> stree::stree_iterator<true>::read_range(size_t pos,
@@ -452,6 +845,11 @@ result<pmem::obj::slice<char *>> stree::stree_iterator<false>::write_range(size_
 
 status stree::stree_iterator<false>::commit()
 {
+	if (log.empty())
+		return status::OK;
+
+	/* concurrent (optimistic) readers of the leaf see the change atomically */
+	std::lock_guard<internal::version_lock> lock(it_.node()->mtx);
 	pmem::obj::transaction::run(pop, [&] {
 		for (auto &p : log) {
 			auto dest = it_->second.range(p.second, p.first.size());
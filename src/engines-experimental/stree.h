@@ -13,6 +13,10 @@
 #include "../pmemobj_engine.h"
 #include "stree/persistent_b_tree.h"
 
+#include <atomic>
+#include <mutex>
+#include <string>
+
 using pmem::obj::persistent_ptr;
 using pmem::obj::pool;
 
@@ -36,11 +40,122 @@ using string_t = pmem::obj::string;
 using key_type = string_t;
 using value_type = string_t;
 using btree_type = b_tree<key_type, value_type, internal::pmemobj_compare, DEGREE>;
+using pmem_type = btree_type::pmem_type;
+
+/*
+ * Nodes and root of pools with layout version 0, which kept inner nodes in
+ * persistent memory too. They are only read and freed, when such a pool is
+ * upgraded (see stree::upgrade_legacy_tree).
+ */
+namespace legacy
+{
+
+struct node_t {
+	uint64_t level;
+};
+
+struct leaf_type : node_t {
+	/* valid entries are destroyed explicitly */
+	~leaf_type()
+	{
+	}
+
+	union {
+		std::pair<key_type, value_type> entries[DEGREE - 1];
+	};
+	/* slots of entries in sorted order, the first size of them are valid */
+	std::ptrdiff_t idxs[DEGREE - 1];
+	pmem::obj::p<std::size_t> size;
+	persistent_ptr<leaf_type> prev;
+	persistent_ptr<leaf_type> next;
+};
+
+struct inner_type : node_t {
+	persistent_ptr<key_type> entries[DEGREE - 1];
+	persistent_ptr<node_t> children[DEGREE];
+	pmem::obj::p<std::size_t> size;
+};
+
+struct pmem_type {
+	persistent_ptr<node_t> root;
+	persistent_ptr<node_t> unused[3];
+	internal::pmemobj_compare compare;
+	pmem::obj::p<std::size_t> size;
+};
+
+} /* namespace legacy */
+
+/*
+ * Readers-writer lock of the whole tree. Most operations run concurrently on
+ * the tree (see b_tree::concurrent_find) and take it in shared mode, only the
+ * ones which may free nodes (erase with rebalancing, batch writes and commits
+ * of transactions) take it exclusively. Readers are counted per shard (threads
+ * are assigned to shards round-robin), so shared locking from different threads
+ * does not write to the same cache line.
+ */
+class global_mutex {
+public:
+	void lock_shared();
+	void unlock_shared();
+
+	void lock();
+	void unlock();
+
+private:
+	static constexpr size_t shards_count = 16;
+
+	struct shard {
+		std::atomic<uint64_t> readers{0};
+		char padding[56];
+	};
+
+	shard &local();
+
+	shard shards[shards_count];
+	std::atomic<bool> writer{false};
+	std::mutex writer_mtx;
+};
+
+/* std::shared_lock is not available in C++11 */
+class shared_global_lock {
+public:
+	shared_global_lock(global_mutex &mtx) : mtx(mtx)
+	{
+		mtx.lock_shared();
+	}
+
+	~shared_global_lock()
+	{
+		mtx.unlock_shared();
+	}
+
+	shared_global_lock(const shared_global_lock &) = delete;
+	shared_global_lock &operator=(const shared_global_lock &) = delete;
+
+private:
+	global_mutex &mtx;
+};
+
+class transaction : public ::pmem::kv::internal::transaction {
+public:
+	transaction(pmem::obj::pool_base &pop, btree_type *tree, global_mutex &mtx);
+	status put(string_view key, string_view value) final;
+	status remove(string_view key) final;
+	status get(string_view key, get_v_callback *callback, void *arg) final;
+	status commit() final;
+	void abort() final;
+
+private:
+	pmem::obj::pool_base &pop;
+	dram_log log;
+	btree_type *tree;
+	global_mutex &mtx;
+};
 
 } /* namespace stree */
 } /* namespace internal */
 
-class stree : public pmemobj_engine_base<internal::stree::btree_type> {
+class stree : public pmemobj_engine_base<internal::stree::pmem_type> {
 private:
 	using container_type = internal::stree::btree_type;
 	using container_iterator = typename container_type::iterator;
@@ -75,15 +190,32 @@ public:
 	status put(string_view key, string_view value) final;
 	status remove(string_view key) final;
 
+	status multi_get(const std::vector<string_view> &keys, get_kv_callback *callback,
+			 void *arg) final;
+	status multi_put(const std::vector<string_view> &keys,
+			 const std::vector<string_view> &values) final;
+	status multi_remove(const std::vector<string_view> &keys) final;
+	status bulk_load(const std::vector<string_view> &keys,
+			 const std::vector<string_view> &values) final;
+
+	internal::transaction *begin_tx() final;
+
 	internal::iterator_base *new_iterator() final;
 	internal::iterator_base *new_const_iterator() final;
 
 private:
+	/* maximal number of legacy leafs freed by each transaction of an upgrade */
+	static constexpr std::size_t upgrade_leafs_per_tx = 64;
+
 	stree(const stree &);
 	void operator=(const stree &);
 	void Recover();
+	void upgrade_legacy_tree(internal::stree::pmem_type *pmem_ptr);
 
-	internal::stree::btree_type *my_btree;
+	std::unique_ptr<internal::stree::btree_type> my_btree;
+	internal::stree::global_mutex mtx;
+	/* number of elements in leafs built by bulk_load */
+	std::size_t bulk_load_leaf_size;
 	std::unique_ptr<internal::config> config;
 };
 
@@ -115,6 +247,8 @@ protected:
 	container_type *container;
 	container_type::iterator it_;
 	pmem::obj::pool_base pop;
+	/* whole key of a leaf with a prefix is copied here, see key() */
+	std::string key_buffer;
 };
 
 template <>
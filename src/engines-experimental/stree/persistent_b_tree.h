@@ -11,12 +11,29 @@
 #include <libpmemobj++/pool.hpp>
 #include <libpmemobj++/transaction.hpp>
 
+#include "../../libpmemkv.hpp"
+#include "../../parallel_for.h"
+#include "../../valgrind/pmemcheck.h"
+#include "../../version_lock.h"
+#include "../../word_hash.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <string>
 #include <type_traits>
 #include <vector>
 
 #include <cassert>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace pmem
 {
 namespace kv
@@ -33,6 +50,7 @@ class node_t {
 public:
 	node_t(uint64_t level = 0) : _level(level)
 	{
+		mtx.runtime_initialize();
 	}
 
 	bool leaf() const
@@ -45,6 +63,12 @@ public:
 		return _level;
 	}
 
+	/*
+	 * Protects the content of the node from concurrent modifications (see
+	 * b_tree_base::concurrent_find), reset on open.
+	 */
+	version_lock mtx;
+
 private:
 	uint64_t _level;
 }; /* class node_t */
@@ -130,16 +154,24 @@ public:
 	void move(pool_base &pop, persistent_ptr<leaf_node_t> other, const key_compare &);
 	template <typename K, typename M>
 	iterator insert(iterator idxs_pos, K &&key, M &&obj);
+	template <typename K, typename M>
+	iterator insert_unlogged(iterator idxs_pos, K &&key, M &&obj);
+	bool order_valid() const;
+	void restore_order(pool_base &pop, const key_compare &);
 
-	template <typename K>
-	iterator find(const K &key, const key_compare &);
-	template <typename K>
-	const_iterator find(const K &key, const key_compare &) const;
-	template <typename K>
-	iterator lower_bound(const K &key, const key_compare &comp);
+	iterator find(string_view key, const key_compare &);
+	const_iterator find(string_view key, const key_compare &) const;
+	iterator lower_bound(string_view key, const key_compare &comp);
+	const_iterator lower_bound(string_view key, const key_compare &comp) const;
+	iterator upper_bound(string_view key, const key_compare &comp);
+	const_iterator upper_bound(string_view key, const key_compare &comp) const;
 
-	template <typename K>
-	size_type erase(pool_base &pop, const K &key, const key_compare &);
+	size_type erase(pool_base &pop, string_view key, const key_compare &);
+
+	const key_type &get_prefix() const;
+	void set_prefix(string_view new_prefix);
+	static int strip_prefix(string_view prefix, string_view &key);
+	string_view key(const_reference e, std::string &buffer) const;
 
 	iterator begin();
 	const_iterator begin() const;
@@ -154,6 +186,13 @@ public:
 	const_reference back() const;
 	reference operator[](size_type pos);
 	const_reference operator[](size_type pos) const;
+	const_reference entry(size_type pos) const;
+	size_type slot(size_type pos) const;
+	reference slot_entry(size_type slot);
+	const_reference slot_entry(size_type slot) const;
+
+	static uint8_t fingerprint(string_view key);
+	uint64_t match(uint8_t fp) const;
 
 	const persistent_ptr<leaf_node_t> &get_next() const;
 	void set_next(const persistent_ptr<leaf_node_t> &n);
@@ -161,37 +200,152 @@ public:
 	void set_prev(const persistent_ptr<leaf_node_t> &p);
 
 private:
+	static_assert(capacity <= 64, "slots of a leaf must fit in the bitmap");
+
+	/* rounded up, so that match() can compare 16 fingerprints at once */
+	static constexpr size_type fingerprints_size = (capacity + 15) / 16 * 16;
+
+	/*
+	 * Bit i is set if entries[i] holds a valid entry, the size of the leaf is
+	 * the number of set bits. This is the only word of the leaf which has to
+	 * be undo-logged when an entry is inserted (see insert_unlogged).
+	 */
+	pmem::obj::p<uint64_t> bitmap;
+	/* fingerprints of keys in entries (valid if the bit of the slot is set),
+	 * kept in the first cache line of the leaf, together with the bitmap */
+	uint8_t fingerprints[fingerprints_size];
 	/* uninitialized static array of value_type is used to avoid entries
 	 * default initialization and to avoid additional allocations */
 	union {
 		value_type entries[capacity];
 	};
-	/* array of indexes to support ordering */
-	pmem::obj::array<difference_type, capacity> idxs;
-	pmem::obj::p<size_type> _size;
+	/* slots of valid entries in sorted order, followed by the free ones */
+	difference_type idxs[capacity];
 	/* persistent pointers to the neighboring leafs */
 	pmem::obj::persistent_ptr<leaf_node_t> prev;
 	pmem::obj::persistent_ptr<leaf_node_t> next;
+	/*
+	 * Common prefix of all keys in the leaf, keys in entries are stored
+	 * without it. It is empty unless prefix compression is enabled (see
+	 * b_tree_base::compress_prefixes), which requires the binary comparator:
+	 * only then keys with the same prefix can be compared by their suffixes.
+	 */
+	key_type prefix;
 
 	/* private helper methods */
+	size_type bound(string_view key, bool upper, const key_compare &comp) const;
+	size_type find_position(string_view key, const key_compare &comp) const;
 	template <typename... Args>
 	pointer emplace(difference_type pos, Args &&... args);
-	size_type insert_idx(const_iterator pos);
+	template <typename K, typename M>
+	iterator insert_entry(iterator idxs_pos, K &&key, M &&obj, uint64_t idxs_flags);
+	size_type insert_idx(const_iterator pos, uint64_t flags);
 	void remove_idx(size_type idx);
 	void internal_erase(pool_base &pop, iterator it);
 	bool is_sorted(const key_compare &);
 	void add_to_tx(size_type begin, size_type end);
 }; /* class leaf_node_t */
 
-template <typename Key, typename Compare, uint64_t capacity>
+/**
+ * Separator key of an inner node: a copy of a key (or of its shortest prefix
+ * which still separates two leafs, see b_tree_base::make_separator). Keys of up
+ * to inline_capacity bytes are stored in the separator itself, longer ones in a
+ * separate buffer.
+ *
+ * Separators are read by optimistic readers while a writer moves them between
+ * entries of a node, so the first word alone tells where the key is: it is
+ * either the size of an inline key (shifted and tagged with the lowest bit) or
+ * the address of the buffer (which starts with the size of the key). Buffers
+ * are freed only when a separator is destroyed or overwritten, which never
+ * happens concurrently with readers.
+ */
+class separator_key {
+public:
+	static constexpr std::size_t inline_capacity = 24;
+
+	separator_key() : tag(1)
+	{
+	}
+
+	explicit separator_key(string_view key) : tag(1)
+	{
+		if (key.size() <= inline_capacity) {
+			std::memcpy(data, key.data(), key.size());
+			tag = (key.size() << 1) | 1;
+		} else {
+			char *buffer = new char[sizeof(std::size_t) + key.size()];
+			std::size_t size = key.size();
+			std::memcpy(buffer, &size, sizeof(size));
+			std::memcpy(buffer + sizeof(size), key.data(), key.size());
+			tag = reinterpret_cast<uintptr_t>(buffer);
+			assert((tag & 1) == 0);
+		}
+	}
+
+	separator_key(separator_key &&other) : tag(other.tag)
+	{
+		std::memcpy(data, other.data, sizeof(data));
+		other.tag = 1;
+	}
+
+	separator_key &operator=(separator_key &&other)
+	{
+		if (this != &other) {
+			release();
+			tag = other.tag;
+			std::memcpy(data, other.data, sizeof(data));
+			other.tag = 1;
+		}
+		return *this;
+	}
+
+	separator_key(const separator_key &) = delete;
+	separator_key &operator=(const separator_key &) = delete;
+
+	~separator_key()
+	{
+		release();
+	}
+
+	string_view view() const
+	{
+		uintptr_t t = tag;
+		/* data may be overwritten concurrently, never read past its end */
+		if (t & 1)
+			return string_view(data,
+					   std::min<std::size_t>(t >> 1, sizeof(data)));
+
+		const char *buffer = reinterpret_cast<const char *>(t);
+		std::size_t size;
+		std::memcpy(&size, buffer, sizeof(size));
+		return string_view(buffer + sizeof(size), size);
+	}
+
+private:
+	void release()
+	{
+		if ((tag & 1) == 0)
+			delete[] reinterpret_cast<char *>(tag);
+		tag = 1;
+	}
+
+	uintptr_t tag;
+	char data[inline_capacity];
+}; /* class separator_key */
+
+/**
+ * Inner node, which is kept in DRAM. Only leafs are persistent, inner nodes are
+ * rebuilt from the chain of leafs when the pool is opened (see
+ * b_tree_base::rebuild_index). Entries own their separator keys, so they do
+ * not have to be updated when keys are removed from leafs.
+ */
+template <typename Compare, uint64_t capacity>
 class inner_node_t : public node_t {
 private:
-	using self_type = inner_node_t<Key, Compare, capacity>;
-	using node_pptr = pmem::obj::persistent_ptr<node_t>;
-	using key_pptr = pmem::obj::persistent_ptr<Key>;
+	using self_type = inner_node_t<Compare, capacity>;
 
 public:
-	using key_type = Key;
+	using key_type = separator_key;
 	using value_type = key_type;
 	using key_compare = Compare;
 
@@ -206,28 +360,21 @@ public:
 	using iterator = node_iterator<self_type, false>;
 	using const_iterator = node_iterator<self_type, true>;
 
-	inner_node_t(size_type level);
-	inner_node_t(size_type level, const_reference key, const node_pptr &first_child,
-		     const node_pptr &second_child);
+	inner_node_t(size_type level, node_t *first_child);
 	~inner_node_t();
 
-	iterator move(pool_base &pop, inner_node_t &other, key_pptr &partition_key);
-	template <typename K>
-	void replace(iterator it, const K &key);
-	void delete_with_child(iterator it, bool left);
-	void inherit_child(iterator it, node_pptr &child, bool left);
-	void update_splitted_child(pool_base &pop, const_reference key,
-				   node_pptr &left_child, node_pptr &right_child,
-				   const key_compare &);
+	iterator move(inner_node_t &other, key_type &partition_key);
+	void append(key_type &&key, node_t *child);
+	void remove_child(size_type pos);
+	void update_splitted_child(key_type &&key, node_t *left_child,
+				   node_t *right_child, const key_compare &);
 
 	template <typename K>
-	std::tuple<node_t *, node_t *, node_t *, iterator>
-	get_child_and_siblings(const K &key, const key_compare &);
+	size_type child_position(const K &key, const key_compare &) const;
 	template <typename K>
-	const node_pptr &get_child(const K &key, const key_compare &) const;
-	const node_pptr &get_child(const_reference key, const key_compare &) const;
-	const node_pptr &get_left_child(const_iterator it) const;
-	const node_pptr &get_right_child(const_iterator it) const;
+	node_t *find_child(const K &key, const key_compare &) const;
+	node_t *get_left_child(const_iterator it) const;
+	node_t *get_right_child(const_iterator it) const;
 
 	bool full() const;
 
@@ -243,12 +390,18 @@ public:
 	reference operator[](size_type pos);
 	const_reference operator[](size_type pos) const;
 
+	/*
+	 * Number of elements in leafs of the subtree, which lets counts of ranges
+	 * skip whole subtrees (see b_tree_base::rank). It is updated by writers
+	 * without locking the node.
+	 */
+	std::atomic<size_type> elements{0};
+
 private:
-	key_pptr entries[capacity];
-	node_pptr children[capacity + 1];
-	pmem::obj::p<size_type> _size = 0;
+	key_type entries[capacity];
+	node_t *children[capacity + 1];
+	size_type _size = 0;
 
-	pool_base get_pool() const noexcept;
 	bool is_sorted(const key_compare &);
 }; /* class inner_node_t */
 
@@ -288,6 +441,9 @@ public:
 	reference operator*() const;
 	pointer operator->() const;
 
+	string_view key(std::string &buffer) const;
+	leaf_node_ptr node() const;
+
 private:
 	leaf_node_ptr current_node;
 	leaf_iterator leaf_it;
@@ -297,17 +453,19 @@ template <typename Key, typename T, typename Compare, std::size_t degree>
 class b_tree_base {
 private:
 	const static std::size_t node_capacity = degree - 1;
+	/* number of lookups multi_find keeps in flight at the same time */
+	const static std::size_t lookup_group_size = 16;
+	/* values concurrent_get() copies to the stack instead of the heap */
+	const static std::size_t small_value_size = 256;
 
 	using self_type = b_tree_base<Key, T, Compare, degree>;
 	using leaf_type = leaf_node_t<Key, T, Compare, node_capacity>;
-	using inner_type = inner_node_t<Key, Compare, node_capacity>;
-	using key_pptr = persistent_ptr<Key>;
-	using node_pptr = persistent_ptr<node_t>;
+	using inner_type = inner_node_t<Compare, node_capacity>;
 	using leaf_pptr = persistent_ptr<leaf_type>;
-	using inner_pptr = persistent_ptr<inner_type>;
-	using path_type = std::vector<inner_pptr>;
+	using path_type = std::vector<inner_type *>;
 
-	using inner_pair = std::pair<inner_pptr, typename inner_type::iterator>;
+	/* inner node and position of a child (or of a key) in it */
+	using inner_pair = std::pair<inner_type *, std::size_t>;
 
 public:
 	using value_type = typename leaf_type::value_type;
@@ -327,11 +485,68 @@ public:
 	using reverse_iterator = std::reverse_iterator<iterator>;
 	using const_reverse_iterator = std::reverse_iterator<const_iterator>;
 
-	b_tree_base();
+	enum class erase_result { erased, not_found, exclusive_required };
+
+	/*
+	 * Version 0 is used by pools with persistent inner nodes and leafs without
+	 * fingerprints, bitmaps and prefixes (the field used to be a pointer which
+	 * was never set).
+	 */
+	static constexpr uint64_t layout_version = 1;
+
+	/*
+	 * Persistent part of the tree (the root object of its pool): only the
+	 * chain of leafs is persistent, everything else is rebuilt on open.
+	 */
+	struct pmem_type {
+		pmem_type(bool prefix_compression = false);
+		~pmem_type();
+
+		/* the leftmost leaf, other leafs are reachable through the chain */
+		leaf_pptr head;
+		pmem::obj::p<uint64_t> version;
+		/* set when the pool is created, see compress_prefixes */
+		pmem::obj::p<uint64_t> prefix_compression;
+		/*
+		 * Set only while the owner of the pool moves elements from a tree
+		 * of layout version 0: its root, or (when legacy_leafs is set and
+		 * its inner nodes are already freed) its leftmost remaining leaf.
+		 */
+		PMEMoid legacy;
+		pmem::obj::p<uint64_t> legacy_leafs;
+		uint64_t reserved[1];
+		key_compare compare;
+	};
+
+	b_tree_base(pmem_type *data, bool bytewise, size_type threads);
 	~b_tree_base();
 
+	/*
+	 * Methods below can be called concurrently with each other. They do not
+	 * free any nodes, but other methods do: the caller must make sure that
+	 * none of them (nor an iterator) is used at the same time.
+	 */
+	template <typename K>
+	bool concurrent_find(const K &key, std::string *value) const;
+	template <typename K, typename F>
+	bool concurrent_get(const K &key, F &&f) const;
+	template <typename InputIt, typename F>
+	bool multi_find(InputIt first, InputIt last, F &&f) const;
+	template <typename K, typename F>
+	bool concurrent_scan(const K *first, bool first_inclusive, const K *last,
+			     bool last_inclusive, F &&f) const;
+	template <typename K>
+	size_type concurrent_count(const K *first, bool first_inclusive, const K *last,
+				   bool last_inclusive) const;
+	template <typename K, typename M>
+	bool concurrent_insert_or_assign(K &&key, M &&obj);
+	template <typename K>
+	erase_result concurrent_erase(const K &key);
+
 	template <typename K, typename M>
 	std::pair<iterator, bool> try_emplace(K &&key, M &&obj);
+	template <typename ForwardIt>
+	bool append(ForwardIt first, ForwardIt last, size_type leaf_size);
 
 	template <typename K>
 	iterator find(const K &key);
@@ -367,69 +582,122 @@ public:
 	const key_compare &key_comp() const;
 
 private:
-	node_pptr root;
-	node_pptr split_node;
-	node_pptr left_child;
-	node_pptr right_child;
-	key_compare compare;
-	pmem::obj::p<size_type> _size;
-
-	const key_type &get_last_key(const node_pptr &node);
+	/* minimal number of leafs processed by each thread of rebuild_index() */
+	const static std::size_t rebuild_leafs_per_thread = 1024;
+	/* maximal number of leafs filled by each transaction of append() */
+	const static std::size_t append_leafs_per_tx = 64;
+
+	pmem_type *data;
+	leaf_pptr &head;
+	key_compare &compare;
+	/* number of elements, counted on open (see rebuild_index) */
+	std::atomic<size_type> _size;
+	bool bytewise;
+	/* inner nodes are rebuilt on open (see rebuild_index) */
+	std::atomic<node_t *> root;
+	/*
+	 * The rightmost leaf, to which increasing keys are appended without
+	 * descending the tree (see try_append). It may be stale, but it never
+	 * points to a freed leaf.
+	 */
+	std::atomic<leaf_type *> last_leaf;
+	/*
+	 * Taken in shared mode by concurrent writers (which change the number of
+	 * elements of inner nodes on the way to their leaf, see add_count) and
+	 * exclusively by concurrent splits of inner nodes (which count elements of
+	 * both halves).
+	 */
+	rw_spin_lock index_mtx;
+	size_type rebuild_threads;
+	bool rebuild_on_abort;
+
+	void add_size_on_commit(difference_type diff);
+	void rebuild_index();
+	void free_index();
+	template <typename F>
+	void update_index(F &&f);
+
+	template <typename S>
+	static string_view view(const S &str);
+	static string_view view(string_view str);
+	static size_type common_prefix(string_view a, string_view b);
+	separator_key make_separator(string_view lower, string_view upper) const;
+	separator_key leaf_separator(const leaf_type *left,
+				     const leaf_type *right) const;
+	bool compress_prefixes() const;
+	void extend_prefix(leaf_type *leaf);
+	template <typename K>
+	leaf_type *find_leaf_optimistic(const K *key, uint64_t &version) const;
+	template <typename K>
+	bool leaf_bound(const leaf_type *leaf, uint64_t version, const K &key, bool upper,
+			size_type &pos) const;
+	template <typename K>
+	bool leaf_lookup(const leaf_type *leaf, uint64_t version, const K &key,
+			 bool &found, size_type &slot) const;
+	template <typename K>
+	bool leaf_find(const leaf_type *leaf, uint64_t version, const K &key, bool &found,
+		       std::string *value) const;
+	template <typename K, typename F>
+	bool scan(const K *first, bool first_inclusive, const K *last,
+		  bool last_inclusive, F &&f) const;
+	template <typename K>
+	size_type rank(const K *key, bool upper) const;
+	template <typename K>
+	void add_count(const K *key, difference_type diff);
+	static size_type subtree_size(const node_t *node);
+	void split_inner_locked(inner_type *node, uint64_t version, inner_type *parent,
+				uint64_t parent_version);
+	template <typename K, typename M>
+	bool try_append(K &&key, M &&obj);
+
 	leaf_type *leftmost_leaf() const;
 	leaf_type *rightmost_leaf() const;
 
-	void create_new_root(const key_type &, node_pptr &, node_pptr &);
-	typename inner_type::const_iterator split_half(pool_base &pop, inner_pptr &node,
-						       inner_pptr &other,
-						       key_pptr &partition_key);
-	void split_inner_node(pool_base &pop, inner_pptr &src_node);
-	void split_inner_node(pool_base &pop, inner_pptr &src_node,
-			      inner_type *parent_node);
-	template <typename K, typename M>
-	std::pair<iterator, bool> split_leaf_node(pool_base &pop, leaf_pptr &split_leaf,
-						  K &&key, M &&obj);
+	inner_type *split_half(inner_type *node, separator_key &partition_key);
+	void split_inner_node(inner_type *src_node);
+	void split_inner_node(inner_type *src_node, inner_type *parent_node);
+	template <typename ForwardIt>
+	leaf_pptr append_leaf(const leaf_pptr &prev, ForwardIt &first, ForwardIt last,
+			      size_type leaf_size);
+	void append_to_index(node_t *node, separator_key &&separator);
 	template <typename K, typename M>
 	std::pair<iterator, bool> split_leaf_node(pool_base &pop, inner_type *parent_node,
 						  leaf_pptr &split_leaf, K &&key,
 						  M &&obj);
 
-	leaf_type *find_leaf_node(const key_type &key) const;
 	template <typename K>
 	leaf_type *find_leaf_node(const K &key) const;
 	template <typename K>
 	leaf_pptr find_leaf_to_insert(const K &key, path_type &path) const;
-	typename path_type::const_iterator find_full_node(const path_type &path);
 	template <typename K, typename M>
 	std::pair<iterator, bool> internal_insert(leaf_pptr leaf, K &&key, M &&obj);
+	template <typename K, typename M>
+	typename leaf_type::iterator insert_to_leaf(pool_base &pop, leaf_type *leaf,
+						    typename leaf_type::iterator pos,
+						    K &&key, M &&obj);
 	template <typename K>
-	leaf_pptr get_path_ext(const K &key, std::vector<inner_pair> &path,
-			       std::vector<std::pair<node_pptr, node_pptr>> &neighbors,
-			       inner_pair &inner_ptr);
-	const_reference get_suitable_entry(inner_pair &node);
-	void delete_leaf_ext(leaf_pptr &leaf, inner_pair &parent, bool has_left_sibling);
-	void delete_inner_ext(inner_pptr &node, inner_pair &parent,
-			      std::pair<node_pptr, node_pptr> &neighbors,
-			      bool has_left_sibling);
-
-	static inner_pptr &cast_inner(node_pptr &node);
+	leaf_type *get_path_ext(const K &key, std::vector<inner_pair> &path);
+	void delete_leaf_ext(leaf_type *leaf);
+	void delete_inner_ext(std::vector<inner_pair> &path);
+
 	static inner_type *cast_inner(node_t *node);
-	static leaf_pptr &cast_leaf(node_pptr &node);
+	static void prefetch_node(const node_t *node);
 	static leaf_type *cast_leaf(node_t *node);
-	static node_pptr &cast_node(leaf_pptr &node);
-	static node_pptr &cast_node(inner_pptr &node);
 
 	template <typename... Args>
-	inline inner_pptr allocate_inner(Args &&... args);
+	inline inner_type *allocate_inner(Args &&... args);
 	template <typename... Args>
 	inline leaf_pptr allocate_leaf(Args &&... args);
-	inline void deallocate(node_pptr &node);
 	inline void deallocate(leaf_pptr &node);
-	inline void deallocate(inner_pptr &node);
+	inline void deallocate(inner_type *node);
 
 	PMEMobjpool *get_objpool();
 	pool_base get_pool_base();
 }; /* class b_tree_base */
 
+template <typename Key, typename T, typename Compare, std::size_t degree>
+constexpr uint64_t b_tree_base<Key, T, Compare, degree>::layout_version;
+
 // -------------------------------------------------------------------------------------
 // ------------------------------------- node_iterator ---------------------------------
 // -------------------------------------------------------------------------------------
@@ -589,8 +857,8 @@ template <typename Key, typename T, typename Compare, uint64_t capacity>
 leaf_node_t<Key, T, Compare, capacity>::leaf_node_t() : node_t()
 {
 	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
-	std::iota(idxs.begin(), idxs.end(), 0);
-	_size = 0;
+	std::iota(idxs, idxs + capacity, 0);
+	bitmap = 0;
 }
 
 template <typename Key, typename T, typename Compare, uint64_t capacity>
@@ -626,32 +894,59 @@ void leaf_node_t<Key, T, Compare, capacity>::move(pool_base &pop,
 	assert(other->full());
 	assert(this->size() == 0);
 	size_type middle_idx = other->size() / 2;
-	auto middle = std::make_move_iterator(other->begin() + middle_idx);
-	auto last = std::make_move_iterator(other->end());
-	auto temp = middle;
+	size_type count = other->size() - middle_idx;
 	/* move second half from 'other' to 'this' */
 	pmem::obj::transaction::run(pop, [&] {
+		/* suffixes of moved keys stay the same */
+		prefix = other->prefix;
 		/* add range to tx before moving to avoid sequential snapshotting */
 		other->add_to_tx(middle_idx, other->size());
-		difference_type count = 0;
-		while (temp != last) {
-			emplace(count++, *temp++);
+		pmemobj_tx_xadd_range_direct(fingerprints, count, POBJ_XADD_NO_SNAPSHOT);
+		uint64_t moved = 0;
+		for (size_type i = 0; i < count; ++i) {
+			difference_type other_slot = other->idxs[middle_idx + i];
+			emplace(static_cast<difference_type>(i),
+				std::move(other->entries[other_slot]));
+			fingerprints[i] = other->fingerprints[other_slot];
+			moved |= 1ULL << other_slot;
 		}
-		_size = static_cast<size_type>(count);
-		other->_size -= static_cast<size_type>(count);
+		bitmap = (1ULL << count) - 1;
+		other->bitmap &= ~moved;
 	});
 	assert(std::distance(begin(), end()) > 0);
 	assert(is_sorted(comp));
 }
 
 template <typename Key, typename T, typename Compare, uint64_t capacity>
-template <typename K>
 typename leaf_node_t<Key, T, Compare, capacity>::iterator
-leaf_node_t<Key, T, Compare, capacity>::lower_bound(const K &key, const key_compare &comp)
+leaf_node_t<Key, T, Compare, capacity>::lower_bound(string_view key,
+						    const key_compare &comp)
+{
+	return iterator(this, bound(key, false, comp));
+}
+
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+typename leaf_node_t<Key, T, Compare, capacity>::const_iterator
+leaf_node_t<Key, T, Compare, capacity>::lower_bound(string_view key,
+						    const key_compare &comp) const
+{
+	return const_iterator(this, bound(key, false, comp));
+}
+
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+typename leaf_node_t<Key, T, Compare, capacity>::iterator
+leaf_node_t<Key, T, Compare, capacity>::upper_bound(string_view key,
+						    const key_compare &comp)
 {
-	return std::lower_bound(
-		begin(), end(), key,
-		[&comp](const_reference e, const K &key) { return comp(e.first, key); });
+	return iterator(this, bound(key, true, comp));
+}
+
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+typename leaf_node_t<Key, T, Compare, capacity>::const_iterator
+leaf_node_t<Key, T, Compare, capacity>::upper_bound(string_view key,
+						    const key_compare &comp) const
+{
+	return const_iterator(this, bound(key, true, comp));
 }
 
 /**
@@ -664,48 +959,81 @@ template <typename K, typename M>
 typename leaf_node_t<Key, T, Compare, capacity>::iterator
 leaf_node_t<Key, T, Compare, capacity>::insert(iterator idxs_pos, K &&key, M &&obj)
 {
-	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
-	assert(!full());
-	difference_type insert_pos = idxs[size()];
-	assert(std::none_of(
-		idxs.cdata(), idxs.cdata() + size(),
-		[&insert_pos](difference_type idx) { return insert_pos == idx; }));
-	// insert an entry to the end
-	emplace(insert_pos, std::forward<K>(key), std::forward<M>(obj));
-	// update idxs & return iterator
-	return iterator(this, insert_idx(idxs_pos));
+	return insert_entry(idxs_pos, std::forward<K>(key), std::forward<M>(obj), 0);
 }
 
+/**
+ * Same as insert(), but idxs is modified without undo-logging, the new entry is
+ * published only by setting its bit in the bitmap. If the transaction aborts (or
+ * is interrupted), the bitmap is rolled back, but idxs is not: the caller must
+ * call restore_order() after an abort (and after the pool is opened, if order_valid()
+ * returns false).
+ *
+ * @pre must be called in the outermost transaction, which does not modify the
+ * leaf in any other way and which did not allocate it.
+ */
 template <typename Key, typename T, typename Compare, uint64_t capacity>
-template <typename K>
+template <typename K, typename M>
 typename leaf_node_t<Key, T, Compare, capacity>::iterator
-leaf_node_t<Key, T, Compare, capacity>::find(const K &key, const key_compare &comp)
+leaf_node_t<Key, T, Compare, capacity>::insert_unlogged(iterator idxs_pos, K &&key,
+							M &&obj)
 {
-	iterator it = lower_bound(key, comp);
-	if (it != end() && (!comp(it->first, key) && !comp(key, it->first))) {
-		return it;
-	} else {
-		return end();
+	return insert_entry(idxs_pos, std::forward<K>(key), std::forward<M>(obj),
+			    POBJ_XADD_NO_SNAPSHOT);
+}
+
+/**
+ * Checks whether idxs holds exactly the slots of the valid entries (it may not,
+ * after a transaction with insert_unlogged() was interrupted).
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+bool leaf_node_t<Key, T, Compare, capacity>::order_valid() const
+{
+	uint64_t slots = 0;
+	for (size_type i = 0; i < size(); ++i) {
+		if (idxs[i] < 0 || idxs[i] >= static_cast<difference_type>(capacity))
+			return false;
+		slots |= 1ULL << idxs[i];
 	}
+
+	return slots == bitmap;
+}
+
+/**
+ * Sorts slots of the valid entries again. Must be called outside of a transaction.
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+void leaf_node_t<Key, T, Compare, capacity>::restore_order(pool_base &pop,
+							   const key_compare &comp)
+{
+	difference_type *last = idxs;
+	for (uint64_t slots = bitmap; slots != 0; slots &= slots - 1)
+		*last++ = __builtin_ctzll(slots);
+
+	std::sort(idxs, last, [&](difference_type a, difference_type b) {
+		return comp(entries[a].first, entries[b].first);
+	});
+	pop.persist(idxs, sizeof(idxs));
+}
+
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+typename leaf_node_t<Key, T, Compare, capacity>::iterator
+leaf_node_t<Key, T, Compare, capacity>::find(string_view key, const key_compare &comp)
+{
+	return iterator(this, find_position(key, comp));
 }
 
 template <typename Key, typename T, typename Compare, uint64_t capacity>
-template <typename K>
 typename leaf_node_t<Key, T, Compare, capacity>::const_iterator
-leaf_node_t<Key, T, Compare, capacity>::find(const K &key, const key_compare &comp) const
+leaf_node_t<Key, T, Compare, capacity>::find(string_view key,
+					     const key_compare &comp) const
 {
-	const_iterator it = lower_bound(key, comp);
-	if (it != cend() && (!comp(it->first, key) && !comp(key, it->first))) {
-		return it;
-	} else {
-		return cend();
-	}
+	return const_iterator(this, find_position(key, comp));
 }
 
 template <typename Key, typename T, typename Compare, uint64_t capacity>
-template <typename K>
 typename leaf_node_t<Key, T, Compare, capacity>::size_type
-leaf_node_t<Key, T, Compare, capacity>::erase(pool_base &pop, const K &key,
+leaf_node_t<Key, T, Compare, capacity>::erase(pool_base &pop, string_view key,
 					      const key_compare &comp)
 {
 	iterator it = find(key, comp);
@@ -716,6 +1044,54 @@ leaf_node_t<Key, T, Compare, capacity>::erase(pool_base &pop, const K &key,
 	return size_type(1);
 }
 
+/**
+ * Returns position of the first entry which is not less than key (greater than
+ * key if upper is set). Key is a whole key: it is compared with suffixes only if
+ * it starts with the prefix of the leaf, otherwise it is less or greater than all
+ * of them.
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+typename leaf_node_t<Key, T, Compare, capacity>::size_type
+leaf_node_t<Key, T, Compare, capacity>::bound(string_view key, bool upper,
+					      const key_compare &comp) const
+{
+	int c = strip_prefix(string_view(prefix.cdata(), prefix.size()), key);
+	if (c != 0)
+		return c < 0 ? 0 : size();
+
+	const_iterator it = upper
+		? std::upper_bound(cbegin(), cend(), key,
+				   [&comp](string_view key, const_reference e) {
+					   return comp(key, e.first);
+				   })
+		: std::lower_bound(cbegin(), cend(), key,
+				   [&comp](const_reference e, string_view key) {
+					   return comp(e.first, key);
+				   });
+
+	return static_cast<size_type>(std::distance(cbegin(), it));
+}
+
+/**
+ * Returns position of the entry with key, or size() if there is no such entry.
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+typename leaf_node_t<Key, T, Compare, capacity>::size_type
+leaf_node_t<Key, T, Compare, capacity>::find_position(string_view key,
+						      const key_compare &comp) const
+{
+	size_type pos = bound(key, false, comp);
+	if (pos == size() ||
+	    strip_prefix(string_view(prefix.cdata(), prefix.size()), key) != 0)
+		return size();
+
+	const key_type &k = (*this)[pos].first;
+	if (comp(k, key) || comp(key, k))
+		return size();
+
+	return pos;
+}
+
 /**
  * Return begin iterator on an array of correct indices.
  */
@@ -783,7 +1159,7 @@ template <typename Key, typename T, typename Compare, uint64_t capacity>
 typename leaf_node_t<Key, T, Compare, capacity>::size_type
 leaf_node_t<Key, T, Compare, capacity>::size() const
 {
-	return _size;
+	return static_cast<size_type>(__builtin_popcountll(bitmap));
 }
 
 template <typename Key, typename T, typename Compare, uint64_t capacity>
@@ -822,6 +1198,80 @@ typename leaf_node_t<Key, T, Compare, capacity>::const_reference
 	return entries[idxs[pos]];
 }
 
+/**
+ * Same as operator[], but without the assertion, so it can be called while the
+ * leaf is modified concurrently (position must be less than capacity).
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+typename leaf_node_t<Key, T, Compare, capacity>::const_reference
+leaf_node_t<Key, T, Compare, capacity>::entry(size_type pos) const
+{
+	return entries[idxs[pos]];
+}
+
+/**
+ * Returns slot (index in entries) of the entry on position pos in sorted order,
+ * it can be called while the leaf is modified concurrently.
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+typename leaf_node_t<Key, T, Compare, capacity>::size_type
+leaf_node_t<Key, T, Compare, capacity>::slot(size_type pos) const
+{
+	return static_cast<size_type>(idxs[pos]);
+}
+
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+typename leaf_node_t<Key, T, Compare, capacity>::reference
+leaf_node_t<Key, T, Compare, capacity>::slot_entry(size_type slot)
+{
+	return entries[slot];
+}
+
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+typename leaf_node_t<Key, T, Compare, capacity>::const_reference
+leaf_node_t<Key, T, Compare, capacity>::slot_entry(size_type slot) const
+{
+	return entries[slot];
+}
+
+/**
+ * Returns one-byte hash of a key. Keys with different fingerprints are not equal
+ * byte by byte, so lookups do not have to read them.
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+uint8_t leaf_node_t<Key, T, Compare, capacity>::fingerprint(string_view key)
+{
+	return static_cast<uint8_t>(word_hash(key.size(), key.data()));
+}
+
+/**
+ * Compares fp with fingerprints of all valid entries, it can be called while the
+ * leaf is modified concurrently.
+ *
+ * @return bitmask of slots of entries with matching fingerprints
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+uint64_t leaf_node_t<Key, T, Compare, capacity>::match(uint8_t fp) const
+{
+	uint64_t mask = 0;
+	const uint8_t *data = fingerprints;
+#ifdef __SSE2__
+	const __m128i needle = _mm_set1_epi8(static_cast<char>(fp));
+	for (size_type i = 0; i < fingerprints_size; i += 16) {
+		__m128i block =
+			_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		auto bits = static_cast<uint32_t>(
+			_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
+		mask |= static_cast<uint64_t>(bits) << i;
+	}
+#else
+	for (size_type i = 0; i < fingerprints_size; ++i)
+		mask |= static_cast<uint64_t>(data[i] == fp) << i;
+#endif
+
+	return mask & bitmap;
+}
+
 template <typename Key, typename T, typename Compare, uint64_t capacity>
 const persistent_ptr<leaf_node_t<Key, T, Compare, capacity>> &
 leaf_node_t<Key, T, Compare, capacity>::get_next() const
@@ -850,6 +1300,81 @@ void leaf_node_t<Key, T, Compare, capacity>::set_prev(
 	this->prev = p;
 }
 
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+const typename leaf_node_t<Key, T, Compare, capacity>::key_type &
+leaf_node_t<Key, T, Compare, capacity>::get_prefix() const
+{
+	return this->prefix;
+}
+
+/**
+ * Replaces the common prefix of keys, new_prefix must be a prefix of all of them
+ * (so it is either shorter or longer than the current one). All keys are stored
+ * again without the new prefix and their fingerprints are recomputed.
+ *
+ * @pre must be called in a transaction scope.
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+void leaf_node_t<Key, T, Compare, capacity>::set_prefix(string_view new_prefix)
+{
+	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
+	/* new_prefix may point to one of the keys, which are modified below */
+	std::string new_value(new_prefix.data(), new_prefix.size());
+	std::string key;
+
+	pmemobj_tx_add_range_direct(fingerprints, sizeof(fingerprints));
+	for (uint64_t slots = bitmap; slots != 0; slots &= slots - 1) {
+		int slot = __builtin_ctzll(slots);
+		key_type &k = entries[slot].first;
+		key.assign(prefix.cdata(), prefix.size());
+		key.append(k.cdata(), k.size());
+		assert(key.compare(0, new_value.size(), new_value) == 0);
+
+		string_view suffix(key.data() + new_value.size(),
+				   key.size() - new_value.size());
+		k = suffix;
+		fingerprints[slot] = fingerprint(suffix);
+	}
+	prefix = string_view(new_value);
+}
+
+/**
+ * Removes prefix from key, if key starts with it.
+ *
+ * @return 0 if key started with prefix, otherwise -1 if key is less than prefix
+ * (and than all keys which start with it) or 1 if it is greater than all of them
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+int leaf_node_t<Key, T, Compare, capacity>::strip_prefix(string_view prefix,
+							 string_view &key)
+{
+	size_type n = std::min(prefix.size(), key.size());
+	int c = n > 0 ? std::memcmp(key.data(), prefix.data(), n) : 0;
+	if (c != 0)
+		return c < 0 ? -1 : 1;
+	if (key.size() < prefix.size())
+		return -1;
+
+	key = string_view(key.data() + n, key.size() - n);
+	return 0;
+}
+
+/**
+ * Returns the whole key of entry e. If the leaf has a prefix, the key is copied
+ * to buffer.
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+string_view leaf_node_t<Key, T, Compare, capacity>::key(const_reference e,
+							std::string &buffer) const
+{
+	if (prefix.size() == 0)
+		return string_view(e.first.cdata(), e.first.size());
+
+	buffer.assign(prefix.cdata(), prefix.size());
+	buffer.append(e.first.cdata(), e.first.size());
+	return string_view(buffer);
+}
+
 /**
  * Constructs value_type in position 'pos' of entries with arguments 'args'.
  *
@@ -868,29 +1393,55 @@ leaf_node_t<Key, T, Compare, capacity>::emplace(difference_type pos, Args &&...
 }
 
 /**
- * Replaces index of newly allocated on position idxs[size()] element in sorted order.
+ * Constructs a new entry in a free slot and inserts it in a sorted way specified
+ * by idxs_pos. idxs is added to the transaction with idxs_flags, the entry becomes
+ * valid when its bit is set in the bitmap.
+ *
+ * @pre key must not already exist in the leaf.
+ */
+template <typename Key, typename T, typename Compare, uint64_t capacity>
+template <typename K, typename M>
+typename leaf_node_t<Key, T, Compare, capacity>::iterator
+leaf_node_t<Key, T, Compare, capacity>::insert_entry(iterator idxs_pos, K &&key, M &&obj,
+						     uint64_t idxs_flags)
+{
+	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
+	assert(!full());
+	difference_type slot = __builtin_ctzll(~bitmap);
+	emplace(slot, std::forward<K>(key), std::forward<M>(obj));
+
+	const key_type &new_key = entries[slot].first;
+	pmemobj_tx_xadd_range_direct(fingerprints + slot, 1, POBJ_XADD_NO_SNAPSHOT);
+	fingerprints[slot] = fingerprint(string_view(new_key.cdata(), new_key.size()));
+
+	size_type pos = insert_idx(idxs_pos, idxs_flags);
+	idxs[pos] = slot;
+
+	bitmap |= 1ULL << slot;
+	return iterator(this, pos);
+}
+
+/**
+ * Makes room in idxs for a new entry.
  *
  * @param pos - position in sorted idxs array where entry must reside.
+ * @param flags - flags for pmemobj_tx_xadd_range_direct, with which the modified
+ * part of idxs is added to the transaction.
  *
- * @pre must be used right after addition of a new entry
- * @pre new entry must be added into idxs[size()] position
+ * @return position of the new entry, its slot must be stored there
  */
 template <typename Key, typename T, typename Compare, uint64_t capacity>
 typename leaf_node_t<Key, T, Compare, capacity>::size_type
-leaf_node_t<Key, T, Compare, capacity>::insert_idx(const_iterator pos)
+leaf_node_t<Key, T, Compare, capacity>::insert_idx(const_iterator pos, uint64_t flags)
 {
 	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
-	difference_type new_entry_idx = idxs[size()];
-
 	auto idx_pos = static_cast<size_type>(std::distance(cbegin(), pos));
-	auto slice = idxs.range(idx_pos, size() - idx_pos);
-	auto to_insert = std::copy_backward(slice.begin(), slice.end(), slice.end() + 1);
-	*(--to_insert) = new_entry_idx;
-	++_size;
+	pmemobj_tx_xadd_range_direct(idxs + idx_pos,
+				     sizeof(difference_type) * (size() - idx_pos + 1),
+				     flags);
+	std::copy_backward(idxs + idx_pos, idxs + size(), idxs + size() + 1);
 
-	size_type result = static_cast<size_type>(to_insert - idxs.cbegin());
-	assert(result >= 0);
-	return result;
+	return idx_pos;
 }
 
 template <typename Key, typename T, typename Compare, uint64_t capacity>
@@ -900,10 +1451,11 @@ void leaf_node_t<Key, T, Compare, capacity>::remove_idx(size_type idx)
 	assert(size() > 0);
 
 	difference_type to_replace = idxs[idx];
-	auto slice = idxs.range(idx, size() - idx);
-	auto replace_pos = std::copy(slice.begin() + 1, slice.end(), slice.begin());
+	pmemobj_tx_add_range_direct(idxs + idx, sizeof(difference_type) * (size() - idx));
+	auto replace_pos = std::copy(idxs + idx + 1, idxs + size(), idxs + idx);
 	*replace_pos = to_replace;
-	--_size;
+
+	bitmap &= ~(1ULL << to_replace);
 }
 
 /**
@@ -946,28 +1498,15 @@ void leaf_node_t<Key, T, Compare, capacity>::add_to_tx(size_type begin, size_typ
 // ------------------------------------- inner_node_t ----------------------------------
 // -------------------------------------------------------------------------------------
 
-template <typename Key, typename Compare, uint64_t capacity>
-inner_node_t<Key, Compare, capacity>::inner_node_t(size_type level)
-    : node_t(level), _size(0)
-{
-	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
-}
-
-template <typename Key, typename Compare, uint64_t capacity>
-inner_node_t<Key, Compare, capacity>::inner_node_t(size_type level, const_reference key,
-						   const node_pptr &first_child,
-						   const node_pptr &second_child)
+template <typename Compare, uint64_t capacity>
+inner_node_t<Compare, capacity>::inner_node_t(size_type level, node_t *first_child)
     : node_t(level)
 {
-	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
-	entries[0] = pmem::obj::persistent_ptr<key_type>(&key);
 	children[0] = first_child;
-	children[1] = second_child;
-	_size = 1;
 }
 
-template <typename Key, typename Compare, uint64_t capacity>
-inner_node_t<Key, Compare, capacity>::~inner_node_t()
+template <typename Compare, uint64_t capacity>
+inner_node_t<Compare, capacity>::~inner_node_t()
 {
 }
 
@@ -975,72 +1514,87 @@ inner_node_t<Key, Compare, capacity>::~inner_node_t()
  * Moves second half from 'other' to 'this'.
  * Returns iterator to first from 'this'.
  */
-template <typename Key, typename Compare, uint64_t capacity>
-typename inner_node_t<Key, Compare, capacity>::iterator
-inner_node_t<Key, Compare, capacity>::move(pool_base &pop, inner_node_t &other,
-					   key_pptr &partition_key)
+template <typename Compare, uint64_t capacity>
+typename inner_node_t<Compare, capacity>::iterator
+inner_node_t<Compare, capacity>::move(inner_node_t &other, key_type &partition_key)
 {
 	assert(size() == 0);
 	assert(other.size() > size_type(1));
-	key_pptr *middle = other.entries + other.size() / 2;
-	key_pptr *last = other.entries + other.size();
+	key_type *middle = other.entries + other.size() / 2;
+	key_type *last = other.entries + other.size();
 	size_type new_size = static_cast<size_type>(std::distance(middle + 1, last));
-	node_pptr *middle_child = other.children + (other.size() / 2) + 1;
-	node_pptr *last_child = other.children + other.size() + 1;
+	node_t **middle_child = other.children + (other.size() / 2) + 1;
+	node_t **last_child = other.children + other.size() + 1;
+	/* save partition key */
+	partition_key = std::move(*middle);
 	/* move second half from 'other' to 'this' */
-	pmem::obj::transaction::run(pop, [&] {
-		/* save partition key */
-		partition_key = *middle;
-		std::move(middle + 1, last, entries);
-		std::move(middle_child, last_child, children);
-		_size = new_size;
-		other._size -= (new_size + 1);
-	});
+	std::move(middle + 1, last, entries);
+	std::copy(middle_child, last_child, children);
+	_size = new_size;
+	other._size -= (new_size + 1);
 	assert(std::distance(begin(), end()) > 0);
 	return begin();
 }
 
 /**
- * Changes entry specified by the iterator with key pointer
+ * Adds key and the child on its right at the end of the node (used when the
+ * node is built from already sorted children).
  */
-template <typename Key, typename Compare, uint64_t capacity>
-template <typename K>
-void inner_node_t<Key, Compare, capacity>::replace(iterator it, const K &key)
+template <typename Compare, uint64_t capacity>
+void inner_node_t<Compare, capacity>::append(key_type &&key, node_t *child)
+{
+	assert(!full());
+	entries[_size] = std::move(key);
+	children[++_size] = child;
+}
+
+/**
+ * Removes child at the given position, together with the key on its left (or
+ * with the first key, if it is the first child).
+ *
+ * @pre size() > 0
+ */
+template <typename Compare, uint64_t capacity>
+void inner_node_t<Compare, capacity>::remove_child(size_type pos)
 {
-	size_type pos = static_cast<size_type>(std::distance(begin(), it));
-	entries[pos] = pmem::obj::persistent_ptr<key_type>(&key);
+	assert(size() > 0);
+	assert(pos <= size());
+
+	size_type key_pos = pos > 0 ? pos - 1 : 0;
+	std::move(entries + key_pos + 1, entries + size(), entries + key_pos);
+	std::copy(children + pos + 1, children + size() + 1, children + pos);
+	--_size;
+	/* the removed key is still there if it was the last one */
+	entries[_size] = key_type();
 }
 
 /**
  * Updates inner node after splitting child.
  *
- * @param[in] pop - persistent pool
  * @param[in] key - key of the first entry in right_child
  * @param[in] left_child - new child node that must be linked
  * @param[in] right_child - new child node that must be linked
  */
-template <typename Key, typename Compare, uint64_t capacity>
-void inner_node_t<Key, Compare, capacity>::update_splitted_child(pool_base &pop,
-								 const_reference key,
-								 node_pptr &left_child,
-								 node_pptr &right_child,
-								 const key_compare &comp)
+template <typename Compare, uint64_t capacity>
+void inner_node_t<Compare, capacity>::update_splitted_child(key_type &&key,
+							  node_t *left_child,
+							  node_t *right_child,
+							  const key_compare &comp)
 {
-	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
 	assert(!full());
 	const_iterator insert_it = std::lower_bound(
 		cbegin(), cend(), key, [&comp](const_reference lhs, const_reference rhs) {
-			return comp(lhs, rhs);
+			return comp(lhs.view(), rhs.view());
 		});
 	difference_type insert_idx = std::distance(cbegin(), insert_it);
 	/* update entries inserting new key */
-	key_pptr *to_insert = std::copy_backward(entries + insert_idx, entries + size(),
+	key_type *to_insert = std::move_backward(entries + insert_idx, entries + size(),
 						 entries + size() + 1);
 	assert(insert_idx < std::distance(entries, to_insert));
-	*(--to_insert) = pmem::obj::persistent_ptr<key_type>(&key);
+	*(--to_insert) = std::move(key);
 	++_size;
 	/* update children inserting new descendants */
-	node_pptr *to_insert_child = std::copy_backward(
+	node_t **to_insert_child = std::copy_backward(
 		children + insert_idx + 1, children + size(), children + size() + 1);
 	*(--to_insert_child) = right_child;
 	*(--to_insert_child) = left_child;
@@ -1049,98 +1603,42 @@ void inner_node_t<Key, Compare, capacity>::update_splitted_child(pool_base &pop,
 }
 
 /**
- * Deletes key specified by iterator.
- * Must be followed by node balancing.
+ * Returns position of the child which may contain key. It does not assert
+ * anything about positions of the entries, so it can be called while the node is
+ * modified concurrently (the result must be validated by the caller before it is
+ * used).
  */
-template <typename Key, typename Compare, uint64_t capacity>
-void inner_node_t<Key, Compare, capacity>::delete_with_child(iterator it, bool left)
-{
-	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
-	assert(size() > 0);
-
-	size_type pos = static_cast<size_type>(std::distance(begin(), it));
-	std::move(entries + pos + 1, entries + size(), entries + pos);
-	if (left) {
-		std::move(children + pos + 1, children + size() + 1, children + pos);
-	} else {
-		std::move(children + pos + 2, children + size() + 1, children + pos + 1);
+template <typename Compare, uint64_t capacity>
+template <typename K>
+typename inner_node_t<Compare, capacity>::size_type
+inner_node_t<Compare, capacity>::child_position(const K &key,
+						     const key_compare &comp) const
+{
+	size_type first = 0;
+	size_type count = size();
+	while (count > 0) {
+		size_type step = count / 2;
+		if (!comp(key, entries[first + step].view())) {
+			first += step + 1;
+			count -= step + 1;
+		} else {
+			count = step;
+		}
 	}
-	--_size;
-}
-
-/**
- * Inherits child specified by iterator and 'left' bool.
- * Key is updated by smallest in right subtree.
- * Assuming that previous child is no longer used and must be deleted.
- *
- * @pre child.size() == 0
- */
-template <typename Key, typename Compare, uint64_t capacity>
-void inner_node_t<Key, Compare, capacity>::inherit_child(iterator it, node_pptr &child,
-							 bool left)
-{
-	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
-	assert(size() > 0);
-
-	size_type pos = static_cast<size_type>(std::distance(begin(), it));
-	if (left) {
-		children[pos] = child;
-	} else {
-		children[pos + 1] = child;
-	}
-}
 
-template <typename Key, typename Compare, uint64_t capacity>
-template <typename K>
-const typename inner_node_t<Key, Compare, capacity>::node_pptr &
-inner_node_t<Key, Compare, capacity>::get_child(const K &key,
-						const key_compare &comp) const
-{
-	const_iterator it = std::upper_bound(
-		cbegin(), cend(), key,
-		[&comp](const K &lhs, const_reference rhs) { return comp(lhs, rhs); });
-	return get_left_child(it);
+	return first;
 }
 
-template <typename Key, typename Compare, uint64_t capacity>
+template <typename Compare, uint64_t capacity>
 template <typename K>
-std::tuple<node_t *, node_t *, node_t *,
-	   typename inner_node_t<Key, Compare, capacity>::iterator>
-inner_node_t<Key, Compare, capacity>::get_child_and_siblings(const K &key,
-							     const key_compare &comp)
+node_t *inner_node_t<Compare, capacity>::find_child(const K &key,
+							 const key_compare &comp) const
 {
-	assert(size() > 0);
-	iterator it = std::upper_bound(
-		begin(), end(), key,
-		[&comp](const K &lhs, const_reference rhs) { return comp(lhs, rhs); });
-	if (it == begin()) {
-		return std::make_tuple(get_left_child(it).get(), nullptr,
-				       get_right_child(it).get(), it);
-	} else if (it == end()) {
-		return std::make_tuple(get_left_child(it).get(),
-				       get_left_child(it - 1).get(), nullptr, it - 1);
-	} else {
-		return std::make_tuple(get_left_child(it).get(),
-				       get_left_child(it - 1).get(),
-				       get_right_child(it).get(), it - 1);
-	}
-}
-
-template <typename Key, typename Compare, uint64_t capacity>
-const typename inner_node_t<Key, Compare, capacity>::node_pptr &
-inner_node_t<Key, Compare, capacity>::get_child(const_reference key,
-						const key_compare &comp) const
-{
-	const_iterator it = std::upper_bound(
-		cbegin(), cend(), key, [&comp](const_reference lhs, const_reference rhs) {
-			return comp(lhs, rhs);
-		});
-	return get_left_child(it);
+	return children[child_position(key, comp)];
 }
 
-template <typename Key, typename Compare, uint64_t capacity>
-const typename inner_node_t<Key, Compare, capacity>::node_pptr &
-inner_node_t<Key, Compare, capacity>::get_left_child(const_iterator it) const
+template <typename Compare, uint64_t capacity>
+node_t *inner_node_t<Compare, capacity>::get_left_child(const_iterator it) const
 {
 	auto result = std::distance(begin(), it);
 	assert(result >= 0);
@@ -1149,9 +1647,8 @@ inner_node_t<Key, Compare, capacity>::get_left_child(const_iterator it) const
 	return children[child_pos];
 }
 
-template <typename Key, typename Compare, uint64_t capacity>
-const typename inner_node_t<Key, Compare, capacity>::node_pptr &
-inner_node_t<Key, Compare, capacity>::get_right_child(const_iterator it) const
+template <typename Compare, uint64_t capacity>
+node_t *inner_node_t<Compare, capacity>::get_right_child(const_iterator it) const
 {
 	auto result = std::distance(begin(), it);
 	assert(result >= 0);
@@ -1160,8 +1657,8 @@ inner_node_t<Key, Compare, capacity>::get_right_child(const_iterator it) const
 	return children[child_pos];
 }
 
-template <typename Key, typename Compare, uint64_t capacity>
-bool inner_node_t<Key, Compare, capacity>::full() const
+template <typename Compare, uint64_t capacity>
+bool inner_node_t<Compare, capacity>::full() const
 {
 	return this->size() == capacity;
 }
@@ -1169,9 +1666,9 @@ bool inner_node_t<Key, Compare, capacity>::full() const
 /**
  * Return begin iterator on an array of keys.
  */
-template <typename Key, typename Compare, uint64_t capacity>
-typename inner_node_t<Key, Compare, capacity>::iterator
-inner_node_t<Key, Compare, capacity>::begin()
+template <typename Compare, uint64_t capacity>
+typename inner_node_t<Compare, capacity>::iterator
+inner_node_t<Compare, capacity>::begin()
 {
 	return iterator(this, 0);
 }
@@ -1179,9 +1676,9 @@ inner_node_t<Key, Compare, capacity>::begin()
 /**
  * Return begin const_iterator on an array of keys.
  */
-template <typename Key, typename Compare, uint64_t capacity>
-typename inner_node_t<Key, Compare, capacity>::const_iterator
-inner_node_t<Key, Compare, capacity>::begin() const
+template <typename Compare, uint64_t capacity>
+typename inner_node_t<Compare, capacity>::const_iterator
+inner_node_t<Compare, capacity>::begin() const
 {
 	return const_iterator(this, 0);
 }
@@ -1189,9 +1686,9 @@ inner_node_t<Key, Compare, capacity>::begin() const
 /**
  * Return begin const_iterator on an array of keys.
  */
-template <typename Key, typename Compare, uint64_t capacity>
-typename inner_node_t<Key, Compare, capacity>::const_iterator
-inner_node_t<Key, Compare, capacity>::cbegin() const
+template <typename Compare, uint64_t capacity>
+typename inner_node_t<Compare, capacity>::const_iterator
+inner_node_t<Compare, capacity>::cbegin() const
 {
 	return const_iterator(this, 0);
 }
@@ -1199,9 +1696,9 @@ inner_node_t<Key, Compare, capacity>::cbegin() const
 /**
  * Return end iterator on an array of keys.
  */
-template <typename Key, typename Compare, uint64_t capacity>
-typename inner_node_t<Key, Compare, capacity>::iterator
-inner_node_t<Key, Compare, capacity>::end()
+template <typename Compare, uint64_t capacity>
+typename inner_node_t<Compare, capacity>::iterator
+inner_node_t<Compare, capacity>::end()
 {
 	return begin() + this->size();
 }
@@ -1209,9 +1706,9 @@ inner_node_t<Key, Compare, capacity>::end()
 /**
  * Return end const_iterator on an array of keys.
  */
-template <typename Key, typename Compare, uint64_t capacity>
-typename inner_node_t<Key, Compare, capacity>::const_iterator
-inner_node_t<Key, Compare, capacity>::end() const
+template <typename Compare, uint64_t capacity>
+typename inner_node_t<Compare, capacity>::const_iterator
+inner_node_t<Compare, capacity>::end() const
 {
 	return begin() + this->size();
 }
@@ -1219,9 +1716,9 @@ inner_node_t<Key, Compare, capacity>::end() const
 /**
  * Return end const_iterator on an array of keys.
  */
-template <typename Key, typename Compare, uint64_t capacity>
-typename inner_node_t<Key, Compare, capacity>::const_iterator
-inner_node_t<Key, Compare, capacity>::cend() const
+template <typename Compare, uint64_t capacity>
+typename inner_node_t<Compare, capacity>::const_iterator
+inner_node_t<Compare, capacity>::cend() const
 {
 	return begin() + this->size();
 }
@@ -1229,53 +1726,45 @@ inner_node_t<Key, Compare, capacity>::cend() const
 /**
  * Return the size of the array of keys.
  */
-template <typename Key, typename Compare, uint64_t capacity>
-typename inner_node_t<Key, Compare, capacity>::size_type
-inner_node_t<Key, Compare, capacity>::size() const
+template <typename Compare, uint64_t capacity>
+typename inner_node_t<Compare, capacity>::size_type
+inner_node_t<Compare, capacity>::size() const
 {
 	return _size;
 }
 
-template <typename Key, typename Compare, uint64_t capacity>
-typename inner_node_t<Key, Compare, capacity>::const_reference
-inner_node_t<Key, Compare, capacity>::back() const
+template <typename Compare, uint64_t capacity>
+typename inner_node_t<Compare, capacity>::const_reference
+inner_node_t<Compare, capacity>::back() const
 {
-	return *entries[this->size() - 1];
+	return entries[this->size() - 1];
 }
 
-template <typename Key, typename Compare, uint64_t capacity>
-typename inner_node_t<Key, Compare, capacity>::reference
-	inner_node_t<Key, Compare, capacity>::operator[](size_type pos)
+template <typename Compare, uint64_t capacity>
+typename inner_node_t<Compare, capacity>::reference
+	inner_node_t<Compare, capacity>::operator[](size_type pos)
 {
 	assert(pos <= size());
-	return *entries[pos];
+	return entries[pos];
 }
 
-template <typename Key, typename Compare, uint64_t capacity>
-typename inner_node_t<Key, Compare, capacity>::const_reference
-	inner_node_t<Key, Compare, capacity>::operator[](size_type pos) const
+template <typename Compare, uint64_t capacity>
+typename inner_node_t<Compare, capacity>::const_reference
+	inner_node_t<Compare, capacity>::operator[](size_type pos) const
 {
 	assert(pos <= size());
-	return *entries[pos];
+	return entries[pos];
 }
 
-template <typename Key, typename Compare, uint64_t capacity>
-bool inner_node_t<Key, Compare, capacity>::is_sorted(const key_compare &comp)
+template <typename Compare, uint64_t capacity>
+bool inner_node_t<Compare, capacity>::is_sorted(const key_compare &comp)
 {
 	return std::is_sorted(begin(), end(),
 			      [&comp](const key_type &lhs, const key_type &rhs) {
-				      return comp(lhs, rhs);
+				      return comp(lhs.view(), rhs.view());
 			      });
 }
 
-template <typename Key, typename Compare, uint64_t capacity>
-pool_base inner_node_t<Key, Compare, capacity>::get_pool() const noexcept
-{
-	auto pop = pmemobj_pool_by_ptr(this);
-	assert(pop != nullptr);
-	return pool_base(pop);
-}
-
 // -------------------------------------------------------------------------------------
 // ----------------------------------- b_tree_iterator ---------------------------------
 // -------------------------------------------------------------------------------------
@@ -1367,52 +1856,1075 @@ b_tree_iterator<LeafType, is_const> b_tree_iterator<LeafType, is_const>::operato
 	return tmp;
 }
 
-template <typename LeafType, bool is_const>
-bool b_tree_iterator<LeafType, is_const>::operator==(const b_tree_iterator &other) const
-{
-	return current_node == other.current_node && leaf_it == other.leaf_it;
-}
+template <typename LeafType, bool is_const>
+bool b_tree_iterator<LeafType, is_const>::operator==(const b_tree_iterator &other) const
+{
+	return current_node == other.current_node && leaf_it == other.leaf_it;
+}
+
+template <typename LeafType, bool is_const>
+bool b_tree_iterator<LeafType, is_const>::operator!=(const b_tree_iterator &other) const
+{
+	return !(*this == other);
+}
+
+template <typename LeafType, bool is_const>
+typename b_tree_iterator<LeafType, is_const>::reference
+	b_tree_iterator<LeafType, is_const>::operator*() const
+{
+	return *(leaf_it);
+}
+
+template <typename LeafType, bool is_const>
+typename b_tree_iterator<LeafType, is_const>::pointer
+	b_tree_iterator<LeafType, is_const>::operator->() const
+{
+	return &**this;
+}
+
+/**
+ * Returns the whole key of the element (keys in leafs are stored without their
+ * common prefix), it may be copied to buffer.
+ */
+template <typename LeafType, bool is_const>
+string_view b_tree_iterator<LeafType, is_const>::key(std::string &buffer) const
+{
+	return current_node->key(*leaf_it, buffer);
+}
+
+template <typename LeafType, bool is_const>
+typename b_tree_iterator<LeafType, is_const>::leaf_node_ptr
+b_tree_iterator<LeafType, is_const>::node() const
+{
+	return current_node;
+}
+
+// -------------------------------------------------------------------------------------
+// ------------------------------------- b_tree_base -----------------------------------
+// -------------------------------------------------------------------------------------
+
+template <typename Key, typename T, typename Compare, std::size_t degree>
+b_tree_base<Key, T, Compare, degree>::pmem_type::pmem_type(bool prefix_compression)
+    : version(layout_version),
+      prefix_compression(prefix_compression),
+      legacy(OID_NULL),
+      legacy_leafs(0)
+{
+	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
+	std::memset(reserved, 0, sizeof(reserved));
+	head = make_persistent<leaf_type>();
+}
+
+template <typename Key, typename T, typename Compare, std::size_t degree>
+b_tree_base<Key, T, Compare, degree>::pmem_type::~pmem_type()
+{
+	try {
+		delete_persistent<leaf_type>(head);
+	} catch (transaction_error &e) {
+		std::terminate();
+	}
+}
+
+/**
+ * Opens the tree, which must be of the current layout_version. Rebuilds inner
+ * nodes (see rebuild_index), which also resets version locks of all leafs and
+ * counts the elements (none of them is persistent) and restores order of
+ * entries in leafs if needed (see insert_to_leaf). Leafs are processed by up to
+ * threads threads.
+ *
+ * bytewise tells whether keys are compared byte by byte (so keys which are equal
+ * according to the comparator are also equal byte by byte). Only then lookups
+ * can skip keys by fingerprints and separator keys of inner nodes can be
+ * truncated.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+b_tree_base<Key, T, Compare, degree>::b_tree_base(pmem_type *data, bool bytewise,
+						  size_type threads)
+    : data(data),
+      head(data->head),
+      compare(data->compare),
+      _size(0),
+      bytewise(bytewise),
+      root(nullptr),
+      last_leaf(nullptr),
+      rebuild_threads(std::max<size_type>(threads, 1)),
+      rebuild_on_abort(false)
+{
+	assert(data->version == layout_version);
+	rebuild_index();
+}
+
+/**
+ * Frees inner nodes, must be called before the pool is closed.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+b_tree_base<Key, T, Compare, degree>::~b_tree_base()
+{
+	free_index();
+}
+
+/**
+ * Looks up key without taking any locks and copies its value to *value (unless
+ * value is nullptr).
+ *
+ * @return true if the key was found
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K>
+bool b_tree_base<Key, T, Compare, degree>::concurrent_find(const K &key,
+							   std::string *value) const
+{
+	optimistic_read_guard guard;
+
+	while (true) {
+		uint64_t version;
+		leaf_type *leaf = find_leaf_optimistic(&key, version);
+
+		bool found;
+		if (leaf_find(leaf, version, key, found, value))
+			return found;
+	}
+}
+
+/**
+ * Looks up key and calls f(value) if it is found. The value is copied (and
+ * validated) before f is called, so no lock is held while f runs: values of up
+ * to small_value_size bytes are copied to the stack, larger ones to the heap.
+ *
+ * @return true if the key was found
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K, typename F>
+bool b_tree_base<Key, T, Compare, degree>::concurrent_get(const K &key, F &&f) const
+{
+	char buffer[small_value_size];
+	std::string large_buffer;
+	while (true) {
+		string_view value;
+		{
+			optimistic_read_guard guard;
+
+			uint64_t version;
+			leaf_type *leaf = find_leaf_optimistic(&key, version);
+
+			bool found;
+			size_type slot;
+			if (!leaf_lookup(leaf, version, key, found, slot))
+				continue;
+			if (!found)
+				return false;
+
+			value = view(leaf->slot_entry(slot).second);
+			if (leaf->mtx.read_retry(version))
+				continue;
+
+			if (value.size() <= small_value_size) {
+				std::memcpy(buffer, value.data(), value.size());
+				value = string_view(buffer, value.size());
+			} else {
+				large_buffer.assign(value.data(), value.size());
+				value = string_view(large_buffer.data(),
+						    large_buffer.size());
+			}
+
+			if (leaf->mtx.read_retry(version))
+				continue;
+		}
+
+		f(value);
+		return true;
+	}
+}
+
+/**
+ * Calls f(key, value) for every element in range between first and last (bounds
+ * are included if first_inclusive/last_inclusive is set, nullptr means no bound).
+ * f returns false to stop the scan, in which case concurrent_scan returns false
+ * as well.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K, typename F>
+bool b_tree_base<Key, T, Compare, degree>::concurrent_scan(const K *first,
+							   bool first_inclusive,
+							   const K *last,
+							   bool last_inclusive,
+							   F &&f) const
+{
+	return scan(first, first_inclusive, last, last_inclusive, std::forward<F>(f));
+}
+
+/**
+ * Counts elements in range between first and last, bounds are interpreted in the
+ * same way as in concurrent_scan(). It is the difference of ranks of the bounds,
+ * so it does not depend on the number of elements in the range. If the tree is
+ * modified concurrently, the result may count an element which is being
+ * inserted or removed (or not).
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K>
+typename b_tree_base<Key, T, Compare, degree>::size_type
+b_tree_base<Key, T, Compare, degree>::concurrent_count(const K *first,
+						       bool first_inclusive,
+						       const K *last,
+						       bool last_inclusive) const
+{
+	optimistic_read_guard guard;
+
+	size_type begin = first ? rank(first, !first_inclusive) : 0;
+	size_type end = last ? rank(last, last_inclusive) : size();
+
+	return end > begin ? end - begin : 0;
+}
+
+/**
+ * Returns the number of elements less than key (or not greater than key, if
+ * upper is set). On the way down, elements of all children to the left of the
+ * one which is descended to are added up, without visiting their subtrees.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K>
+typename b_tree_base<Key, T, Compare, degree>::size_type
+b_tree_base<Key, T, Compare, degree>::rank(const K *key, bool upper) const
+{
+	while (true) {
+		node_t *node = root;
+		uint64_t version = node->mtx.read_begin();
+		if (node != root)
+			continue;
+
+		size_type result = 0;
+		while (node && !node->leaf()) {
+			inner_type *inner = cast_inner(node);
+			size_type pos = inner->child_position(*key, compare);
+			for (size_type i = 0; i < pos; ++i)
+				result += subtree_size(
+					inner->get_left_child(inner->begin() + i));
+			node_t *child = inner->get_left_child(inner->begin() + pos);
+			if (inner->mtx.read_retry(version)) {
+				node = nullptr;
+				break;
+			}
+
+			uint64_t child_version = child->mtx.read_begin();
+			if (inner->mtx.read_retry(version)) {
+				node = nullptr;
+				break;
+			}
+
+			node = child;
+			version = child_version;
+		}
+
+		size_type pos;
+		if (node && leaf_bound(cast_leaf(node), version, *key, upper, pos))
+			return result + pos;
+	}
+}
+
+/**
+ * Adds diff to the number of elements of every inner node on the way to the leaf
+ * of key (or to the rightmost leaf, if key is nullptr), the leaf itself is not
+ * read (it may be already deleted). Concurrent writers call
+ * it in the shared mode of index_mtx, while they still hold the lock of the
+ * leaf, so the leaf is still below the same inner nodes. Otherwise the caller
+ * must have the tree for itself and inner nodes are restored by rebuild_index()
+ * if an enclosing transaction aborts (see update_index).
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K>
+void b_tree_base<Key, T, Compare, degree>::add_count(const K *key,
+						     difference_type diff)
+{
+	update_index([&] {
+		inner_type *inner = cast_inner(root);
+		while (true) {
+			inner->elements.fetch_add(static_cast<size_type>(diff));
+			if (inner->level() == 1)
+				break;
+
+			/* leafs of other writers may be split meanwhile */
+			node_t *child;
+			uint64_t version;
+			do {
+				version = inner->mtx.read_begin();
+				child = key ? inner->find_child(*key, compare)
+					    : inner->get_left_child(inner->end());
+			} while (inner->mtx.read_retry(version));
+			inner = cast_inner(child);
+		}
+	});
+}
+
+template <typename Key, typename T, typename Compare, std::size_t degree>
+typename b_tree_base<Key, T, Compare, degree>::size_type
+b_tree_base<Key, T, Compare, degree>::subtree_size(const node_t *node)
+{
+	if (node->leaf())
+		return static_cast<const leaf_type *>(node)->size();
+
+	return static_cast<const inner_type *>(node)->elements.load();
+}
+
+/**
+ * Inserts (key, obj) or assigns obj to the existing element.
+ *
+ * Writers descend the tree in the same way as readers and lock only the nodes
+ * they modify: a leaf, or a leaf together with its parent when the leaf is split.
+ * A lock is taken only if the node did not change since it was read, otherwise
+ * the operation restarts from the root. Full inner nodes met on the way down are
+ * split eagerly, so a split of a leaf never has to propagate upwards (and the
+ * root is never a leaf, so every leaf has a parent). A new element is counted by
+ * inner nodes on the way to its leaf afterwards, see add_count.
+ *
+ * @return true if a new element was inserted
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K, typename M>
+bool b_tree_base<Key, T, Compare, degree>::concurrent_insert_or_assign(K &&key,
+								       M &&obj)
+{
+	auto pop = get_pool_base();
+	optimistic_read_guard guard;
+	shared_lock_guard<rw_spin_lock> index_lock(index_mtx);
+
+	if (try_append(std::forward<K>(key), std::forward<M>(obj)))
+		return true;
+
+	while (true) {
+		node_t *node = root;
+		uint64_t version = node->mtx.read_begin();
+		if (node != root)
+			continue;
+
+		inner_type *parent = nullptr;
+		uint64_t parent_version = 0;
+		while (node && !node->leaf()) {
+			inner_type *inner = cast_inner(node);
+			if (inner->full()) {
+				index_lock.unlock();
+				split_inner_locked(inner, version, parent,
+						   parent_version);
+				index_lock.lock();
+				node = nullptr;
+				break;
+			}
+
+			node_t *child = inner->find_child(key, compare);
+			if (inner->mtx.read_retry(version)) {
+				node = nullptr;
+				break;
+			}
+
+			uint64_t child_version = child->mtx.read_begin();
+			if (inner->mtx.read_retry(version)) {
+				node = nullptr;
+				break;
+			}
+
+			parent = inner;
+			parent_version = version;
+			node = child;
+			version = child_version;
+		}
+
+		if (node == nullptr)
+			continue;
+
+		leaf_type *leaf = cast_leaf(node);
+		bool found;
+		size_type slot;
+		size_type pos = 0;
+		if (!leaf_lookup(leaf, version, key, found, slot))
+			continue;
+		if (!found && !leaf_bound(leaf, version, key, false, pos))
+			continue;
+
+		bool full = leaf->full();
+		if (leaf->mtx.read_retry(version))
+			continue;
+
+		if (found || !full) {
+			if (!leaf->mtx.try_lock(version))
+				continue;
+			std::unique_lock<version_lock> lock(leaf->mtx, std::adopt_lock);
+
+			if (found) {
+				pmem::obj::transaction::run(pop, [&] {
+					leaf->slot_entry(slot).second =
+						std::forward<M>(obj);
+				});
+			} else {
+				insert_to_leaf(pop, leaf, leaf->begin() + pos,
+					       std::forward<K>(key),
+					       std::forward<M>(obj));
+				add_count(&key, 1);
+			}
+			return !found;
+		}
+
+		/* leaf is full, split it (parent is not full) */
+		assert(parent != nullptr);
+		if (!parent->mtx.try_lock(parent_version))
+			continue;
+		std::unique_lock<version_lock> parent_lock(parent->mtx, std::adopt_lock);
+		if (!leaf->mtx.try_lock(version))
+			continue;
+		std::unique_lock<version_lock> lock(leaf->mtx, std::adopt_lock);
+
+		leaf_pptr split_leaf(leaf);
+		split_leaf_node(pop, parent, split_leaf, std::forward<K>(key),
+				std::forward<M>(obj));
+		/* add_count() reads the parent */
+		parent_lock.unlock();
+		add_count(&key, 1);
+		return true;
+	}
+}
+
+/**
+ * Inserts (key, obj) at the end of the rightmost leaf (see last_leaf) without
+ * descending the tree, if key is greater than all keys in the tree and the leaf
+ * is not full. The rightmost leaf is the last child on the rightmost path, so
+ * every key greater than its keys belongs to it.
+ *
+ * @pre index_mtx must be held in shared mode.
+ *
+ * @return false if nothing was inserted and the caller must descend the tree
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K, typename M>
+bool b_tree_base<Key, T, Compare, degree>::try_append(K &&key, M &&obj)
+{
+	leaf_type *leaf = last_leaf;
+	if (leaf == nullptr)
+		return false;
+
+	uint64_t version = leaf->mtx.read_begin();
+	string_view key_suffix = view(key);
+	string_view prefix = view(leaf->get_prefix());
+	size_type size = leaf->size();
+	string_view back = size > 0 ? view(leaf->entry(size - 1).first) : string_view();
+	bool rightmost = !leaf->get_next() && !leaf->full();
+	if (leaf->mtx.read_retry(version))
+		return false;
+
+	int c = leaf_type::strip_prefix(prefix, key_suffix);
+	bool greater = size == 0 || c > 0 || (c == 0 && compare(back, key_suffix));
+	if (!rightmost || !greater || leaf->mtx.read_retry(version))
+		return false;
+
+	if (!leaf->mtx.try_lock(version))
+		return false;
+	std::unique_lock<version_lock> lock(leaf->mtx, std::adopt_lock);
+
+	auto pop = get_pool_base();
+	insert_to_leaf(pop, leaf, leaf->end(), std::forward<K>(key),
+		       std::forward<M>(obj));
+	add_count<string_view>(nullptr, 1);
+	return true;
+}
+
+/**
+ * Removes key from its leaf without locking anything but the leaf. Removal of
+ * the only element of a leaf requires rebalancing: in this case nothing is
+ * removed and the caller must fall back to erase().
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K>
+typename b_tree_base<Key, T, Compare, degree>::erase_result
+b_tree_base<Key, T, Compare, degree>::concurrent_erase(const K &key)
+{
+	auto pop = get_pool_base();
+	optimistic_read_guard guard;
+	shared_lock_guard<rw_spin_lock> index_lock(index_mtx);
+
+	while (true) {
+		uint64_t version;
+		leaf_type *leaf = find_leaf_optimistic(&key, version);
+
+		bool found;
+		size_type slot = 0;
+		if (!leaf_lookup(leaf, version, key, found, slot))
+			continue;
+
+		bool exclusive = leaf->size() == 1;
+		if (leaf->mtx.read_retry(version))
+			continue;
+
+		if (!found)
+			return erase_result::not_found;
+		if (exclusive)
+			return erase_result::exclusive_required;
+
+		if (!leaf->mtx.try_lock(version))
+			continue;
+		std::unique_lock<version_lock> lock(leaf->mtx, std::adopt_lock);
+
+		pmem::obj::transaction::run(pop, [&] {
+			leaf->erase(pop, view(key), compare);
+			add_size_on_commit(-1);
+		});
+		add_count(&key, -1);
+		return erase_result::erased;
+	}
+}
+
+/**
+ * Changes the number of elements when the (outermost) transaction commits, the
+ * counter is not persistent, so it would not be rolled back on abort.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+void b_tree_base<Key, T, Compare, degree>::add_size_on_commit(difference_type diff)
+{
+	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
+	pmem::obj::transaction::register_callback(
+		pmem::obj::transaction::stage::oncommit,
+		[this, diff] { _size.fetch_add(static_cast<size_type>(diff)); });
+}
+
+/**
+ * Builds inner nodes from the chain of leafs, bottom up. Leafs are collected
+ * first (by following the chain) and then processed in parallel: their version
+ * locks are reset, their order is restored if needed and their elements are
+ * counted (and added up by inner nodes). Every inner node gets up to
+ * node_capacity children, so that it is not full and the first insert into it
+ * does not split it.
+ *
+ * The root is always an inner node (of the first level, if there is just one
+ * leaf), so that every leaf has a parent.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+void b_tree_base<Key, T, Compare, degree>::rebuild_index()
+{
+	free_index();
+
+	std::vector<node_t *> nodes;
+	for (leaf_type *leaf = head.get(); leaf; leaf = leaf->get_next().get())
+		nodes.push_back(leaf);
+
+	auto pop = get_pool_base();
+	size_type n = nodes.size();
+	size_type threads_count = std::max<size_type>(
+		std::min(rebuild_threads, n / rebuild_leafs_per_thread), 1);
+
+	std::vector<size_type> sizes(n);
+	parallel_for(threads_count, [&](size_t t) {
+		for (size_type i = n * t / threads_count; i < n * (t + 1) / threads_count;
+		     ++i) {
+			leaf_type *leaf = cast_leaf(nodes[i]);
+			leaf->mtx.runtime_initialize();
+			/* insert_to_leaf() could have been interrupted */
+			if (!leaf->order_valid())
+				leaf->restore_order(pop, compare);
+
+			sizes[i] = leaf->size();
+		}
+	});
+	_size = std::accumulate(sizes.begin(), sizes.end(), size_type(0));
+
+	/* separator between every node and its left sibling */
+	std::vector<separator_key> keys(n);
+	parallel_for(threads_count, [&](size_t t) {
+		for (size_type i = std::max<size_type>(n * t / threads_count, 1);
+		     i < n * (t + 1) / threads_count; ++i)
+			keys[i] = leaf_separator(cast_leaf(nodes[i - 1]),
+						 cast_leaf(nodes[i]));
+	});
+
+	last_leaf = cast_leaf(nodes.back());
+
+	std::vector<std::unique_ptr<inner_type>> allocated;
+	uint64_t level = 0;
+	do {
+		++level;
+		size_type count = (nodes.size() + node_capacity - 1) / node_capacity;
+		std::vector<node_t *> parents;
+		std::vector<separator_key> parent_keys;
+		std::vector<size_type> parent_sizes;
+		for (size_type i = 0; i < count; ++i) {
+			size_type first = nodes.size() * i / count;
+			size_type last = nodes.size() * (i + 1) / count;
+
+			allocated.emplace_back(allocate_inner(level, nodes[first]));
+			inner_type *inner = allocated.back().get();
+			size_type elements = sizes[first];
+			for (size_type j = first + 1; j < last; ++j) {
+				inner->append(std::move(keys[j]), nodes[j]);
+				elements += sizes[j];
+			}
+			inner->elements = elements;
+
+			parents.push_back(inner);
+			parent_keys.push_back(std::move(keys[first]));
+			parent_sizes.push_back(elements);
+		}
+
+		nodes.swap(parents);
+		keys.swap(parent_keys);
+		sizes.swap(parent_sizes);
+	} while (nodes.size() > 1);
+
+	for (auto &inner : allocated)
+		inner.release();
+	root = nodes.front();
+}
+
+/**
+ * Frees all inner nodes. It does not read leafs, which may be already freed (if
+ * it is called after a transaction which allocated them aborted).
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+void b_tree_base<Key, T, Compare, degree>::free_index()
+{
+	std::vector<inner_type *> nodes;
+	if (root != nullptr)
+		nodes.push_back(cast_inner(root));
+	root = nullptr;
+	last_leaf = nullptr;
+
+	while (!nodes.empty()) {
+		inner_type *inner = nodes.back();
+		nodes.pop_back();
+
+		if (inner->level() > 1) {
+			for (auto it = inner->begin(); it != inner->end(); ++it)
+				nodes.push_back(cast_inner(inner->get_left_child(it)));
+			nodes.push_back(cast_inner(inner->get_left_child(inner->end())));
+		}
+		deallocate(inner);
+	}
+}
+
+/**
+ * Calls f, which modifies inner nodes after the leafs were modified in a
+ * transaction. Inner nodes are not persistent, so if the transaction was the
+ * outermost one (it is already committed), they are simply modified. Otherwise
+ * they are modified right away as well (later operations in the enclosing
+ * transaction must see the new leafs), but the whole index is rebuilt from the
+ * leafs if the enclosing transaction aborts.
+ *
+ * @pre f must not throw if the transaction was the outermost one
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename F>
+void b_tree_base<Key, T, Compare, degree>::update_index(F &&f)
+{
+	if (pmemobj_tx_stage() == TX_STAGE_WORK && !rebuild_on_abort) {
+		pmem::obj::transaction::register_callback(
+			pmem::obj::transaction::stage::oncommit,
+			[this] { rebuild_on_abort = false; });
+		pmem::obj::transaction::register_callback(
+			pmem::obj::transaction::stage::onabort, [this] {
+				rebuild_on_abort = false;
+				rebuild_index();
+			});
+		rebuild_on_abort = true;
+	}
+
+	f();
+}
+
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename S>
+string_view b_tree_base<Key, T, Compare, degree>::view(const S &str)
+{
+	return string_view(str.cdata(), str.size());
+}
+
+template <typename Key, typename T, typename Compare, std::size_t degree>
+string_view b_tree_base<Key, T, Compare, degree>::view(string_view str)
+{
+	return str;
+}
+
+template <typename Key, typename T, typename Compare, std::size_t degree>
+typename b_tree_base<Key, T, Compare, degree>::size_type
+b_tree_base<Key, T, Compare, degree>::common_prefix(string_view a, string_view b)
+{
+	size_type n = std::min(a.size(), b.size());
+	return static_cast<size_type>(
+		std::mismatch(a.data(), a.data() + n, b.data()).first - a.data());
+}
+
+/**
+ * Returns separator key for two adjacent leafs, where lower is the greatest key
+ * of the left one and upper is the smallest key of the right one. If keys are
+ * compared byte by byte, it is the shortest prefix of upper which is greater
+ * than lower (long keys with a common prefix usually differ only at the end, so
+ * separators are short enough to be stored inline), otherwise it is upper.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+separator_key
+b_tree_base<Key, T, Compare, degree>::make_separator(string_view lower,
+						     string_view upper) const
+{
+	if (!bytewise)
+		return separator_key(upper);
+
+	assert(lower.compare(upper) < 0);
+	size_type common = common_prefix(lower, upper);
+	assert(common < upper.size());
+	return separator_key(string_view(upper.data(), common + 1));
+}
+
+/**
+ * Returns separator key between two adjacent leafs, made from their whole keys.
+ * Only the leftmost leaf can be empty, right is never empty.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+separator_key
+b_tree_base<Key, T, Compare, degree>::leaf_separator(const leaf_type *left,
+						     const leaf_type *right) const
+{
+	std::string lower_buffer, upper_buffer;
+	string_view upper = right->key(right->front(), upper_buffer);
+	if (left->size() == 0)
+		return separator_key(upper);
+
+	return make_separator(left->key(left->back(), lower_buffer), upper);
+}
+
+/**
+ * Leafs store the common prefix of their keys once (see leaf_node_t::prefix)
+ * only if it was requested when the pool was created and if keys are compared
+ * byte by byte.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+bool b_tree_base<Key, T, Compare, degree>::compress_prefixes() const
+{
+	return data->prefix_compression && bytewise;
+}
+
+/**
+ * Makes the prefix of a leaf the longest common prefix of its keys (which is the
+ * common prefix of the first and the last one), if it is longer than the current
+ * one. Prefixes are extended only when leafs are split and they are shortened
+ * when a key with a different prefix is inserted (see insert_to_leaf).
+ *
+ * @pre must be called in a transaction scope.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+void b_tree_base<Key, T, Compare, degree>::extend_prefix(leaf_type *leaf)
+{
+	if (!compress_prefixes() || leaf->size() < 2)
+		return;
+
+	std::string first_buffer, last_buffer;
+	string_view first = leaf->key(leaf->front(), first_buffer);
+	string_view last = leaf->key(leaf->back(), last_buffer);
+	size_type n = common_prefix(first, last);
+	if (n > leaf->get_prefix().size())
+		leaf->set_prefix(string_view(first.data(), n));
+}
+
+/**
+ * Descends, without taking any locks, to the leaf which may contain key (or to
+ * the leftmost leaf if key is nullptr). Version of every inner node is validated
+ * after the version of its child is read, so the child could not have been
+ * split or freed in between (writers lock both the parent and the child).
+ *
+ * @return the leaf, its version (to be validated by the caller) is stored in
+ * the version argument
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K>
+typename b_tree_base<Key, T, Compare, degree>::leaf_type *
+b_tree_base<Key, T, Compare, degree>::find_leaf_optimistic(const K *key,
+							   uint64_t &version) const
+{
+	while (true) {
+		node_t *node = root;
+		uint64_t node_version = node->mtx.read_begin();
+		if (node != root)
+			continue;
+
+		while (node && !node->leaf()) {
+			inner_type *inner = cast_inner(node);
+			node_t *child = key ? inner->find_child(*key, compare)
+					    : inner->get_left_child(inner->begin());
+			if (inner->mtx.read_retry(node_version)) {
+				node = nullptr;
+				break;
+			}
+
+			uint64_t child_version = child->mtx.read_begin();
+			if (inner->mtx.read_retry(node_version)) {
+				node = nullptr;
+				break;
+			}
+
+			node = child;
+			node_version = child_version;
+		}
+
+		if (node) {
+			version = node_version;
+			return cast_leaf(node);
+		}
+	}
+}
+
+/**
+ * Binary search in a leaf which may be modified concurrently. Every key is
+ * validated before it is compared, so that a key which is being destroyed is
+ * never used (freed memory of the pool stays mapped, so reading it is harmless).
+ * The prefix of the leaf is validated the same way before it is stripped from key.
+ * Sets pos to the first entry which is not less than key (greater than key if
+ * upper is set).
+ *
+ * @return false if the leaf changed and the result is not valid
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K>
+bool b_tree_base<Key, T, Compare, degree>::leaf_bound(const leaf_type *leaf,
+						      uint64_t version, const K &key,
+						      bool upper, size_type &pos) const
+{
+	string_view key_suffix = view(key);
+	string_view prefix = view(leaf->get_prefix());
+	if (leaf->mtx.read_retry(version))
+		return false;
+
+	int c = leaf_type::strip_prefix(prefix, key_suffix);
+	if (c != 0) {
+		pos = c < 0 ? 0 : leaf->size();
+		return !leaf->mtx.read_retry(version);
+	}
+
+	size_type first = 0;
+	size_type count = leaf->size();
+	while (count > 0) {
+		size_type step = count / 2;
+		string_view k = view(leaf->entry(first + step).first);
+		if (leaf->mtx.read_retry(version))
+			return false;
+
+		if (upper ? !compare(key_suffix, k) : compare(k, key_suffix)) {
+			first += step + 1;
+			count -= step + 1;
+		} else {
+			count = step;
+		}
+	}
+
+	pos = first;
+	return true;
+}
+
+/**
+ * Looks up key in a leaf which may be modified concurrently and sets slot to the
+ * slot of its entry if it is found. If fingerprints can be used, only keys with
+ * the same fingerprint as key are read (usually at most one), otherwise the leaf
+ * is binary searched.
+ *
+ * @return false if the leaf changed and the result is not valid
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K>
+bool b_tree_base<Key, T, Compare, degree>::leaf_lookup(const leaf_type *leaf,
+						       uint64_t version, const K &key,
+						       bool &found, size_type &slot) const
+{
+	found = false;
+	if (!bytewise) {
+		size_type pos;
+		if (!leaf_bound(leaf, version, key, false, pos))
+			return false;
+
+		if (pos < leaf->size()) {
+			slot = leaf->slot(pos);
+			string_view k = view(leaf->slot_entry(slot).first);
+			if (leaf->mtx.read_retry(version))
+				return false;
+
+			found = !compare(key, k);
+		}
+		return true;
+	}
+
+	string_view k = view(key);
+	string_view prefix = view(leaf->get_prefix());
+	if (leaf->mtx.read_retry(version))
+		return false;
+	if (leaf_type::strip_prefix(prefix, k) != 0)
+		return !leaf->mtx.read_retry(version);
+
+	uint64_t matches = leaf->match(leaf_type::fingerprint(k));
+	for (; matches != 0; matches &= matches - 1) {
+		slot = static_cast<size_type>(__builtin_ctzll(matches));
+		string_view e = view(leaf->slot_entry(slot).first);
+		if (leaf->mtx.read_retry(version))
+			return false;
+
+		if (e.compare(k) == 0) {
+			found = true;
+			return true;
+		}
+	}
+
+	return !leaf->mtx.read_retry(version);
+}
+
+/**
+ * Looks up key in a leaf which may be modified concurrently and copies its value
+ * to *value (unless value is nullptr).
+ *
+ * @return false if the leaf changed and the result is not valid
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K>
+bool b_tree_base<Key, T, Compare, degree>::leaf_find(const leaf_type *leaf,
+						     uint64_t version, const K &key,
+						     bool &found,
+						     std::string *value) const
+{
+	size_type slot;
+	if (!leaf_lookup(leaf, version, key, found, slot))
+		return false;
+
+	if (found && value) {
+		string_view v = view(leaf->slot_entry(slot).second);
+		if (leaf->mtx.read_retry(version))
+			return false;
+
+		value->assign(v.data(), v.size());
+	}
+
+	return !leaf->mtx.read_retry(version);
+}
+
+/**
+ * Implementation of concurrent_scan().
+ *
+ * Elements of a leaf are copied and validated together before any of them is
+ * passed to f, so f may take as long as it needs. A leaf which changed while it
+ * was copied is looked up again by the last key passed to f.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K, typename F>
+bool b_tree_base<Key, T, Compare, degree>::scan(const K *first, bool first_inclusive,
+						const K *last, bool last_inclusive,
+						F &&f) const
+{
+	std::string buffer;
+	std::vector<std::pair<size_type, size_type>> sizes;
+	std::string last_key;
+	bool started = false;
+
+	leaf_type *leaf = nullptr;
+	uint64_t version = 0;
+	while (true) {
+		leaf_type *next = nullptr;
+		uint64_t next_version = 0;
+		bool at_end = false;
+		{
+			optimistic_read_guard guard;
+
+			if (leaf == nullptr) {
+				string_view key(last_key);
+				leaf = started ? find_leaf_optimistic(&key, version)
+					       : find_leaf_optimistic(first, version);
+			}
+
+			size_type pos = 0;
+			size_type end = leaf->size();
+			bool valid = true;
+			if (started) {
+				valid = leaf_bound(leaf, version, string_view(last_key),
+						   true, pos);
+			} else if (first) {
+				valid = leaf_bound(leaf, version, *first,
+						   !first_inclusive, pos);
+			}
+			if (valid && last)
+				valid = leaf_bound(leaf, version, *last,
+						   last_inclusive, end);
+
+			buffer.clear();
+			sizes.clear();
+			string_view p = view(leaf->get_prefix());
+			for (size_type i = pos; valid && i < end; ++i) {
+				const value_type &entry = leaf->entry(i);
+				string_view k = view(entry.first);
+				string_view v = view(entry.second);
+				valid = !leaf->mtx.read_retry(version);
+				if (valid) {
+					buffer.append(p.data(), p.size());
+					buffer.append(k.data(), k.size());
+					buffer.append(v.data(), v.size());
+					sizes.emplace_back(p.size() + k.size(),
+							   v.size());
+				}
+			}
+
+			at_end = end < leaf->size();
+			next = leaf->get_next().get();
+			valid = valid && !leaf->mtx.read_retry(version);
+			if (valid && next && !at_end) {
+				next_version = next->mtx.read_begin();
+				valid = !leaf->mtx.read_retry(version);
+			}
+
+			if (!valid) {
+				leaf = nullptr;
+				continue;
+			}
+		}
 
-template <typename LeafType, bool is_const>
-bool b_tree_iterator<LeafType, is_const>::operator!=(const b_tree_iterator &other) const
-{
-	return !(*this == other);
-}
+		size_type offset = 0;
+		for (auto &s : sizes) {
+			string_view k(buffer.data() + offset, s.first);
+			string_view v(buffer.data() + offset + s.first, s.second);
+			offset += s.first + s.second;
 
-template <typename LeafType, bool is_const>
-typename b_tree_iterator<LeafType, is_const>::reference
-	b_tree_iterator<LeafType, is_const>::operator*() const
-{
-	return *(leaf_it);
-}
+			if (!f(k, v))
+				return false;
+		}
 
-template <typename LeafType, bool is_const>
-typename b_tree_iterator<LeafType, is_const>::pointer
-	b_tree_iterator<LeafType, is_const>::operator->() const
-{
-	return &**this;
-}
+		if (!sizes.empty()) {
+			offset -= sizes.back().first + sizes.back().second;
+			last_key.assign(buffer.data() + offset, sizes.back().first);
+			started = true;
+		}
 
-// -------------------------------------------------------------------------------------
-// ------------------------------------- b_tree_base -----------------------------------
-// -------------------------------------------------------------------------------------
+		if (at_end || next == nullptr)
+			return true;
 
-template <typename Key, typename T, typename Compare, std::size_t degree>
-b_tree_base<Key, T, Compare, degree>::b_tree_base()
-{
-	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
-	cast_leaf(root) = allocate_leaf();
-	_size = 0;
+		leaf = next;
+		version = next_version;
+	}
 }
 
+/**
+ * Splits a full inner node, unless it or its parent (which is locked as well,
+ * unless node is the root) changed since they were read. The caller restarts
+ * from the root in both cases. Writers which count elements are waited for, so
+ * that elements of both halves can be counted (see split_half).
+ *
+ * @pre index_mtx must not be held by the caller.
+ */
 template <typename Key, typename T, typename Compare, std::size_t degree>
-b_tree_base<Key, T, Compare, degree>::~b_tree_base()
-{
-	try {
-		deallocate(root);
-	} catch (transaction_error &e) {
-		std::terminate();
+void b_tree_base<Key, T, Compare, degree>::split_inner_locked(inner_type *node,
+							      uint64_t version,
+							      inner_type *parent,
+							      uint64_t parent_version)
+{
+	std::unique_lock<rw_spin_lock> index_lock(index_mtx);
+	std::unique_lock<version_lock> parent_lock;
+	if (parent) {
+		if (!parent->mtx.try_lock(parent_version))
+			return;
+		parent_lock =
+			std::unique_lock<version_lock>(parent->mtx, std::adopt_lock);
 	}
+	if (!node->mtx.try_lock(version))
+		return;
+	std::unique_lock<version_lock> lock(node->mtx, std::adopt_lock);
+
+	if (parent)
+		split_inner_node(node, parent);
+	else
+		split_inner_node(node);
 }
 
 template <typename Key, typename T, typename Compare, std::size_t degree>
@@ -1424,22 +2936,20 @@ b_tree_base<Key, T, Compare, degree>::try_emplace(K &&key, M &&obj)
 
 	path_type path;
 	leaf_pptr leaf = find_leaf_to_insert(std::forward<K>(key), path);
+	assert(!path.empty());
 
 	// --------------- entry with the same key found ---------------
-	typename leaf_type::iterator leaf_it = leaf->find(std::forward<K>(key), compare);
+	typename leaf_type::iterator leaf_it = leaf->find(view(key), compare);
 	if (leaf_it != leaf->end()) {
 		return std::pair<iterator, bool>(iterator(leaf.get(), leaf_it), false);
 	}
 
 	// ------------------ leaf not full -> insert ------------------
 	if (!leaf->full()) {
-		return internal_insert(leaf, std::forward<K>(key), std::forward<M>(obj));
-	}
-
-	// -------------------- if root is leaf ------------------------
-	if (path.empty()) {
-		return split_leaf_node(pop, leaf, std::forward<K>(key),
-				       std::forward<M>(obj));
+		auto result = internal_insert(leaf, std::forward<K>(key),
+					      std::forward<M>(obj));
+		add_count(&key, 1);
+		return result;
 	}
 
 	// ---------- find the first not full node from leaf -----------
@@ -1453,22 +2963,180 @@ b_tree_base<Key, T, Compare, degree>::try_emplace(K &&key, M &&obj)
 	// -------------- if root is full split root -------------------
 	inner_type *parent_node = nullptr;
 	if ((*i)->full()) {
-		split_inner_node(pop, *i);
+		split_inner_node(*i);
 		parent_node = cast_inner(
-			cast_inner(root)->get_child(std::forward<K>(key), compare).get());
+			cast_inner(root)->find_child(std::forward<K>(key), compare));
 	} else {
-		parent_node = (*i).get();
+		parent_node = *i;
 	}
 	++i;
 
 	for (; i != path.end(); ++i) {
-		split_inner_node(pop, *i, parent_node);
+		split_inner_node(*i, parent_node);
 		parent_node = cast_inner(
-			parent_node->get_child(std::forward<K>(key), compare).get());
+			parent_node->find_child(std::forward<K>(key), compare));
+	}
+
+	auto result = split_leaf_node(pop, parent_node, leaf, std::forward<K>(key),
+				      std::forward<M>(obj));
+	add_count(&key, 1);
+	return result;
+}
+
+/**
+ * Appends elements of range [first, last), which must be sorted and unique, if all
+ * of them are greater than elements already in the tree (otherwise it returns
+ * false and does nothing). Leafs are filled left to right up to leaf_size
+ * elements: the rightmost leaf first and then new leafs, append_leafs_per_tx of
+ * them in each transaction, which are linked to the index after it commits
+ * (see append_to_index), so no leaf is split.
+ *
+ * Must be called outside of a transaction and not concurrently with any other
+ * method. If a transaction aborts, elements appended by previous transactions stay
+ * in the tree and the exception is rethrown.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename ForwardIt>
+bool b_tree_base<Key, T, Compare, degree>::append(ForwardIt first, ForwardIt last,
+						  size_type leaf_size)
+{
+	assert(pmemobj_tx_stage() == TX_STAGE_NONE);
+	if (first == last)
+		return true;
+
+	leaf_pptr tail(rightmost_leaf());
+	std::string buffer;
+	if (tail->size() > 0 &&
+	    !compare(tail->key(tail->back(), buffer), view(first->first)))
+		return false;
+
+	if (leaf_size == 0 || leaf_size > node_capacity)
+		leaf_size = node_capacity;
+	auto pop = get_pool_base();
+	try {
+		size_type tail_size = tail->size();
+		pmem::obj::transaction::run(pop, [&] {
+			for (; first != last && tail->size() < leaf_size; ++first)
+				insert_to_leaf(pop, tail.get(), tail->end(),
+					       view(first->first), first->second);
+			extend_prefix(tail.get());
+		});
+		add_count<string_view>(
+			nullptr, static_cast<difference_type>(tail->size() - tail_size));
+
+		std::vector<leaf_pptr> leafs;
+		while (first != last) {
+			leafs.clear();
+			pmem::obj::transaction::run(pop, [&] {
+				while (first != last &&
+				       leafs.size() < append_leafs_per_tx) {
+					leaf_pptr prev =
+						leafs.empty() ? tail : leafs.back();
+					leafs.push_back(append_leaf(prev, first, last,
+								    leaf_size));
+				}
+			});
+
+			for (auto &leaf : leafs) {
+				append_to_index(leaf.get(),
+						leaf_separator(leaf->get_prev().get(),
+							       leaf.get()));
+				add_count<string_view>(
+					nullptr,
+					static_cast<difference_type>(leaf->size()));
+			}
+			tail = leafs.back();
+			last_leaf = tail.get();
+		}
+	} catch (...) {
+		rebuild_index();
+		throw;
+	}
+
+	return true;
+}
+
+/**
+ * Allocates a new leaf with up to leaf_size elements from range [first, last),
+ * advances first past them and links the leaf to the chain after prev. With prefix
+ * compression, the prefix of the leaf is set before the elements are inserted, so
+ * keys are written only once.
+ *
+ * @pre must be called in a transaction scope.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename ForwardIt>
+typename b_tree_base<Key, T, Compare, degree>::leaf_pptr
+b_tree_base<Key, T, Compare, degree>::append_leaf(const leaf_pptr &prev,
+						  ForwardIt &first, ForwardIt last,
+						  size_type leaf_size)
+{
+	leaf_pptr leaf = allocate_leaf();
+	ForwardIt leaf_first = first, leaf_last = first;
+	size_type count = 0;
+	for (; first != last && count < leaf_size; ++first, ++count)
+		leaf_last = first;
+
+	string_view lo = view(leaf_first->first);
+	string_view hi = view(leaf_last->first);
+	if (compress_prefixes() && count > 1)
+		leaf->set_prefix(string_view(lo.data(), common_prefix(lo, hi)));
+
+	size_type n = leaf->get_prefix().size();
+	for (; leaf_first != first; ++leaf_first) {
+		string_view key = view(leaf_first->first);
+		leaf->insert(leaf->end(), string_view(key.data() + n, key.size() - n),
+			     leaf_first->second);
+	}
+
+	leaf->set_prev(prev);
+	prev->set_next(leaf);
+	add_size_on_commit(static_cast<difference_type>(count));
+
+	return leaf;
+}
+
+/**
+ * Links node, which was appended to the right of the rightmost node of its level,
+ * to the index. Separator is the separator between node and its left sibling.
+ * Unlike insert, it does not split full inner nodes: the rightmost inner node
+ * gets node as a new child, or a new right sibling with node as its first child,
+ * if it is full. So inner nodes created by appends are full, just like the ones
+ * built by rebuild_index().
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+void b_tree_base<Key, T, Compare, degree>::append_to_index(node_t *node,
+							    separator_key &&separator)
+{
+	path_type path;
+	for (node_t *n = root; !n->leaf();) {
+		inner_type *inner = cast_inner(n);
+		path.push_back(inner);
+		n = inner->get_left_child(inner->end());
 	}
 
-	return split_leaf_node(pop, parent_node, leaf, std::forward<K>(key),
-			       std::forward<M>(obj));
+	/* allocated first, so that nothing can fail once the index is modified */
+	std::vector<std::unique_ptr<inner_type>> allocated;
+	auto parent = path.rbegin();
+	for (; parent != path.rend() && (*parent)->full(); ++parent) {
+		node_t *first_child = allocated.empty() ? node : allocated.back().get();
+		allocated.emplace_back(allocate_inner((*parent)->level(), first_child));
+	}
+
+	node_t *child = allocated.empty() ? node : allocated.back().get();
+	inner_type *new_root = nullptr;
+	if (parent == path.rend()) {
+		allocated.emplace_back(
+			allocate_inner(path.front()->level() + 1, path.front()));
+		new_root = allocated.back().get();
+		new_root->elements = path.front()->elements.load();
+	}
+
+	(new_root ? new_root : *parent)->append(std::move(separator), child);
+	if (new_root)
+		root = new_root;
+	for (auto &inner : allocated)
+		inner.release();
 }
 
 template <typename Key, typename T, typename Compare, std::size_t degree>
@@ -1477,7 +3145,7 @@ typename b_tree_base<Key, T, Compare, degree>::iterator
 b_tree_base<Key, T, Compare, degree>::find(const K &key)
 {
 	leaf_type *leaf = find_leaf_node(key);
-	typename leaf_type::iterator leaf_it = leaf->find(key, compare);
+	typename leaf_type::iterator leaf_it = leaf->find(view(key), compare);
 	if (leaf->end() == leaf_it)
 		return end();
 
@@ -1490,13 +3158,124 @@ typename b_tree_base<Key, T, Compare, degree>::const_iterator
 b_tree_base<Key, T, Compare, degree>::find(const K &key) const
 {
 	leaf_type *leaf = find_leaf_node(key);
-	typename leaf_type::const_iterator leaf_it = leaf->find(key);
+	typename leaf_type::const_iterator leaf_it = leaf->find(view(key), compare);
 	if (leaf->cend() == leaf_it)
 		return cend();
 
 	return const_iterator(leaf, leaf_it);
 }
 
+/**
+ * Looks up every key from range [first, last) and calls f(key, value) for each
+ * of them, where value points to a copy of the value or is nullptr if the key is
+ * not present. f returns false to stop the lookup, in which case multi_find
+ * returns false as well.
+ *
+ * Lookups are processed in groups of lookup_group_size. All lookups in a group
+ * descend the tree together, one level per round: the child of each lookup is
+ * prefetched before switching to the next one, so by the time the group comes
+ * back to it, the node is (hopefully) already in cache and cache misses of
+ * different lookups overlap instead of stalling one after another. Because the
+ * tree is balanced, all lookups in a group reach the leaf level in the same round.
+ *
+ * Nodes are read optimistically, in the same way as in concurrent_find(): the
+ * version of a node is read in the round after its child was prefetched, and a
+ * lookup which sees a concurrent modification is finished by concurrent_find().
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename InputIt, typename F>
+bool b_tree_base<Key, T, Compare, degree>::multi_find(InputIt first, InputIt last,
+						      F &&f) const
+{
+	assert(root != nullptr);
+
+	std::array<InputIt, lookup_group_size> keys;
+	/* nullptr if the lookup must be restarted */
+	std::array<node_t *, lookup_group_size> nodes;
+	std::array<uint64_t, lookup_group_size> versions;
+	std::array<inner_type *, lookup_group_size> parents;
+	std::array<uint64_t, lookup_group_size> parent_versions;
+	std::string value;
+
+	prefetch_node(root);
+
+	while (first != last) {
+		std::size_t n = 0;
+		for (; n < lookup_group_size && first != last; ++n, ++first)
+			keys[n] = first;
+
+		{
+			optimistic_read_guard guard;
+
+			node_t *top = root;
+			uint64_t top_version = top->mtx.read_begin();
+			bool valid = top == root;
+			for (std::size_t i = 0; i < n; ++i) {
+				nodes[i] = valid ? top : nullptr;
+				versions[i] = top_version;
+				parents[i] = nullptr;
+			}
+
+			for (uint64_t level = top->level(); level > 0; --level) {
+				for (std::size_t i = 0; i < n; ++i) {
+					if (nodes[i] == nullptr)
+						continue;
+
+					inner_type *inner = cast_inner(nodes[i]);
+					if (parents[i]) {
+						versions[i] = inner->mtx.read_begin();
+						if (parents[i]->mtx.read_retry(
+							    parent_versions[i])) {
+							nodes[i] = nullptr;
+							continue;
+						}
+					}
+
+					node_t *child =
+						inner->find_child(*keys[i], compare);
+					if (inner->mtx.read_retry(versions[i])) {
+						nodes[i] = nullptr;
+						continue;
+					}
+
+					prefetch_node(child);
+					parents[i] = inner;
+					parent_versions[i] = versions[i];
+					nodes[i] = child;
+				}
+			}
+		}
+
+		for (std::size_t i = 0; i < n; ++i) {
+			bool found = false;
+			bool valid = false;
+			if (nodes[i]) {
+				optimistic_read_guard guard;
+
+				leaf_type *leaf = cast_leaf(nodes[i]);
+				if (parents[i]) {
+					versions[i] = leaf->mtx.read_begin();
+					valid = !parents[i]->mtx.read_retry(
+						parent_versions[i]);
+				} else {
+					valid = true;
+				}
+				valid = valid &&
+					leaf_find(leaf, versions[i], *keys[i], found,
+						  &value);
+			}
+
+			if (!valid)
+				found = concurrent_find(*keys[i], &value);
+
+			if (!f(*keys[i], found ? &value : nullptr))
+				return false;
+		}
+	}
+
+	return true;
+}
+
 /**
  * Returns an iterator pointing to the least element which is larger than or equal
  * to the given key. Keys are sorted in binary order (see
@@ -1512,10 +3291,7 @@ typename b_tree_base<Key, T, Compare, degree>::iterator
 b_tree_base<Key, T, Compare, degree>::lower_bound(const K &key)
 {
 	leaf_type *leaf = find_leaf_node(key);
-	typename leaf_type::iterator leaf_it = std::lower_bound(
-		leaf->begin(), leaf->end(), key, [this](const_reference e, const K &key) {
-			return compare(e.first, key);
-		});
+	typename leaf_type::iterator leaf_it = leaf->lower_bound(view(key), compare);
 	if (leaf->end() == leaf_it)
 		return end();
 
@@ -1538,10 +3314,7 @@ b_tree_base<Key, T, Compare, degree>::lower_bound(const K &key) const
 {
 	leaf_type *leaf = find_leaf_node(key);
 	typename leaf_type::const_iterator leaf_it =
-		std::lower_bound(leaf->cbegin(), leaf->cend(), key,
-				 [this](const_reference e, const K &key) {
-					 return compare(e.first, key);
-				 });
+		leaf->lower_bound(view(key), compare);
 	if (leaf->cend() == leaf_it)
 		return cend();
 
@@ -1563,10 +3336,7 @@ typename b_tree_base<Key, T, Compare, degree>::iterator
 b_tree_base<Key, T, Compare, degree>::upper_bound(const K &key)
 {
 	leaf_type *leaf = find_leaf_node(key);
-	typename leaf_type::iterator leaf_it = std::upper_bound(
-		leaf->begin(), leaf->end(), key, [this](const K &key, const_reference e) {
-			return compare(key, e.first);
-		});
+	typename leaf_type::iterator leaf_it = leaf->upper_bound(view(key), compare);
 	if (leaf->end() == leaf_it) {
 		if (leaf->get_next())
 			return iterator(leaf->get_next().get(),
@@ -1593,10 +3363,7 @@ b_tree_base<Key, T, Compare, degree>::upper_bound(const K &key) const
 {
 	leaf_type *leaf = find_leaf_node(key);
 	typename leaf_type::const_iterator leaf_it =
-		std::upper_bound(leaf->cbegin(), leaf->cend(), key,
-				 [this](const K &key, const_reference e) {
-					 return compare(key, e.first);
-				 });
+		leaf->upper_bound(view(key), compare);
 	if (leaf->cend() == leaf_it) {
 		if (leaf->get_next())
 			return iterator(leaf->get_next().get(),
@@ -1608,152 +3375,113 @@ b_tree_base<Key, T, Compare, degree>::upper_bound(const K &key) const
 }
 
 /**
- * Searches leaf with given key saving extended path including neighbors and inner node
- * with pointer to leaf entry (inner_ptr).
+ * Searches leaf with given key saving path (inner nodes from the root and
+ * positions of children on the way to the leaf).
  */
 template <typename Key, typename T, typename Compare, std::size_t degree>
 template <typename K>
-typename b_tree_base<Key, T, Compare, degree>::leaf_pptr
-b_tree_base<Key, T, Compare, degree>::get_path_ext(
-	const K &key, std::vector<inner_pair> &path,
-	std::vector<std::pair<node_pptr, node_pptr>> &neighbors, inner_pair &inner_ptr)
+typename b_tree_base<Key, T, Compare, degree>::leaf_type *
+b_tree_base<Key, T, Compare, degree>::get_path_ext(const K &key,
+						   std::vector<inner_pair> &path)
 {
-	node_pptr temp = root;
+	node_t *temp = root;
 	while (!temp->leaf()) {
-		auto set = cast_inner(temp)->get_child_and_siblings(key, compare);
-		path.push_back(std::make_pair(cast_inner(temp).get(), std::get<3>(set)));
-		neighbors.push_back(std::make_pair(std::get<1>(set), std::get<2>(set)));
-		if (!compare(*std::get<3>(set), key) &&
-		    !compare(key, *std::get<3>(set))) {
-			assert(inner_ptr.first == nullptr); // it should not duplicate
-			inner_ptr = std::make_pair(cast_inner(temp), std::get<3>(set));
-		}
-		temp = std::get<0>(set);
+		inner_type *inner = cast_inner(temp);
+		size_type pos = inner->child_position(key, compare);
+		path.push_back(std::make_pair(inner, pos));
+		temp = inner->get_left_child(inner->begin() + pos);
 	}
 	return cast_leaf(temp);
 }
 
 /**
- * Searches leaf in the right subtree of inner node (node.first), first element of which
- * must reside at given iterator (node.second).
- */
-template <typename Key, typename T, typename Compare, std::size_t degree>
-typename b_tree_base<Key, T, Compare, degree>::const_reference
-b_tree_base<Key, T, Compare, degree>::get_suitable_entry(inner_pair &node)
-{
-	node_pptr temp = node.first->get_right_child(node.second);
-	while (!temp->leaf())
-		temp = cast_inner(temp)->get_left_child(cast_inner(temp)->begin());
-	return cast_leaf(temp)->front();
-}
-
-/**
- * Deletes leaf from the tree leaving parent_node and neighbors in consistent state.
+ * Unlinks leaf from the chain of leafs and deletes it, in a transaction.
  */
 template <typename Key, typename T, typename Compare, std::size_t degree>
-void b_tree_base<Key, T, Compare, degree>::delete_leaf_ext(leaf_pptr &leaf,
-							   inner_pair &parent,
-							   bool no_left_sibling)
+void b_tree_base<Key, T, Compare, degree>::delete_leaf_ext(leaf_type *leaf)
 {
-	/* if left sibling exists then leaf is right child */
-	parent.first->delete_with_child(parent.second, no_left_sibling);
+	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
 	/* correct leaf siblings pointers before deleting it */
 	if (leaf->get_prev()) {
 		leaf->get_prev()->set_next(leaf->get_next());
+	} else {
+		head = leaf->get_next();
 	}
 	if (leaf->get_next()) {
 		leaf->get_next()->set_prev(leaf->get_prev());
+	} else {
+		/* stale if the transaction aborts, but not freed */
+		last_leaf = leaf->get_prev().get();
 	}
-	deallocate(leaf);
+	leaf_pptr node(leaf);
+	deallocate(node);
 }
 
 /**
- * Deletes inner node from the tree leaving parent_node and neighbors in consistent state.
- * Also inherites remaining child.
+ * Removes the last child of path (a deleted leaf) from its parent. Inner nodes
+ * which are left without children are deleted as well, so the tree stays
+ * balanced (but inner nodes may be left with a single child and no keys).
  */
 template <typename Key, typename T, typename Compare, std::size_t degree>
-void b_tree_base<Key, T, Compare, degree>::delete_inner_ext(
-	inner_pptr &node, inner_pair &parent, std::pair<node_pptr, node_pptr> &neighbors,
-	bool has_left_sibling)
-{
-	if (neighbors.first) {
-		parent.first->inherit_child(parent.second, neighbors.first,
-					    !has_left_sibling);
-	} else if (neighbors.second) {
-		parent.first->inherit_child(parent.second, neighbors.second,
-					    !has_left_sibling);
+void b_tree_base<Key, T, Compare, degree>::delete_inner_ext(std::vector<inner_pair> &path)
+{
+	size_type pos = path.size() - 1;
+	while (path[pos].first->size() == 0) {
+		/* other leafs exist, so some node on the path has another child */
+		assert(pos > 0);
+		deallocate(path[pos].first);
+		--pos;
+	}
+	path[pos].first->remove_child(path[pos].second);
+
+	/* the root is not needed if it has a single inner child */
+	inner_type *old_root = cast_inner(root);
+	while (old_root->size() == 0 && old_root->level() > 1) {
+		root = old_root->get_left_child(old_root->begin());
+		deallocate(old_root);
+		old_root = cast_inner(root);
 	}
-	deallocate(node);
 }
 
 /**
  * Erases entry specified by key from the tree.
+ *
+ * Leafs are modified in a transaction and inner nodes (which are not persistent)
+ * afterwards, see update_index. A leaf which is left empty is deleted, unless it
+ * is the only one.
  */
 template <typename Key, typename T, typename Compare, std::size_t degree>
 template <typename K>
 typename b_tree_base<Key, T, Compare, degree>::size_type
 b_tree_base<Key, T, Compare, degree>::erase(const K &key)
 {
-	using const_key = const key_type &;
-	/* search leaf saving path, neighbors */
-	std::vector<inner_pair> path;				// [root, leaf)
-	std::vector<std::pair<node_pptr, node_pptr>> neighbors; // (root, leaf]
-	inner_pair to_replace; // inner node with key reference
-	leaf_pptr leaf = get_path_ext(key, path, neighbors, to_replace);
+	/* search leaf saving path */
+	std::vector<inner_pair> path; // [root, leaf)
+	leaf_type *leaf = get_path_ext(key, path);
 
 	auto pop = get_pool_base();
-	size_type result(1);
+	size_type result(0);
+	bool leaf_deleted = false;
 	pmem::obj::transaction::run(pop, [&] {
 		/* remove entry */
-		size_type deleted = leaf->erase(pop, key, compare);
-		if (!deleted) {
-			result = size_type(0);
-			return;
-		}
-		/* still left elements in leaf -> replace pointer in inner node */
-		if (leaf->size() > 0) {
-			if (to_replace.first != nullptr) {
-				const_key new_key = get_suitable_entry(to_replace).first;
-				to_replace.first->replace(to_replace.second, new_key);
-			}
-			--_size;
+		result = leaf->erase(pop, view(key), compare);
+		if (!result)
 			return;
+
+		add_size_on_commit(-1);
+		/* leaf is empty and it is not the only one -> delete it */
+		if (leaf->size() == 0 &&
+		    (leaf->get_prev() != nullptr || leaf->get_next() != nullptr)) {
+			delete_leaf_ext(leaf);
+			leaf_deleted = true;
 		}
-		/* leaf is empty and it is root */
-		if (path.empty()) {
-			--_size;
-			return;
-		}
-		/* handle leaf node */
-		auto nbors = neighbors.back();
-		auto parent = path.back();
-		/* if left sibling exists then leaf is right child */
-		delete_leaf_ext(leaf, parent, nbors.first == nullptr);
-		/* handle inner nodes */
-		auto node = path.back().first;
-		if (path.size() > 1 && node->size() == 0) {
-			path.pop_back();
-			neighbors.pop_back();
-
-			delete_inner_ext(node, path.back(), nbors,
-					 neighbors.back().first != nullptr);
-		}
-		/* replace pointer in inner node */
-		if (to_replace.first) {
-			const_key new_key = get_suitable_entry(to_replace).first;
-			to_replace.first->replace(to_replace.second, new_key);
-		}
-		/* one of the main subtrees deleted, other will become root */
-		if (path.back().first->size() == 0) {
-			if (nbors.first) {
-				cast_inner(root) = nbors.first;
-			} else if (nbors.second) {
-				cast_inner(root) = nbors.second;
-			}
-		}
-		--_size;
 	});
-	/* all done, return */
+	if (result)
+		add_count(&key, -1);
+	/* separators are copies, they stay valid when keys are removed */
+	if (leaf_deleted)
+		update_index([&] { delete_inner_ext(path); });
+
 	return result;
 }
 
@@ -1846,76 +3574,63 @@ typename b_tree_base<Key, T, Compare, degree>::const_reference
 	return temp->operator[](pos);
 }
 
+/**
+ * Moves second half of node to a new inner node, which is returned. Elements of
+ * the moved children are counted, so they must not change meanwhile.
+ */
 template <typename Key, typename T, typename Compare, std::size_t degree>
-const typename b_tree_base<Key, T, Compare, degree>::key_type &
-b_tree_base<Key, T, Compare, degree>::get_last_key(const node_pptr &node)
+typename b_tree_base<Key, T, Compare, degree>::inner_type *
+b_tree_base<Key, T, Compare, degree>::split_half(inner_type *node,
+						 separator_key &partition_key)
 {
-	if (node->leaf()) {
-		return cast_leaf(node.get())->back().first;
-	} else {
-		return cast_inner(node.get())->back();
-	}
-}
+	inner_type *other = allocate_inner(node->level(), nullptr);
+	other->move(*node, partition_key);
 
-template <typename Key, typename T, typename Compare, std::size_t degree>
-void b_tree_base<Key, T, Compare, degree>::create_new_root(const key_type &key,
-							   node_pptr &l_child,
-							   node_pptr &r_child)
-{
-	assert(l_child != nullptr);
-	assert(r_child != nullptr);
-	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
-	cast_inner(root) = allocate_inner(root->level() + 1, key, l_child, r_child);
-}
+	size_type moved = subtree_size(other->get_left_child(other->end()));
+	for (auto it = other->begin(); it != other->end(); ++it)
+		moved += subtree_size(other->get_left_child(it));
+	other->elements = moved;
+	node->elements -= moved;
 
-template <typename Key, typename T, typename Compare, std::size_t degree>
-typename b_tree_base<Key, T, Compare, degree>::inner_type::const_iterator
-b_tree_base<Key, T, Compare, degree>::split_half(pool_base &pop, inner_pptr &node,
-						 inner_pptr &other,
-						 key_pptr &partition_key)
-{
-	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
-	assert(other == nullptr);
-	other = allocate_inner(node->level());
-	return other->move(pop, *node, partition_key);
+	return other;
 }
 
-/* when root is the only inner node */
+/* when src_node is the root */
 template <typename Key, typename T, typename Compare, std::size_t degree>
-void b_tree_base<Key, T, Compare, degree>::split_inner_node(pool_base &pop,
-							    inner_pptr &src_node)
+void b_tree_base<Key, T, Compare, degree>::split_inner_node(inner_type *src_node)
 {
 	assert(root == src_node);
-	pmem::obj::transaction::run(pop, [&] {
-		node_pptr other(nullptr);
-		key_pptr partition_key(nullptr);
-		split_half(pop, src_node, cast_inner(other), partition_key);
-		assert(partition_key != nullptr);
-		create_new_root(*partition_key, cast_node(src_node), other);
-	});
+	/* allocated first, so that nothing can fail once src_node is modified */
+	std::unique_ptr<inner_type> new_root(
+		allocate_inner(src_node->level() + 1, src_node));
+	new_root->elements = src_node->elements.load();
+
+	separator_key partition_key;
+	inner_type *other = split_half(src_node, partition_key);
+	new_root->append(std::move(partition_key), other);
+	root = new_root.release();
 }
 
-/* when root is not the only inner node (2 or more inner node layers) */
+/* when src_node is not the root */
 template <typename Key, typename T, typename Compare, std::size_t degree>
-void b_tree_base<Key, T, Compare, degree>::split_inner_node(pool_base &pop,
-							    inner_pptr &src_node,
+void b_tree_base<Key, T, Compare, degree>::split_inner_node(inner_type *src_node,
 							    inner_type *parent_node)
 {
-	pmem::obj::transaction::run(pop, [&] {
-		node_pptr other(nullptr);
-		key_pptr partition_key(nullptr);
-		split_half(pop, src_node, cast_inner(other), partition_key);
-		assert(partition_key != nullptr);
-		parent_node->update_splitted_child(pop, *partition_key,
-						   cast_node(src_node), other, compare);
-	});
+	separator_key partition_key;
+	inner_type *other = split_half(src_node, partition_key);
+	parent_node->update_splitted_child(std::move(partition_key), src_node, other,
+					   compare);
 }
 
-/* split leaf in case when root is leaf */
+/**
+ * Splits a full leaf: the second half is moved (in a transaction) to a new leaf,
+ * which is linked to parent_node afterwards.
+ */
 template <typename Key, typename T, typename Compare, std::size_t degree>
 template <typename K, typename M>
 std::pair<typename b_tree_base<Key, T, Compare, degree>::iterator, bool>
 b_tree_base<Key, T, Compare, degree>::split_leaf_node(pool_base &pop,
+						      inner_type *parent_node,
 						      leaf_pptr &split_leaf, K &&key,
 						      M &&obj)
 {
@@ -1923,12 +3638,31 @@ b_tree_base<Key, T, Compare, degree>::split_leaf_node(pool_base &pop,
 
 	leaf_pptr node;
 	std::pair<iterator, bool> result(nullptr, false);
-	auto middle = split_leaf->begin() + split_leaf->size() / 2;
-	bool less = compare(std::forward<K>(key), middle->first);
+	std::string lower_buffer, upper_buffer;
+	string_view lower = split_leaf->key(split_leaf->back(), lower_buffer);
+	string_view upper = view(key);
+	/*
+	 * A key greater than all keys of the rightmost leaf is (most likely) one
+	 * of increasing keys, so the leaf is left full and the key goes to a new
+	 * leaf alone, instead of leaving two half-empty leafs behind.
+	 */
+	bool append = !split_leaf->get_next() && compare(lower, upper);
+	bool less = false;
+	if (!append) {
+		auto middle = split_leaf->begin() + split_leaf->size() / 2;
+		upper = split_leaf->key(*middle, upper_buffer);
+		less = compare(view(key), upper);
+		lower = split_leaf->key(*(middle - 1), lower_buffer);
+		if (less && compare(lower, view(key)))
+			lower = view(key);
+	}
+	/* created first, so that nothing can fail once leafs are modified */
+	separator_key separator = make_separator(lower, upper);
 	// move second half into node and insert new element where needed
 	pmem::obj::transaction::run(pop, [&] {
 		node = allocate_leaf();
-		node->move(pop, split_leaf, compare);
+		if (!append)
+			node->move(pop, split_leaf, compare);
 		/* insert entry(key, obj) into needed half */
 		if (less) {
 			result = internal_insert(split_leaf, std::forward<K>(key),
@@ -1937,8 +3671,6 @@ b_tree_base<Key, T, Compare, degree>::split_leaf_node(pool_base &pop,
 			result = internal_insert(node, std::forward<K>(key),
 						 std::forward<M>(obj));
 		}
-		create_new_root(node->front().first, cast_node(split_leaf),
-				cast_node(node));
 		// re-set node's pointers
 		node->set_next(split_leaf->get_next());
 		node->set_prev(split_leaf);
@@ -1946,79 +3678,35 @@ b_tree_base<Key, T, Compare, degree>::split_leaf_node(pool_base &pop,
 			split_leaf->get_next()->set_prev(node);
 		}
 		split_leaf->set_next(node);
-	});
-
-	assert(!compare(result.first->first, key) && !compare(key, result.first->first));
-	return result;
-}
 
-/* split leaf in case when root is not leaf */
-template <typename Key, typename T, typename Compare, std::size_t degree>
-template <typename K, typename M>
-std::pair<typename b_tree_base<Key, T, Compare, degree>::iterator, bool>
-b_tree_base<Key, T, Compare, degree>::split_leaf_node(pool_base &pop,
-						      inner_type *parent_node,
-						      leaf_pptr &split_leaf, K &&key,
-						      M &&obj)
-{
-	assert(split_leaf->full());
+		extend_prefix(split_leaf.get());
+		extend_prefix(node.get());
+	});
 
-	leaf_pptr node;
-	std::pair<iterator, bool> result(nullptr, false);
-	auto middle = split_leaf->begin() + split_leaf->size() / 2;
-	bool less = compare(std::forward<K>(key), middle->first);
-	// move second half into node and insert new element where needed
-	pmem::obj::transaction::run(pop, [&] {
-		node = allocate_leaf();
-		node->move(pop, split_leaf, compare);
-		/* insert entry(key, obj) into needed half */
-		if (less) {
-			result = internal_insert(split_leaf, std::forward<K>(key),
-						 std::forward<M>(obj));
-		} else {
-			result = internal_insert(node, std::forward<K>(key),
-						 std::forward<M>(obj));
-		}
-		// take care of parent node
-		parent_node->update_splitted_child(pop, node->front().first,
-						   cast_node(split_leaf), cast_node(node),
-						   compare);
-		// re-set node's pointers
-		node->set_next(split_leaf->get_next());
-		node->set_prev(split_leaf);
-		if (split_leaf->get_next()) {
-			split_leaf->get_next()->set_prev(node);
-		}
-		split_leaf->set_next(node);
+	// take care of parent node
+	update_index([&] {
+		parent_node->update_splitted_child(std::move(separator), split_leaf.get(),
+						   node.get(), compare);
+		if (!node->get_next())
+			last_leaf = node.get();
 	});
 
-	assert(!compare(result.first->first, key) && !compare(key, result.first->first));
+	assert(!compare(result.first.key(lower_buffer), view(key)) &&
+	       !compare(view(key), result.first.key(upper_buffer)));
 	return result;
 }
 
-template <typename Key, typename T, typename Compare, std::size_t degree>
-typename b_tree_base<Key, T, Compare, degree>::leaf_type *
-b_tree_base<Key, T, Compare, degree>::find_leaf_node(const key_type &key) const
-{
-	assert(root != nullptr);
-	node_pptr node = root;
-	while (!node->leaf()) {
-		node = cast_inner(node)->get_child(key);
-	}
-	return cast_leaf(node).get();
-}
-
 template <typename Key, typename T, typename Compare, std::size_t degree>
 template <typename K>
 typename b_tree_base<Key, T, Compare, degree>::leaf_type *
 b_tree_base<Key, T, Compare, degree>::find_leaf_node(const K &key) const
 {
 	assert(root != nullptr);
-	node_pptr node = root;
+	node_t *node = root;
 	while (!node->leaf()) {
-		node = cast_inner(node)->get_child(key, compare);
+		node = cast_inner(node)->find_child(key, compare);
 	}
-	return cast_leaf(node).get();
+	return cast_leaf(node);
 }
 
 template <typename Key, typename T, typename Compare, std::size_t degree>
@@ -2028,24 +3716,12 @@ b_tree_base<Key, T, Compare, degree>::find_leaf_to_insert(const K &key,
 							  path_type &path) const
 {
 	assert(root != nullptr);
-	node_pptr node = root;
+	node_t *node = root;
 	while (!node->leaf()) {
 		path.push_back(cast_inner(node));
-		node = cast_inner(node)->get_child(key, compare);
-	}
-	return cast_leaf(node);
-}
-
-template <typename Key, typename T, typename Compare, std::size_t degree>
-typename b_tree_base<Key, T, Compare, degree>::path_type::const_iterator
-b_tree_base<Key, T, Compare, degree>::find_full_node(const path_type &path)
-{
-	auto i = path.end() - 1;
-	for (; i > path.begin(); --i) {
-		if (!(*i)->full())
-			return i;
+		node = cast_inner(node)->find_child(key, compare);
 	}
-	return i;
+	return leaf_pptr(cast_leaf(node));
 }
 
 template <typename Key, typename T, typename Compare, std::size_t degree>
@@ -2053,18 +3729,60 @@ template <typename K, typename M>
 std::pair<typename b_tree_base<Key, T, Compare, degree>::iterator, bool>
 b_tree_base<Key, T, Compare, degree>::internal_insert(leaf_pptr leaf, K &&key, M &&obj)
 {
-	auto idxs_pos = leaf->lower_bound(std::forward<K>(key), compare);
-	if (idxs_pos != leaf->end() && !compare(idxs_pos->first, std::forward<K>(key)) &&
-	    !compare(std::forward<K>(key), idxs_pos->first)) {
+	auto idxs_pos = leaf->find(view(key), compare);
+	if (idxs_pos != leaf->end())
 		return std::pair<iterator, bool>(iterator(leaf.get(), idxs_pos), false);
-	}
+
+	idxs_pos = leaf->lower_bound(view(key), compare);
 	auto pop = get_pool_base();
+	typename leaf_type::iterator res = insert_to_leaf(
+		pop, leaf.get(), idxs_pos, std::forward<K>(key), std::forward<M>(obj));
+	return std::pair<iterator, bool>(iterator(leaf.get(), res), true);
+}
+
+/**
+ * Inserts (key, obj) to a leaf which is not full. A transaction is still needed
+ * to allocate the key and the value, if they do not fit in their strings, but if
+ * it is the outermost one, the only undo-logged word of the leaf is its bitmap:
+ * idxs is modified without logging and sorted again if the transaction aborts.
+ * An enclosing transaction could modify the leaf again (or could have allocated
+ * it), so in that case everything is logged.
+ *
+ * Only the suffix of key is stored if it starts with the prefix of the leaf,
+ * otherwise the prefix is shortened first (and all keys are stored again, with
+ * logging). Order of the entries does not change, so pos stays valid.
+ */
+template <typename Key, typename T, typename Compare, std::size_t degree>
+template <typename K, typename M>
+typename b_tree_base<Key, T, Compare, degree>::leaf_type::iterator
+b_tree_base<Key, T, Compare, degree>::insert_to_leaf(pool_base &pop, leaf_type *leaf,
+						     typename leaf_type::iterator pos,
+						     K &&key, M &&obj)
+{
+	string_view prefix = view(leaf->get_prefix());
+	string_view suffix = view(key);
+	bool same_prefix = leaf_type::strip_prefix(prefix, suffix) == 0;
+	bool outermost = pmemobj_tx_stage() == TX_STAGE_NONE && same_prefix;
 	typename leaf_type::iterator res;
 	pmem::obj::transaction::run(pop, [&] {
-		res = leaf->insert(idxs_pos, std::forward<K>(key), std::forward<M>(obj));
-		++_size;
+		if (!same_prefix) {
+			suffix = view(key);
+			leaf->set_prefix(string_view(prefix.data(),
+						     common_prefix(prefix, suffix)));
+			leaf_type::strip_prefix(view(leaf->get_prefix()), suffix);
+		}
+
+		if (outermost) {
+			pmem::obj::transaction::register_callback(
+				pmem::obj::transaction::stage::onabort,
+				[&] { leaf->restore_order(pop, compare); });
+			res = leaf->insert_unlogged(pos, suffix, std::forward<M>(obj));
+		} else {
+			res = leaf->insert(pos, suffix, std::forward<M>(obj));
+		}
+		add_size_on_commit(1);
 	});
-	return std::pair<iterator, bool>(iterator(leaf.get(), res), true);
+	return res;
 }
 
 template <typename Key, typename T, typename Compare, std::size_t degree>
@@ -2085,13 +3803,8 @@ template <typename Key, typename T, typename Compare, std::size_t degree>
 typename b_tree_base<Key, T, Compare, degree>::leaf_type *
 b_tree_base<Key, T, Compare, degree>::leftmost_leaf() const
 {
-	assert(root != nullptr);
-	node_pptr node = root;
-	while (!node->leaf()) {
-		inner_type *inner_node = cast_inner(node).get();
-		node = inner_node->get_left_child(inner_node->begin());
-	}
-	return cast_leaf(node).get();
+	assert(head != nullptr);
+	return head.get();
 }
 
 template <typename Key, typename T, typename Compare, std::size_t degree>
@@ -2099,19 +3812,12 @@ typename b_tree_base<Key, T, Compare, degree>::leaf_type *
 b_tree_base<Key, T, Compare, degree>::rightmost_leaf() const
 {
 	assert(root != nullptr);
-	node_pptr node = root;
+	node_t *node = root;
 	while (!node->leaf()) {
-		inner_type *inner_node = cast_inner(node).get();
+		inner_type *inner_node = cast_inner(node);
 		node = inner_node->get_left_child(inner_node->end());
 	}
-	return cast_leaf(node).get();
-}
-
-template <typename Key, typename T, typename Compare, std::size_t degree>
-typename b_tree_base<Key, T, Compare, degree>::inner_pptr &
-b_tree_base<Key, T, Compare, degree>::cast_inner(node_pptr &node)
-{
-	return reinterpret_cast<inner_pptr &>(node);
+	return cast_leaf(node);
 }
 
 template <typename Key, typename T, typename Compare, std::size_t degree>
@@ -2121,11 +3827,19 @@ b_tree_base<Key, T, Compare, degree>::cast_inner(node_t *node)
 	return static_cast<inner_type *>(node);
 }
 
+/**
+ * Issues software prefetch for the beginning of the node (its level and the first
+ * entries) and for its middle, which is the first probe of a binary search.
+ */
 template <typename Key, typename T, typename Compare, std::size_t degree>
-typename b_tree_base<Key, T, Compare, degree>::leaf_pptr &
-b_tree_base<Key, T, Compare, degree>::cast_leaf(node_pptr &node)
+void
+b_tree_base<Key, T, Compare, degree>::prefetch_node(const node_t *node)
 {
-	return reinterpret_cast<leaf_pptr &>(node);
+	const char *ptr = reinterpret_cast<const char *>(node);
+	const std::size_t size = (std::min)(sizeof(leaf_type), sizeof(inner_type));
+
+	__builtin_prefetch(ptr);
+	__builtin_prefetch(ptr + size / 2);
 }
 
 template <typename Key, typename T, typename Compare, std::size_t degree>
@@ -2135,27 +3849,12 @@ b_tree_base<Key, T, Compare, degree>::cast_leaf(node_t *node)
 	return static_cast<leaf_type *>(node);
 }
 
-template <typename Key, typename T, typename Compare, std::size_t degree>
-typename b_tree_base<Key, T, Compare, degree>::node_pptr &
-b_tree_base<Key, T, Compare, degree>::cast_node(leaf_pptr &node)
-{
-	return reinterpret_cast<node_pptr &>(node);
-}
-
-template <typename Key, typename T, typename Compare, std::size_t degree>
-typename b_tree_base<Key, T, Compare, degree>::node_pptr &
-b_tree_base<Key, T, Compare, degree>::cast_node(inner_pptr &node)
-{
-	return reinterpret_cast<node_pptr &>(node);
-}
-
 template <typename Key, typename T, typename Compare, std::size_t degree>
 template <typename... Args>
-inline typename b_tree_base<Key, T, Compare, degree>::inner_pptr
+inline typename b_tree_base<Key, T, Compare, degree>::inner_type *
 b_tree_base<Key, T, Compare, degree>::allocate_inner(Args &&... args)
 {
-	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
-	return make_persistent<inner_type>(std::forward<Args>(args)...);
+	return new inner_type(std::forward<Args>(args)...);
 }
 
 template <typename Key, typename T, typename Compare, std::size_t degree>
@@ -2167,17 +3866,6 @@ b_tree_base<Key, T, Compare, degree>::allocate_leaf(Args &&... args)
 	return make_persistent<leaf_type>(std::forward<Args>(args)...);
 }
 
-template <typename Key, typename T, typename Compare, std::size_t degree>
-inline void b_tree_base<Key, T, Compare, degree>::deallocate(node_pptr &node)
-{
-	assert(node != nullptr);
-	if (node->leaf()) {
-		deallocate(cast_leaf(node));
-	} else {
-		deallocate(cast_inner(node));
-	}
-}
-
 template <typename Key, typename T, typename Compare, std::size_t degree>
 inline void b_tree_base<Key, T, Compare, degree>::deallocate(leaf_pptr &node)
 {
@@ -2190,20 +3878,16 @@ inline void b_tree_base<Key, T, Compare, degree>::deallocate(leaf_pptr &node)
 }
 
 template <typename Key, typename T, typename Compare, std::size_t degree>
-inline void b_tree_base<Key, T, Compare, degree>::deallocate(inner_pptr &node)
+inline void b_tree_base<Key, T, Compare, degree>::deallocate(inner_type *node)
 {
 	assert(node != nullptr);
-	pool_base pop = get_pool_base();
-	pmem::obj::transaction::run(pop, [&] {
-		delete_persistent<inner_type>(node);
-		node = nullptr;
-	});
+	delete node;
 }
 
 template <typename Key, typename T, typename Compare, std::size_t degree>
 PMEMobjpool *b_tree_base<Key, T, Compare, degree>::get_objpool()
 {
-	PMEMoid oid = pmemobj_oid(this);
+	PMEMoid oid = pmemobj_oid(data);
 	return pmemobj_pool_by_oid(oid);
 }
 
@@ -2236,7 +3920,10 @@ public:
 	using const_iterator = typename base_type::const_iterator;
 	using reverse_iterator = typename base_type::reverse_iterator;
 
-	explicit b_tree() : base_type()
+	using pmem_type = typename base_type::pmem_type;
+
+	b_tree(pmem_type *data, bool bytewise, std::size_t threads)
+	    : base_type(data, bytewise, threads)
 	{
 	}
 
@@ -3,28 +3,89 @@
 
 #include "tree3.h"
 #include "../out.h"
+#include "../parallel_for.h"
 
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstring>
 #include <iostream>
-#include <list>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 namespace pmem
 {
 namespace kv
 {
 
+/*
+ * Allocates KVRoot. It's allocated with root_type_num (which make_persistent does
+ * not allow to specify), so it can be told apart from the first leaf of a legacy pool.
+ */
+static PMEMoid allocate_root()
+{
+	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
+
+	PMEMoid oid = pmemobj_tx_xalloc(sizeof(internal::tree3::KVRoot),
+					internal::tree3::root_type_num,
+					POBJ_XALLOC_ZERO | POBJ_XALLOC_NO_ABORT);
+	if (OID_IS_NULL(oid)) {
+		if (errno == ENOMEM)
+			throw pmem::transaction_out_of_memory(
+				"Failed to allocate tree3 root");
+		throw pmem::transaction_alloc_error("Failed to allocate tree3 root");
+	}
+
+	persistent_ptr<internal::tree3::KVRoot>(oid)->version =
+		internal::tree3::layout_version;
+	return oid;
+}
+
 tree3::tree3(std::unique_ptr<internal::config> cfg)
     : pmemobj_engine_base(cfg, "pmemkv_tree3")
 {
-	Recover();
+	std::size_t recovery_threads;
+	if (!cfg->get_uint64("recovery_threads", &recovery_threads) ||
+	    recovery_threads == 0)
+		recovery_threads = std::thread::hardware_concurrency();
+
+	std::size_t checkpoint;
+	use_checkpoint = !cfg->get_uint64("checkpoint", &checkpoint) || checkpoint != 0;
+
+	if (OID_IS_NULL(*root_oid)) {
+		transaction::run(pmpool, [&] {
+			transaction::snapshot(root_oid);
+			*root_oid = allocate_root();
+		});
+	} else if (pmemobj_type_num(*root_oid) != internal::tree3::root_type_num) {
+		// first leaf of a legacy pool becomes the head of the list
+		transaction::run(pmpool, [&] {
+			auto head = *root_oid;
+			transaction::snapshot(root_oid);
+			*root_oid = allocate_root();
+			persistent_ptr<internal::tree3::KVRoot>(*root_oid)->head =
+				persistent_ptr<internal::tree3::KVLeaf>(head);
+		});
+	}
+	root = persistent_ptr<internal::tree3::KVRoot>(*root_oid);
+	if (root->version != internal::tree3::layout_version)
+		throw internal::not_supported("Unsupported tree3 layout version: " +
+					      std::to_string(root->version));
+
+	Recover(recovery_threads);
 	LOG("Started ok");
 }
 
 tree3::~tree3()
 {
+	// index is recovered from leaves on next open if checkpoint cannot be written
+	try {
+		if (use_checkpoint)
+			CheckpointWrite();
+	} catch (std::exception &e) {
+		LOG("Checkpoint not written: " << e.what());
+	}
 	LOG("Stopped ok");
 }
 
@@ -42,7 +103,7 @@ status tree3::count_all(std::size_t &cnt)
 	LOG("count_all");
 	check_outside_tx();
 	std::size_t result = 0;
-	auto leaf = (pmem::kv::internal::tree3::KVLeaf *)pmemobj_direct(*root_oid);
+	auto leaf = root->head.get();
 	while (leaf) {
 		for (int slot = LEAF_KEYS; slot--;) {
 			auto kvslot = leaf->slots[slot].get_ro();
@@ -62,7 +123,7 @@ status tree3::get_all(get_kv_callback *callback, void *arg)
 {
 	LOG("get_all");
 	check_outside_tx();
-	auto leaf = (pmem::kv::internal::tree3::KVLeaf *)pmemobj_direct(*root_oid);
+	auto leaf = root->head.get();
 	while (leaf) {
 		for (int slot = LEAF_KEYS; slot--;) {
 			auto kvslot = leaf->slots[slot].get_ro();
@@ -145,13 +206,10 @@ status tree3::put(string_view key, string_view value)
 				new_node->leaf = leaves_prealloc.back();
 				leaves_prealloc.pop_back();
 			} else {
-				auto old_head = persistent_ptr<internal::tree3::KVLeaf>(
-					*root_oid);
 				auto new_leaf =
 					make_persistent<internal::tree3::KVLeaf>();
-				transaction::snapshot(root_oid);
-				*root_oid = new_leaf.raw();
-				new_leaf->next = old_head;
+				new_leaf->next = root->head;
+				root->head = new_leaf;
 				new_node->leaf = new_leaf;
 			}
 			LeafFillSpecificSlot(new_node.get(), hash,
@@ -228,7 +286,12 @@ internal::tree3::KVLeafNode *tree3::LeafSearch(const std::string &key)
 		if (!matched)
 			node = inner->children[keycount].get();
 	}
-	return (internal::tree3::KVLeafNode *)node;
+	auto leafnode = (internal::tree3::KVLeafNode *)node;
+	if (!leafnode->recovered) { // leaf restored from checkpoint is read on first use
+		std::string max_key;
+		LeafLoad(leafnode, max_key);
+	}
+	return leafnode;
 }
 
 void tree3::LeafFillEmptySlot(internal::tree3::KVLeafNode *leafnode, const uint8_t hash,
@@ -306,12 +369,9 @@ void tree3::LeafSplitFull(internal::tree3::KVLeafNode *leafnode, const uint8_t h
 			new_leafnode->leaf = new_leaf;
 			leaves_prealloc.pop_back();
 		} else {
-			auto old_head =
-				persistent_ptr<internal::tree3::KVLeaf>(*root_oid);
 			new_leaf = make_persistent<internal::tree3::KVLeaf>();
-			transaction::snapshot(root_oid);
-			*root_oid = new_leaf.raw();
-			new_leaf->next = old_head;
+			new_leaf->next = root->head;
+			root->head = new_leaf;
 			new_leafnode->leaf = new_leaf;
 		}
 		for (int slot = LEAF_KEYS; slot--;) {
@@ -407,80 +467,329 @@ void tree3::InnerUpdateAfterSplit(internal::tree3::KVNode *node,
 // PROTECTED LIFECYCLE METHODS
 // ===============================================================================================
 
-void tree3::Recover()
+void tree3::Recover(size_t threads)
 {
 	LOG("Recovering");
 
+	tree_top.reset(nullptr);
+	if (CheckpointRecover(threads)) {
+		LOG("Recovered ok from checkpoint");
+		return;
+	}
+
 	// traverse persistent leaves to build list of leaves to recover
-	std::list<internal::tree3::KVRecoveredLeaf> leaves;
+	std::vector<persistent_ptr<internal::tree3::KVLeaf>> persistent_leaves;
 
-	auto root_leaf = persistent_ptr<internal::tree3::KVLeaf>(*root_oid);
+	auto root_leaf = root->head;
 
 	while (root_leaf) {
-		unique_ptr<internal::tree3::KVLeafNode> leafnode(
-			new internal::tree3::KVLeafNode());
-		leafnode->leaf = root_leaf;
-		leafnode->is_leaf = true;
+		persistent_leaves.push_back(root_leaf);
+		root_leaf = root_leaf->next.get(); // advance to next linked leaf
+	}
 
-		// find highest sorting key in leaf, while recovering all hashes
-		bool empty_leaf = true;
-		std::string max_key;
-		for (int slot = LEAF_KEYS; slot--;) {
-			auto kvslot = root_leaf->slots[slot].get_ro();
-			if (kvslot.empty())
-				continue;
-			leafnode->hashes[slot] = kvslot.hash();
-			if (leafnode->hashes[slot] == 0)
-				continue;
-			const char *key = kvslot.key();
-			if (empty_leaf) {
-				max_key = std::string(kvslot.key(), kvslot.get_ks());
-				empty_leaf = false;
-			} else if (max_key.compare(0, std::string::npos, kvslot.key(),
-						   kvslot.get_ks()) < 0) {
-				max_key = std::string(kvslot.key(), kvslot.get_ks());
-			}
-			leafnode->keys[slot] = std::string(key, kvslot.get_ks());
-		}
+	// recover leaves in parallel, each thread takes a contiguous range of them
+	const size_t n = persistent_leaves.size();
+	threads = std::max<size_t>(std::min(threads, n / RECOVERY_LEAVES_PER_THREAD), 1);
 
-		// use highest sorting key to decide how to recover the leaf
-		if (empty_leaf) {
-			leaves_prealloc.push_back(root_leaf);
-		} else {
-			leaves.push_back({move(leafnode), max_key});
-		}
+	std::vector<internal::tree3::KVRecoveredLeaf> recovered(n);
+	internal::parallel_for(threads, [&](size_t t) {
+		for (size_t i = n * t / threads; i < n * (t + 1) / threads; i++)
+			recovered[i] = LeafRecover(persistent_leaves[i]);
+	});
 
-		root_leaf = root_leaf->next.get(); // advance to next linked leaf
+	// use highest sorting key to decide how to recover the leaf
+	std::vector<internal::tree3::KVRecoveredLeaf> leaves;
+	for (size_t i = 0; i < n; i++) {
+		if (recovered[i].leafnode)
+			leaves.push_back(move(recovered[i]));
+		else
+			leaves_prealloc.push_back(persistent_leaves[i]);
 	}
+	recovered.clear();
 
-	// sort recovered leaves in ascending key order
-	leaves.sort([](const internal::tree3::KVRecoveredLeaf &lhs,
+	// sort recovered leaves in ascending key order: sort ranges in parallel and
+	// merge adjacent pairs of sorted ranges until a single one is left
+	auto less = [](const internal::tree3::KVRecoveredLeaf &lhs,
 		       const internal::tree3::KVRecoveredLeaf &rhs) {
 		return (lhs.max_key.compare(rhs.max_key) < 0);
+	};
+	const size_t m = leaves.size();
+	const size_t ranges =
+		std::max<size_t>(std::min(threads, m / RECOVERY_LEAVES_PER_THREAD), 1);
+	auto range_begin = [&](size_t r) {
+		return leaves.begin() + static_cast<std::ptrdiff_t>(m * r / ranges);
+	};
+	internal::parallel_for(ranges, [&](size_t r) {
+		std::sort(range_begin(r), range_begin(r + 1), less);
 	});
+	for (size_t width = 1; width < ranges; width *= 2) {
+		const size_t merges = (ranges + 2 * width - 1) / (2 * width);
+		internal::parallel_for(merges, [&](size_t i) {
+			const size_t first = 2 * width * i;
+			const size_t middle = std::min(first + width, ranges);
+			const size_t last = std::min(first + 2 * width, ranges);
+			std::inplace_merge(range_begin(first), range_begin(middle),
+					   range_begin(last), less);
+		});
+	}
 
-	// reconstruct top/inner nodes using adjacent pairs of recovered leaves
-	tree_top.reset(nullptr);
+	// reconstruct top/inner nodes bottom up
+	std::vector<unique_ptr<internal::tree3::KVNode>> nodes;
+	std::vector<std::string> max_keys;
+	for (auto &leaf : leaves) {
+		nodes.push_back(move(leaf.leafnode));
+		max_keys.push_back(move(leaf.max_key));
+	}
+	leaves.clear();
+	InnerRecoverAll(nodes, max_keys, threads);
+
+	LOG("Recovered ok");
+}
 
-	if (!leaves.empty()) {
-		tree_top = move(leaves.front().leafnode);
-		auto max_key = leaves.front().max_key;
-		leaves.pop_front();
-
-		auto prevnode = tree_top.get();
-		while (!leaves.empty()) {
-			std::string split_key = std::string(max_key);
-			auto nextnode = leaves.front().leafnode.get();
-			nextnode->parent = prevnode->parent;
-			InnerUpdateAfterSplit(prevnode, move(leaves.front().leafnode),
-					      &split_key);
-			max_key = leaves.front().max_key;
-			leaves.pop_front();
-			prevnode = nextnode;
+bool tree3::LeafLoad(internal::tree3::KVLeafNode *leafnode, std::string &max_key)
+{
+	auto leaf = leafnode->leaf;
+
+	// find highest sorting key in leaf, while recovering all hashes
+	bool empty_leaf = true;
+	for (int slot = LEAF_KEYS; slot--;) {
+		auto kvslot = leaf->slots[slot].get_ro();
+		if (kvslot.empty())
+			continue;
+		leafnode->hashes[slot] = kvslot.hash();
+		if (leafnode->hashes[slot] == 0)
+			continue;
+		const char *key = kvslot.key();
+		if (empty_leaf) {
+			max_key = std::string(kvslot.key(), kvslot.get_ks());
+			empty_leaf = false;
+		} else if (max_key.compare(0, std::string::npos, kvslot.key(),
+					   kvslot.get_ks()) < 0) {
+			max_key = std::string(kvslot.key(), kvslot.get_ks());
 		}
+		leafnode->keys[slot] = std::string(key, kvslot.get_ks());
 	}
+	leafnode->recovered = true;
+	return !empty_leaf;
+}
 
-	LOG("Recovered ok");
+internal::tree3::KVRecoveredLeaf
+tree3::LeafRecover(persistent_ptr<internal::tree3::KVLeaf> leaf)
+{
+	unique_ptr<internal::tree3::KVLeafNode> leafnode(
+		new internal::tree3::KVLeafNode());
+	leafnode->leaf = leaf;
+	leafnode->is_leaf = true;
+
+	std::string max_key;
+	if (!LeafLoad(leafnode.get(), max_key))
+		leafnode.reset(nullptr); // empty leaf is kept for reuse only
+	return {move(leafnode), move(max_key)};
+}
+
+void tree3::InnerRecoverAll(std::vector<unique_ptr<internal::tree3::KVNode>> &nodes,
+			    std::vector<std::string> &max_keys, size_t threads)
+{
+	// build one level at a time, max_keys[i] separates nodes[i] and nodes[i + 1]
+	while (nodes.size() > 1) {
+		// children are spread evenly, leaving room for splits in every node
+		const size_t count = (nodes.size() + INNER_KEYS - 1) / INNER_KEYS;
+		std::vector<unique_ptr<internal::tree3::KVNode>> parents(count);
+		std::vector<std::string> parent_keys(count);
+		const size_t level_threads = std::max<size_t>(
+			std::min(threads, count / RECOVERY_LEAVES_PER_THREAD), 1);
+		internal::parallel_for(level_threads, [&](size_t t) {
+			for (size_t i = count * t / level_threads;
+			     i < count * (t + 1) / level_threads; i++) {
+				const size_t first = nodes.size() * i / count;
+				const size_t last = nodes.size() * (i + 1) / count;
+				parents[i] = InnerRecover(&nodes[first], &max_keys[first],
+							  last - first);
+				parent_keys[i] = move(max_keys[last - 1]);
+			}
+		});
+		nodes.swap(parents);
+		max_keys.swap(parent_keys);
+	}
+
+	if (!nodes.empty())
+		tree_top = move(nodes.front());
+}
+
+unique_ptr<internal::tree3::KVNode>
+tree3::InnerRecover(unique_ptr<internal::tree3::KVNode> *children, std::string *max_keys,
+		    size_t count)
+{
+	unique_ptr<internal::tree3::KVInnerNode> inner(
+		new internal::tree3::KVInnerNode());
+	inner->keycount = (uint8_t)(count - 1);
+	for (size_t idx = 0; idx < count; idx++) {
+		children[idx]->parent = inner.get();
+		inner->children[idx] = move(children[idx]);
+		if (idx < count - 1)
+			inner->keys[idx] = move(max_keys[idx]);
+	}
+#ifndef NDEBUG
+	inner->assert_invariants();
+#endif
+	return inner;
+}
+
+// ===============================================================================================
+// CHECKPOINT METHODS
+// ===============================================================================================
+
+// Checkpoint of the volatile index, written on clean shutdown, consists of:
+// number of leaves in the tree, number of preallocated leaves, pool offsets of
+// leaves in key order followed by preallocated ones, and separator keys between
+// adjacent leaves (each preceded by its 32-bit size).
+
+void tree3::CheckpointCollect(internal::tree3::KVNode *node,
+			      std::vector<uint64_t> &offsets,
+			      std::vector<const std::string *> &separators)
+{
+	if (node->is_leaf) {
+		offsets.push_back(((internal::tree3::KVLeafNode *)node)->leaf.raw().off);
+		return;
+	}
+	auto inner = (internal::tree3::KVInnerNode *)node;
+	for (uint8_t idx = 0; idx <= inner->keycount; idx++) {
+		CheckpointCollect(inner->children[idx].get(), offsets, separators);
+		if (idx < inner->keycount)
+			separators.push_back(&inner->keys[idx]);
+	}
+}
+
+void tree3::CheckpointWrite()
+{
+	check_outside_tx();
+	std::vector<uint64_t> offsets;
+	std::vector<const std::string *> separators;
+	if (tree_top)
+		CheckpointCollect(tree_top.get(), offsets, separators);
+	const uint64_t leaves = offsets.size();
+	for (auto &leaf : leaves_prealloc)
+		offsets.push_back(leaf.raw().off);
+	const uint64_t prealloc = offsets.size() - leaves;
+
+	size_t size = sizeof(uint64_t) * (2 + offsets.size());
+	for (auto separator : separators)
+		size += sizeof(uint32_t) + separator->size();
+
+	transaction::run(pmpool, [&] {
+		if (root->checkpoint)
+			delete_persistent<char[]>(root->checkpoint,
+						  root->checkpoint_size);
+		auto checkpoint = make_persistent<char[]>(size);
+		char *p = checkpoint.get();
+		memcpy(p, &leaves, sizeof(uint64_t));
+		p += sizeof(uint64_t);
+		memcpy(p, &prealloc, sizeof(uint64_t));
+		p += sizeof(uint64_t);
+		memcpy(p, offsets.data(), sizeof(uint64_t) * offsets.size());
+		p += sizeof(uint64_t) * offsets.size();
+		for (auto separator : separators) {
+			const uint32_t ksize = (uint32_t)separator->size();
+			memcpy(p, &ksize, sizeof(uint32_t));
+			p += sizeof(uint32_t);
+			memcpy(p, separator->data(), ksize);
+			p += ksize;
+		}
+		root->checkpoint = checkpoint;
+		root->checkpoint_size = size;
+	});
+	LOG("Checkpoint written, leaves=" << leaves << ", prealloc=" << prealloc);
+}
+
+bool tree3::CheckpointRecover(size_t threads)
+{
+	if (!root->checkpoint)
+		return false;
+
+	// checkpoint is valid only until the first modification after open
+	auto free_checkpoint = [&] {
+		transaction::run(pmpool, [&] {
+			delete_persistent<char[]>(root->checkpoint,
+						  root->checkpoint_size);
+			root->checkpoint = nullptr;
+			root->checkpoint_size = 0;
+		});
+	};
+	if (!use_checkpoint) {
+		LOG("Checkpoint ignored");
+		free_checkpoint();
+		return false;
+	}
+
+	// every read is checked against the size of the checkpoint, so a damaged
+	// checkpoint falls back to the full recovery instead of reading past it
+	const char *p = root->checkpoint.get();
+	uint64_t left = root->checkpoint_size;
+	auto read = [&](void *dst, uint64_t n) {
+		if (n > left)
+			return false;
+		memcpy(dst, p, n);
+		p += n;
+		left -= n;
+		return true;
+	};
+
+	uint64_t leaves;
+	uint64_t prealloc;
+	bool valid = read(&leaves, sizeof(uint64_t)) &&
+		read(&prealloc, sizeof(uint64_t)) && leaves <= left / sizeof(uint64_t) &&
+		prealloc <= left / sizeof(uint64_t) - leaves;
+	std::vector<uint64_t> offsets;
+	std::vector<std::string> max_keys;
+	if (valid) {
+		offsets.resize(leaves + prealloc);
+		valid = read(offsets.data(), sizeof(uint64_t) * offsets.size());
+		for (auto off : offsets)
+			valid = valid && off != 0;
+		max_keys.resize(leaves);
+	}
+	for (uint64_t i = 0; valid && i + 1 < leaves; i++) {
+		uint32_t ksize;
+		valid = read(&ksize, sizeof(uint32_t)) && ksize <= left;
+		if (valid) {
+			max_keys[i].assign(p, ksize);
+			p += ksize;
+			left -= ksize;
+		}
+	}
+	if (!valid || left != 0) {
+		LOG("Checkpoint discarded, size=" << root->checkpoint_size);
+		free_checkpoint();
+		return false;
+	}
+
+	// leaves are not read here, each one is read on first use (see LeafSearch)
+	const uint64_t pool_uuid_lo = root.raw().pool_uuid_lo;
+	auto leaf_at = [&](uint64_t off) {
+		PMEMoid oid = {pool_uuid_lo, off};
+		return persistent_ptr<internal::tree3::KVLeaf>(oid);
+	};
+	std::vector<unique_ptr<internal::tree3::KVNode>> nodes(leaves);
+	threads = std::max<size_t>(std::min(threads, leaves / RECOVERY_LEAVES_PER_THREAD),
+				   1);
+	internal::parallel_for(threads, [&](size_t t) {
+		for (size_t i = leaves * t / threads; i < leaves * (t + 1) / threads;
+		     i++) {
+			unique_ptr<internal::tree3::KVLeafNode> leafnode(
+				new internal::tree3::KVLeafNode());
+			leafnode->leaf = leaf_at(offsets[i]);
+			leafnode->is_leaf = true;
+			leafnode->recovered = false;
+			nodes[i] = move(leafnode);
+		}
+	});
+	for (uint64_t i = leaves; i < leaves + prealloc; i++)
+		leaves_prealloc.push_back(leaf_at(offsets[i]));
+
+	free_checkpoint();
+
+	InnerRecoverAll(nodes, max_keys, threads);
+	return true;
 }
 
 // ===============================================================================================
@@ -38,6 +38,7 @@ namespace tree3
 #define INNER_KEYS_UPPER ((INNER_KEYS / 2) + 1) // index where upper half of keys begins
 #define LEAF_KEYS 48				// maximum keys in tree nodes
 #define LEAF_KEYS_MIDPOINT (LEAF_KEYS / 2)	// halfway point within the node
+#define RECOVERY_LEAVES_PER_THREAD 1024		// minimum leaves recovered by each thread
 
 class KVSlot {
 public:
@@ -147,6 +148,21 @@ struct KVLeaf {
 	persistent_ptr<KVLeaf> next; // next leaf in unsorted list
 };
 
+/*
+ * Pools created before KVRoot was introduced point directly to the first leaf.
+ * Both layouts are distinguished by the type number of the allocation, KVRoot is
+ * always allocated with root_type_num.
+ */
+static constexpr uint64_t layout_version = 1;
+static constexpr uint64_t root_type_num = 0x7472656533726f6fULL; /* "tree3roo" */
+
+struct KVRoot {				   // persistent root of the engine
+	persistent_ptr<KVLeaf> head;	   // first leaf of unsorted list
+	persistent_ptr<char[]> checkpoint; // index written by clean shutdown
+	p<uint64_t> checkpoint_size;	   // size of checkpoint buffer
+	p<uint64_t> version;		   // layout version
+};
+
 struct KVInnerNode;
 
 struct KVNode {		      // volatile nodes of the tree
@@ -166,6 +182,7 @@ struct KVLeafNode final : KVNode {   // volatile leaf nodes of the tree
 	uint8_t hashes[LEAF_KEYS];   // Pearson hashes of keys
 	std::string keys[LEAF_KEYS]; // keys stored in this leaf
 	persistent_ptr<KVLeaf> leaf; // pointer to persistent leaf
+	bool recovered = true;	     // hashes and keys were read from leaf
 };
 
 struct KVRecoveredLeaf {		 // temporary wrapper used for recovery
@@ -177,7 +194,7 @@ struct KVRecoveredLeaf {		 // temporary wrapper used for recovery
 } /* namespace internal */
 
 class tree3
-    : public pmemobj_engine_base<internal::tree3::KVLeaf> { // hybrid B+ tree engine
+    : public pmemobj_engine_base<internal::tree3::KVRoot> { // hybrid B+ tree engine
 public:
 	tree3(std::unique_ptr<internal::config> cfg);
 	tree3(const tree3 &) = delete;
@@ -213,12 +230,26 @@ protected:
 				   unique_ptr<internal::tree3::KVNode> newnode,
 				   std::string *split_key);
 	uint8_t PearsonHash(const char *data, size_t size);
-	void Recover();
+	bool LeafLoad(internal::tree3::KVLeafNode *leafnode, std::string &max_key);
+	internal::tree3::KVRecoveredLeaf
+	LeafRecover(persistent_ptr<internal::tree3::KVLeaf> leaf);
+	unique_ptr<internal::tree3::KVNode>
+	InnerRecover(unique_ptr<internal::tree3::KVNode> *children, std::string *max_keys,
+		     size_t count);
+	void InnerRecoverAll(vector<unique_ptr<internal::tree3::KVNode>> &nodes,
+			     vector<std::string> &max_keys, size_t threads);
+	void CheckpointCollect(internal::tree3::KVNode *node, vector<uint64_t> &offsets,
+			       vector<const std::string *> &separators);
+	void CheckpointWrite();
+	bool CheckpointRecover(size_t threads);
+	void Recover(size_t threads);
 
 private:
+	persistent_ptr<internal::tree3::KVRoot> root; // persistent root of the engine
 	vector<persistent_ptr<internal::tree3::KVLeaf>>
 		leaves_prealloc;		      // persisted but unused leaves
 	unique_ptr<internal::tree3::KVNode> tree_top; // pointer to uppermost inner node
+	bool use_checkpoint;			      // use checkpoint of the index
 };
 
 class tree3_factory : public engine_base::factory_base {
@@ -4,6 +4,7 @@
 #include "cmap.h"
 #include "../out.h"
 
+#include <cerrno>
 #include <unistd.h>
 
 namespace pmem
@@ -17,8 +18,18 @@ cmap::cmap(std::unique_ptr<internal::config> cfg) : pmemobj_engine_base(cfg, "pm
 		sizeof(internal::cmap::string_t) == 40,
 		"Wrong size of cmap value and key. This probably means that std::string has size > 32");
 
+	uint64_t hash_id = internal::cmap::word_hash_id;
+	uint64_t upgrade_hash = 0;
+	uint64_t read_cache_slots = 0;
+	cfg->get_uint64("hash_id", &hash_id);
+	cfg->get_uint64("upgrade_hash", &upgrade_hash);
+	cfg->get_uint64("read_cache_slots", &read_cache_slots);
+
+	if (read_cache_slots > 0)
+		cache.reset(new internal::cmap::read_cache(read_cache_slots));
+
 	LOG("Started ok");
-	Recover();
+	Recover(hash_id, upgrade_hash != 0);
 }
 
 cmap::~cmap()
@@ -35,40 +46,36 @@ status cmap::count_all(std::size_t &cnt)
 {
 	LOG("count_all");
 	check_outside_tx();
-	cnt = container->size();
 
-	return status::OK;
+	return ops->count_all(cnt);
 }
 
 status cmap::get_all(get_kv_callback *callback, void *arg)
 {
 	LOG("get_all");
 	check_outside_tx();
-	auto it = container->begin();
-	auto end = container->end();
-	return internal::iterate_through_pairs(it, end, callback, arg);
+
+	return ops->get_all(callback, arg);
 }
 
 status cmap::exists(string_view key)
 {
 	LOG("exists for key=" << std::string(key.data(), key.size()));
 	check_outside_tx();
-	return container->count(key) == 1 ? status::OK : status::NOT_FOUND;
+
+	return ops->exists(key);
 }
 
 status cmap::get(string_view key, get_v_callback *callback, void *arg)
 {
 	LOG("get key=" << std::string(key.data(), key.size()));
 	check_outside_tx();
-	internal::cmap::map_t::const_accessor result;
-	bool found = container->find(result, key);
-	if (!found) {
+
+	auto s = ops->get(key, callback, arg);
+	if (s == status::NOT_FOUND)
 		LOG("  key not found");
-		return status::NOT_FOUND;
-	}
 
-	callback(result->second.c_str(), result->second.size(), arg);
-	return status::OK;
+	return s;
 }
 
 status cmap::put(string_view key, string_view value)
@@ -77,9 +84,7 @@ status cmap::put(string_view key, string_view value)
 		       << ", value.size=" << std::to_string(value.size()));
 	check_outside_tx();
 
-	container->insert_or_assign(key, value);
-
-	return status::OK;
+	return ops->put(key, value);
 }
 
 status cmap::remove(string_view key)
@@ -87,8 +92,7 @@ status cmap::remove(string_view key)
 	LOG("remove key=" << std::string(key.data(), key.size()));
 	check_outside_tx();
 
-	bool erased = container->erase(key);
-	return erased ? status::OK : status::NOT_FOUND;
+	return ops->remove(key);
 }
 
 status cmap::defrag(double start_percent, double amount_percent)
@@ -97,8 +101,237 @@ status cmap::defrag(double start_percent, double amount_percent)
 				       << " amount_percent = " << amount_percent);
 	check_outside_tx();
 
+	return ops->defrag(start_percent, amount_percent);
+}
+
+status cmap::multi_get(const std::vector<string_view> &keys, get_kv_callback *callback,
+		       void *arg)
+{
+	LOG("multi_get for " << keys.size() << " keys");
+	check_outside_tx();
+
+	return ops->multi_get(keys, callback, arg);
+}
+
+status cmap::multi_put(const std::vector<string_view> &keys,
+		       const std::vector<string_view> &values)
+{
+	LOG("multi_put for " << keys.size() << " keys");
+	check_outside_tx();
+
+	assert(keys.size() == values.size());
+
+	return ops->multi_put(keys, values);
+}
+
+status cmap::multi_remove(const std::vector<string_view> &keys)
+{
+	LOG("multi_remove for " << keys.size() << " keys");
+	check_outside_tx();
+
+	return ops->multi_remove(keys);
+}
+
+internal::iterator_base *cmap::new_iterator()
+{
+	return ops->new_iterator();
+}
+
+internal::iterator_base *cmap::new_const_iterator()
+{
+	return ops->new_const_iterator();
+}
+
+/*
+ * Allocates root_t. It's allocated with root_type_num (which make_persistent
+ * does not allow to specify), so it can be told apart from legacy map_t.
+ */
+static PMEMoid allocate_root()
+{
+	assert(pmemobj_tx_stage() == TX_STAGE_WORK);
+
+	PMEMoid oid = pmemobj_tx_xalloc(sizeof(internal::cmap::root_t),
+					internal::cmap::root_type_num,
+					POBJ_XALLOC_ZERO | POBJ_XALLOC_NO_ABORT);
+	if (OID_IS_NULL(oid)) {
+		if (errno == ENOMEM)
+			throw pmem::transaction_out_of_memory(
+				"Failed to allocate cmap root");
+		throw pmem::transaction_alloc_error("Failed to allocate cmap root");
+	}
+
+	return oid;
+}
+
+void cmap::Recover(uint64_t hash_id, bool upgrade_hash)
+{
+	using namespace internal::cmap;
+
+	if (OID_IS_NULL(*root_oid)) {
+		if (hash_id != legacy_hash_id && hash_id != word_hash_id)
+			throw internal::invalid_argument("Unsupported hash_id: " +
+							 std::to_string(hash_id));
+
+		pmem::obj::transaction::run(pmpool, [&] {
+			pmem::obj::transaction::snapshot(root_oid);
+			if (hash_id == legacy_hash_id) {
+				*root_oid = pmem::obj::make_persistent<map_t>().raw();
+				return;
+			}
+
+			*root_oid = allocate_root();
+			auto root = static_cast<root_t *>(pmemobj_direct(*root_oid));
+			root->hash_id = hash_id;
+			root->map = pmem::obj::make_persistent<word_map_t>().raw();
+		});
+	}
+
+	if (pmemobj_type_num(*root_oid) != root_type_num) {
+		auto map = static_cast<map_t *>(pmemobj_direct(*root_oid));
+		map->runtime_initialize();
+
+		if (!upgrade_hash) {
+			ops.reset(new container_ops<map_t>(map, cache.get()));
+			return;
+		}
+
+		/* the legacy map stays attached until its elements are moved */
+		pmem::obj::transaction::run(pmpool, [&] {
+			auto legacy = *root_oid;
+			pmem::obj::transaction::snapshot(root_oid);
+			*root_oid = allocate_root();
+			auto root = static_cast<root_t *>(pmemobj_direct(*root_oid));
+			root->hash_id = word_hash_id;
+			root->map = pmem::obj::make_persistent<word_map_t>().raw();
+			root->legacy_map = legacy;
+		});
+	}
+
+	auto root = static_cast<root_t *>(pmemobj_direct(*root_oid));
+	if (root->hash_id != word_hash_id)
+		throw internal::invalid_argument("Unsupported hash_id: " +
+						 std::to_string(root->hash_id));
+
+	auto map = static_cast<word_map_t *>(pmemobj_direct(root->map));
+	map->runtime_initialize();
+
+	/* finish (possibly interrupted) upgrade of the legacy map */
+	if (!OID_IS_NULL(root->legacy_map))
+		upgrade_legacy_map(root, map);
+
+	ops.reset(new container_ops<word_map_t>(map, cache.get()));
+}
+
+/*
+ * Moves all elements of the legacy map into map and frees the legacy map.
+ * Elements are copied outside of a transaction (concurrent_hash_map does not
+ * allow modifications inside one), but the legacy map stays attached to the root
+ * until all of them are copied. If the process is interrupted, the copy is simply
+ * repeated on the next open - insert_or_assign makes it idempotent.
+ */
+void cmap::upgrade_legacy_map(internal::cmap::root_t *root,
+			      internal::cmap::word_map_t *map)
+{
+	LOG("Upgrading hash function of the legacy map");
+
+	auto legacy = static_cast<internal::cmap::map_t *>(
+		pmemobj_direct(root->legacy_map));
+	legacy->runtime_initialize();
+
+	for (auto &e : *legacy)
+		map->insert_or_assign(string_view(e.first.c_str(), e.first.size()),
+				      string_view(e.second.c_str(), e.second.size()));
+
+	legacy->free_data();
+	pmem::obj::transaction::run(pmpool, [&] {
+		pmem::obj::delete_persistent<internal::cmap::map_t>(
+			pmem::obj::persistent_ptr<internal::cmap::map_t>(
+				root->legacy_map));
+		pmem::obj::transaction::snapshot(&root->legacy_map);
+		root->legacy_map = OID_NULL;
+	});
+}
+
+template <typename Map>
+cmap::container_ops<Map>::container_ops(Map *map, internal::cmap::read_cache *cache)
+    : map(map), cache(cache)
+{
+}
+
+template <typename Map>
+status cmap::container_ops<Map>::count_all(std::size_t &cnt)
+{
+	cnt = map->size();
+
+	return status::OK;
+}
+
+template <typename Map>
+status cmap::container_ops<Map>::get_all(get_kv_callback *callback, void *arg)
+{
+	auto it = map->begin();
+	auto end = map->end();
+	return internal::iterate_through_pairs(it, end, callback, arg);
+}
+
+template <typename Map>
+status cmap::container_ops<Map>::exists(string_view key)
+{
+	return map->count(key) == 1 ? status::OK : status::NOT_FOUND;
+}
+
+template <typename Map>
+status cmap::container_ops<Map>::get(string_view key, get_v_callback *callback,
+				     void *arg)
+{
+	uint64_t ticket = 0;
+	if (cache) {
+		if (cache->get(key, callback, arg))
+			return status::OK;
+
+		/* fall back to locking the element, on miss or conflict */
+		ticket = cache->ticket(key);
+	}
+
+	typename Map::const_accessor result;
+	bool found = map->find(result, key);
+	if (!found)
+		return status::NOT_FOUND;
+
+	if (cache)
+		cache->install(key,
+			       string_view(result->second.c_str(), result->second.size()),
+			       ticket);
+
+	callback(result->second.c_str(), result->second.size(), arg);
+	return status::OK;
+}
+
+template <typename Map>
+status cmap::container_ops<Map>::put(string_view key, string_view value)
+{
+	map->insert_or_assign(key, value);
+	if (cache)
+		cache->invalidate(key);
+
+	return status::OK;
+}
+
+template <typename Map>
+status cmap::container_ops<Map>::remove(string_view key)
+{
+	bool erased = map->erase(key);
+	if (cache)
+		cache->invalidate(key);
+
+	return erased ? status::OK : status::NOT_FOUND;
+}
+
+template <typename Map>
+status cmap::container_ops<Map>::defrag(double start_percent, double amount_percent)
+{
 	try {
-		container->defragment(start_percent, amount_percent);
+		map->defragment(start_percent, amount_percent);
 	} catch (std::range_error &e) {
 		out_err_stream("defrag") << e.what();
 		return status::INVALID_ARGUMENT;
@@ -110,44 +343,81 @@ status cmap::defrag(double start_percent, double amount_percent)
 	return status::OK;
 }
 
-void cmap::Recover()
+template <typename Map>
+status cmap::container_ops<Map>::multi_get(const std::vector<string_view> &keys,
+					   get_kv_callback *callback, void *arg)
 {
-	if (!OID_IS_NULL(*root_oid)) {
-		container = (pmem::kv::internal::cmap::map_t *)pmemobj_direct(*root_oid);
-		container->runtime_initialize();
-	} else {
-		pmem::obj::transaction::run(pmpool, [&] {
-			pmem::obj::transaction::snapshot(root_oid);
-			*root_oid =
-				pmem::obj::make_persistent<internal::cmap::map_t>().raw();
-			container = (pmem::kv::internal::cmap::map_t *)pmemobj_direct(
-				*root_oid);
-			container->runtime_initialize();
-		});
+	status ret = status::OK;
+	for (auto &key : keys) {
+		typename Map::const_accessor result;
+		if (!map->find(result, key)) {
+			ret = status::NOT_FOUND;
+			continue;
+		}
+
+		auto cb_ret = callback(key.data(), key.size(), result->second.c_str(),
+				       result->second.size(), arg);
+		if (cb_ret != 0)
+			return status::STOPPED_BY_CB;
 	}
+
+	return ret;
 }
 
-internal::iterator_base *cmap::new_iterator()
+template <typename Map>
+status cmap::container_ops<Map>::multi_put(const std::vector<string_view> &keys,
+					   const std::vector<string_view> &values)
 {
-	return new cmap_iterator<false>{container};
+	for (size_t i = 0; i < keys.size(); i++) {
+		map->insert_or_assign(keys[i], values[i]);
+		if (cache)
+			cache->invalidate(keys[i]);
+	}
+
+	return status::OK;
 }
 
-internal::iterator_base *cmap::new_const_iterator()
+template <typename Map>
+status cmap::container_ops<Map>::multi_remove(const std::vector<string_view> &keys)
 {
-	return new cmap_iterator<true>{container};
+	status ret = status::OK;
+	for (auto &key : keys) {
+		if (!map->erase(key))
+			ret = status::NOT_FOUND;
+		if (cache)
+			cache->invalidate(key);
+	}
+
+	return ret;
 }
 
-cmap::cmap_iterator<true>::cmap_iterator(container_type *c)
+template <typename Map>
+internal::iterator_base *cmap::container_ops<Map>::new_iterator()
+{
+	return new cmap_iterator<Map, false>{map, cache};
+}
+
+template <typename Map>
+internal::iterator_base *cmap::container_ops<Map>::new_const_iterator()
+{
+	return new cmap_iterator<Map, true>{map};
+}
+
+template <typename Map>
+cmap::cmap_iterator<Map, true>::cmap_iterator(container_type *c)
     : container(c), pop(pmem::obj::pool_by_vptr(c))
 {
 }
 
-cmap::cmap_iterator<false>::cmap_iterator(container_type *c)
-    : cmap::cmap_iterator<true>(c)
+template <typename Map>
+cmap::cmap_iterator<Map, false>::cmap_iterator(container_type *c,
+					       internal::cmap::read_cache *cache)
+    : cmap::cmap_iterator<Map, true>(c), cache(cache)
 {
 }
 
-status cmap::cmap_iterator<true>::seek(string_view key)
+template <typename Map>
+status cmap::cmap_iterator<Map, true>::seek(string_view key)
 {
 	init_seek();
 
@@ -157,15 +427,17 @@ status cmap::cmap_iterator<true>::seek(string_view key)
 	return status::NOT_FOUND;
 }
 
-result<string_view> cmap::cmap_iterator<true>::key()
+template <typename Map>
+result<string_view> cmap::cmap_iterator<Map, true>::key()
 {
 	assert(!acc_.empty());
 
 	return string_view(acc_->first.c_str(), acc_->first.length());
 }
 
-result<pmem::obj::slice<const char *>> cmap::cmap_iterator<true>::read_range(size_t pos,
-									     size_t n)
+template <typename Map>
+result<pmem::obj::slice<const char *>>
+cmap::cmap_iterator<Map, true>::read_range(size_t pos, size_t n)
 {
 	assert(!acc_.empty());
 
@@ -175,8 +447,9 @@ result<pmem::obj::slice<const char *>> cmap::cmap_iterator<true>::read_range(siz
 	return {{acc_->second.c_str() + pos, acc_->second.c_str() + pos + n}};
 }
 
-result<pmem::obj::slice<char *>> cmap::cmap_iterator<false>::write_range(size_t pos,
-									 size_t n)
+template <typename Map>
+result<pmem::obj::slice<char *>> cmap::cmap_iterator<Map, false>::write_range(size_t pos,
+									      size_t n)
 {
 	assert(!acc_.empty());
 
@@ -189,7 +462,8 @@ result<pmem::obj::slice<char *>> cmap::cmap_iterator<false>::write_range(size_t
 	return {{&val[0], &val[n]}};
 }
 
-status cmap::cmap_iterator<false>::commit()
+template <typename Map>
+status cmap::cmap_iterator<Map, false>::commit()
 {
 	pmem::obj::transaction::run(pop, [&] {
 		for (auto &p : log) {
@@ -199,10 +473,14 @@ status cmap::cmap_iterator<false>::commit()
 	});
 	log.clear();
 
+	if (cache)
+		cache->invalidate(string_view(acc_->first.c_str(), acc_->first.size()));
+
 	return status::OK;
 }
 
-void cmap::cmap_iterator<false>::abort()
+template <typename Map>
+void cmap::cmap_iterator<Map, false>::abort()
 {
 	log.clear();
 }
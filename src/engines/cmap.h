@@ -7,6 +7,8 @@
 #include "../iterator.h"
 #include "../pmemobj_engine.h"
 #include "../polymorphic_string.h"
+#include "../word_hash.h"
+#include "cmap_read_cache.h"
 
 #include <libpmemobj++/container/concurrent_hash_map.hpp>
 #include <libpmemobj++/persistent_ptr.hpp>
@@ -29,6 +31,19 @@ public:
 	}
 };
 
+/*
+ * Identifiers of hash functions used by the map. The identifier is persisted in
+ * the pool (see root_t), so pools created with an older hash function can still
+ * be opened.
+ */
+/*
+ * byte-at-a-time hash, used by pools created before hash_id was introduced and by
+ * pools created with it explicitly (those can still be opened by older pmemkv)
+ */
+static constexpr uint64_t legacy_hash_id = 0;
+/* word-at-a-time hash, used by new pools by default, they have the root_t layout */
+static constexpr uint64_t word_hash_id = 1;
+
 class string_hasher {
 	/* hash multiplier used by fibonacci hashing */
 	static const size_t hash_multiplier = 11400714819323198485ULL;
@@ -57,15 +72,51 @@ private:
 	}
 };
 
+class word_string_hasher {
+public:
+	using transparent_key_equal = key_equal;
+
+	size_t operator()(const pmem::kv::polymorphic_string &str) const
+	{
+		return word_hash(str.size(), str.c_str());
+	}
+
+	size_t operator()(string_view str) const
+	{
+		return word_hash(str.size(), str.data());
+	}
+};
+
 using string_t = pmem::kv::polymorphic_string;
-using map_t = pmem::obj::concurrent_hash_map<string_t, string_t, string_hasher>;
+template <typename Hasher>
+using basic_map_t = pmem::obj::concurrent_hash_map<string_t, string_t, Hasher>;
+using map_t = basic_map_t<string_hasher>;
+using word_map_t = basic_map_t<word_string_hasher>;
+
+/*
+ * Engine data of pools which store hash_id. Pools with legacy_hash_id (created
+ * before it was introduced or with it explicitly) point directly to map_t. Both layouts
+ * are distinguished by the type number of the allocation, root_t is always
+ * allocated with root_type_num.
+ */
+struct root_t {
+	pmem::obj::p<uint64_t> hash_id;
+	PMEMoid map;
+	/* set only while elements of a legacy map are moved to map */
+	PMEMoid legacy_map;
+};
+
+static constexpr uint64_t root_type_num = 0x636d6170726f6f74ULL; /* "cmaproot" */
 
 } /* namespace cmap */
 } /* namespace internal */
 
 class cmap : public pmemobj_engine_base<internal::cmap::map_t> {
-	template <bool IsConst>
+	template <typename Map, bool IsConst>
 	class cmap_iterator;
+	class container_ops_base;
+	template <typename Map>
+	class container_ops;
 
 public:
 	cmap(std::unique_ptr<internal::config> cfg);
@@ -91,17 +142,80 @@ public:
 
 	status defrag(double start_percent, double amount_percent) final;
 
+	status multi_get(const std::vector<string_view> &keys, get_kv_callback *callback,
+			 void *arg) final;
+	status multi_put(const std::vector<string_view> &keys,
+			 const std::vector<string_view> &values) final;
+	status multi_remove(const std::vector<string_view> &keys) final;
+
+	internal::iterator_base *new_iterator() final;
+	internal::iterator_base *new_const_iterator() final;
+
+private:
+	void Recover(uint64_t hash_id, bool upgrade_hash);
+	void upgrade_legacy_map(internal::cmap::root_t *root,
+				internal::cmap::word_map_t *map);
+
+	/* set only if optimistic reads are enabled (read_cache_slots > 0) */
+	std::unique_ptr<internal::cmap::read_cache> cache;
+	/* operations on the map of the pool, its type depends on hash_id of the pool */
+	std::unique_ptr<container_ops_base> ops;
+};
+
+/*
+ * Operations of the engine on its map. They are implemented once, for every type
+ * of the map (container_ops), and the engine selects the implementation on open.
+ */
+class cmap::container_ops_base {
+public:
+	virtual ~container_ops_base() = default;
+
+	virtual status count_all(std::size_t &cnt) = 0;
+	virtual status get_all(get_kv_callback *callback, void *arg) = 0;
+	virtual status exists(string_view key) = 0;
+	virtual status get(string_view key, get_v_callback *callback, void *arg) = 0;
+	virtual status put(string_view key, string_view value) = 0;
+	virtual status remove(string_view key) = 0;
+	virtual status defrag(double start_percent, double amount_percent) = 0;
+	virtual status multi_get(const std::vector<string_view> &keys,
+				 get_kv_callback *callback, void *arg) = 0;
+	virtual status multi_put(const std::vector<string_view> &keys,
+				 const std::vector<string_view> &values) = 0;
+	virtual status multi_remove(const std::vector<string_view> &keys) = 0;
+
+	virtual internal::iterator_base *new_iterator() = 0;
+	virtual internal::iterator_base *new_const_iterator() = 0;
+};
+
+template <typename Map>
+class cmap::container_ops : public cmap::container_ops_base {
+public:
+	container_ops(Map *map, internal::cmap::read_cache *cache);
+
+	status count_all(std::size_t &cnt) final;
+	status get_all(get_kv_callback *callback, void *arg) final;
+	status exists(string_view key) final;
+	status get(string_view key, get_v_callback *callback, void *arg) final;
+	status put(string_view key, string_view value) final;
+	status remove(string_view key) final;
+	status defrag(double start_percent, double amount_percent) final;
+	status multi_get(const std::vector<string_view> &keys, get_kv_callback *callback,
+			 void *arg) final;
+	status multi_put(const std::vector<string_view> &keys,
+			 const std::vector<string_view> &values) final;
+	status multi_remove(const std::vector<string_view> &keys) final;
+
 	internal::iterator_base *new_iterator() final;
 	internal::iterator_base *new_const_iterator() final;
 
 private:
-	void Recover();
-	internal::cmap::map_t *container;
+	Map *map;
+	internal::cmap::read_cache *cache;
 };
 
-template <>
-class cmap::cmap_iterator<true> : public internal::iterator_base {
-	using container_type = internal::cmap::map_t;
+template <typename Map>
+class cmap::cmap_iterator<Map, true> : public internal::iterator_base {
+	using container_type = Map;
 
 public:
 	cmap_iterator(container_type *container);
@@ -114,16 +228,18 @@ public:
 
 protected:
 	container_type *container;
-	container_type::accessor acc_;
+	typename container_type::accessor acc_;
 	pmem::obj::pool_base pop;
 };
 
-template <>
-class cmap::cmap_iterator<false> : public cmap::cmap_iterator<true> {
-	using container_type = internal::cmap::map_t;
+template <typename Map>
+class cmap::cmap_iterator<Map, false> : public cmap::cmap_iterator<Map, true> {
+	using container_type = Map;
+	using cmap_iterator<Map, true>::acc_;
+	using cmap_iterator<Map, true>::pop;
 
 public:
-	cmap_iterator(container_type *container);
+	cmap_iterator(container_type *container, internal::cmap::read_cache *cache);
 
 	result<pmem::obj::slice<char *>> write_range(size_t pos, size_t n) final;
 
@@ -132,6 +248,7 @@ public:
 
 private:
 	std::vector<std::pair<std::string, size_t>> log;
+	internal::cmap::read_cache *cache;
 };
 
 class cmap_factory : public engine_base::factory_base {
@@ -0,0 +1,182 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#ifndef LIBPMEMKV_CMAP_READ_CACHE_H
+#define LIBPMEMKV_CMAP_READ_CACHE_H
+
+#include "../libpmemkv.hpp"
+#include "../word_hash.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <thread>
+
+namespace pmem
+{
+namespace kv
+{
+namespace internal
+{
+namespace cmap
+{
+
+/*
+ * Volatile, direct-mapped table with copies of recently read elements, used by
+ * the optimistic read path of cmap. Each slot is protected by a seqlock: readers
+ * never write to the slot, they copy its content and validate the version
+ * afterwards, so reads of hot keys do not bounce cache lines between cores.
+ * Only elements whose key and value fit in a slot are cached.
+ *
+ * Writers modify the map first and then invalidate the slot (which bumps its
+ * version). A reader which missed takes a ticket (the version) before reading
+ * the map and installs the element only if the version did not change in the
+ * meantime, so it can never install a value which was already overwritten.
+ */
+class read_cache {
+public:
+	read_cache(size_t slots)
+	    : mask(round_up_pow2(slots) - 1),
+	      memory(new char[(mask + 1) * sizeof(slot) + cacheline_size])
+	{
+		/* operator new does not respect alignment of slot before C++17 */
+		auto addr = reinterpret_cast<uintptr_t>(memory.get());
+		addr = (addr + cacheline_size - 1) & ~(uintptr_t)(cacheline_size - 1);
+		table = reinterpret_cast<slot *>(addr);
+
+		for (size_t i = 0; i <= mask; i++)
+			new (&table[i]) slot();
+	}
+
+	/*
+	 * Calls callback with a (validated) copy of the value of key and returns
+	 * true, or returns false if the element is not cached or a writer is
+	 * modifying the slot.
+	 */
+	bool get(string_view key, get_v_callback *callback, void *arg) const
+	{
+		const slot &s = slot_for(key);
+		uint64_t words[slot_words];
+
+		uint64_t version = s.version.load(std::memory_order_acquire);
+		if (version & 1)
+			return false;
+
+		uint64_t sizes = s.sizes.load(std::memory_order_relaxed);
+		uint64_t key_size = sizes >> 32;
+		uint64_t value_size = sizes & 0xFFFFFFFFULL;
+		if (key_size != key.size() || key_size + value_size > capacity)
+			return false;
+
+		for (size_t i = 0; i < words_for(key_size + value_size); i++)
+			words[i] = s.words[i].load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (s.version.load(std::memory_order_relaxed) != version)
+			return false;
+
+		const char *data = reinterpret_cast<const char *>(words);
+		if (std::memcmp(data, key.data(), key_size) != 0)
+			return false;
+
+		callback(data + key_size, value_size, arg);
+		return true;
+	}
+
+	/* Returns ticket for install(), it must be taken before the map is read. */
+	uint64_t ticket(string_view key) const
+	{
+		return slot_for(key).version.load(std::memory_order_acquire);
+	}
+
+	/*
+	 * Stores a copy of the element in its slot, unless the slot was modified
+	 * since the ticket was taken.
+	 */
+	void install(string_view key, string_view value, uint64_t ticket)
+	{
+		if ((ticket & 1) || key.size() + value.size() > capacity)
+			return;
+
+		slot &s = slot_for(key);
+		if (!s.version.compare_exchange_strong(ticket, ticket + 1,
+						       std::memory_order_acquire))
+			return;
+		std::atomic_thread_fence(std::memory_order_release);
+
+		uint64_t words[slot_words];
+		char *data = reinterpret_cast<char *>(words);
+		std::memcpy(data, key.data(), key.size());
+		std::memcpy(data + key.size(), value.data(), value.size());
+
+		for (size_t i = 0; i < words_for(key.size() + value.size()); i++)
+			s.words[i].store(words[i], std::memory_order_relaxed);
+		s.sizes.store((uint64_t(key.size()) << 32) | value.size(),
+			      std::memory_order_relaxed);
+
+		s.version.store(ticket + 2, std::memory_order_release);
+	}
+
+	/* Must be called after the element is modified or removed from the map. */
+	void invalidate(string_view key)
+	{
+		slot &s = slot_for(key);
+
+		uint64_t version = s.version.load(std::memory_order_relaxed);
+		while ((version & 1) ||
+		       !s.version.compare_exchange_weak(version, version + 1,
+							std::memory_order_acquire)) {
+			std::this_thread::yield();
+			version = s.version.load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_release);
+
+		s.sizes.store(empty, std::memory_order_relaxed);
+
+		s.version.store(version + 2, std::memory_order_release);
+	}
+
+private:
+	static constexpr size_t cacheline_size = 64;
+	static constexpr size_t slot_words = 30;
+	static constexpr size_t capacity = slot_words * sizeof(uint64_t);
+	static constexpr uint64_t empty = ~0ULL;
+
+	/* slot takes exactly 4 cache lines */
+	struct slot {
+		std::atomic<uint64_t> version{0};
+		std::atomic<uint64_t> sizes{empty};
+		std::atomic<uint64_t> words[slot_words];
+	};
+
+	static size_t round_up_pow2(size_t n)
+	{
+		size_t ret = 1;
+		while (ret < n)
+			ret <<= 1;
+		return ret;
+	}
+
+	static size_t words_for(size_t size)
+	{
+		return (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+	}
+
+	slot &slot_for(string_view key) const
+	{
+		return table[word_hash(key.size(), key.data()) & mask];
+	}
+
+	size_t mask;
+	std::unique_ptr<char[]> memory;
+	slot *table;
+};
+
+} /* namespace cmap */
+} /* namespace internal */
+} /* namespace kv */
+} /* namespace pmem */
+
+#endif /* LIBPMEMKV_CMAP_READ_CACHE_H */
@@ -10,6 +10,10 @@
 #include <libpmemobj++/slice.hpp>
 #include <libpmemobj++/transaction.hpp>
 
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
 namespace pmem
 {
 namespace kv
@@ -70,6 +74,38 @@ status iterate_through_pairs(It first, It last, get_kv_callback *callback, void
 	return status::OK;
 }
 
+/**
+ * Helper function which returns positions of the keys in order specified
+ * by a comparator. Used by batch operations of sorted engines to process
+ * keys in the order in which they are laid out in the container. Equal keys
+ * keep their relative order, so the last put of a duplicated key wins.
+ */
+template <typename Compare>
+std::vector<std::size_t> sorted_positions(const std::vector<string_view> &keys,
+					  const Compare &comp)
+{
+	std::vector<std::size_t> pos(keys.size());
+	std::iota(pos.begin(), pos.end(), 0);
+	std::stable_sort(pos.begin(), pos.end(), [&](std::size_t lhs, std::size_t rhs) {
+		return comp(keys[lhs], keys[rhs]);
+	});
+	return pos;
+}
+
+/**
+ * Helper function which checks if keys are sorted and unique in order specified
+ * by a comparator. Used by bulk_load of sorted engines, which can build the
+ * container directly from such keys.
+ */
+template <typename Compare>
+bool strictly_sorted(const std::vector<string_view> &keys, const Compare &comp)
+{
+	return std::adjacent_find(keys.begin(), keys.end(),
+				  [&](string_view lhs, string_view rhs) {
+					  return !comp(lhs, rhs);
+				  }) == keys.end();
+}
+
 } /* namespace internal */
 } /* namespace kv */
 } /* namespace pmem */
@@ -75,6 +75,17 @@ iterator_from_internal(pmem::kv::internal::iterator_base *it)
 	return reinterpret_cast<pmemkv_iterator *>(it);
 }
 
+static inline std::vector<pmem::kv::string_view>
+string_views_from_arrays(size_t n, const char *const *data, const size_t *sizes)
+{
+	std::vector<pmem::kv::string_view> views;
+	views.reserve(n);
+	for (size_t i = 0; i < n; i++)
+		views.emplace_back(data[i], sizes[i]);
+
+	return views;
+}
+
 template <typename Function>
 static inline int catch_and_return_status(const char *func_name, Function &&f)
 {
@@ -365,6 +376,27 @@ int pmemkv_tx_remove(pmemkv_tx *tx, const char *k, size_t kb)
 	});
 }
 
+int pmemkv_tx_get(pmemkv_tx *tx, const char *k, size_t kb, pmemkv_get_v_callback *c,
+		  void *arg)
+{
+	if (!tx)
+		return PMEMKV_STATUS_INVALID_ARGUMENT;
+
+	return catch_and_return_status(__func__, [&] {
+		return tx_to_internal(tx)->get(pmem::kv::string_view(k, kb), c, arg);
+	});
+}
+
+int pmemkv_tx_exists(pmemkv_tx *tx, const char *k, size_t kb)
+{
+	if (!tx)
+		return PMEMKV_STATUS_INVALID_ARGUMENT;
+
+	return catch_and_return_status(__func__, [&] {
+		return tx_to_internal(tx)->exists(pmem::kv::string_view(k, kb));
+	});
+}
+
 int pmemkv_tx_commit(pmemkv_tx *tx)
 {
 	if (!tx)
@@ -658,6 +690,55 @@ int pmemkv_remove(pmemkv_db *db, const char *k, size_t kb)
 	});
 }
 
+int pmemkv_multi_get(pmemkv_db *db, size_t n, const char *const *ks, const size_t *kbs,
+		     pmemkv_get_kv_callback *c, void *arg)
+{
+	if (!db || (n > 0 && (!ks || !kbs)))
+		return PMEMKV_STATUS_INVALID_ARGUMENT;
+
+	return catch_and_return_status(__func__, [&] {
+		auto keys = string_views_from_arrays(n, ks, kbs);
+		return db_to_internal(db)->multi_get(keys, c, arg);
+	});
+}
+
+int pmemkv_multi_put(pmemkv_db *db, size_t n, const char *const *ks, const size_t *kbs,
+		     const char *const *vs, const size_t *vbs)
+{
+	if (!db || (n > 0 && (!ks || !kbs || !vs || !vbs)))
+		return PMEMKV_STATUS_INVALID_ARGUMENT;
+
+	return catch_and_return_status(__func__, [&] {
+		auto keys = string_views_from_arrays(n, ks, kbs);
+		auto values = string_views_from_arrays(n, vs, vbs);
+		return db_to_internal(db)->multi_put(keys, values);
+	});
+}
+
+int pmemkv_multi_remove(pmemkv_db *db, size_t n, const char *const *ks, const size_t *kbs)
+{
+	if (!db || (n > 0 && (!ks || !kbs)))
+		return PMEMKV_STATUS_INVALID_ARGUMENT;
+
+	return catch_and_return_status(__func__, [&] {
+		auto keys = string_views_from_arrays(n, ks, kbs);
+		return db_to_internal(db)->multi_remove(keys);
+	});
+}
+
+int pmemkv_bulk_load(pmemkv_db *db, size_t n, const char *const *ks, const size_t *kbs,
+		     const char *const *vs, const size_t *vbs)
+{
+	if (!db || (n > 0 && (!ks || !kbs || !vs || !vbs)))
+		return PMEMKV_STATUS_INVALID_ARGUMENT;
+
+	return catch_and_return_status(__func__, [&] {
+		auto keys = string_views_from_arrays(n, ks, kbs);
+		auto values = string_views_from_arrays(n, vs, vbs);
+		return db_to_internal(db)->bulk_load(keys, values);
+	});
+}
+
 int pmemkv_defrag(pmemkv_db *db, double start_percent, double amount_percent)
 {
 	if (!db)
@@ -108,6 +108,15 @@ int pmemkv_put(pmemkv_db *db, const char *k, size_t kb, const char *v, size_t vb
 
 int pmemkv_remove(pmemkv_db *db, const char *k, size_t kb);
 
+int pmemkv_multi_get(pmemkv_db *db, size_t n, const char *const *ks, const size_t *kbs,
+		     pmemkv_get_kv_callback *c, void *arg);
+int pmemkv_multi_put(pmemkv_db *db, size_t n, const char *const *ks, const size_t *kbs,
+		     const char *const *vs, const size_t *vbs);
+int pmemkv_multi_remove(pmemkv_db *db, size_t n, const char *const *ks,
+			const size_t *kbs);
+int pmemkv_bulk_load(pmemkv_db *db, size_t n, const char *const *ks, const size_t *kbs,
+		     const char *const *vs, const size_t *vbs);
+
 int pmemkv_defrag(pmemkv_db *db, double start_percent, double amount_percent);
 
 const char *pmemkv_errormsg(void);
@@ -116,6 +125,9 @@ const char *pmemkv_errormsg(void);
 int pmemkv_tx_begin(pmemkv_db *db, pmemkv_tx **tx);
 int pmemkv_tx_put(pmemkv_tx *tx, const char *k, size_t kb, const char *v, size_t vb);
 int pmemkv_tx_remove(pmemkv_tx *tx, const char *k, size_t kb);
+int pmemkv_tx_get(pmemkv_tx *tx, const char *k, size_t kb, pmemkv_get_v_callback *c,
+		  void *arg);
+int pmemkv_tx_exists(pmemkv_tx *tx, const char *k, size_t kb);
 int pmemkv_tx_commit(pmemkv_tx *tx);
 void pmemkv_tx_abort(pmemkv_tx *tx);
 void pmemkv_tx_end(pmemkv_tx *tx);
@@ -13,6 +13,7 @@
 #include <stdexcept>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "libpmemkv.h"
 #include <libpmemobj/pool_base.h>
@@ -511,6 +512,10 @@ public:
 
 	status put(string_view key, string_view value) noexcept;
 	status remove(string_view key) noexcept;
+	status exists(string_view key) noexcept;
+	status get(string_view key, get_v_callback *callback, void *arg) noexcept;
+	status get(string_view key, std::function<get_v_function> f) noexcept;
+	status get(string_view key, std::string *value) noexcept;
 	status commit() noexcept;
 	void abort() noexcept;
 
@@ -595,6 +600,18 @@ public:
 	status remove(string_view key) noexcept;
 	status defrag(double start_percent = 0, double amount_percent = 100);
 
+	status multi_get(const std::vector<string_view> &keys, get_kv_callback *callback,
+			 void *arg) noexcept;
+	status multi_get(const std::vector<string_view> &keys,
+			 std::function<get_kv_function> f) noexcept;
+	status multi_put(const std::vector<string_view> &keys,
+			 const std::vector<string_view> &values) noexcept;
+	status multi_remove(const std::vector<string_view> &keys) noexcept;
+	status bulk_load(const std::vector<string_view> &keys,
+			 const std::vector<string_view> &values) noexcept;
+	template <typename ForwardIt>
+	status bulk_load(ForwardIt first, ForwardIt last) noexcept;
+
 	result<tx> tx_begin() noexcept;
 
 	result<read_iterator> new_read_iterator();
@@ -1695,8 +1712,8 @@ inline tx::tx(pmemkv_tx *tx_) noexcept : tx_(tx_, &pmemkv_tx_end)
 
 /**
  * Removes from database record with given *key*. The removed element is still
- * visible until commit. This function will succeed even if there is no element in the
- * database.
+ * visible to other threads until commit. This function will succeed even if there
+ * is no element in the database.
  *
  * @param[in] key record's key to query for, to be removed
  *
@@ -1709,7 +1726,8 @@ inline status tx::remove(string_view key) noexcept
 
 /**
  * Inserts a key-value pair into pmemkv database. The inserted elements are not
- * visible (not even in the same thread) until commit.
+ * visible to other threads until commit, but they can be read through this
+ * transaction (see tx::get()).
  *
  * @param[in] key record's key; record will be put into database under its name
  * @param[in] value data to be inserted into this new database record
@@ -1769,6 +1787,87 @@ static inline void call_get_copy(const char *v, size_t vb, void *arg)
 }
 }
 
+/**
+ * Checks existence of record with given *key*, taking into account puts and
+ * removes of this transaction which were not committed yet. If record is
+ * present pmem::kv::status::OK is returned, if not, pmem::kv::status::NOT_FOUND
+ * is returned.
+ *
+ * @param[in] key record's key to query for
+ *
+ * @return pmem::kv::status
+ */
+inline status tx::exists(string_view key) noexcept
+{
+	return static_cast<status>(pmemkv_tx_exists(tx_.get(), key.data(), key.size()));
+}
+
+/**
+ * Executes (C-like) *callback* function for record with given *key*. Pending
+ * (not committed) puts and removes of this transaction are visible: the value
+ * put in this transaction is returned and the key removed in this transaction
+ * is reported as pmem::kv::status::NOT_FOUND. Other keys are read from the
+ * database.
+ *
+ * @param[in] key record's key to query for
+ * @param[in] callback function to be called for returned element
+ * @param[in] arg additional arguments to be passed to callback
+ *
+ * @return pmem::kv::status
+ */
+inline status tx::get(string_view key, get_v_callback *callback, void *arg) noexcept
+{
+	return static_cast<status>(
+		pmemkv_tx_get(tx_.get(), key.data(), key.size(), callback, arg));
+}
+
+/**
+ * Executes function for record with given *key*, see tx::get() above for
+ * visibility of pending operations.
+ *
+ * @param[in] key record's key to query for
+ * @param[in] f function called for returned element, it is called with only
+ *				one param - value (key is known)
+ *
+ * @return pmem::kv::status
+ */
+inline status tx::get(string_view key, std::function<get_v_function> f) noexcept
+{
+	return static_cast<status>(pmemkv_tx_get(tx_.get(), key.data(), key.size(),
+						 call_get_v_function, &f));
+}
+
+/**
+ * Gets value copy of record with given *key*, see tx::get() above for
+ * visibility of pending operations.
+ *
+ * @param[in] key record's key to query for
+ * @param[out] value stores returned copy of the data
+ *
+ * @return pmem::kv::status
+ */
+inline status tx::get(string_view key, std::string *value) noexcept
+{
+	return static_cast<status>(pmemkv_tx_get(tx_.get(), key.data(), key.size(),
+						 call_get_copy, value));
+}
+
+/*
+ * Splits vector of string_views into two arrays (of pointers and sizes),
+ * as expected by pmemkv_multi_* functions.
+ */
+static inline void split_string_views(const std::vector<string_view> &views,
+				      std::vector<const char *> &data,
+				      std::vector<size_t> &sizes)
+{
+	data.reserve(views.size());
+	sizes.reserve(views.size());
+	for (auto &v : views) {
+		data.push_back(v.data());
+		sizes.push_back(v.size());
+	}
+}
+
 /**
  * Default constructor with uninitialized database.
  */
@@ -2268,6 +2367,188 @@ inline status db::defrag(double start_percent, double amount_percent)
 		pmemkv_defrag(this->db_.get(), start_percent, amount_percent));
 }
 
+/**
+ * Executes (C-like) *callback* function for every record with key from *keys*.
+ * Keys are looked up in a single call to the engine, which allows it to
+ * amortize locking and tree traversals over the whole batch. *Callback* is
+ * called with the following parameters: pointer to a key (the one passed
+ * by the user), size of the key, pointer to a value, size of the value and
+ * *arg* specified by the user. Order in which *callback* is called for
+ * the keys is not specified. If all records are present and no error occurred,
+ * pmem::kv::status::OK is returned. If at least one record does not exist,
+ * remaining keys are still processed and pmem::kv::status::NOT_FOUND is
+ * returned. *Callback* can stop processing by returning non-zero value,
+ * in that case pmem::kv::status::STOPPED_BY_CB is returned.
+ * This function is guaranteed to be implemented by all engines.
+ *
+ * @param[in] keys records' keys to query for
+ * @param[in] callback function to be called for each returned element
+ * @param[in] arg additional arguments to be passed to callback
+ *
+ * @return pmem::kv::status
+ */
+inline status db::multi_get(const std::vector<string_view> &keys,
+			    get_kv_callback *callback, void *arg) noexcept
+{
+	try {
+		std::vector<const char *> ks;
+		std::vector<size_t> kbs;
+		split_string_views(keys, ks, kbs);
+
+		return static_cast<status>(pmemkv_multi_get(this->db_.get(), keys.size(),
+							    ks.data(), kbs.data(),
+							    callback, arg));
+	} catch (std::bad_alloc &) {
+		return status::OUT_OF_MEMORY;
+	}
+}
+
+/**
+ * Executes function for every record with key from *keys*.
+ * See the callback version of db::multi_get() for details.
+ *
+ * @param[in] keys records' keys to query for
+ * @param[in] f function called for each returned element, it is called with
+ *				params: key and value
+ *
+ * @return pmem::kv::status
+ */
+inline status db::multi_get(const std::vector<string_view> &keys,
+			    std::function<get_kv_function> f) noexcept
+{
+	return multi_get(keys, call_get_kv_function, &f);
+}
+
+/**
+ * Inserts key-value pairs (keys[i], values[i]) into pmemkv database.
+ * Depending on the engine, the whole batch may be applied using a single
+ * lock acquisition and a single pmemobj transaction. Engines which apply
+ * the batch in one transaction make it atomic, other engines do not
+ * guarantee atomicity of the whole batch. If *keys* contains duplicates,
+ * the value which appears last is stored.
+ * This function is guaranteed to be implemented by all engines.
+ *
+ * @param[in] keys records' keys
+ * @param[in] values data to be inserted, must be of the same size as *keys*
+ *
+ * @return pmem::kv::status
+ */
+inline status db::multi_put(const std::vector<string_view> &keys,
+			    const std::vector<string_view> &values) noexcept
+{
+	if (keys.size() != values.size())
+		return status::INVALID_ARGUMENT;
+
+	try {
+		std::vector<const char *> ks, vs;
+		std::vector<size_t> kbs, vbs;
+		split_string_views(keys, ks, kbs);
+		split_string_views(values, vs, vbs);
+
+		return static_cast<status>(pmemkv_multi_put(this->db_.get(), keys.size(),
+							    ks.data(), kbs.data(),
+							    vs.data(), vbs.data()));
+	} catch (std::bad_alloc &) {
+		return status::OUT_OF_MEMORY;
+	}
+}
+
+/**
+ * Removes from database records with given *keys*. If at least one record
+ * does not exist, remaining keys are still removed and
+ * pmem::kv::status::NOT_FOUND is returned.
+ * This function is guaranteed to be implemented by all engines.
+ *
+ * @param[in] keys records' keys to be removed
+ *
+ * @return pmem::kv::status
+ */
+inline status db::multi_remove(const std::vector<string_view> &keys) noexcept
+{
+	try {
+		std::vector<const char *> ks;
+		std::vector<size_t> kbs;
+		split_string_views(keys, ks, kbs);
+
+		return static_cast<status>(pmemkv_multi_remove(
+			this->db_.get(), keys.size(), ks.data(), kbs.data()));
+	} catch (std::bad_alloc &) {
+		return status::OUT_OF_MEMORY;
+	}
+}
+
+/**
+ * Inserts key-value pairs (keys[i], values[i]) into pmemkv database, like
+ * db::multi_put(). If *keys* are sorted (and unique) and the database is empty
+ * or all of them are greater than keys already stored, sorted engines (e.g.
+ * stree) build the container directly from them, instead of inserting them one
+ * by one. Otherwise, or if the engine does not support it, the batch is simply
+ * put. The batch is not atomic.
+ * This function is guaranteed to be implemented by all engines.
+ *
+ * @param[in] keys records' keys, preferably sorted
+ * @param[in] values data to be inserted, must be of the same size as *keys*
+ *
+ * @return pmem::kv::status
+ */
+inline status db::bulk_load(const std::vector<string_view> &keys,
+			    const std::vector<string_view> &values) noexcept
+{
+	if (keys.size() != values.size())
+		return status::INVALID_ARGUMENT;
+
+	try {
+		std::vector<const char *> ks, vs;
+		std::vector<size_t> kbs, vbs;
+		split_string_views(keys, ks, kbs);
+		split_string_views(values, vs, vbs);
+
+		return static_cast<status>(pmemkv_bulk_load(this->db_.get(), keys.size(),
+							    ks.data(), kbs.data(),
+							    vs.data(), vbs.data()));
+	} catch (std::bad_alloc &) {
+		return status::OUT_OF_MEMORY;
+	}
+}
+
+/**
+ * Inserts key-value pairs from range [first, last) into pmemkv database, e.g.
+ * elements of a std::map<std::string, std::string>. Elements are passed to
+ * the vector version of db::bulk_load() in batches, so sorted input is appended
+ * batch after batch.
+ *
+ * @param[in] first beginning of the range, elements must have members *first*
+ *		and *second* convertible to string_view
+ * @param[in] last end of the range
+ *
+ * @return pmem::kv::status
+ */
+template <typename ForwardIt>
+inline status db::bulk_load(ForwardIt first, ForwardIt last) noexcept
+{
+	const size_t batch_size = 1 << 16;
+
+	try {
+		std::vector<string_view> keys, values;
+		while (first != last) {
+			keys.clear();
+			values.clear();
+			for (; first != last && keys.size() < batch_size; ++first) {
+				keys.emplace_back(first->first);
+				values.emplace_back(first->second);
+			}
+
+			auto s = bulk_load(keys, values);
+			if (s != status::OK)
+				return s;
+		}
+	} catch (std::bad_alloc &) {
+		return status::OUT_OF_MEMORY;
+	}
+
+	return status::OK;
+}
+
 /**
  * Returns new write iterator in pmem::kv::result.
  *
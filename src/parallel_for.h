@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#ifndef LIBPMEMKV_PARALLEL_FOR_H
+#define LIBPMEMKV_PARALLEL_FOR_H
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace pmem
+{
+namespace kv
+{
+namespace internal
+{
+
+/* Runs f(0), ..., f(n - 1) on separate threads and rethrows first exception. */
+inline void parallel_for(size_t n, const std::function<void(size_t)> &f)
+{
+	std::vector<std::exception_ptr> exceptions(n);
+	std::vector<std::thread> threads;
+
+	auto run = [&](size_t i) {
+		try {
+			f(i);
+		} catch (...) {
+			exceptions[i] = std::current_exception();
+		}
+	};
+
+	try {
+		for (size_t i = 1; i < n; i++)
+			threads.emplace_back(run, i);
+	} catch (...) {
+		for (auto &t : threads)
+			t.join();
+		throw;
+	}
+
+	run(0);
+	for (auto &t : threads)
+		t.join();
+
+	for (auto &e : exceptions)
+		if (e)
+			std::rethrow_exception(e);
+}
+
+} /* namespace internal */
+} /* namespace kv */
+} /* namespace pmem */
+
+#endif /* LIBPMEMKV_PARALLEL_FOR_H */
@@ -1,12 +1,20 @@
 // SPDX-License-Identifier: BSD-3-Clause
-/* Copyright 2020, Intel Corporation */
+/* Copyright 2020-2021, Intel Corporation */
 
 #ifndef LIBPMEMKV_TRANSACTION_H
 #define LIBPMEMKV_TRANSACTION_H
 
 #include "libpmemkv.hpp"
+#include "word_hash.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <utility>
+#include <vector>
 
 namespace pmem
 {
@@ -35,40 +43,91 @@ public:
 	{
 		return status::NOT_SUPPORTED;
 	}
+
+	/* Reads the value of key, including pending (not committed) writes. */
+	virtual status get(string_view key, get_v_callback *callback, void *arg)
+	{
+		return status::NOT_SUPPORTED;
+	}
+
+	virtual status exists(string_view key)
+	{
+		return get(
+			key, [](const char *, size_t, void *) {}, nullptr);
+	}
 };
 
+/*
+ * Operations of a transaction, kept in DRAM until commit. Keys and values are
+ * copied to an arena (memory allocated in big chunks), so logging an operation
+ * does not allocate memory in the common case. Only the latest operation of
+ * each key is kept, an index (hash table with open addressing) maps keys to
+ * their operations, so pending writes can be read before commit.
+ */
 class dram_log {
 public:
-	using element_type = std::pair<std::string, std::string>;
+	using element_type = std::pair<string_view, string_view>;
+
+	/* result of find() */
+	enum class lookup_result { not_found, inserted, removed };
+
+	dram_log()
+	{
+	}
+
+	dram_log(const dram_log &) = delete;
+	dram_log &operator=(const dram_log &) = delete;
 
 	void insert(string_view key, string_view value)
 	{
-		op_type.emplace_back(operation::insert);
-		log.emplace_back(std::piecewise_construct,
-				 std::forward_as_tuple(key.data(), key.size()),
-				 std::forward_as_tuple(value.data(), value.size()));
+		log(key, value, operation::insert);
 	}
 
 	void remove(string_view key)
 	{
-		op_type.emplace_back(operation::remove);
-		log.emplace_back(std::piecewise_construct,
-				 std::forward_as_tuple(key.data(), key.size()),
-				 std::forward_as_tuple());
+		log(key, string_view(), operation::remove);
 	}
 
+	/* Returns the latest operation on key, sets value if it was an insert. */
+	lookup_result find(string_view key, string_view &value) const
+	{
+		if (entries.empty())
+			return lookup_result::not_found;
+
+		auto pos = lookup(key, word_hash(key.size(), key.data()));
+		if (index[pos] == empty)
+			return lookup_result::not_found;
+
+		auto &e = entries[index[pos]];
+		if (e.op == operation::remove)
+			return lookup_result::removed;
+
+		value = e.value;
+		return lookup_result::inserted;
+	}
+
+	/*
+	 * Calls insert_cb or remove_cb (with element_type) for the latest operation
+	 * of each key, in the order of keys, so that they are applied to pmem with
+	 * better locality.
+	 */
 	template <typename F1, typename F2>
 	void foreach (F1 &&insert_cb, F2 && remove_cb)
 	{
-		assert(op_type.size() == log.size());
+		std::vector<uint32_t> order(entries.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&](uint32_t lhs, uint32_t rhs) {
+			return entries[lhs].key.compare(entries[rhs].key) < 0;
+		});
 
-		for (size_t i = 0; i < log.size(); i++) {
-			switch (op_type[i]) {
+		for (auto i : order) {
+			auto &e = entries[i];
+			switch (e.op) {
 				case operation::insert:
-					insert_cb(log[i]);
+					insert_cb(element_type(e.key, e.value));
 					break;
 				case operation::remove:
-					remove_cb(log[i]);
+					remove_cb(element_type(e.key, e.value));
 					break;
 				default:
 					assert(false);
@@ -77,17 +136,119 @@ public:
 		}
 	}
 
+	/* Discards all operations, the first chunk of the arena is reused. */
 	void clear()
 	{
-		op_type.clear();
-		log.clear();
+		entries.clear();
+		std::fill(index.begin(), index.end(), empty);
+		if (chunks.size() > 1)
+			chunks.resize(1);
+		chunk_used = 0;
 	}
 
 private:
 	enum class operation { insert, remove };
 
-	std::vector<operation> op_type;
-	std::vector<element_type> log;
+	struct entry {
+		string_view key;
+		string_view value;
+		uint64_t hash;
+		operation op;
+	};
+
+	static constexpr size_t chunk_size = 64 * 1024;
+	/* marks unused slots of the index */
+	enum : uint32_t { empty = std::numeric_limits<uint32_t>::max() };
+
+	void log(string_view key, string_view value, operation op)
+	{
+		auto hash = word_hash(key.size(), key.data());
+
+		if (!entries.empty()) {
+			auto pos = lookup(key, hash);
+			if (index[pos] != empty) {
+				/* the previous value stays in the arena until clear() */
+				auto &e = entries[index[pos]];
+				e.value = copy(value);
+				e.op = op;
+				return;
+			}
+		}
+
+		/* keep load factor of the index below 1/2 */
+		if ((entries.size() + 1) * 2 > index.size())
+			grow_index();
+
+		entries.push_back(entry{copy(key), copy(value), hash, op});
+		index[lookup(key, hash)] = static_cast<uint32_t>(entries.size() - 1);
+	}
+
+	/* Returns position of key in the index, or of the empty slot for it. */
+	size_t lookup(string_view key, uint64_t hash) const
+	{
+		auto mask = index.size() - 1;
+		for (auto pos = hash & mask;; pos = (pos + 1) & mask) {
+			if (index[pos] == empty)
+				return pos;
+
+			auto &e = entries[index[pos]];
+			if (e.hash == hash && e.key.compare(key) == 0)
+				return pos;
+		}
+	}
+
+	void grow_index()
+	{
+		index.assign(std::max<size_t>(index.size() * 2, 16), empty);
+
+		auto mask = index.size() - 1;
+		for (uint32_t i = 0; i < entries.size(); i++) {
+			auto pos = entries[i].hash & mask;
+			while (index[pos] != empty)
+				pos = (pos + 1) & mask;
+			index[pos] = i;
+		}
+	}
+
+	/*
+	 * Copies data to the arena. Empty data is not null, so that an empty value
+	 * is not mistaken for a removed one (null value marks removal in radix).
+	 */
+	string_view copy(string_view data)
+	{
+		if (data.size() == 0)
+			return string_view("", 0);
+
+		bool big = data.size() > chunk_size;
+		if (chunks.empty() || (!big && chunk_used + data.size() > chunk_size)) {
+			chunks.emplace_back(new char[chunk_size]);
+			chunk_used = 0;
+		}
+
+		if (big) {
+			/* big values get their own chunk, before the current one */
+			std::unique_ptr<char[]> chunk(new char[data.size()]);
+			std::memcpy(chunk.get(), data.data(), data.size());
+			auto ret = string_view(chunk.get(), data.size());
+			chunks.insert(chunks.end() - 1, std::move(chunk));
+
+			return ret;
+		}
+
+		auto dst = chunks.back().get() + chunk_used;
+		std::memcpy(dst, data.data(), data.size());
+		chunk_used += data.size();
+
+		return string_view(dst, data.size());
+	}
+
+	/* the last chunk is the one being filled */
+	std::vector<std::unique_ptr<char[]>> chunks;
+	size_t chunk_used = 0;
+
+	std::vector<entry> entries;
+	/* indexes of entries, size is a power of 2 */
+	std::vector<uint32_t> index;
 };
 
 } /* namespace internal */
@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#ifndef LIBPMEMKV_VERSION_LOCK_H
+#define LIBPMEMKV_VERSION_LOCK_H
+
+#include "valgrind/drd.h"
+#include "valgrind/pmemcheck.h"
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+namespace pmem
+{
+namespace kv
+{
+namespace internal
+{
+
+/*
+ * Lock which lets readers proceed optimistically (like a seqlock): the version
+ * is odd while a writer holds the lock and it changes with every write, so
+ * a reader can copy the protected data without writing to shared memory and
+ * retry if the version changed in the meantime.
+ *
+ * The lock may live in persistent memory (next to the data it protects, so it
+ * shares cache lines with lookups), but it is not persistent: owners must call
+ * runtime_initialize() on every open.
+ */
+class version_lock {
+public:
+	version_lock() = default;
+
+	version_lock(const version_lock &) = delete;
+	version_lock &operator=(const version_lock &) = delete;
+
+	void lock()
+	{
+		uint64_t v = version.load(std::memory_order_relaxed);
+		while ((v & 1) ||
+		       !version.compare_exchange_weak(v, v + 1,
+						      std::memory_order_acquire)) {
+			std::this_thread::yield();
+			v = version.load(std::memory_order_relaxed);
+		}
+		ANNOTATE_HAPPENS_AFTER(&version);
+	}
+
+	/*
+	 * Takes the lock only if the version is still v (returned by
+	 * read_begin()), so a reader can become a writer without waiting and
+	 * without rereading the data.
+	 */
+	bool try_lock(uint64_t v)
+	{
+		if (!version.compare_exchange_strong(v, v + 1, std::memory_order_acquire))
+			return false;
+
+		ANNOTATE_HAPPENS_AFTER(&version);
+		return true;
+	}
+
+	void unlock()
+	{
+		ANNOTATE_HAPPENS_BEFORE(&version);
+		version.fetch_add(1, std::memory_order_release);
+	}
+
+	/* Waits for a writer (if any) and returns version to be validated. */
+	uint64_t read_begin() const
+	{
+		uint64_t v;
+		while ((v = version.load(std::memory_order_acquire)) & 1)
+			std::this_thread::yield();
+
+		return v;
+	}
+
+	/* Returns true if data read since read_begin() may be inconsistent. */
+	bool read_retry(uint64_t v) const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return version.load(std::memory_order_relaxed) != v;
+	}
+
+	void runtime_initialize()
+	{
+		/* stores to the version are never flushed, do not report them */
+		VALGRIND_PMC_REMOVE_PMEM_MAPPING(&version, sizeof(version));
+		version.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> version{0};
+};
+
+/*
+ * Readers-writer spin lock for short critical sections. A writer which waits for
+ * readers to leave stops new ones from entering, so writers are not starved.
+ * Like version_lock, it may live in persistent memory, but it is not persistent.
+ */
+class rw_spin_lock {
+public:
+	rw_spin_lock() = default;
+
+	rw_spin_lock(const rw_spin_lock &) = delete;
+	rw_spin_lock &operator=(const rw_spin_lock &) = delete;
+
+	void lock_shared()
+	{
+		while (state.fetch_add(reader) & writer) {
+			state.fetch_sub(reader);
+			while (state.load(std::memory_order_relaxed) & writer)
+				std::this_thread::yield();
+		}
+		ANNOTATE_HAPPENS_AFTER(&state);
+	}
+
+	void unlock_shared()
+	{
+		ANNOTATE_HAPPENS_BEFORE(&state);
+		state.fetch_sub(reader, std::memory_order_release);
+	}
+
+	void lock()
+	{
+		uint64_t s = state.load(std::memory_order_relaxed);
+		while ((s & writer) || !state.compare_exchange_weak(s, s | writer)) {
+			std::this_thread::yield();
+			s = state.load(std::memory_order_relaxed);
+		}
+		while (state.load() != writer)
+			std::this_thread::yield();
+		ANNOTATE_HAPPENS_AFTER(&state);
+	}
+
+	void unlock()
+	{
+		ANNOTATE_HAPPENS_BEFORE(&state);
+		state.fetch_sub(writer, std::memory_order_release);
+	}
+
+	void runtime_initialize()
+	{
+		VALGRIND_PMC_REMOVE_PMEM_MAPPING(&state, sizeof(state));
+		state.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr uint64_t writer = 1;
+	static constexpr uint64_t reader = 2;
+
+	std::atomic<uint64_t> state{0};
+};
+
+/* std::shared_lock is not available in C++11 */
+template <typename Mutex>
+class shared_lock_guard {
+public:
+	explicit shared_lock_guard(Mutex &mtx) : mtx(mtx), owns(true)
+	{
+		mtx.lock_shared();
+	}
+
+	~shared_lock_guard()
+	{
+		if (owns)
+			mtx.unlock_shared();
+	}
+
+	shared_lock_guard(const shared_lock_guard &) = delete;
+	shared_lock_guard &operator=(const shared_lock_guard &) = delete;
+
+	void lock()
+	{
+		mtx.lock_shared();
+		owns = true;
+	}
+
+	void unlock()
+	{
+		mtx.unlock_shared();
+		owns = false;
+	}
+
+private:
+	Mutex &mtx;
+	bool owns;
+};
+
+/*
+ * Optimistic readers race with writers by design (what they read is validated
+ * instead of protected), so their reads are hidden from drd within the scope of
+ * this guard. Guards must not be nested.
+ */
+class optimistic_read_guard {
+public:
+	optimistic_read_guard()
+	{
+		ANNOTATE_IGNORE_READS_BEGIN();
+	}
+
+	~optimistic_read_guard()
+	{
+		ANNOTATE_IGNORE_READS_END();
+	}
+
+	optimistic_read_guard(const optimistic_read_guard &) = delete;
+	optimistic_read_guard &operator=(const optimistic_read_guard &) = delete;
+};
+
+} /* namespace internal */
+} /* namespace kv */
+} /* namespace pmem */
+
+#endif /* LIBPMEMKV_VERSION_LOCK_H */
@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+/*
+ * word_hash.cc -- word-at-a-time hash function, based on the structure of
+ * wyhash by Wang Yi (released into the public domain): each step multiplies
+ * two 64-bit words into a 128-bit product and folds its halves together.
+ */
+
+#include "word_hash.h"
+
+#include <cstring>
+
+namespace pmem
+{
+namespace kv
+{
+namespace internal
+{
+
+static const uint64_t secret[4] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+				   0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
+
+/*
+ * mum -- (internal) multiplies a and b and folds the 128-bit product
+ */
+static inline uint64_t mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = static_cast<__uint128_t>(a) * b;
+	return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+#else
+	/* the same product computed from 32-bit halves */
+	uint64_t a_lo = a & 0xffffffffULL, a_hi = a >> 32;
+	uint64_t b_lo = b & 0xffffffffULL, b_hi = b >> 32;
+	uint64_t lo_lo = a_lo * b_lo;
+	uint64_t hi_lo = a_hi * b_lo;
+	uint64_t lo_hi = a_lo * b_hi;
+	uint64_t hi_hi = a_hi * b_hi;
+
+	uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffffULL) + lo_hi;
+	uint64_t hi = hi_hi + (hi_lo >> 32) + (cross >> 32);
+	uint64_t lo = (cross << 32) | (lo_lo & 0xffffffffULL);
+	return lo ^ hi;
+#endif
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static inline uint64_t read64(const char *p)
+{
+	uint64_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t read32(const char *p)
+{
+	uint32_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+#else
+/* words are read as little-endian on every platform, so the hash is the same */
+static inline uint64_t read_le(const char *p, size_t size)
+{
+	const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+	uint64_t v = 0;
+	for (size_t i = size; i > 0; i--)
+		v = (v << 8) | u[i - 1];
+	return v;
+}
+
+static inline uint64_t read64(const char *p)
+{
+	return read_le(p, 8);
+}
+
+static inline uint64_t read32(const char *p)
+{
+	return read_le(p, 4);
+}
+#endif
+
+/*
+ * read_small -- (internal) reads 1 to 3 bytes into a single word
+ */
+static inline uint64_t read_small(const char *p, size_t size)
+{
+	const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+	return (static_cast<uint64_t>(u[0]) << 16) |
+		(static_cast<uint64_t>(u[size >> 1]) << 8) | u[size - 1];
+}
+
+uint64_t word_hash(size_t key_size, const char *key)
+{
+	const char *p = key;
+	size_t left = key_size;
+	uint64_t seed = secret[0] ^ mum(key_size ^ secret[1], secret[0]);
+	uint64_t a = 0;
+	uint64_t b = 0;
+
+	if (left <= 16) {
+		if (left >= 4) {
+			size_t mid = (left >> 3) << 2;
+			a = (read32(p) << 32) | read32(p + mid);
+			b = (read32(p + left - 4) << 32) | read32(p + left - 4 - mid);
+		} else if (left > 0) {
+			a = read_small(p, left);
+		}
+	} else {
+		if (left > 48) {
+			uint64_t seed1 = seed;
+			uint64_t seed2 = seed;
+			do {
+				seed = mum(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+				seed1 = mum(read64(p + 16) ^ secret[2],
+					    read64(p + 24) ^ seed1);
+				seed2 = mum(read64(p + 32) ^ secret[3],
+					    read64(p + 40) ^ seed2);
+				p += 48;
+				left -= 48;
+			} while (left > 48);
+			seed ^= seed1 ^ seed2;
+		}
+
+		while (left > 16) {
+			seed = mum(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+			p += 16;
+			left -= 16;
+		}
+
+		/* last 16 bytes of the key, possibly overlapping with processed ones */
+		a = read64(p + left - 16);
+		b = read64(p + left - 8);
+	}
+
+	return mum(secret[1] ^ key_size, mum(a ^ secret[1], b ^ seed));
+}
+
+} /* namespace internal */
+} /* namespace kv */
+} /* namespace pmem */
@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#ifndef LIBPMEMKV_WORD_HASH_H
+#define LIBPMEMKV_WORD_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace pmem
+{
+namespace kv
+{
+namespace internal
+{
+
+/*
+ * Hash function which consumes the key 8 bytes at a time (and, for longer
+ * keys, 48 bytes per iteration in three independent lanes). Its result depends
+ * only on the key, not on the platform's endianness, so it can be used for data
+ * which is persisted.
+ */
+uint64_t word_hash(size_t key_size, const char *key);
+
+} /* namespace internal */
+} /* namespace kv */
+} /* namespace pmem */
+
+#endif /* LIBPMEMKV_WORD_HASH_H */
@@ -0,0 +1,233 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#include "unittest.hpp"
+
+#include <iterator>
+#include <map>
+
+/**
+ * Tests batch operations: multi_put, multi_get, multi_remove and bulk_load
+ */
+
+using namespace pmem::kv;
+
+static std::vector<string_view> to_views(const std::vector<std::string> &v)
+{
+	return std::vector<string_view>(v.begin(), v.end());
+}
+
+static void MultiPutGetTest(const size_t items, pmem::kv::db &kv)
+{
+	std::vector<std::string> keys;
+	std::vector<std::string> values;
+	/* insert in reverse order, so sorted engines have to reorder the batch */
+	for (size_t i = items; i > 0; i--) {
+		keys.emplace_back(entry_from_number(i));
+		values.emplace_back(entry_from_number(i, "", "!"));
+	}
+
+	ASSERT_STATUS(kv.multi_put(to_views(keys), to_views(values)), status::OK);
+
+	std::size_t cnt = std::numeric_limits<std::size_t>::max();
+	ASSERT_STATUS(kv.count_all(cnt), status::OK);
+	UT_ASSERTeq(cnt, items);
+
+	std::map<std::string, std::string> result;
+	auto s = kv.multi_get(to_views(keys), [&](string_view k, string_view v) {
+		result.emplace(std::string(k.data(), k.size()),
+			       std::string(v.data(), v.size()));
+		return 0;
+	});
+	ASSERT_STATUS(s, status::OK);
+	UT_ASSERTeq(result.size(), items);
+
+	for (size_t i = 0; i < items; i++) {
+		UT_ASSERT(result[keys[i]] == values[i]);
+
+		std::string value;
+		ASSERT_STATUS(kv.get(keys[i], &value), status::OK);
+		UT_ASSERT(value == values[i]);
+	}
+}
+
+static void MultiPutOverwriteTest(pmem::kv::db &kv)
+{
+	ASSERT_STATUS(kv.put(entry_from_string("key1"), entry_from_string("value1")),
+		      status::OK);
+
+	std::vector<std::string> keys = {entry_from_string("key1"),
+					 entry_from_string("key2"),
+					 entry_from_string("key1")};
+	std::vector<std::string> values = {entry_from_string("A"),
+					   entry_from_string("B"),
+					   entry_from_string("C")};
+
+	ASSERT_STATUS(kv.multi_put(to_views(keys), to_views(values)), status::OK);
+
+	std::size_t cnt = std::numeric_limits<std::size_t>::max();
+	ASSERT_STATUS(kv.count_all(cnt), status::OK);
+	UT_ASSERTeq(cnt, 2);
+
+	/* the last value of duplicated key wins */
+	std::string value;
+	ASSERT_STATUS(kv.get(entry_from_string("key1"), &value), status::OK);
+	UT_ASSERT(value == entry_from_string("C"));
+	ASSERT_STATUS(kv.get(entry_from_string("key2"), &value), status::OK);
+	UT_ASSERT(value == entry_from_string("B"));
+}
+
+static void MultiGetNotFoundTest(pmem::kv::db &kv)
+{
+	ASSERT_STATUS(kv.put(entry_from_string("key1"), entry_from_string("value1")),
+		      status::OK);
+	ASSERT_STATUS(kv.put(entry_from_string("key3"), entry_from_string("value3")),
+		      status::OK);
+
+	std::vector<std::string> keys = {entry_from_string("key1"),
+					 entry_from_string("key2"),
+					 entry_from_string("key3")};
+
+	std::map<std::string, std::string> result;
+	auto s = kv.multi_get(to_views(keys), [&](string_view k, string_view v) {
+		result.emplace(std::string(k.data(), k.size()),
+			       std::string(v.data(), v.size()));
+		return 0;
+	});
+
+	/* existing keys are still returned */
+	ASSERT_STATUS(s, status::NOT_FOUND);
+	UT_ASSERTeq(result.size(), 2);
+	UT_ASSERT(result[entry_from_string("key1")] == entry_from_string("value1"));
+	UT_ASSERT(result[entry_from_string("key3")] == entry_from_string("value3"));
+
+	ASSERT_STATUS(kv.multi_get(std::vector<string_view>(),
+				   [&](string_view, string_view) { return 0; }),
+		      status::OK);
+}
+
+static void MultiGetStoppedByCallbackTest(pmem::kv::db &kv)
+{
+	std::vector<std::string> keys;
+	for (size_t i = 0; i < 10; i++) {
+		keys.emplace_back(entry_from_number(i));
+		ASSERT_STATUS(kv.put(keys.back(), entry_from_number(i, "", "!")),
+			      status::OK);
+	}
+
+	size_t called = 0;
+	auto s = kv.multi_get(to_views(keys), [&](string_view, string_view) {
+		called++;
+		return called == 3 ? 1 : 0;
+	});
+	ASSERT_STATUS(s, status::STOPPED_BY_CB);
+	UT_ASSERTeq(called, 3);
+}
+
+static void MultiRemoveTest(const size_t items, pmem::kv::db &kv)
+{
+	std::vector<std::string> keys;
+	for (size_t i = 0; i < items; i++) {
+		keys.emplace_back(entry_from_number(i));
+		ASSERT_STATUS(kv.put(keys.back(), entry_from_number(i, "", "!")),
+			      status::OK);
+	}
+
+	/* remove every second key */
+	std::vector<std::string> to_remove;
+	for (size_t i = 0; i < items; i += 2)
+		to_remove.emplace_back(keys[i]);
+
+	ASSERT_STATUS(kv.multi_remove(to_views(to_remove)), status::OK);
+
+	std::size_t cnt = std::numeric_limits<std::size_t>::max();
+	ASSERT_STATUS(kv.count_all(cnt), status::OK);
+	UT_ASSERTeq(cnt, items - to_remove.size());
+
+	for (size_t i = 0; i < items; i++)
+		ASSERT_STATUS(kv.exists(keys[i]),
+			      i % 2 == 0 ? status::NOT_FOUND : status::OK);
+
+	/* removing already removed keys reports NOT_FOUND, others are removed */
+	ASSERT_STATUS(kv.multi_remove(to_views(keys)), status::NOT_FOUND);
+
+	cnt = std::numeric_limits<std::size_t>::max();
+	ASSERT_STATUS(kv.count_all(cnt), status::OK);
+	UT_ASSERTeq(cnt, 0);
+}
+
+/*
+ * Sizes are checked by db::multi_put (C API takes a single count of keys and
+ * values, so engines always get vectors of the same size).
+ */
+static void MultiPutSizeMismatchTest(pmem::kv::db &kv)
+{
+	std::vector<string_view> keys = {"key1", "key2"};
+	std::vector<string_view> values = {"value1"};
+
+	ASSERT_STATUS(kv.multi_put(keys, values), status::INVALID_ARGUMENT);
+
+	std::size_t cnt = std::numeric_limits<std::size_t>::max();
+	ASSERT_STATUS(kv.count_all(cnt), status::OK);
+	UT_ASSERTeq(cnt, 0);
+}
+
+static void BulkLoadTest(const size_t items, pmem::kv::db &kv)
+{
+	/* sorted input, loaded in two batches: the second one is appended */
+	std::map<std::string, std::string> elements;
+	for (size_t i = 0; i < items; i++)
+		elements.emplace(entry_from_number(i, "key"),
+				 entry_from_number(i, "", "!"));
+
+	auto middle = std::next(elements.begin(), static_cast<std::ptrdiff_t>(items / 2));
+	ASSERT_STATUS(kv.bulk_load(elements.begin(), middle), status::OK);
+	ASSERT_STATUS(kv.bulk_load(middle, elements.end()), status::OK);
+
+	/* unsorted keys, which are not greater than the loaded ones, are simply put */
+	std::vector<std::string> keys = {elements.begin()->first,
+					 entry_from_string("a")};
+	std::vector<std::string> values = {entry_from_string("A"),
+					   entry_from_string("B")};
+	ASSERT_STATUS(kv.bulk_load(to_views(keys), to_views(values)), status::OK);
+	for (size_t i = 0; i < keys.size(); i++)
+		elements[keys[i]] = values[i];
+
+	std::size_t cnt = std::numeric_limits<std::size_t>::max();
+	ASSERT_STATUS(kv.count_all(cnt), status::OK);
+	UT_ASSERTeq(cnt, elements.size());
+
+	for (auto &e : elements) {
+		std::string value;
+		ASSERT_STATUS(kv.get(e.first, &value), status::OK);
+		UT_ASSERT(value == e.second);
+	}
+
+	ASSERT_STATUS(kv.bulk_load(to_views(keys), std::vector<string_view>()),
+		      status::INVALID_ARGUMENT);
+}
+
+static void test(int argc, char *argv[])
+{
+	using namespace std::placeholders;
+
+	if (argc < 4)
+		UT_FATAL("usage: %s engine json_config items", argv[0]);
+
+	size_t items = std::stoull(argv[3]);
+	run_engine_tests(argv[1], argv[2],
+			 {
+				 std::bind(MultiPutGetTest, items, _1),
+				 MultiPutOverwriteTest,
+				 MultiGetNotFoundTest,
+				 MultiGetStoppedByCallbackTest,
+				 std::bind(MultiRemoveTest, items, _1),
+				 MultiPutSizeMismatchTest,
+				 std::bind(BulkLoadTest, items, _1),
+			 });
+}
+
+int main(int argc, char *argv[])
+{
+	return run_test([&] { test(argc, argv); });
+}
@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#include "unittest.hpp"
+
+#include <atomic>
+
+/**
+ * Tests count_all() called concurrently with removes (and, if supported,
+ * transactions which put new keys). The count must never exceed the number of
+ * elements which could be present.
+ */
+
+using namespace pmem::kv;
+
+static void CountAllWhileRemovingTest(const size_t threads_number,
+				      const size_t thread_items, pmem::kv::db &kv)
+{
+	const size_t initial_items = threads_number * thread_items;
+	for (size_t i = 0; i < initial_items; i++)
+		ASSERT_STATUS(kv.put(entry_from_number(i), entry_from_number(i, "", "!")),
+			      status::OK);
+
+	std::atomic<size_t> removers_done(0);
+	parallel_exec(threads_number * 2, [&](size_t thread_id) {
+		if (thread_id % 2 == 0) {
+			size_t begin = thread_id / 2 * thread_items;
+			for (size_t i = begin; i < begin + thread_items; i++)
+				ASSERT_STATUS(kv.remove(entry_from_number(i)),
+					      status::OK);
+			removers_done++;
+		} else {
+			/* nothing is put, so the count never grows */
+			size_t last = initial_items;
+			while (removers_done.load() < threads_number) {
+				std::size_t cnt = std::numeric_limits<std::size_t>::max();
+				ASSERT_STATUS(kv.count_all(cnt), status::OK);
+				UT_ASSERT(cnt <= last);
+				last = cnt;
+			}
+		}
+	});
+
+	std::size_t cnt = std::numeric_limits<std::size_t>::max();
+	ASSERT_STATUS(kv.count_all(cnt), status::OK);
+	UT_ASSERTeq(cnt, 0);
+}
+
+static void CountAllWhileCommittingTest(const size_t threads_number,
+					const size_t thread_items, pmem::kv::db &kv)
+{
+	if (kv.tx_begin().get_status() == status::NOT_SUPPORTED)
+		return;
+
+	const size_t max_items = threads_number * thread_items;
+	std::atomic<size_t> writers_done(0);
+	parallel_exec(threads_number * 2, [&](size_t thread_id) {
+		if (thread_id % 2 == 0) {
+			size_t begin = thread_id / 2 * thread_items;
+			for (size_t i = begin; i < begin + thread_items; i++) {
+				auto key = entry_from_number(i, "tx_");
+
+				/* puts a new key, then removes it */
+				{
+					auto tx = kv.tx_begin().get_value();
+					ASSERT_STATUS(tx.put(key, key), status::OK);
+					ASSERT_STATUS(tx.commit(), status::OK);
+				}
+				{
+					auto tx = kv.tx_begin().get_value();
+					ASSERT_STATUS(tx.remove(key), status::OK);
+					ASSERT_STATUS(tx.commit(), status::OK);
+				}
+			}
+			writers_done++;
+		} else {
+			while (writers_done.load() < threads_number) {
+				std::size_t cnt = std::numeric_limits<std::size_t>::max();
+				ASSERT_STATUS(kv.count_all(cnt), status::OK);
+				UT_ASSERT(cnt <= max_items);
+			}
+		}
+	});
+
+	std::size_t cnt = std::numeric_limits<std::size_t>::max();
+	ASSERT_STATUS(kv.count_all(cnt), status::OK);
+	UT_ASSERTeq(cnt, 0);
+}
+
+static void test(int argc, char *argv[])
+{
+	using namespace std::placeholders;
+
+	if (argc < 5)
+		UT_FATAL("usage: %s engine json_config threads items", argv[0]);
+
+	size_t threads_number = std::stoull(argv[3]);
+	size_t thread_items = std::stoull(argv[4]);
+	run_engine_tests(argv[1], argv[2],
+			 {
+				 std::bind(CountAllWhileRemovingTest, threads_number,
+					   thread_items, _1),
+				 std::bind(CountAllWhileCommittingTest, threads_number,
+					   thread_items, _1),
+			 });
+}
+
+int main(int argc, char *argv[])
+{
+	return run_test([&] { test(argc, argv); });
+}
@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#include "unittest.hpp"
+
+#include <atomic>
+
+/**
+ * Tests gets racing with puts which split nodes of tree-based engines: readers
+ * get keys put before the test (which must always be found with their values)
+ * and keys put by writers (which may be not found yet, but never have a wrong
+ * value), while writers put keys in between the initial ones.
+ */
+
+using namespace pmem::kv;
+
+static void GetWhileSplitTest(const size_t threads_number, const size_t thread_items,
+			      pmem::kv::db &kv)
+{
+	/* initial keys are even, keys of writers are odd */
+	const size_t initial_items = threads_number * thread_items;
+	for (size_t i = 0; i < initial_items; i++) {
+		auto key = entry_from_number(i * 2);
+		ASSERT_STATUS(kv.put(key, key), status::OK);
+	}
+
+	std::atomic<size_t> writers_done(0);
+	parallel_exec(threads_number * 2, [&](size_t thread_id) {
+		if (thread_id % 2 == 0) {
+			/* every writer puts keys spread over the whole tree */
+			for (size_t i = thread_id / 2; i < initial_items;
+			     i += threads_number) {
+				auto key = entry_from_number(i * 2 + 1);
+				ASSERT_STATUS(kv.put(key, key), status::OK);
+			}
+			writers_done++;
+			return;
+		}
+
+		do {
+			for (size_t i = 0; i < initial_items * 2; i++) {
+				auto key = entry_from_number(i);
+				std::string value;
+				auto s = kv.get(key, &value);
+				if (i % 2 == 0 || s == status::OK) {
+					ASSERT_STATUS(s, status::OK);
+					UT_ASSERT(value == key);
+				} else {
+					ASSERT_STATUS(s, status::NOT_FOUND);
+				}
+			}
+		} while (writers_done.load() < threads_number);
+	});
+
+	ASSERT_SIZE(kv, initial_items * 2);
+
+	for (size_t i = 0; i < initial_items * 2; i++) {
+		auto key = entry_from_number(i);
+		std::string value;
+		ASSERT_STATUS(kv.get(key, &value), status::OK);
+		UT_ASSERT(value == key);
+	}
+}
+
+static void test(int argc, char *argv[])
+{
+	using namespace std::placeholders;
+
+	if (argc < 5)
+		UT_FATAL("usage: %s engine json_config threads items", argv[0]);
+
+	size_t threads_number = std::stoull(argv[3]);
+	size_t thread_items = std::stoull(argv[4]);
+	run_engine_tests(argv[1], argv[2],
+			 {
+				 std::bind(GetWhileSplitTest, threads_number,
+					   thread_items, _1),
+			 });
+}
+
+int main(int argc, char *argv[])
+{
+	return run_test([&] { test(argc, argv); });
+}
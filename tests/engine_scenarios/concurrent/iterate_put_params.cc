@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#include "unittest.hpp"
+
+#include <atomic>
+
+/**
+ * Tests get_all() whose callback accesses the engine, for engines which do not
+ * hold their locks while callbacks run: callbacks put keys, which are
+ * concurrently updated by other threads, and wait for puts of other threads.
+ */
+
+using namespace pmem::kv;
+
+static void CallbackPutTest(const size_t threads_number, const size_t thread_items,
+			    pmem::kv::db &kv)
+{
+	const size_t initial_items = threads_number * thread_items;
+	for (size_t i = 0; i < initial_items; i++)
+		ASSERT_STATUS(kv.put(entry_from_number(i), entry_from_number(i)),
+			      status::OK);
+
+	parallel_exec(threads_number * 2, [&](size_t thread_id) {
+		if (thread_id % 2 == 0) {
+			/* every visited key is updated from the callback */
+			auto s = kv.get_all([&](string_view k, string_view) {
+				ASSERT_STATUS(kv.put(k, entry_from_string("cb")),
+					      status::OK);
+				return 0;
+			});
+			ASSERT_STATUS(s, status::OK);
+		} else {
+			size_t begin = thread_id / 2 * thread_items;
+			for (size_t i = begin; i < begin + thread_items; i++)
+				ASSERT_STATUS(kv.put(entry_from_number(i),
+						     entry_from_string("cb")),
+					      status::OK);
+		}
+	});
+
+	std::size_t cnt = std::numeric_limits<std::size_t>::max();
+	ASSERT_STATUS(kv.count_all(cnt), status::OK);
+	UT_ASSERTeq(cnt, initial_items);
+
+	for (size_t i = 0; i < initial_items; i++) {
+		std::string value;
+		ASSERT_STATUS(kv.get(entry_from_number(i), &value), status::OK);
+		UT_ASSERT(value == entry_from_string("cb"));
+	}
+}
+
+static void CallbackWaitForPutsTest(const size_t threads_number,
+				    const size_t thread_items, pmem::kv::db &kv)
+{
+	ASSERT_STATUS(kv.put(entry_from_string("first"), entry_from_string("first")),
+		      status::OK);
+
+	std::atomic<size_t> puts_done(0);
+	parallel_exec(threads_number + 1, [&](size_t thread_id) {
+		if (thread_id == 0) {
+			/* waits (inside the callback) until all other threads put
+			 * their keys */
+			auto s = kv.get_all([&](string_view, string_view) {
+				while (puts_done.load() < threads_number)
+					std::this_thread::yield();
+				return 1;
+			});
+			ASSERT_STATUS(s, status::STOPPED_BY_CB);
+		} else {
+			size_t begin = (thread_id - 1) * thread_items;
+			for (size_t i = begin; i < begin + thread_items; i++)
+				ASSERT_STATUS(kv.put(entry_from_number(i, "new_"),
+						     entry_from_number(i)),
+					      status::OK);
+			puts_done++;
+		}
+	});
+
+	std::size_t cnt = std::numeric_limits<std::size_t>::max();
+	ASSERT_STATUS(kv.count_all(cnt), status::OK);
+	UT_ASSERTeq(cnt, threads_number * thread_items + 1);
+}
+
+static void test(int argc, char *argv[])
+{
+	using namespace std::placeholders;
+
+	if (argc < 5)
+		UT_FATAL("usage: %s engine json_config threads items", argv[0]);
+
+	size_t threads_number = std::stoull(argv[3]);
+	size_t thread_items = std::stoull(argv[4]);
+	run_engine_tests(argv[1], argv[2],
+			 {
+				 std::bind(CallbackPutTest, threads_number, thread_items,
+					   _1),
+				 std::bind(CallbackWaitForPutsTest, threads_number,
+					   thread_items, _1),
+			 });
+}
+
+int main(int argc, char *argv[])
+{
+	return run_test([&] { test(argc, argv); });
+}
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#include "unittest.hpp"
+
+#include <map>
+
+/**
+ * Tests that the latest put (or remove) of a key wins after the engine is
+ * reopened. Keys are overwritten many times (by multiple threads, each with its
+ * own keys) just before the engine is closed, so engines which log their writes
+ * (radix with dram_caching) leave many entries of the same keys in the log,
+ * which are replayed on open.
+ */
+
+using namespace pmem::kv;
+
+static void verify(pmem::kv::db &kv, const std::map<std::string, std::string> &model)
+{
+	ASSERT_SIZE(kv, model.size());
+
+	for (auto &e : model) {
+		std::string value;
+		ASSERT_STATUS(kv.get(e.first, &value), status::OK);
+		UT_ASSERT(value == e.second);
+	}
+}
+
+static void test(int argc, char *argv[])
+{
+	if (argc < 7)
+		UT_FATAL("usage: %s engine json_config threads keys_per_thread "
+			 "puts_per_thread n_reopens",
+			 argv[0]);
+
+	auto threads_number = std::stoull(argv[3]);
+	auto thread_keys = std::stoull(argv[4]);
+	auto thread_puts = std::stoull(argv[5]);
+	auto n_reopens = std::stoull(argv[6]);
+
+	std::map<std::string, std::string> model;
+	for (size_t r = 0; r < n_reopens; r++) {
+		auto kv = INITIALIZE_KV(argv[1], CONFIG_FROM_JSON(argv[2]));
+		verify(kv, model);
+
+		std::vector<std::map<std::string, std::string>> written(threads_number);
+		parallel_exec(threads_number, [&](size_t thread_id) {
+			for (size_t i = 0; i < thread_puts; i++) {
+				auto key = entry_from_number(
+					thread_id + threads_number * (i % thread_keys),
+					"key");
+				auto value =
+					entry_from_number(r * thread_puts + i, "value");
+				ASSERT_STATUS(kv.put(key, value), status::OK);
+				written[thread_id][key] = value;
+			}
+		});
+
+		for (auto &w : written)
+			for (auto &e : w)
+				model[e.first] = e.second;
+
+		/* some keys are removed after their puts */
+		for (size_t i = r % 7; i < threads_number * thread_keys; i += 7) {
+			auto key = entry_from_number(i, "key");
+			auto expected = model.erase(key) ? status::OK : status::NOT_FOUND;
+			ASSERT_STATUS(kv.remove(key), expected);
+		}
+
+		kv.close();
+	}
+
+	auto kv = INITIALIZE_KV(argv[1], CONFIG_FROM_JSON(argv[2]));
+	verify(kv, model);
+	kv.close();
+}
+
+int main(int argc, char *argv[])
+{
+	return run_test([&] { test(argc, argv); });
+}
@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#include "unittest.hpp"
+
+#include <algorithm>
+
+/**
+ * Tests that puts (also batched or in a transaction) which fail with
+ * OUT_OF_MEMORY (their pmem transaction is aborted) do not leave partial changes
+ * and that the order of elements is intact, also after the pool is reopened.
+ */
+
+using namespace pmem::kv;
+
+static constexpr size_t items = 100;
+
+/* does not fit in the pool */
+static const std::string big_value(64 * 1024 * 1024, 'x');
+
+static void verify(pmem::kv::db &kv, size_t count)
+{
+	std::vector<std::string> keys;
+	auto s = kv.get_all([&](string_view k, string_view v) {
+		UT_ASSERT(k.compare(v) == 0);
+		keys.emplace_back(k.data(), k.size());
+		return 0;
+	});
+	ASSERT_STATUS(s, status::OK);
+
+	UT_ASSERTeq(keys.size(), count);
+	ASSERT_SIZE(kv, count);
+	UT_ASSERT(std::is_sorted(keys.begin(), keys.end()));
+
+	for (auto &key : keys) {
+		std::string value;
+		ASSERT_STATUS(kv.get(key, &value), status::OK);
+		UT_ASSERT(value == key);
+	}
+}
+
+static void insert(pmem::kv::db &kv)
+{
+	/* every other key, so the failed puts go between existing ones */
+	for (size_t i = 0; i < items; i += 2) {
+		auto key = entry_from_number(i, "key");
+		ASSERT_STATUS(kv.put(key, key), status::OK);
+	}
+
+	for (size_t i = 1; i < items; i += 2)
+		ASSERT_STATUS(kv.put(entry_from_number(i, "key"), big_value),
+			      status::OUT_OF_MEMORY);
+
+	verify(kv, items / 2);
+
+	/* the last put of the batch fails after the others were done */
+	std::vector<std::string> batch;
+	for (size_t i = 1; i < 10; i += 2)
+		batch.push_back(entry_from_number(i, "key"));
+
+	std::vector<string_view> keys(batch.begin(), batch.end());
+	std::vector<string_view> values(batch.begin(), batch.end());
+	keys.push_back("zzz");
+	values.push_back(big_value);
+	ASSERT_STATUS(kv.multi_put(keys, values), status::OUT_OF_MEMORY);
+
+	verify(kv, items / 2);
+
+	auto tx = kv.tx_begin();
+	if (tx.is_ok()) {
+		for (auto &key : batch)
+			ASSERT_STATUS(tx.get_value().put(key, key), status::OK);
+		ASSERT_STATUS(tx.get_value().put("zzz", big_value), status::OK);
+		ASSERT_STATUS(tx.get_value().commit(), status::OUT_OF_MEMORY);
+
+		verify(kv, items / 2);
+	}
+}
+
+static void check(pmem::kv::db &kv)
+{
+	verify(kv, items / 2);
+
+	for (size_t i = 1; i < items; i += 2) {
+		auto key = entry_from_number(i, "key");
+		ASSERT_STATUS(kv.put(key, key), status::OK);
+	}
+
+	verify(kv, items);
+}
+
+static void test(int argc, char *argv[])
+{
+	if (argc < 4)
+		UT_FATAL("usage: %s engine json_config insert/check", argv[0]);
+
+	std::string mode = argv[3];
+	if (mode != "insert" && mode != "check")
+		UT_FATAL("usage: %s engine json_config insert/check", argv[0]);
+
+	auto kv = INITIALIZE_KV(argv[1], CONFIG_FROM_JSON(argv[2]));
+
+	if (mode == "insert") {
+		insert(kv);
+	} else {
+		check(kv);
+	}
+
+	kv.close();
+}
+
+int main(int argc, char *argv[])
+{
+	return run_test([&] { test(argc, argv); });
+}
@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#include "unittest.hpp"
+
+#include <libpmemobj++/pool.hpp>
+#include <libpmemobj.h>
+
+#include <algorithm>
+#include <cstdio>
+
+/**
+ * Tests puts of increasing keys mixed with puts of smaller keys (and updates),
+ * for engines which fill leafs when keys are appended (stree). All elements must
+ * be found in order and the pool may hold only a little more leafs than needed
+ * for the increasing keys: leafs are counted as allocations bigger than
+ * leaf_min_size (keys and values are short, so they are not allocated apart).
+ */
+
+using namespace pmem::kv;
+
+struct Root {
+	PMEMoid oid;
+};
+
+static const size_t leaf_min_size = 1024;
+
+static std::string key(size_t i)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "key%08zu", i);
+	return buf;
+}
+
+static void verify(pmem::kv::db &kv, const std::vector<size_t> &numbers)
+{
+	std::vector<std::string> keys;
+	auto s = kv.get_all([&](string_view k, string_view v) {
+		UT_ASSERT(k.compare(v) == 0);
+		keys.emplace_back(k.data(), k.size());
+		return 0;
+	});
+	ASSERT_STATUS(s, status::OK);
+
+	UT_ASSERTeq(keys.size(), numbers.size());
+	for (size_t i = 0; i < keys.size(); i++)
+		UT_ASSERT(keys[i] == key(numbers[i]));
+}
+
+static size_t count_leafs(pmem::obj::pool_base &pop)
+{
+	size_t count = 0;
+	for (auto oid = pmemobj_first(pop.handle()); !OID_IS_NULL(oid);
+	     oid = pmemobj_next(oid)) {
+		if (pmemobj_alloc_usable_size(oid) >= leaf_min_size)
+			count++;
+	}
+
+	return count;
+}
+
+static void test(int argc, char *argv[])
+{
+	if (argc < 6)
+		UT_FATAL("usage: %s engine path n_inserts leaf_capacity n_out_of_order",
+			 argv[0]);
+
+	auto engine = std::string(argv[1]);
+	auto n_inserts = std::stoull(argv[3]);
+	auto leaf_capacity = std::stoull(argv[4]);
+	auto n_out_of_order = std::stoull(argv[5]);
+
+	pmem::obj::pool<Root> pop;
+	try {
+		pop = pmem::obj::pool<Root>::open(argv[2], "pmemkv_" + engine);
+	} catch (std::exception &e) {
+		UT_FATALexc(e);
+	}
+
+	auto open_kv = [&] {
+		pmem::kv::config cfg;
+		ASSERT_STATUS(cfg.put_oid(&pop.root()->oid), status::OK);
+
+		return INITIALIZE_KV(engine, std::move(cfg));
+	};
+
+	/* increasing keys are even, smaller keys put in between are odd */
+	std::vector<size_t> numbers;
+	auto every = std::max<size_t>(n_inserts / (n_out_of_order + 1), 1);
+	auto append = [&](pmem::kv::db &kv, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			auto k = key(i * 2);
+			ASSERT_STATUS(kv.put(k, k), status::OK);
+			numbers.push_back(i * 2);
+
+			if (i == 0 || i % every != every - 1 ||
+			    i / every >= n_out_of_order)
+				continue;
+
+			/* to a random earlier leaf */
+			auto j = static_cast<size_t>(rand()) % i;
+			auto smaller = key(j * 2 + 1);
+			ASSERT_STATUS(kv.put(smaller, smaller), status::OK);
+			numbers.push_back(j * 2 + 1);
+
+			/* update of an existing key */
+			auto existing = key((static_cast<size_t>(rand()) % i) * 2);
+			ASSERT_STATUS(kv.put(existing, existing), status::OK);
+		}
+
+		std::sort(numbers.begin(), numbers.end());
+		numbers.erase(std::unique(numbers.begin(), numbers.end()), numbers.end());
+		verify(kv, numbers);
+	};
+
+	/* appending continues after the pool is reopened */
+	{
+		auto kv = open_kv();
+		append(kv, 0, n_inserts / 2);
+		kv.close();
+	}
+	{
+		auto kv = open_kv();
+		verify(kv, numbers);
+		append(kv, n_inserts / 2, n_inserts);
+		kv.close();
+	}
+
+	/*
+	 * Every put of a smaller key may split a full leaf. Leafs split in
+	 * halves would need about 2 * n_inserts / leaf_capacity leafs.
+	 */
+	auto max_leafs =
+		(n_inserts + leaf_capacity - 1) / leaf_capacity + n_out_of_order + 2;
+	UT_ASSERT(count_leafs(pop) <= max_leafs);
+
+	pop.close();
+}
+
+int main(int argc, char *argv[])
+{
+	return run_test([&] { test(argc, argv); });
+}
@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#include "unittest.hpp"
+
+/**
+ * Tests counters (of DRAM cache and stalled puts) which the engine writes on
+ * close to the config passed as "stats" object (radix with dram_caching). The
+ * same config is used for two opens, its counters are replaced on the second one.
+ */
+
+using namespace pmem::kv;
+
+static uint64_t get_stat(pmem::kv::config &stats, const std::string &key)
+{
+	uint64_t value;
+	ASSERT_STATUS(stats.get_uint64(key, value), status::OK);
+	return value;
+}
+
+static void check_cache_stats(pmem::kv::config &stats, size_t gets)
+{
+	UT_ASSERTeq(get_stat(stats, "cache_hits") + get_stat(stats, "cache_misses"),
+		    gets);
+	UT_ASSERT(get_stat(stats, "cache_hits") > 0);
+	UT_ASSERT(get_stat(stats, "cache_misses") > 0);
+}
+
+static void check_stall_stats(pmem::kv::config &stats)
+{
+	auto stalls = get_stat(stats, "put_stalls");
+	auto stall_ns = get_stat(stats, "put_stall_ns");
+	auto max_stall_ns = get_stat(stats, "put_max_stall_ns");
+
+	UT_ASSERT(max_stall_ns <= stall_ns);
+	if (stalls == 0)
+		UT_ASSERTeq(stall_ns, 0);
+}
+
+static void test(int argc, char *argv[])
+{
+	if (argc < 5)
+		UT_FATAL("usage: %s engine json_config cache_size items", argv[0]);
+
+	auto cache_size = std::stoull(argv[3]);
+	auto items = std::stoull(argv[4]);
+	UT_ASSERT(items > cache_size);
+
+	/* owned by the test, the engine only writes to it */
+	auto stats_ptr = pmemkv_config_new();
+	UT_ASSERT(stats_ptr != nullptr);
+	pmem::kv::config stats(stats_ptr);
+
+	auto cfg = CONFIG_FROM_JSON(argv[2]);
+	ASSERT_STATUS(cfg.put_object("stats", stats_ptr, nullptr), status::OK);
+	auto kv = INITIALIZE_KV(argv[1], std::move(cfg));
+
+	for (size_t i = 0; i < items; i++) {
+		auto key = entry_from_number(i);
+		ASSERT_STATUS(kv.put(key, key), status::OK);
+	}
+
+	/* the last key is cached, most of the other ones are not */
+	for (size_t i = items; i > 0; i--) {
+		auto key = entry_from_number(i - 1);
+		std::string value;
+		ASSERT_STATUS(kv.get(key, &value), status::OK);
+		UT_ASSERT(value == key);
+	}
+
+	kv.close();
+
+	check_cache_stats(stats, items);
+	/* elements put when the cache was full evicted other ones */
+	UT_ASSERT(get_stat(stats, "cache_evictions") >= items - cache_size);
+	get_stat(stats, "cache_rejections");
+	check_stall_stats(stats);
+
+	cfg = CONFIG_FROM_JSON(argv[2]);
+	ASSERT_STATUS(cfg.put_object("stats", stats_ptr, nullptr), status::OK);
+	kv = INITIALIZE_KV(argv[1], std::move(cfg));
+
+	/* every key is read twice, the first get caches it */
+	for (size_t i = 0; i < items; i++) {
+		auto key = entry_from_number(i);
+		std::string value;
+		ASSERT_STATUS(kv.get(key, &value), status::OK);
+		ASSERT_STATUS(kv.get(key, &value), status::OK);
+		UT_ASSERT(value == key);
+	}
+
+	kv.close();
+
+	/* counters of the cache start from 0 on each open */
+	check_cache_stats(stats, items * 2);
+	/* nothing was put */
+	UT_ASSERTeq(get_stat(stats, "put_stalls"), 0);
+	check_stall_stats(stats);
+}
+
+int main(int argc, char *argv[])
+{
+	return run_test([&] { test(argc, argv); });
+}
@@ -7,6 +7,8 @@
 
 #include "unittest.hpp"
 
+#include <algorithm>
+
 static constexpr size_t len_elements = 10;
 
 static void check_exist(pmem::kv::db &kv, const std::string &element,
@@ -57,6 +59,19 @@ static void check_consistency(pmem::kv::db &kv)
 	}
 
 	UT_ASSERTeq(count, size);
+
+	/* sorted engines keep the order, also after an interrupted insert */
+	std::size_t above;
+	if (kv.count_above("", above) == pmem::kv::status::OK) {
+		std::vector<std::string> keys;
+		auto s = kv.get_all([&](pmem::kv::string_view k, pmem::kv::string_view) {
+			keys.emplace_back(k.data(), k.size());
+			return 0;
+		});
+		ASSERT_STATUS(s, pmem::kv::status::OK);
+		UT_ASSERTeq(keys.size(), size);
+		UT_ASSERT(std::is_sorted(keys.begin(), keys.end()));
+	}
 }
 
 static void test(int argc, char *argv[])
@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#include "unittest.hpp"
+
+#include <algorithm>
+#include <random>
+#include <set>
+
+/**
+ * Generated test of count_* methods over ranges which span many leafs and inner
+ * nodes of tree-based engines. Counts are compared with counts of matching keys
+ * of std::set (computed by checking every key). Keys are put in random order and
+ * some of them are removed, so nodes are split and merged.
+ * It's NOT suitable to test with custom comparator.
+ */
+
+using namespace pmem::kv;
+
+static std::mt19937_64 generator;
+
+static void CountRangesTest(const size_t items, const size_t queries, pmem::kv::db &kv)
+{
+	/* keys are drawn from a bigger set, so bounds of ranges may be missing */
+	auto random_key = [&] { return entry_from_number(generator() % (items * 4)); };
+
+	std::set<std::string> keys;
+	for (size_t i = 0; i < items; i++) {
+		auto key = random_key();
+		ASSERT_STATUS(kv.put(key, key), status::OK);
+		keys.insert(key);
+	}
+
+	for (size_t i = 0; i < items / 4; i++) {
+		auto key = random_key();
+		auto expected = keys.erase(key) ? status::OK : status::NOT_FOUND;
+		ASSERT_STATUS(kv.remove(key), expected);
+	}
+
+	ASSERT_SIZE(kv, keys.size());
+
+	auto brute_count = [&](std::function<bool(const std::string &)> pred) {
+		return static_cast<size_t>(std::count_if(keys.begin(), keys.end(), pred));
+	};
+
+	for (size_t i = 0; i < queries; i++) {
+		auto key1 = random_key();
+		auto key2 = random_key();
+		size_t cnt;
+
+		ASSERT_STATUS(kv.count_above(key1, cnt), status::OK);
+		UT_ASSERTeq(cnt, brute_count([&](const std::string &k) {
+				    return k > key1;
+			    }));
+
+		ASSERT_STATUS(kv.count_equal_above(key1, cnt), status::OK);
+		UT_ASSERTeq(cnt, brute_count([&](const std::string &k) {
+				    return k >= key1;
+			    }));
+
+		ASSERT_STATUS(kv.count_below(key1, cnt), status::OK);
+		UT_ASSERTeq(cnt, brute_count([&](const std::string &k) {
+				    return k < key1;
+			    }));
+
+		ASSERT_STATUS(kv.count_equal_below(key1, cnt), status::OK);
+		UT_ASSERTeq(cnt, brute_count([&](const std::string &k) {
+				    return k <= key1;
+			    }));
+
+		/* empty if key1 >= key2 */
+		ASSERT_STATUS(kv.count_between(key1, key2, cnt), status::OK);
+		UT_ASSERTeq(cnt, brute_count([&](const std::string &k) {
+				    return k > key1 && k < key2;
+			    }));
+	}
+
+	/* ranges of all elements */
+	size_t cnt;
+	ASSERT_STATUS(kv.count_above("", cnt), status::OK);
+	UT_ASSERTeq(cnt, keys.size());
+	ASSERT_STATUS(kv.count_between("", *keys.rbegin() + "0", cnt), status::OK);
+	UT_ASSERTeq(cnt, keys.size());
+	ASSERT_STATUS(kv.count_between(*keys.begin(), *keys.rbegin(), cnt), status::OK);
+	UT_ASSERTeq(cnt, keys.size() - 2);
+}
+
+static void test(int argc, char *argv[])
+{
+	using namespace std::placeholders;
+
+	if (argc < 5)
+		UT_FATAL("usage: %s engine json_config items queries", argv[0]);
+
+	std::random_device rd;
+	auto seed = rd();
+	std::cout << "rand seed: " << seed << std::endl;
+	generator = std::mt19937_64(seed);
+
+	size_t items = std::stoull(argv[3]);
+	size_t queries = std::stoull(argv[4]);
+	run_engine_tests(argv[1], argv[2],
+			 {
+				 std::bind(CountRangesTest, items, queries, _1),
+			 });
+}
+
+int main(int argc, char *argv[])
+{
+	return run_test([&] { test(argc, argv); });
+}
@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#include "unittest.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <set>
+
+/**
+ * Tests keys with long common prefixes (like "tenant/table/row" paths), so that
+ * separators of tree-based engines are long and keys differ only at the end.
+ * Some keys are prefixes of other keys. Keys are put in random order and some
+ * of them are removed, then every key and ranges between random keys are checked
+ * against std::set.
+ * It's NOT suitable to test with custom comparator.
+ */
+
+using namespace pmem::kv;
+
+static std::mt19937_64 generator;
+
+static std::string make_key(size_t prefix_len, size_t n)
+{
+	/* a few different prefixes, each shared by many keys */
+	std::string key(prefix_len, static_cast<char>('a' + n % 3));
+	key += '/';
+
+	/* every 8th key is a prefix of the next one */
+	auto num = std::to_string(n / 8 * 8 + 1000000000);
+	if (n % 8 != 0)
+		num += std::to_string(n % 8);
+
+	return entry_from_string(key + num);
+}
+
+static void verify_range(pmem::kv::db &kv, const std::set<std::string> &keys,
+			 const std::string &key1, const std::string &key2)
+{
+	std::vector<std::string> expected;
+	for (auto &k : keys)
+		if (k > key1 && k < key2)
+			expected.push_back(k);
+
+	std::vector<std::string> result;
+	auto s = kv.get_between(key1, key2, [&](string_view k, string_view v) {
+		UT_ASSERT(k.compare(v) == 0);
+		result.emplace_back(k.data(), k.size());
+		return 0;
+	});
+	UT_ASSERT(s == status::OK || (s == status::NOT_FOUND && expected.empty()));
+	UT_ASSERT(result == expected);
+
+	size_t cnt;
+	ASSERT_STATUS(kv.count_between(key1, key2, cnt), status::OK);
+	UT_ASSERTeq(cnt, expected.size());
+}
+
+static void SharedPrefixTest(const size_t prefix_len, const size_t items,
+			     pmem::kv::db &kv)
+{
+	std::vector<size_t> numbers(items);
+	std::iota(numbers.begin(), numbers.end(), 0);
+	std::shuffle(numbers.begin(), numbers.end(), generator);
+
+	std::set<std::string> keys;
+	for (auto n : numbers) {
+		auto key = make_key(prefix_len, n);
+		ASSERT_STATUS(kv.put(key, key), status::OK);
+		keys.insert(key);
+	}
+
+	for (size_t i = 0; i < items / 4; i++) {
+		auto key = make_key(prefix_len, numbers[i]);
+		ASSERT_STATUS(kv.remove(key), status::OK);
+		keys.erase(key);
+	}
+
+	ASSERT_SIZE(kv, keys.size());
+
+	std::vector<std::string> all;
+	auto s = kv.get_all([&](string_view k, string_view) {
+		all.emplace_back(k.data(), k.size());
+		return 0;
+	});
+	ASSERT_STATUS(s, status::OK);
+	UT_ASSERT(all == std::vector<std::string>(keys.begin(), keys.end()));
+
+	for (size_t i = 0; i < items; i++) {
+		auto key = make_key(prefix_len, i);
+		std::string value;
+		if (keys.count(key)) {
+			ASSERT_STATUS(kv.get(key, &value), status::OK);
+			UT_ASSERT(value == key);
+		} else {
+			ASSERT_STATUS(kv.get(key, &value), status::NOT_FOUND);
+		}
+	}
+
+	for (size_t i = 0; i < 100; i++)
+		verify_range(kv, keys, make_key(prefix_len, generator() % items),
+			     make_key(prefix_len, generator() % items));
+}
+
+static void test(int argc, char *argv[])
+{
+	using namespace std::placeholders;
+
+	if (argc < 5)
+		UT_FATAL("usage: %s engine json_config prefix_len items", argv[0]);
+
+	std::random_device rd;
+	auto seed = rd();
+	std::cout << "rand seed: " << seed << std::endl;
+	generator = std::mt19937_64(seed);
+
+	size_t prefix_len = std::stoull(argv[3]);
+	size_t items = std::stoull(argv[4]);
+	run_engine_tests(argv[1], argv[2],
+			 {
+				 std::bind(SharedPrefixTest, prefix_len, items, _1),
+			 });
+}
+
+int main(int argc, char *argv[])
+{
+	return run_test([&] { test(argc, argv); });
+}
@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, Intel Corporation */
+
+#include "unittest.hpp"
+
+using namespace pmem::kv;
+
+static void test_get_pending_put(pmem::kv::db &kv)
+{
+	auto tx = kv.tx_begin().get_value();
+
+	ASSERT_STATUS(tx.put("key1", "value1"), status::OK);
+	ASSERT_STATUS(kv.exists("key1"), status::NOT_FOUND);
+	ASSERT_STATUS(tx.exists("key1"), status::OK);
+
+	std::string value;
+	ASSERT_STATUS(tx.get("key1", &value), status::OK);
+	UT_ASSERT(value == "value1");
+
+	/* only the latest put is visible */
+	ASSERT_STATUS(tx.put("key1", "value2"), status::OK);
+	auto s = tx.get("key1", [&](string_view v) { value.assign(v.data(), v.size()); });
+	ASSERT_STATUS(s, status::OK);
+	UT_ASSERT(value == "value2");
+
+	tx.abort();
+
+	ASSERT_STATUS(tx.exists("key1"), status::NOT_FOUND);
+	ASSERT_STATUS(kv.exists("key1"), status::NOT_FOUND);
+}
+
+static void test_get_pending_remove(pmem::kv::db &kv)
+{
+	ASSERT_STATUS(kv.put("key1", "value1"), status::OK);
+
+	auto tx = kv.tx_begin().get_value();
+
+	/* element from the database is visible through the transaction */
+	std::string value;
+	ASSERT_STATUS(tx.get("key1", &value), status::OK);
+	UT_ASSERT(value == "value1");
+
+	ASSERT_STATUS(tx.remove("key1"), status::OK);
+	ASSERT_STATUS(tx.exists("key1"), status::NOT_FOUND);
+	ASSERT_STATUS(tx.get("key1", &value), status::NOT_FOUND);
+	ASSERT_STATUS(kv.exists("key1"), status::OK);
+
+	/* put after remove revives the element */
+	ASSERT_STATUS(tx.put("key1", "value2"), status::OK);
+	ASSERT_STATUS(tx.get("key1", &value), status::OK);
+	UT_ASSERT(value == "value2");
+
+	ASSERT_STATUS(tx.remove("key1"), status::OK);
+	ASSERT_STATUS(tx.commit(), status::OK);
+
+	ASSERT_STATUS(kv.exists("key1"), status::NOT_FOUND);
+	ASSERT_STATUS(tx.exists("key1"), status::NOT_FOUND);
+	ASSERT_SIZE(kv, 0);
+}
+
+static void test_get_pending_empty_value(pmem::kv::db &kv)
+{
+	auto tx = kv.tx_begin().get_value();
+
+	/* empty value is not a remove */
+	ASSERT_STATUS(tx.put("key1", ""), status::OK);
+	ASSERT_STATUS(tx.exists("key1"), status::OK);
+
+	std::string value = "x";
+	ASSERT_STATUS(tx.get("key1", &value), status::OK);
+	UT_ASSERT(value.empty());
+
+	ASSERT_STATUS(tx.commit(), status::OK);
+
+	value = "x";
+	ASSERT_STATUS(kv.get("key1", &value), status::OK);
+	UT_ASSERT(value.empty());
+	ASSERT_SIZE(kv, 1);
+}
+
+static void test_get_many(pmem::kv::db &kv)
+{
+	const size_t N = 10000;
+
+	for (size_t i = 0; i < N; i += 2)
+		ASSERT_STATUS(kv.put(entry_from_number(i), entry_from_number(i)),
+			      status::OK);
+
+	auto tx = kv.tx_begin().get_value();
+
+	/* big values do not fit in a single chunk of the log */
+	std::string big_value(256 * 1024, 'x');
+	for (size_t i = 0; i < N; i++) {
+		if (i % 3 == 0)
+			ASSERT_STATUS(tx.remove(entry_from_number(i)), status::OK);
+		else if (i % 1000 == 1)
+			ASSERT_STATUS(tx.put(entry_from_number(i), big_value),
+				      status::OK);
+		else
+			ASSERT_STATUS(tx.put(entry_from_number(i),
+					     entry_from_number(i, "", "_tx")),
+				      status::OK);
+	}
+
+	auto verify = [&](std::function<status(string_view, std::string *)> get) {
+		for (size_t i = 0; i < N; i++) {
+			std::string value;
+			auto s = get(entry_from_number(i), &value);
+			if (i % 3 == 0) {
+				ASSERT_STATUS(s, status::NOT_FOUND);
+			} else {
+				ASSERT_STATUS(s, status::OK);
+				if (i % 1000 == 1)
+					UT_ASSERT(value == big_value);
+				else
+					UT_ASSERT(value ==
+						  entry_from_number(i, "", "_tx"));
+			}
+		}
+	};
+
+	verify([&](string_view key, std::string *value) { return tx.get(key, value); });
+
+	ASSERT_STATUS(tx.commit(), status::OK);
+
+	verify([&](string_view key, std::string *value) { return kv.get(key, value); });
+	ASSERT_SIZE(kv, N - (N + 2) / 3);
+}
+
+static void test(int argc, char *argv[])
+{
+	if (argc < 3)
+		UT_FATAL("usage: %s engine json_config", argv[0]);
+
+	run_engine_tests(argv[1], argv[2],
+			 {test_get_pending_put, test_get_pending_remove,
+			  test_get_pending_empty_value, test_get_many});
+}
+
+int main(int argc, char *argv[])
+{
+	return run_test([&] { test(argc, argv); });
+}
@@ -0,0 +1,24 @@
+# SPDX-License-Identifier: BSD-3-Clause
+# Copyright 2021, Intel Corporation
+
+include(${PARENT_SRC_DIR}/helpers.cmake)
+include(${PARENT_SRC_DIR}/engines/pmemobj_based/helpers.cmake)
+
+setup()
+
+pmempool_execute(create -l ${LAYOUT} -s ${DB_SIZE} obj ${DIR}/testfile)
+
+# create a pool with the legacy hash function
+make_config({"path":"${DIR}/testfile","hash_id":0})
+execute(${TEST_EXECUTABLE} ${ENGINE} ${CONFIG} insert ${PARAMS})
+execute(${TEST_EXECUTABLE} ${ENGINE} ${CONFIG} check ${PARAMS})
+
+# rehash all elements using the current hash function
+make_config({"path":"${DIR}/testfile","upgrade_hash":1})
+execute(${TEST_EXECUTABLE} ${ENGINE} ${CONFIG} check ${PARAMS})
+
+# upgraded pool can be opened without the flag
+make_config({"path":"${DIR}/testfile"})
+execute(${TEST_EXECUTABLE} ${ENGINE} ${CONFIG} check ${PARAMS})
+
+finish()
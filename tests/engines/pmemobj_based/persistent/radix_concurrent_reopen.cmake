@@ -0,0 +1,35 @@
+# SPDX-License-Identifier: BSD-3-Clause
+# Copyright 2021, Intel Corporation
+
+include(${PARENT_SRC_DIR}/helpers.cmake)
+include(${PARENT_SRC_DIR}/engines/pmemobj_based/helpers.cmake)
+
+setup()
+
+pmempool_execute(create -l ${LAYOUT} -s ${DB_SIZE} obj ${DIR}/testfile)
+
+# the concurrent tree ("concurrent" and "dram_caching" modes) reads pools
+# written by the single-threaded one
+make_config({"path":"${DIR}/testfile","concurrent":0})
+execute(${TEST_EXECUTABLE} ${ENGINE} ${CONFIG} insert ${PARAMS})
+
+make_config({"path":"${DIR}/testfile","concurrent":1})
+execute(${TEST_EXECUTABLE} ${ENGINE} ${CONFIG} check ${PARAMS})
+
+make_config({"path":"${DIR}/testfile","dram_caching":1,"cache_size":100,"log_size":50000})
+execute(${TEST_EXECUTABLE} ${ENGINE} ${CONFIG} check ${PARAMS})
+
+make_config({"path":"${DIR}/testfile","concurrent":0})
+execute(${TEST_EXECUTABLE} ${ENGINE} ${CONFIG} check ${PARAMS})
+
+# the other way round
+file(REMOVE ${DIR}/testfile)
+pmempool_execute(create -l ${LAYOUT} -s ${DB_SIZE} obj ${DIR}/testfile)
+
+make_config({"path":"${DIR}/testfile","concurrent":1})
+execute(${TEST_EXECUTABLE} ${ENGINE} ${CONFIG} insert ${PARAMS})
+
+make_config({"path":"${DIR}/testfile","concurrent":0})
+execute(${TEST_EXECUTABLE} ${ENGINE} ${CONFIG} check ${PARAMS})
+
+finish()